@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <vector>
+
+#include "glog/logging.h"
+#include "voxel/build_stats.h"
+#include "voxel/builder.h"
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+namespace voxel {
+
+constexpr int32_t kNoMaterial = -1;
+
+// A voxel labeled with the material of the part it lies in, kNoMaterial outside every part.
+class MaterialVoxel : public Voxel {
+  public:
+    int32_t material = kNoMaterial;
+};
+
+namespace builder {
+
+// One stl file of an assembly.
+struct AssemblyPart {
+  std::filesystem::path stl_path;
+  // Anything but kNoMaterial. Parts may share a material, in which case they form a single body in the grid.
+  int32_t material = 0;
+  // Where parts overlap, the voxel goes to the part with the highest priority, and among those to the first one listed.
+  int32_t priority = 0;
+};
+
+// Builds a single grid from all the parts of an assembly, in their positions relative to each other, with the padding
+// of the options around the bounding box of the whole assembly. Every column casts one ray per part and classifies
+// its voxels for all of them at once, as the column scanline engine does, so the grid is traversed once whatever the
+// number of parts. options.classification is ignored. Internal voxels get the material of their part, and one more
+// pass marks the internal voxels with an external neighbor as kVoxelTypeBoundary and the ones with a neighbor of
+// another material as kVoxelTypeInterface, a voxel getting both where two bodies meet at the surface. Returns false
+// if a file cannot be read.
+template <std::derived_from<MaterialVoxel> T, typename Layout>
+bool BuildFromStlAssembly(std::span<const AssemblyPart> parts, VoxelGrid3d<T, Layout>* grid, double step,
+                          const StlBuildOptions& options = {}) {
+  CHECK(!parts.empty());
+  std::vector<std::filesystem::path> paths;
+  for (const AssemblyPart& part : parts) {
+    CHECK_NE(part.material, kNoMaterial);
+    paths.push_back(part.stl_path);
+  }
+  std::vector<std::unique_ptr<internal::StlMesh>> meshes;
+  if (!internal::LoadAssemblyMeshes(paths, step, options, &meshes)) {
+    return false;
+  }
+
+  voxel::internal::StatsScope stats(options.stats);
+  // The casters in order of precedence, so that the first part a voxel is inside of wins it.
+  std::vector<size_t> order(parts.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return parts[a].priority > parts[b].priority; });
+  std::vector<internal::RayCaster> casters;
+  std::vector<int32_t> materials;
+  for (size_t part : order) {
+    casters.push_back(meshes[part]->Caster());
+    materials.push_back(parts[part].material);
+  }
+
+  int64_t z_dim = meshes.front()->z_dim;
+  {
+    voxel::internal::PhaseScope phase("classify");
+    grid->Init(meshes.front()->x_dim, meshes.front()->y_dim, z_dim, step);
+    phase.AddBytes(grid->XDim() * grid->YDim() * z_dim * sizeof(T));
+    // Tiles of columns are walked directly rather than through ForEachXY, so that every task reuses one set of
+    // transition vectors for all of its columns.
+    Tiling tiling = Tiling::Make(0, grid->XDim(), 0, grid->YDim(),
+                                 Tiling::Grain(grid->GrainSize(), grid->XDim() * grid->YDim(), *grid->GetScheduler()));
+    grid->GetScheduler()->ParallelFor(tiling.Count(), 1, [&](int64_t begin, int64_t end) {
+      std::vector<std::vector<int64_t>> transitions(casters.size());
+      std::vector<size_t> crossings(casters.size());
+      for (int64_t tile = begin; tile < end; tile++) {
+        tiling.ForEachColumn(tile, [&](int64_t x, int64_t y) {
+          for (size_t i = 0; i < casters.size(); i++) {
+            internal::ColumnTransitions(casters[i], x, y, z_dim, step, &transitions[i]);
+            crossings[i] = 0;
+          }
+          // The material only changes where some part is crossed, so the parts are only looked at once per span
+          // between two crossings instead of once per voxel.
+          int64_t z = 0;
+          while (z < z_dim) {
+            int64_t next = z_dim;
+            int32_t material = kNoMaterial;
+            for (size_t i = 0; i < casters.size(); i++) {
+              while (crossings[i] < transitions[i].size() && transitions[i][crossings[i]] <= z) {
+                crossings[i]++;
+              }
+              if (crossings[i] < transitions[i].size()) {
+                next = std::min(next, transitions[i][crossings[i]]);
+              }
+              if (crossings[i] % 2 == 1 && material == kNoMaterial) {
+                material = materials[i];
+              }
+            }
+            for (; z < next; z++) {
+              T* voxel = grid->At(x, y, z);
+              voxel->type = material == kNoMaterial ? kVoxelTypeExternal : kVoxelTypeInternal;
+              voxel->material = material;
+            }
+          }
+        });
+      }
+    });
+  }
+
+  // Only the types change in this pass, and neighbors are told apart by their materials alone.
+  voxel::internal::PhaseScope phase("boundaries");
+  grid->ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+    T* voxel = grid->At(x, y, z);
+    if (voxel->material == kNoMaterial) {
+      return;
+    }
+    int32_t flags = 0;
+    for (const T* neighbor : grid->D3Q27(x, y, z)) {
+      if (neighbor == nullptr) {
+        continue;
+      }
+      if (neighbor->material == kNoMaterial) {
+        flags |= kVoxelTypeBoundary;
+      } else if (neighbor->material != voxel->material) {
+        flags |= kVoxelTypeInterface;
+      }
+    }
+    voxel->type |= flags;
+  });
+  return true;
+}
+
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "voxel/builder.h"
+#include "voxel/indexed_mesh.h"
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+#include "glog/logging.h"
+
+namespace voxel::builder {
+
+// One build of a BatchBuilder: the mesh, the step, and the options, which include the padding.
+struct BatchJob {
+  std::filesystem::path stl_path;
+  double step = 1.0;
+  StlBuildOptions options;
+};
+
+template <std::derived_from<Voxel> T>
+struct BatchResult {
+  // Index of the job in the list passed to Start.
+  size_t job = 0;
+  // False if the stl file could not be read, in which case grid is null.
+  bool ok = false;
+  std::unique_ptr<VoxelGrid3d<T>> grid;
+};
+
+namespace internal {
+
+// Queue between two threads. Push blocks while the queue holds capacity items, and Pop blocks until there is an item
+// or the queue is closed and drained.
+template <typename Item>
+class BlockingQueue {
+  public:
+    explicit BlockingQueue(size_t capacity) : capacity_(capacity) {}
+
+    // Returns false, dropping the item, if the queue was closed.
+    bool Push(Item item) {
+      std::unique_lock lock(mutex_);
+      not_full_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+      if (closed_) {
+        return false;
+      }
+      items_.push_back(std::move(item));
+      not_empty_.notify_one();
+      return true;
+    }
+
+    bool Pop(Item* item) {
+      std::unique_lock lock(mutex_);
+      not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+      if (items_.empty()) {
+        return false;
+      }
+      *item = std::move(items_.front());
+      items_.pop_front();
+      not_full_.notify_one();
+      return true;
+    }
+
+    // Wakes every waiting thread. Items already queued can still be popped.
+    void Close() {
+      std::lock_guard lock(mutex_);
+      closed_ = true;
+      not_empty_.notify_all();
+      not_full_.notify_all();
+    }
+
+  private:
+    size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<Item> items_;
+    bool closed_ = false;
+};
+
+}
+
+// Builds the grids of many (stl file, step, options) jobs as a pipeline. A loader thread reads each stl file once for
+// all of its jobs, and prepares the translated planes and acceleration structures of the next jobs while the current
+// ones are voxelized on the shared scheduler, so the pool is not left idle while files are parsed. The structures
+// depend on the step, so only the IndexedMesh read from the file is shared between its resolutions. Finished grids are
+// delivered through a completion queue, see Next, which holds at most as many grids as are voxelized at once. A
+// consumer slower than the builds holds the voxelization back instead of letting finished grids pile up in memory.
+template <std::derived_from<Voxel> T>
+class BatchBuilder {
+  public:
+    // prefetch is the number of prepared meshes the loader may get ahead of the voxelization by, and concurrency the
+    // number of jobs voxelized at once. A small grid does not keep the whole pool busy on its own.
+    explicit BatchBuilder(Scheduler* scheduler = &Scheduler::Default(), size_t prefetch = 4, int concurrency = 2)
+        : scheduler_(scheduler), concurrency_(concurrency), meshes_(prefetch), results_(std::max(concurrency, 1)) {
+      CHECK_GT(concurrency, 0);
+    }
+
+    // Stops once the jobs in flight finish. Results that were not taken are dropped.
+    ~BatchBuilder() {
+      meshes_.Close();
+      results_.Close();
+      if (loader_.joinable()) {
+        loader_.join();
+      }
+      for (auto& voxelizer : voxelizers_) {
+        voxelizer.join();
+      }
+    }
+
+    BatchBuilder(const BatchBuilder&) = delete;
+    BatchBuilder& operator=(const BatchBuilder&) = delete;
+
+    // Starts building the jobs and returns immediately. Jobs of the same file are loaded together, in the order of the
+    // first job of every file. May only be called once.
+    void Start(std::vector<BatchJob> jobs) {
+      CHECK(!loader_.joinable()) << "A batch builder runs a single batch";
+      jobs_ = std::move(jobs);
+      pending_ = jobs_.size();
+      loader_ = std::thread([this] { Load(); });
+      for (int i = 0; i < concurrency_; i++) {
+        voxelizers_.emplace_back([this] { Voxelize(); });
+      }
+    }
+
+    // Waits for the next job to finish, in completion order. Returns false once the results of all jobs were returned.
+    bool Next(BatchResult<T>* result) {
+      if (pending_ == 0) {
+        return false;
+      }
+      CHECK(results_.Pop(result));
+      pending_--;
+      return true;
+    }
+
+  private:
+    struct PreparedMesh {
+      size_t job = 0;
+      // Empty if the stl file could not be read.
+      std::unique_ptr<internal::StlMesh> mesh;
+    };
+
+    void Load() {
+      std::vector<bool> loaded(jobs_.size());
+      for (size_t first = 0; first < jobs_.size(); first++) {
+        if (loaded[first]) {
+          continue;
+        }
+        IndexedMesh indexed;
+        indexed.SetScheduler(scheduler_);
+        bool ok = indexed.Read(jobs_[first].stl_path);
+        for (size_t job = first; job < jobs_.size(); job++) {
+          if (loaded[job] || jobs_[job].stl_path != jobs_[first].stl_path) {
+            continue;
+          }
+          loaded[job] = true;
+          PreparedMesh prepared;
+          prepared.job = job;
+          if (ok) {
+            prepared.mesh = std::make_unique<internal::StlMesh>();
+            internal::BuildStlMesh(indexed, jobs_[job].step, jobs_[job].options, prepared.mesh.get());
+          }
+          if (!meshes_.Push(std::move(prepared))) {
+            return;
+          }
+        }
+      }
+      meshes_.Close();
+    }
+
+    void Voxelize() {
+      PreparedMesh prepared;
+      while (meshes_.Pop(&prepared)) {
+        BatchResult<T> result;
+        result.job = prepared.job;
+        if (prepared.mesh != nullptr) {
+          const BatchJob& job = jobs_[prepared.job];
+          result.grid = std::make_unique<VoxelGrid3d<T>>();
+          result.grid->SetScheduler(scheduler_);
+          internal::Voxelize(*prepared.mesh, job.step, job.options, result.grid.get());
+          result.ok = true;
+        }
+        if (!results_.Push(std::move(result))) {
+          return;
+        }
+      }
+    }
+
+    Scheduler* scheduler_;
+    int concurrency_;
+    std::vector<BatchJob> jobs_;
+    size_t pending_ = 0;
+    internal::BlockingQueue<PreparedMesh> meshes_;
+    internal::BlockingQueue<BatchResult<T>> results_;
+    std::thread loader_;
+    std::vector<std::thread> voxelizers_;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include "voxel/bit_grid.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <numeric>
+#include <utility>
+
+
+namespace voxel {
+namespace {
+
+constexpr uint64_t kAllBits = ~static_cast<uint64_t>(0);
+
+// Calls f(begin, end) for every run [begin, end) of clear bits among the first z_dim bits of a column.
+template <typename F>
+void ForEachClearRun(std::span<const uint64_t> column, int64_t z_dim, F&& f) {
+  // The first bit at or after z that is set, or clear, z_dim if there is none.
+  auto next = [&](int64_t z, bool set) {
+    while (z < z_dim) {
+      int64_t w = z / BitGrid3d::kBitsPerWord;
+      uint64_t word = (set ? column[w] : ~column[w]) & (kAllBits << (z % BitGrid3d::kBitsPerWord));
+      if (word != 0) {
+        return std::min<int64_t>(w * BitGrid3d::kBitsPerWord + std::countr_zero(word), z_dim);
+      }
+      z = (w + 1) * BitGrid3d::kBitsPerWord;
+    }
+    return z_dim;
+  };
+  for (int64_t z = next(0, false); z < z_dim; z = next(z, false)) {
+    int64_t end = next(z, true);
+    f(z, end);
+    z = end;
+  }
+}
+
+// Lock free union-find in which every node points to a smaller or equal index, so the root of a set is its smallest
+// node. A parent is only ever replaced by one of its ancestors.
+class ConcurrentSets {
+  public:
+    explicit ConcurrentSets(int64_t size) : parents_(size) { std::iota(parents_.begin(), parents_.end(), 0); }
+
+    int64_t Find(int64_t i) {
+      while (true) {
+        int64_t parent = Atomic(i).load(std::memory_order_acquire);
+        if (parent == i) {
+          return i;
+        }
+        // Path halving, skipped if another thread got there first.
+        int64_t grandparent = Atomic(parent).load(std::memory_order_acquire);
+        Atomic(i).compare_exchange_weak(parent, grandparent, std::memory_order_acq_rel);
+        i = grandparent;
+      }
+    }
+
+    void Union(int64_t a, int64_t b) {
+      while (true) {
+        a = Find(a);
+        b = Find(b);
+        if (a == b) {
+          return;
+        }
+        if (a < b) {
+          std::swap(a, b);
+        }
+        // Fails if another thread linked the root a meanwhile, in which case both roots are looked up again.
+        int64_t expected = a;
+        if (Atomic(a).compare_exchange_strong(expected, b, std::memory_order_acq_rel)) {
+          return;
+        }
+      }
+    }
+
+  private:
+    std::atomic_ref<int64_t> Atomic(int64_t i) { return std::atomic_ref<int64_t>(parents_[i]); }
+
+    std::vector<int64_t> parents_;
+};
+
+}
+
+void BitGrid3d::Init(int64_t x_dim, int64_t y_dim, int64_t z_dim, double step) {
+  x_dim_ = x_dim;
+  y_dim_ = y_dim;
+  z_dim_ = z_dim;
+  step_ = step;
+  words_per_column_ = (z_dim + kBitsPerWord - 1) / kBitsPerWord;
+  inside_.assign(x_dim_ * y_dim_ * words_per_column_, 0);
+  boundary_.assign(x_dim_ * y_dim_ * words_per_column_, 0);
+}
+
+bool BitGrid3d::Inside(int64_t x, int64_t y, int64_t z) const {
+  return (inside_[ColumnOffset(x, y) + z / kBitsPerWord] >> (z % kBitsPerWord)) & 1;
+}
+
+bool BitGrid3d::Boundary(int64_t x, int64_t y, int64_t z) const {
+  return (boundary_[ColumnOffset(x, y) + z / kBitsPerWord] >> (z % kBitsPerWord)) & 1;
+}
+
+void BitGrid3d::SetInside(int64_t x, int64_t y, int64_t z, bool inside) {
+  uint64_t& word = inside_[ColumnOffset(x, y) + z / kBitsPerWord];
+  uint64_t bit = static_cast<uint64_t>(1) << (z % kBitsPerWord);
+  word = inside ? word | bit : word & ~bit;
+}
+
+void BitGrid3d::SetBoundary(int64_t x, int64_t y, int64_t z, bool boundary) {
+  uint64_t& word = boundary_[ColumnOffset(x, y) + z / kBitsPerWord];
+  uint64_t bit = static_cast<uint64_t>(1) << (z % kBitsPerWord);
+  word = boundary ? word | bit : word & ~bit;
+}
+
+int32_t BitGrid3d::Type(int64_t x, int64_t y, int64_t z) const {
+  if (!Inside(x, y, z)) {
+    return kVoxelTypeExternal;
+  }
+  return Boundary(x, y, z) ? kVoxelTypeInternal | kVoxelTypeBoundary : kVoxelTypeInternal;
+}
+
+std::span<uint64_t> BitGrid3d::InsideColumn(int64_t x, int64_t y) {
+  return {inside_.data() + ColumnOffset(x, y), static_cast<size_t>(words_per_column_)};
+}
+
+std::span<const uint64_t> BitGrid3d::InsideColumn(int64_t x, int64_t y) const {
+  return {inside_.data() + ColumnOffset(x, y), static_cast<size_t>(words_per_column_)};
+}
+
+std::span<uint64_t> BitGrid3d::BoundaryColumn(int64_t x, int64_t y) {
+  return {boundary_.data() + ColumnOffset(x, y), static_cast<size_t>(words_per_column_)};
+}
+
+std::span<const uint64_t> BitGrid3d::BoundaryColumn(int64_t x, int64_t y) const {
+  return {boundary_.data() + ColumnOffset(x, y), static_cast<size_t>(words_per_column_)};
+}
+
+uint64_t BitGrid3d::ValidBits(int64_t word) const {
+  int64_t bits = z_dim_ - word * kBitsPerWord;
+  return bits >= kBitsPerWord ? kAllBits : (static_cast<uint64_t>(1) << bits) - 1;
+}
+
+int64_t BitGrid3d::CountInside() const {
+  int64_t count = 0;
+  for (uint64_t word : inside_) {
+    count += std::popcount(word);
+  }
+  return count;
+}
+
+int64_t BitGrid3d::CountBoundary() const {
+  int64_t count = 0;
+  for (uint64_t word : boundary_) {
+    count += std::popcount(word);
+  }
+  return count;
+}
+
+void BitGrid3d::DilatePlane(const std::vector<uint64_t>& source, bool complement, bool outside,
+                            std::vector<uint64_t>* target) {
+  const uint64_t outside_bits = outside ? kAllBits : 0;
+  AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+    // OR the nine columns of the 3x3 neighborhood in the xy plane together, then smear the result by one bit up and
+    // down the column.
+    thread_local std::vector<uint64_t> merged;
+    merged.assign(words_per_column_, 0);
+    for (int64_t dx = -1; dx <= 1; dx++) {
+      for (int64_t dy = -1; dy <= 1; dy++) {
+        int64_t nx = x + dx, ny = y + dy;
+        if (nx < 0 || ny < 0 || nx >= x_dim_ || ny >= y_dim_) {
+          for (auto& word : merged) {
+            word |= outside_bits;
+          }
+          continue;
+        }
+        const uint64_t* column = source.data() + ColumnOffset(nx, ny);
+        for (int64_t w = 0; w < words_per_column_; w++) {
+          merged[w] |= complement ? ~column[w] & (ValidBits(w) | outside_bits) : column[w];
+        }
+      }
+    }
+
+    uint64_t* out = target->data() + ColumnOffset(x, y);
+    for (int64_t w = 0; w < words_per_column_; w++) {
+      uint64_t below = (w > 0 ? merged[w - 1] : outside_bits) >> (kBitsPerWord - 1);
+      uint64_t above = (w + 1 < words_per_column_ ? merged[w + 1] : outside_bits) << (kBitsPerWord - 1);
+      out[w] = (merged[w] | (merged[w] << 1) | below | (merged[w] >> 1) | above) & ValidBits(w);
+    }
+  });
+  RunSync(true);
+}
+
+void BitGrid3d::MarkBoundaries() {
+  // A voxel is a boundary if it is inside and its neighborhood contains an external voxel of the grid.
+  DilatePlane(inside_, true, false, &boundary_);
+  for (size_t i = 0; i < boundary_.size(); i++) {
+    boundary_[i] &= inside_[i];
+  }
+}
+
+void BitGrid3d::FillInterior() {
+  // Label the runs of free voxels along every column as the nodes of a union-find, in which the runs of face neighbor
+  // columns that overlap along z are joined and node 0 stands for the space outside the grid. Every pair of
+  // overlapping runs is joined once, so the fill takes time linear in the number of runs whatever the shape of the
+  // space, and the external voxels are the runs in the set of node 0.
+  int64_t columns = x_dim_ * y_dim_;
+  std::vector<int64_t> first_run(columns + 1, 0);
+  AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+    int64_t runs = 0;
+    ForEachClearRun(BoundaryColumn(x, y), z_dim_, [&](int64_t begin, int64_t end) { runs++; });
+    first_run[y * x_dim_ + x + 1] = runs;
+  });
+  RunSync(true);
+  first_run[0] = 1;
+  for (int64_t column = 0; column < columns; column++) {
+    first_run[column + 1] += first_run[column];
+  }
+
+  std::vector<int64_t> run_begin(first_run[columns]);
+  std::vector<int64_t> run_end(first_run[columns]);
+  AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+    int64_t run = first_run[y * x_dim_ + x];
+    ForEachClearRun(BoundaryColumn(x, y), z_dim_, [&](int64_t begin, int64_t end) {
+      run_begin[run] = begin;
+      run_end[run] = end;
+      run++;
+    });
+  });
+  RunSync(true);
+
+  ConcurrentSets sets(first_run[columns]);
+  AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+    int64_t column = y * x_dim_ + x;
+    bool on_border = x == 0 || y == 0 || x == x_dim_ - 1 || y == y_dim_ - 1;
+    for (int64_t run = first_run[column]; run < first_run[column + 1]; run++) {
+      if (on_border || run_begin[run] == 0 || run_end[run] == z_dim_) {
+        sets.Union(0, run);
+      }
+    }
+    // Both lists of runs are sorted along z, so the overlapping pairs are found in a single merge.
+    auto join = [&](int64_t neighbor) {
+      int64_t i = first_run[column], j = first_run[neighbor];
+      while (i < first_run[column + 1] && j < first_run[neighbor + 1]) {
+        if (run_begin[i] < run_end[j] && run_begin[j] < run_end[i]) {
+          sets.Union(i, j);
+        }
+        if (run_end[i] < run_end[j]) {
+          i++;
+        } else {
+          j++;
+        }
+      }
+    };
+    if (x + 1 < x_dim_) {
+      join(column + 1);
+    }
+    if (y + 1 < y_dim_) {
+      join(column + x_dim_);
+    }
+  });
+  RunSync(true);
+
+  AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+    std::span<uint64_t> inside = InsideColumn(x, y);
+    for (int64_t w = 0; w < words_per_column_; w++) {
+      inside[w] = ValidBits(w);
+    }
+    int64_t column = y * x_dim_ + x;
+    for (int64_t run = first_run[column]; run < first_run[column + 1]; run++) {
+      if (sets.Find(run) != 0) {
+        continue;
+      }
+      for (int64_t z = run_begin[run]; z < run_end[run];) {
+        int64_t bit = z % kBitsPerWord;
+        int64_t bits = std::min(run_end[run] - z, kBitsPerWord - bit);
+        uint64_t mask = bits == kBitsPerWord ? kAllBits : ((static_cast<uint64_t>(1) << bits) - 1) << bit;
+        inside[z / kBitsPerWord] &= ~mask;
+        z += bits;
+      }
+    }
+  });
+  RunSync(true);
+}
+
+void BitGrid3d::Dilate() {
+  std::vector<uint64_t> dilated(inside_.size());
+  DilatePlane(inside_, false, false, &dilated);
+  inside_.swap(dilated);
+  std::fill(boundary_.begin(), boundary_.end(), 0);
+}
+
+void BitGrid3d::Erode() {
+  // A voxel survives if there is no external voxel in its neighborhood.
+  std::vector<uint64_t> touches_external(inside_.size());
+  DilatePlane(inside_, true, true, &touches_external);
+  for (size_t i = 0; i < inside_.size(); i++) {
+    inside_[i] &= ~touches_external[i];
+  }
+  std::fill(boundary_.begin(), boundary_.end(), 0);
+}
+
+void BitGrid3d::Open() {
+  Erode();
+  Dilate();
+}
+
+void BitGrid3d::Close() {
+  Dilate();
+  Erode();
+}
+
+void BitGrid3d::Run() {
+  WaitForCompletion();
+  // Columns are cheap to process in packed form, so the automatic grain gives each task a few times more of them.
+  int64_t grain = grain_ > 0 ? grain_ : Tiling::Grain(0, x_dim_ * y_dim_, *scheduler_) * 4;
+  tiling_ = Tiling::Make(0, x_dim_, 0, y_dim_, grain);
+  done_ = std::make_unique<std::latch>(tiling_.Count());
+  scheduler_->Submit(&BitGrid3d::RunTiles, this, tiling_.Count(), 1, done_.get());
+}
+
+void BitGrid3d::WaitForCompletion() {
+  if (done_ != nullptr) {
+    scheduler_->Wait(done_.get());
+    done_.reset();
+  }
+}
+
+void BitGrid3d::RunSync(bool clear_on_completion) {
+  Run();
+  WaitForCompletion();
+  if (clear_on_completion) {
+    ClearForeachXYCallbacks();
+  }
+}
+
+void BitGrid3d::RunTiles(void* context, int64_t begin, int64_t end) {
+  auto* grid = static_cast<BitGrid3d*>(context);
+  for (int64_t tile = begin; tile < end; tile++) {
+    grid->tiling_.ForEachColumn(tile, [grid](int64_t x, int64_t y) {
+      for (auto& callback : grid->foreach_xy_callbacks_) {
+        callback(grid, x, y);
+      }
+    });
+  }
+}
+
+}
\ No newline at end of file
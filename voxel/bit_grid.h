@@ -0,0 +1,129 @@
+#pragma once
+
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+namespace voxel {
+
+// A 3d grid that only stores the classification of every voxel, packed into two bitplanes: whether the voxel is inside
+// the mesh, and whether it is a boundary voxel. Each (x, y) column is stored as consecutive 64 bit words along z, with
+// bit z % 64 of word z / 64 holding voxel z, so a 1024^3 grid takes 256 MB instead of 4 GB as a VoxelGrid3d<Voxel>.
+//
+// Neighborhood operations work on whole words: shifting a word by one bit moves 64 voxels one step along z, and the
+// x and y neighbors are the words at the same position in the adjacent columns. Bits past the end of a column are
+// always zero.
+class BitGrid3d {
+  public:
+    static constexpr int64_t kBitsPerWord = 64;
+
+    // Resizes the grid, and marks every voxel as external.
+    void Init(int64_t x_dim, int64_t y_dim, int64_t z_dim, double step);
+
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
+    int64_t ZDim() const { return z_dim_; }
+    double Step() const { return step_; }
+    int64_t WordsPerColumn() const { return words_per_column_; }
+
+    bool Inside(int64_t x, int64_t y, int64_t z) const;
+    bool Boundary(int64_t x, int64_t y, int64_t z) const;
+
+    // Setting voxels is only safe from a callback running on the voxel's own column.
+    void SetInside(int64_t x, int64_t y, int64_t z, bool inside);
+    void SetBoundary(int64_t x, int64_t y, int64_t z, bool boundary);
+
+    // The voxel type flags VoxelGrid3d would hold for the voxel.
+    int32_t Type(int64_t x, int64_t y, int64_t z) const;
+
+    std::span<uint64_t> InsideColumn(int64_t x, int64_t y);
+    std::span<const uint64_t> InsideColumn(int64_t x, int64_t y) const;
+    std::span<uint64_t> BoundaryColumn(int64_t x, int64_t y);
+    std::span<const uint64_t> BoundaryColumn(int64_t x, int64_t y) const;
+
+    // Mask of the bits of word `word` of a column that hold voxels.
+    uint64_t ValidBits(int64_t word) const;
+
+    int64_t CountInside() const;
+    int64_t CountBoundary() const;
+
+    // Marks every inside voxel that has at least one external neighbor among its 26 neighbors as a boundary, and
+    // clears the boundary flag of every other voxel. Same result as builder::internal::MarkBoundaries.
+    void MarkBoundaries();
+
+    // Marks every voxel that the external space cannot reach through face neighbors as inside, treating the boundary
+    // voxels as walls and everything outside the grid as external. The boundary voxels themselves end up inside.
+    void FillInterior();
+
+    // Morphology over the 3x3x3 neighborhood, with everything outside the grid treated as external. Each one clears
+    // the boundary plane, call MarkBoundaries again to recompute it.
+    void Dilate();
+    void Erode();
+    // Erode followed by dilate, removing features thinner than 3 voxels.
+    void Open();
+    // Dilate followed by erode, closing gaps thinner than 3 voxels.
+    void Close();
+
+    // Copies the classification into a VoxelGrid3d of the same dimensions.
+    template <std::derived_from<Voxel> T>
+    void ToVoxelGrid(VoxelGrid3d<T>* grid) const {
+      grid->Init(x_dim_, y_dim_, z_dim_, step_);
+      grid->ForEachXY([this, grid](int64_t x, int64_t y) {
+        for (int64_t z = 0; z < z_dim_; z++) {
+          grid->At(x, y, z)->type = Type(x, y, z);
+        }
+      });
+    }
+
+    void AddForeachXYCallback(std::function<void(void*, int64_t, int64_t)> callback) {
+      foreach_xy_callbacks_.push_back(callback);
+    }
+
+    void ClearForeachXYCallbacks() {
+      foreach_xy_callbacks_.clear();
+    }
+
+    // Work runs on the shared Scheduler::Default() unless another scheduler is set.
+    void SetScheduler(Scheduler* scheduler) { scheduler_ = scheduler; }
+    Scheduler* GetScheduler() const { return scheduler_; }
+
+    // Number of columns per task, 0 to pick it from the grid size and the number of threads.
+    void SetGrainSize(int64_t columns) { grain_ = columns; }
+    int64_t GrainSize() const { return grain_; }
+
+    void Run();
+    void WaitForCompletion();
+    void RunSync(bool clear_on_completion);
+
+  private:
+    static void RunTiles(void* context, int64_t begin, int64_t end);
+
+    size_t ColumnOffset(int64_t x, int64_t y) const { return (y * x_dim_ + x) * words_per_column_; }
+
+    // Sets every voxel of `target` that has a set voxel of `source` in its 3x3x3 neighborhood. If `complement` is true
+    // the complement of source is used instead, and `outside` is the value of the voxels outside the grid.
+    void DilatePlane(const std::vector<uint64_t>& source, bool complement, bool outside, std::vector<uint64_t>* target);
+
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    int64_t z_dim_ = 0;
+    int64_t words_per_column_ = 0;
+    double step_ = 0;
+    std::vector<uint64_t> inside_;
+    std::vector<uint64_t> boundary_;
+
+    Scheduler* scheduler_ = &Scheduler::Default();
+    int64_t grain_ = 0;
+    Tiling tiling_;
+    std::unique_ptr<std::latch> done_;
+    std::vector<std::function<void(void* data, int64_t x, int64_t y)>> foreach_xy_callbacks_;
+};
+
+}
\ No newline at end of file
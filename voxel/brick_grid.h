@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <vector>
+
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+namespace voxel {
+
+// A sparse 3d grid made of bricks of kBrickSize^3 voxels, grouped into nodes of kNodeBricks^3 bricks. The top level
+// is a dense table with one entry per node, holding the node's value while all of its voxels are the same. A node
+// only gets its table of bricks once a brick in it is written, and within it a brick whose voxels are all the same is
+// stored as that one value until a voxel in it is accessed for writing. A thin walled part in a large bounding box
+// therefore pays for the bricks its surface passes through, the brick tables of the nodes around them, and a top
+// level of sizeof(T) plus a pointer per (kBrickSize * kNodeBricks)^3 voxels.
+//
+// Exposes the same At, D3Q27 and callback surface as VoxelGrid3d. Work is split into tiles of brick columns, and
+// callbacks must only write voxels of the brick column they are called for, as writing to a uniform brick allocates it.
+template <std::derived_from<Voxel> T>
+class BrickGrid3d {
+  public:
+    static constexpr int64_t kBrickSize = 8;
+    static constexpr int64_t kBrickVoxels = kBrickSize * kBrickSize * kBrickSize;
+    static constexpr int64_t kNodeBricks = 4;
+
+    // Resizes the grid, and sets every voxel to fill.
+    void Init(int64_t x_dim, int64_t y_dim, int64_t z_dim, double step, const T& fill = T{}) {
+      x_dim_ = x_dim;
+      y_dim_ = y_dim;
+      z_dim_ = z_dim;
+      step_ = step;
+      bricks_x_ = (x_dim + kBrickSize - 1) / kBrickSize;
+      bricks_y_ = (y_dim + kBrickSize - 1) / kBrickSize;
+      bricks_z_ = (z_dim + kBrickSize - 1) / kBrickSize;
+      nodes_x_ = (bricks_x_ + kNodeBricks - 1) / kNodeBricks;
+      nodes_y_ = (bricks_y_ + kNodeBricks - 1) / kNodeBricks;
+      nodes_z_ = (bricks_z_ + kNodeBricks - 1) / kNodeBricks;
+      nodes_ = std::make_unique<Node[]>(nodes_x_ * nodes_y_ * nodes_z_);
+      for (int64_t i = 0; i < nodes_x_ * nodes_y_ * nodes_z_; i++) {
+        nodes_[i].uniform = fill;
+      }
+    }
+
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
+    int64_t ZDim() const { return z_dim_; }
+    double Step() const { return step_; }
+
+    int64_t BricksX() const { return bricks_x_; }
+    int64_t BricksY() const { return bricks_y_; }
+    int64_t BricksZ() const { return bricks_z_; }
+
+    // Number of nodes that have their own brick table.
+    int64_t AllocatedNodes() const {
+      int64_t allocated = 0;
+      for (int64_t i = 0; i < nodes_x_ * nodes_y_ * nodes_z_; i++) {
+        allocated += nodes_[i].bricks.load(std::memory_order_relaxed) != nullptr;
+      }
+      return allocated;
+    }
+
+    // Number of bricks that have their own storage.
+    int64_t AllocatedBricks() const {
+      int64_t allocated = 0;
+      for (int64_t i = 0; i < nodes_x_ * nodes_y_ * nodes_z_; i++) {
+        const Brick* bricks = nodes_[i].bricks.load(std::memory_order_relaxed);
+        for (int64_t j = 0; bricks != nullptr && j < kNodeBrickCount; j++) {
+          allocated += bricks[j].voxels != nullptr;
+        }
+      }
+      return allocated;
+    }
+
+    // Returns the voxel for writing, allocating its node and brick if they are uniform.
+    T* At(int64_t x, int64_t y, int64_t z) {
+      Brick& brick = BrickAt(x / kBrickSize, y / kBrickSize, z / kBrickSize);
+      if (brick.voxels == nullptr) {
+        brick.voxels = std::make_unique<T[]>(kBrickVoxels);
+        std::fill(brick.voxels.get(), brick.voxels.get() + kBrickVoxels, brick.uniform);
+      }
+      return &brick.voxels[VoxelIndex(x, y, z)];
+    }
+
+    // Returns the voxel for reading. For a uniform node or brick, this is its single value.
+    const T* At(int64_t x, int64_t y, int64_t z) const {
+      const T* uniform = Uniform(x / kBrickSize, y / kBrickSize, z / kBrickSize);
+      if (uniform != nullptr) {
+        return uniform;
+      }
+      return &FindBrick(x / kBrickSize, y / kBrickSize, z / kBrickSize)->voxels[VoxelIndex(x, y, z)];
+    }
+
+    // The voxel followed by its 26 neighbors, null for the neighbors outside the grid. Allocates every uniform brick
+    // the neighbors are in, use the const overload to only read them.
+    std::array<T*, 27> D3Q27(int64_t x, int64_t y, int64_t z) {
+      std::array<T*, 27> neighbors = {};
+      VisitNeighbors(x, y, z, [&](int i, int64_t nx, int64_t ny, int64_t nz) { neighbors[i] = At(nx, ny, nz); });
+      return neighbors;
+    }
+
+    std::array<const T*, 27> D3Q27(int64_t x, int64_t y, int64_t z) const {
+      std::array<const T*, 27> neighbors = {};
+      VisitNeighbors(x, y, z, [&](int i, int64_t nx, int64_t ny, int64_t nz) { neighbors[i] = At(nx, ny, nz); });
+      return neighbors;
+    }
+
+    // Returns the value of the brick if it is uniform, and null otherwise.
+    const T* Uniform(int64_t bx, int64_t by, int64_t bz) const {
+      const Brick* brick = FindBrick(bx, by, bz);
+      if (brick == nullptr) {
+        return &NodeAt(bx, by, bz).uniform;
+      }
+      return brick->voxels == nullptr ? &brick->uniform : nullptr;
+    }
+
+    // Sets every voxel of the brick to the same value, releasing its storage. Allocates the brick table of its node.
+    void SetUniform(int64_t bx, int64_t by, int64_t bz, const T& value) {
+      Brick& brick = BrickAt(bx, by, bz);
+      brick.uniform = value;
+      brick.voxels.reset();
+    }
+
+    // Releases the storage of every brick whose voxels within the grid are all equal, then the brick tables of the
+    // nodes whose bricks are all uniform and equal.
+    void Compact(std::function<bool(const T& a, const T& b)> equal) {
+      AddForeachBrickColumnCallback([&](void* data, int64_t bx, int64_t by) {
+        for (int64_t bz = 0; bz < bricks_z_; bz++) {
+          const Brick* found = FindBrick(bx, by, bz);
+          if (found == nullptr || found->voxels == nullptr) {
+            continue;
+          }
+
+          Brick& brick = BrickAt(bx, by, bz);
+          const T& first = brick.voxels[0];
+          bool uniform = true;
+          ForEachVoxelInBrick(bx, by, bz, [&](int64_t x, int64_t y, int64_t z) {
+            uniform = uniform && equal(first, brick.voxels[VoxelIndex(x, y, z)]);
+          });
+          if (uniform) {
+            SetUniform(bx, by, bz, first);
+          }
+        }
+      });
+      RunSync(true);
+      CompactNodes(equal);
+    }
+
+    // Releases the brick table of every node whose bricks within the grid are all uniform and equal. Cheaper than
+    // Compact, as it never looks at the voxels of allocated bricks.
+    void CompactNodes(std::function<bool(const T& a, const T& b)> equal) {
+      scheduler_->ParallelFor(nodes_x_ * nodes_y_ * nodes_z_, 64, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+          Node& node = nodes_[i];
+          Brick* bricks = node.bricks.load(std::memory_order_acquire);
+          if (bricks == nullptr) {
+            continue;
+          }
+
+          int64_t nx = i % nodes_x_, ny = i / nodes_x_ % nodes_y_, nz = i / (nodes_x_ * nodes_y_);
+          const T* first = nullptr;
+          bool uniform = true;
+          for (int64_t bz = nz * kNodeBricks; uniform && bz < std::min((nz + 1) * kNodeBricks, bricks_z_); bz++) {
+            for (int64_t by = ny * kNodeBricks; uniform && by < std::min((ny + 1) * kNodeBricks, bricks_y_); by++) {
+              for (int64_t bx = nx * kNodeBricks; uniform && bx < std::min((nx + 1) * kNodeBricks, bricks_x_); bx++) {
+                const Brick& brick = bricks[BrickIndex(bx, by, bz)];
+                first = first == nullptr ? &brick.uniform : first;
+                uniform = brick.voxels == nullptr && equal(*first, brick.uniform);
+              }
+            }
+          }
+          if (uniform) {
+            node.uniform = *first;
+            node.bricks.store(nullptr, std::memory_order_release);
+            delete[] bricks;
+          }
+        }
+      });
+    }
+
+    // Calls visit(x, y, z) for every voxel of the brick that lies within the grid.
+    template <typename Visitor>
+    void ForEachVoxelInBrick(int64_t bx, int64_t by, int64_t bz, Visitor visit) const {
+      for (int64_t z = bz * kBrickSize; z < std::min((bz + 1) * kBrickSize, z_dim_); z++) {
+        for (int64_t y = by * kBrickSize; y < std::min((by + 1) * kBrickSize, y_dim_); y++) {
+          for (int64_t x = bx * kBrickSize; x < std::min((bx + 1) * kBrickSize, x_dim_); x++) {
+            visit(x, y, z);
+          }
+        }
+      }
+    }
+
+    void AddForeachXYZCallback(std::function<void(void*, int64_t, int64_t, int64_t)> callback) {
+      foreach_xyz_callbacks_.push_back(callback);
+    }
+
+    void ClearForeachXYZCallbacks() {
+      foreach_xyz_callbacks_.clear();
+    }
+
+    void AddForeachXYCallback(std::function<void(void*, int64_t, int64_t)> callback) {
+      foreach_xy_callbacks_.push_back(callback);
+    }
+
+    void ClearForeachXYCallbacks() {
+      foreach_xy_callbacks_.clear();
+    }
+
+    // Brick column callbacks run once per column of bricks, before the column and per voxel callbacks of the voxels
+    // in it. They are where uniform bricks can be handled in bulk.
+    void AddForeachBrickColumnCallback(std::function<void(void*, int64_t, int64_t)> callback) {
+      foreach_brick_column_callbacks_.push_back(callback);
+    }
+
+    void ClearForeachBrickColumnCallbacks() {
+      foreach_brick_column_callbacks_.clear();
+    }
+
+    // Work runs on the shared Scheduler::Default() unless another scheduler is set.
+    void SetScheduler(Scheduler* scheduler) { scheduler_ = scheduler; }
+
+    // Number of brick columns per task, 0 to pick it from the grid size and the number of threads.
+    void SetGrainSize(int64_t brick_columns) { grain_ = brick_columns; }
+    int64_t GrainSize() const { return grain_; }
+
+    void Run() {
+      WaitForCompletion();
+      tiling_ = Tiling::Make(0, bricks_x_, 0, bricks_y_, Tiling::Grain(grain_, bricks_x_ * bricks_y_, *scheduler_));
+      done_ = std::make_unique<std::latch>(tiling_.Count());
+      scheduler_->Submit(&BrickGrid3d::RunTiles, this, tiling_.Count(), 1, done_.get());
+    }
+
+    void WaitForCompletion() {
+      if (done_ != nullptr) {
+        scheduler_->Wait(done_.get());
+        done_.reset();
+      }
+    }
+
+    void RunSync(bool clear_on_completion) {
+      Run();
+      WaitForCompletion();
+      if (clear_on_completion) {
+        ClearForeachBrickColumnCallbacks();
+        ClearForeachXYCallbacks();
+        ClearForeachXYZCallbacks();
+      }
+    }
+
+  private:
+    static constexpr int64_t kNodeBrickCount = kNodeBricks * kNodeBricks * kNodeBricks;
+
+    struct Brick {
+      T uniform = {};
+      std::unique_ptr<T[]> voxels;
+    };
+
+    // The brick table is allocated by whichever brick column writes to the node first, and the others adopt it, so
+    // it is installed with a compare and swap.
+    struct Node {
+      ~Node() { delete[] bricks.load(std::memory_order_relaxed); }
+
+      T uniform = {};
+      std::atomic<Brick*> bricks = nullptr;
+    };
+
+    static void RunTiles(void* context, int64_t begin, int64_t end) {
+      auto* grid = static_cast<BrickGrid3d*>(context);
+      for (int64_t tile = begin; tile < end; tile++) {
+        grid->tiling_.ForEachColumn(tile, [grid](int64_t bx, int64_t by) { grid->RunBrickColumn(bx, by); });
+      }
+    }
+
+    void RunBrickColumn(int64_t bx, int64_t by) {
+      for (auto& callback : foreach_brick_column_callbacks_) {
+        callback(this, bx, by);
+      }
+      if (foreach_xy_callbacks_.empty() && foreach_xyz_callbacks_.empty()) {
+        return;
+      }
+
+      for (int64_t x = bx * kBrickSize; x < std::min((bx + 1) * kBrickSize, x_dim_); x++) {
+        for (int64_t y = by * kBrickSize; y < std::min((by + 1) * kBrickSize, y_dim_); y++) {
+          for (auto& callback : foreach_xy_callbacks_) {
+            callback(this, x, y);
+          }
+          if (foreach_xyz_callbacks_.empty()) {
+            continue;
+          }
+          for (int64_t z = 0; z < z_dim_; z++) {
+            for (auto& callback : foreach_xyz_callbacks_) {
+              callback(this, x, y, z);
+            }
+          }
+        }
+      }
+    }
+
+    Node& NodeAt(int64_t bx, int64_t by, int64_t bz) const {
+      int64_t nx = bx / kNodeBricks, ny = by / kNodeBricks, nz = bz / kNodeBricks;
+      return nodes_[(nz * nodes_y_ + ny) * nodes_x_ + nx];
+    }
+
+    static int64_t BrickIndex(int64_t bx, int64_t by, int64_t bz) {
+      return ((bz % kNodeBricks) * kNodeBricks + by % kNodeBricks) * kNodeBricks + bx % kNodeBricks;
+    }
+
+    // The brick, or null if its node has no brick table yet.
+    const Brick* FindBrick(int64_t bx, int64_t by, int64_t bz) const {
+      const Brick* bricks = NodeAt(bx, by, bz).bricks.load(std::memory_order_acquire);
+      return bricks == nullptr ? nullptr : &bricks[BrickIndex(bx, by, bz)];
+    }
+
+    // The brick, allocating the brick table of its node with every brick set to the node's value.
+    Brick& BrickAt(int64_t bx, int64_t by, int64_t bz) {
+      Node& node = NodeAt(bx, by, bz);
+      Brick* bricks = node.bricks.load(std::memory_order_acquire);
+      if (bricks == nullptr) {
+        auto* allocated = new Brick[kNodeBrickCount];
+        for (int64_t i = 0; i < kNodeBrickCount; i++) {
+          allocated[i].uniform = node.uniform;
+        }
+        if (node.bricks.compare_exchange_strong(bricks, allocated, std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+          bricks = allocated;
+        } else {
+          delete[] allocated;
+        }
+      }
+      return bricks[BrickIndex(bx, by, bz)];
+    }
+
+    static int64_t VoxelIndex(int64_t x, int64_t y, int64_t z) {
+      return ((z % kBrickSize) * kBrickSize + y % kBrickSize) * kBrickSize + x % kBrickSize;
+    }
+
+    // Calls visit(i, nx, ny, nz) for the voxel (i = 0) and every neighbor within the grid (i = 1 to 26).
+    template <typename Visitor>
+    void VisitNeighbors(int64_t x, int64_t y, int64_t z, Visitor visit) const {
+      visit(0, x, y, z);
+      int i = 1;
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          for (int64_t dz = -1; dz <= 1; dz++) {
+            if (dx == 0 && dy == 0 && dz == 0) {
+              continue;
+            }
+            int64_t nx = x + dx, ny = y + dy, nz = z + dz;
+            if (nx >= 0 && ny >= 0 && nz >= 0 && nx < x_dim_ && ny < y_dim_ && nz < z_dim_) {
+              visit(i, nx, ny, nz);
+            }
+            i++;
+          }
+        }
+      }
+    }
+
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    int64_t z_dim_ = 0;
+    int64_t bricks_x_ = 0;
+    int64_t bricks_y_ = 0;
+    int64_t bricks_z_ = 0;
+    int64_t nodes_x_ = 0;
+    int64_t nodes_y_ = 0;
+    int64_t nodes_z_ = 0;
+    double step_ = 0;
+    std::unique_ptr<Node[]> nodes_;
+
+    Scheduler* scheduler_ = &Scheduler::Default();
+    int64_t grain_ = 0;
+    Tiling tiling_;
+    std::unique_ptr<std::latch> done_;
+    std::vector<std::function<void(void* data, int64_t bx, int64_t by)>> foreach_brick_column_callbacks_;
+    std::vector<std::function<void(void* data, int64_t x, int64_t y)>> foreach_xy_callbacks_;
+    std::vector<std::function<void(void* data, int64_t x, int64_t y, int64_t z)>> foreach_xyz_callbacks_;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "voxel/build_stats.h"
+
+#include <algorithm>
+#include <fstream>
+
+
+namespace voxel {
+namespace {
+
+// The record of the BuildStats this thread counted into last, so that every ray does not look it up.
+struct CachedRecord {
+  uint64_t stats_id = 0;
+  void* record = nullptr;
+};
+
+thread_local CachedRecord cached_record;
+
+}
+
+std::atomic<uint64_t> BuildStats::next_id_ = 1;
+
+namespace internal {
+
+thread_local BuildStats* current_stats = nullptr;
+
+}
+
+BuildStats::ThreadRecord& BuildStats::Record() {
+  if (cached_record.stats_id == id_) {
+    return *static_cast<ThreadRecord*>(cached_record.record);
+  }
+  std::lock_guard lock(mutex_);
+  auto& record = records_[std::this_thread::get_id()];
+  if (record == nullptr) {
+    record = std::make_unique<ThreadRecord>();
+    record->index = records_.size() - 1;
+  }
+  cached_record = {id_, record.get()};
+  return *record;
+}
+
+int BuildStats::BeginPhase(const char* name) {
+  std::lock_guard lock(mutex_);
+  Phase phase;
+  phase.name = name;
+  phase.begin_ns = Now();
+  phases_.push_back(phase);
+  phase_first_task_.push_back(tasks_.load());
+  current_phase_ = phases_.size() - 1;
+  return phases_.size() - 1;
+}
+
+void BuildStats::EndPhase(int phase, int64_t bytes) {
+  std::lock_guard lock(mutex_);
+  phases_[phase].end_ns = Now();
+  phases_[phase].bytes = bytes;
+  phases_[phase].tasks = tasks_.load() - phase_first_task_[phase];
+}
+
+void BuildStats::RecordTask(int64_t begin_ns, int64_t end_ns) {
+  ThreadRecord& record = Record();
+  record.counters.tasks++;
+  record.tasks.push_back({begin_ns, end_ns, current_phase_.load(std::memory_order_relaxed)});
+  tasks_.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<BuildStats::Phase> BuildStats::Phases() const {
+  std::lock_guard lock(mutex_);
+  return phases_;
+}
+
+BuildCounters BuildStats::Counters() const {
+  std::lock_guard lock(mutex_);
+  BuildCounters total;
+  for (const auto& [id, record] : records_) {
+    total += record->counters;
+  }
+  return total;
+}
+
+std::vector<BuildStats::ThreadTime> BuildStats::ThreadTimes() const {
+  std::lock_guard lock(mutex_);
+  int64_t begin = 0, end = 0;
+  if (!phases_.empty()) {
+    begin = phases_.front().begin_ns;
+    for (const Phase& phase : phases_) {
+      end = std::max(end, phase.end_ns);
+    }
+  }
+
+  std::vector<ThreadTime> times(records_.size());
+  for (const auto& [id, record] : records_) {
+    ThreadTime& time = times[record->index];
+    time.thread = record->index;
+    time.tasks = record->tasks.size();
+    int64_t busy = 0;
+    for (const Task& task : record->tasks) {
+      busy += task.end_ns - task.begin_ns;
+    }
+    time.busy_seconds = busy * 1e-9;
+    time.idle_seconds = std::max<int64_t>(0, end - begin - busy) * 1e-9;
+  }
+  return times;
+}
+
+bool BuildStats::WriteChromeTrace(const std::filesystem::path& path) const {
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+  std::lock_guard lock(mutex_);
+  // Timestamps are in microseconds. The phases get the first row, and every thread the row after its index.
+  auto micros = [](int64_t ns) { return ns / 1000.0; };
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"phases\"}}";
+  for (const Phase& phase : phases_) {
+    out << ",\n{\"name\":\"" << phase.name << "\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":"
+        << micros(phase.begin_ns) << ",\"dur\":" << micros(phase.end_ns - phase.begin_ns) << ",\"args\":{\"bytes\":"
+        << phase.bytes << ",\"tasks\":" << phase.tasks << "}}";
+  }
+  for (const auto& [id, record] : records_) {
+    int tid = record->index + 1;
+    out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << tid << ",\"args\":{\"name\":\"thread "
+        << record->index << "\"}}";
+    for (const Task& task : record->tasks) {
+      const char* name = task.phase >= 0 ? phases_[task.phase].name.c_str() : "task";
+      out << ",\n{\"name\":\"" << name << "\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid << ",\"ts\":"
+          << micros(task.begin_ns) << ",\"dur\":" << micros(task.end_ns - task.begin_ns) << "}";
+    }
+  }
+  out << "\n]}\n";
+  return static_cast<bool>(out);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace voxel {
+
+struct BuildCounters {
+  // Rays cast to classify voxels, and the triangles tested against them.
+  int64_t rays = 0;
+  int64_t triangles_tested = 0;
+  // Triangles the rays crossed, and the crossings dropped because the triangle shares an edge with one already
+  // crossed by the same ray.
+  int64_t crossings = 0;
+  int64_t duplicate_edges = 0;
+  // Scheduler tasks run for the build.
+  int64_t tasks = 0;
+
+  BuildCounters& operator+=(const BuildCounters& other) {
+    rays += other.rays;
+    triangles_tested += other.triangles_tested;
+    crossings += other.crossings;
+    duplicate_edges += other.duplicate_edges;
+    tasks += other.tasks;
+    return *this;
+  }
+};
+
+// Statistics of the builds it is passed to, see StlBuildOptions::stats: the wall time of every phase, the bytes of
+// the buffers it allocates and the tasks it runs, hot path counters, and the time every thread spent running tasks.
+// Every thread counts into its own record, merged when the statistics are read, and the builders only look for a
+// BuildStats once per phase, task and ray, so builds without one pay for a null check per ray.
+//
+// A BuildStats may be shared by several builds, also concurrent ones, whose phases and counters then add up. It must
+// outlive them.
+class BuildStats {
+  public:
+    struct Phase {
+      std::string name;
+      // Nanoseconds since the BuildStats was created.
+      int64_t begin_ns = 0;
+      int64_t end_ns = 0;
+      int64_t bytes = 0;
+      int64_t tasks = 0;
+
+      double Seconds() const { return (end_ns - begin_ns) * 1e-9; }
+    };
+
+    struct ThreadTime {
+      // Numbered in the order the threads first ran a task or counted a ray.
+      int thread = 0;
+      int64_t tasks = 0;
+      // Time running tasks, and the rest of the time from the start of the first phase to the end of the last one.
+      double busy_seconds = 0;
+      double idle_seconds = 0;
+    };
+
+    BuildStats() : id_(next_id_.fetch_add(1)), epoch_(std::chrono::steady_clock::now()) {}
+
+    BuildStats(const BuildStats&) = delete;
+    BuildStats& operator=(const BuildStats&) = delete;
+
+    // Phases in the order they started.
+    std::vector<Phase> Phases() const;
+    // The counters of all threads.
+    BuildCounters Counters() const;
+    std::vector<ThreadTime> ThreadTimes() const;
+
+    double TrianglesPerRay() const {
+      BuildCounters counters = Counters();
+      return counters.rays > 0 ? static_cast<double>(counters.triangles_tested) / counters.rays : 0;
+    }
+
+    // Writes the phases and the tasks of every thread in the Chrome trace event format, for chrome://tracing or
+    // Perfetto, where gaps between the tasks of a thread are time it sat idle. Returns false if the file cannot be
+    // written.
+    bool WriteChromeTrace(const std::filesystem::path& path) const;
+
+    // The recording side, used by the builders and the scheduler.
+    int64_t Now() const {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+    int BeginPhase(const char* name);
+    void EndPhase(int phase, int64_t bytes);
+    void RecordTask(int64_t begin_ns, int64_t end_ns);
+    // The counters of the calling thread.
+    BuildCounters& ThreadCounters() { return Record().counters; }
+
+  private:
+    struct Task {
+      int64_t begin_ns;
+      int64_t end_ns;
+      // Phase that was running when the task started, -1 if none.
+      int phase;
+    };
+
+    struct ThreadRecord {
+      int index = 0;
+      BuildCounters counters;
+      std::vector<Task> tasks;
+    };
+
+    // Finds the record of the calling thread, creating it on first use.
+    ThreadRecord& Record();
+
+    static std::atomic<uint64_t> next_id_;
+
+    // Tells the records of BuildStats apart in the cache of every thread, even at a reused address.
+    const uint64_t id_;
+    const std::chrono::steady_clock::time_point epoch_;
+    std::atomic<int> current_phase_ = -1;
+    std::atomic<int64_t> tasks_ = 0;
+
+    mutable std::mutex mutex_;
+    std::vector<Phase> phases_;
+    std::vector<int64_t> phase_first_task_;
+    std::map<std::thread::id, std::unique_ptr<ThreadRecord>> records_;
+};
+
+namespace internal {
+
+// The stats of the build running on this thread, null if it collects none. Tasks run with the stats of the thread
+// that submitted them.
+extern thread_local BuildStats* current_stats;
+
+// Makes stats the stats of the calling thread until the end of the scope. A null stats leaves the current ones.
+class StatsScope {
+  public:
+    explicit StatsScope(BuildStats* stats) : previous_(current_stats) {
+      if (stats != nullptr) {
+        current_stats = stats;
+      }
+    }
+    ~StatsScope() { current_stats = previous_; }
+
+    StatsScope(const StatsScope&) = delete;
+    StatsScope& operator=(const StatsScope&) = delete;
+
+  private:
+    BuildStats* previous_;
+};
+
+// Records a phase of the current build, if it collects stats, from construction to destruction.
+class PhaseScope {
+  public:
+    explicit PhaseScope(const char* name) : stats_(current_stats) {
+      if (stats_ != nullptr) {
+        phase_ = stats_->BeginPhase(name);
+      }
+    }
+    ~PhaseScope() {
+      if (stats_ != nullptr) {
+        stats_->EndPhase(phase_, bytes_);
+      }
+    }
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+    // Adds the size of a buffer the phase allocated.
+    void AddBytes(int64_t bytes) { bytes_ += bytes; }
+
+  private:
+    BuildStats* stats_;
+    int phase_ = -1;
+    int64_t bytes_ = 0;
+};
+
+// Counts a ray of the current build that tested `tested` triangles and kept `crossings` of the ones it crossed.
+inline void CountRay(int64_t tested, int64_t crossings, int64_t duplicate_edges) {
+  if (current_stats != nullptr) {
+    BuildCounters& counters = current_stats->ThreadCounters();
+    counters.rays++;
+    counters.triangles_tested += tested;
+    counters.crossings += crossings;
+    counters.duplicate_edges += duplicate_edges;
+  }
+}
+
+}
+
+}
\ No newline at end of file
@@ -1,23 +1,95 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <concepts>
 #include <filesystem>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <span>
 #include <vector>
 
+#include "glog/logging.h"
 #include "libmath/line.h"
 #include "libmath/plane.h"
 #include "simplebmp/simplebmp.h"
 #include "simplestl/simplestl.h"
+#include "voxel/bit_grid.h"
+#include "voxel/build_stats.h"
+#include "voxel/brick_grid.h"
+#include "voxel/indexed_mesh.h"
+#include "voxel/projected_triangles.h"
+#include "voxel/slab.h"
+#include "voxel/triangle_bins.h"
+#include "voxel/triangle_store.h"
 #include "voxel/voxel.h"
-#include "workqueue/grid.h"
-#include "workqueue/workqueue.h"
 
 
 namespace voxel::builder {
+
+// Spatial index used to limit the triangles each classification ray is tested against.
+enum class Acceleration {
+  // Every ray is tested against every triangle.
+  kNone,
+  // Triangles are binned by the grid columns they cover, see internal::TriangleBins.
+  kTriangleBins,
+};
+
+// How BuildFromStl decides whether a voxel is inside the mesh.
+enum class Classification {
+  // Casts six rays from every voxel, one along each axis direction, and requires all of them to see an odd number of
+  // crossings.
+  kSixRayVote,
+  // Casts a single ray along each (x, y) column and classifies the whole column by the parity of the crossings below
+  // each voxel.
+  kColumnScanline,
+  // Marks the voxels that overlap a triangle as the boundary and flood fills the external space from the padding
+  // around the mesh, without casting any rays. The boundary is conservative, so it is usually thicker than the one
+  // the ray casting engines produce, and sealed cavities are classified as internal.
+  kSurfaceFloodFill,
+  // Votes like kSixRayVote, but coarse to fine: cubic cells of coarse_cell_size voxels that no triangle touches are
+  // classified with a single vote, and only the cells the surface passes through are split down to single voxels.
+  // Gives the same grid as kSixRayVote for closed meshes.
+  kCoarseToFine,
+};
+
+// Implementation of the ray/triangle test used by the ray casting engines.
+enum class RayTriangleTest {
+  // libmath::Line against one libmath::Plane at a time.
+  kLibmath,
+  // Batched kernel over a structure of arrays copy of the triangles, using AVX2 when the CPU supports it.
+  kBatched,
+  // Axis aligned rays are tested against the triangles projected onto the plane perpendicular to the ray, with the
+  // edge functions of every projection precomputed and ties on shared edges broken by the top-left rule, so no
+  // duplicate rejection is needed. Other rays fall back to libmath.
+  kProjected,
+};
+
+// Tunables for BuildFromStl.
+struct StlBuildOptions {
+  // Padding, in steps, added around the bounding box of the mesh on each side. At least 2 are always used.
+  int64_t extra_steps_x = 2;
+  int64_t extra_steps_y = 2;
+  int64_t extra_steps_z = 2;
+
+  Acceleration acceleration = Acceleration::kNone;
+  Classification classification = Classification::kSixRayVote;
+  RayTriangleTest ray_triangle_test = RayTriangleTest::kLibmath;
+
+  // Side, in voxels, of the top level cells of Classification::kCoarseToFine. Must be a power of two.
+  int64_t coarse_cell_size = 16;
+
+  // Collects the phase times, counters and task timeline of the build when set. Not owned.
+  BuildStats* stats = nullptr;
+};
+
 namespace internal {
 
 // Tests whether a pixel is black.
@@ -35,30 +107,147 @@ int64_t ComputeSteps(double dim, double step);
 // Create a point given the x, y, and z step.
 libmath::Point MakePoint(int64_t x, int64_t y, int64_t z, double step);
 
-// Computes the number of triangles intersected by the line between the specified points.
-int64_t ComputeIntersections(std::span<libmath::Plane> triangles, const libmath::Point& p1, const libmath::Point& p2);
+// Numbers the edges of the triangles like NumberEdges, with the vertices that have identical coordinates merged. Used
+// for the meshes that do not come from an IndexedMesh.
+std::vector<uint32_t> ComputeEdgeIds(std::span<const libmath::Plane> triangles);
+
+// Computes the number of triangles intersected by the line between the specified points. A triangle that shares an
+// edge with one already counted, as the ids of ComputeEdgeIds tell, is a crossing through that edge and is skipped.
+int64_t ComputeIntersections(std::span<libmath::Plane> triangles, std::span<const uint32_t> edge_ids,
+                             const libmath::Point& p1, const libmath::Point& p2);
+
+// Same as above, but only tests the triangles that the bins say can be hit.
+int64_t ComputeIntersections(std::span<libmath::Plane> triangles, std::span<const uint32_t> edge_ids,
+                             const TriangleBins& bins, const libmath::Point& p1, const libmath::Point& p2);
+
+// Batched equivalents of the above over a structure of arrays copy of the triangles. bins may be null.
+int64_t ComputeIntersections(const TriangleStore& store, std::span<const uint32_t> edge_ids, const TriangleBins* bins,
+                             const libmath::Point& p1, const libmath::Point& p2);
+std::vector<double> ComputeIntersectionDepths(const TriangleStore& store, std::span<const uint32_t> edge_ids,
+                                              const TriangleBins* bins, const libmath::Point& p1,
+                                              const libmath::Point& p2);
+
+// Equivalents of the above for axis aligned rays against the projected triangles, which need no shared edge checks,
+// see ProjectedTriangles. The planes and edge ids are used for rays that are not axis aligned. bins may be null.
+int64_t ComputeIntersections(const ProjectedTriangles& projected, std::span<libmath::Plane> triangles,
+                             std::span<const uint32_t> edge_ids, const TriangleBins* bins, const libmath::Point& p1,
+                             const libmath::Point& p2);
+std::vector<double> ComputeIntersectionDepths(const ProjectedTriangles& projected, std::span<libmath::Plane> triangles,
+                                              std::span<const uint32_t> edge_ids, const TriangleBins* bins,
+                                              const libmath::Point& p1, const libmath::Point& p2);
+
+// The triangles of a mesh, along with whichever optional structures were built to speed up casting rays against them.
+struct RayCaster {
+  std::span<libmath::Plane> planes;
+  // Three per plane, see ComputeEdgeIds.
+  std::span<const uint32_t> edge_ids;
+  const TriangleBins* bins = nullptr;
+  const TriangleStore* store = nullptr;
+  const ProjectedTriangles* projected = nullptr;
+
+  // Counts the triangles crossed by the line between the specified points.
+  int64_t CountIntersections(const libmath::Point& p1, const libmath::Point& p2) const;
+
+  // Computes the sorted crossings of the line between the specified points, see ComputeIntersectionDepths.
+  std::vector<double> IntersectionDepths(const libmath::Point& p1, const libmath::Point& p2) const;
+};
+
+// A mesh read from a stl file and translated into the padding of its grid, along with the structures the build options
+// ask for.
+struct StlMesh {
+  int64_t x_dim = 0;
+  int64_t y_dim = 0;
+  int64_t z_dim = 0;
+  // Offset added to the stl coordinates to move the mesh into the padding.
+  double translate_x = 0;
+  double translate_y = 0;
+  double translate_z = 0;
+  std::vector<libmath::Plane> planes;
+  std::vector<uint32_t> edge_ids;
+  std::optional<TriangleBins> bins;
+  std::optional<TriangleStore> store;
+  std::optional<ProjectedTriangles> projected;
+
+  RayCaster Caster() {
+    return {planes, edge_ids, bins.has_value() ? &*bins : nullptr, store.has_value() ? &*store : nullptr,
+            projected.has_value() ? &*projected : nullptr};
+  }
+};
+
+// Reads a stl file into an IndexedMesh and computes the dims of the grid it needs at the specified step. Returns false
+// if the file cannot be read.
+bool LoadStlMesh(const std::filesystem::path& stl_path, double step, const StlBuildOptions& options, StlMesh* mesh);
+
+// Same as above, from a mesh already in memory, with the triangles in the coordinates of a stl file.
+void BuildStlMesh(std::span<libmath::Triangle> triangles, double step, const StlBuildOptions& options, StlMesh* mesh);
+void BuildStlMesh(const IndexedMesh& indexed, double step, const StlBuildOptions& options, StlMesh* mesh);
+
+// Reads several stl files into meshes of the same grid, sized to the bounding box of all of them, and in the same
+// coordinates, so that the parts keep their positions relative to each other. Returns false if a file cannot be read.
+bool LoadAssemblyMeshes(std::span<const std::filesystem::path> stl_paths, double step, const StlBuildOptions& options,
+                        std::vector<std::unique_ptr<StlMesh>>* meshes);
+
+// Copies triangles in any coordinates, translated so that their bounding box starts at the origin, the coordinates of a
+// stl file.
+std::vector<libmath::Triangle> MoveToOrigin(std::span<const libmath::Triangle> triangles);
+
+// Tests whether a triangle overlaps the axis aligned cube with the specified center and half side length.
+bool TriangleOverlapsBox(const libmath::Triangle& triangle, const libmath::Point& center, double half_size);
+
+// Tests whether a triangle touches the cube of size voxels per side starting at voxel (x, y, z). The cube is slightly
+// enlarged, so that a triangle on a face touches the cubes on both sides of it.
+bool TriangleTouchesCell(const libmath::Triangle& triangle, int64_t x, int64_t y, int64_t z, int64_t size, double step);
+
+// The triangles touching each cubic cell of cell_size voxels per side of a grid, see ClassifyCoarseToFine.
+struct CellBins {
+  int64_t cell_size = 0;
+  int64_t cells_x = 0;
+  int64_t cells_y = 0;
+  int64_t cells_z = 0;
+  std::vector<libmath::Triangle> triangles;
+  // Indices into triangles, per cell with x fastest, then y, then z.
+  std::vector<std::vector<uint32_t>> cells;
+
+  void Init(std::span<libmath::Plane> planes, int64_t x_dim, int64_t y_dim, int64_t z_dim, double step,
+            int64_t cell_size);
+
+  std::span<const uint32_t> Cell(int64_t cx, int64_t cy, int64_t cz) const {
+    return cells[(cz * cells_y + cy) * cells_x + cx];
+  }
+};
+
+// Computes where the line between the specified points crosses the triangles, as fractions of the distance from p1 to
+// p2 in ascending order. Crossings through a shared edge are reported once. bins may be null.
+std::vector<double> ComputeIntersectionDepths(std::span<libmath::Plane> triangles, std::span<const uint32_t> edge_ids,
+                                              const TriangleBins* bins, const libmath::Point& p1,
+                                              const libmath::Point& p2);
 
 }
 
+// Builds the grid of a bmp image, black pixels being internal. stats, if not null, collects the phases of the build.
 template <std::derived_from<Voxel> T>
-bool BuildFromBmp(const std::filesystem::path& bmp, double step, VoxelGrid2d<T>* grid) {
+bool BuildFromBmp(const std::filesystem::path& bmp, double step, VoxelGrid2d<T>* grid, BuildStats* stats = nullptr) {
+  voxel::internal::StatsScope stats_scope(stats);
+  std::optional<voxel::internal::PhaseScope> phase;
+  phase.emplace("read");
   auto maybe_image = simplebmp::Image::Load(bmp);
   if (!maybe_image.has_value()) {
     return false;
   }
   auto& image = maybe_image.value();
+
+  phase.emplace("classify");
   grid->Init(image.Width(), image.Height(), step);
+  phase->AddBytes(image.Width() * image.Height() * sizeof(T));
 
   // Mark voxels as internal or external.
-  grid->AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
-    VoxelGrid2d<T>* grid = reinterpret_cast<VoxelGrid2d<T>*>(data);
+  grid->ForEachXY([&](int64_t x, int64_t y) {
     grid->At(x, y)->type = internal::IsBlack(image.At(x, y)) ? kVoxelTypeInternal : kVoxelTypeExternal;
   });
-  grid->RunSync(true);
 
   // Mark boundary voxels.
-  grid->AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
-    VoxelGrid2d<T>* grid = reinterpret_cast<VoxelGrid2d<T>*>(data);
+  phase.emplace("boundaries");
+  grid->ForEachXY([&](int64_t x, int64_t y) {
     auto d2q9 = grid->D2Q9(x, y);
     auto* center = d2q9[0];
 
@@ -78,67 +267,276 @@ bool BuildFromBmp(const std::filesystem::path& bmp, double step, VoxelGrid2d<T>*
       center->type |= kVoxelTypeBoundary;
     }
   });
-  grid->RunSync(true);
 
   return true;
 }
 
-template <std::derived_from<Voxel> T>
-bool BuildFromStl(const std::filesystem::path& stl_path, VoxelGrid3d<T>* grid, double step,
-                  int64_t extra_steps_x = 2, int64_t extra_steps_y = 2, int64_t extra_steps_z = 2) {
-  simplestl::StlReader reader(stl_path);
-  std::vector<libmath::Triangle> triangles;
-  if (!reader.Read(&triangles)) {
-    return false;
+namespace internal {
+
+// Casts six rays from the point, one along each axis direction, to the faces of a grid of the specified size. Returns
+// true if all of them cross the mesh an odd number of times.
+inline bool SixRayVote(const RayCaster& caster, const libmath::Point& p, double width, double height, double depth) {
+  bool odd_intersection_count = true;
+  odd_intersection_count &= caster.CountIntersections(p, {p.x, height, p.z}) % 2; // Up [ +y ]
+  odd_intersection_count &= caster.CountIntersections(p, {p.x, 0, p.z}) % 2;      // Down [ -y ]
+  odd_intersection_count &= caster.CountIntersections(p, {width, p.y, p.z}) % 2;  // Right [ +x ]
+  odd_intersection_count &= caster.CountIntersections(p, {0, p.y, p.z}) % 2;      // Left [ -x ]
+  odd_intersection_count &= caster.CountIntersections(p, {p.x, p.y, depth}) % 2;  // Front [ +z ]
+  odd_intersection_count &= caster.CountIntersections(p, {p.x, p.y, 0}) % 2;      // Back [ -z ]
+  return odd_intersection_count;
+}
+
+// Classifies every voxel by casting six rays from its center, one along each axis direction. The voxel is internal
+// only if all six rays cross the mesh an odd number of times.
+template <std::derived_from<Voxel> T, typename Layout>
+void ClassifySixRayVote(const RayCaster& caster, VoxelGrid3d<T, Layout>* grid) {
+  double step = grid->Step();
+  double width = grid->XDim() * step;
+  double height = grid->YDim() * step;
+  double depth = grid->ZDim() * step;
+
+  // For each point, determine whether the voxel is internal or external.
+  grid->ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+    auto* cur_voxel = grid->At(x, y, z);
+    bool inside = SixRayVote(caster, MakePoint(x, y, z, step), width, height, depth);
+    cur_voxel->type = inside ? kVoxelTypeInternal : kVoxelTypeExternal;
+  });
+}
+
+// Casts one ray up the column from the bottom to the top of a grid with z_dim voxels along z, and sets *transitions to
+// the first voxel at or above every crossing in ascending order, z_dim for crossings above the last voxel center. A
+// voxel is inside iff an odd number of the values are at or below it. The vector's storage is reused.
+inline void ColumnTransitions(const RayCaster& caster, int64_t x, int64_t y, int64_t z_dim, double step,
+                              std::vector<int64_t>* transitions) {
+  double depth = z_dim * step;
+  libmath::Point p = MakePoint(x, y, 0, step);
+  std::vector<double> depths = caster.IntersectionDepths({p.x, p.y, 0}, {p.x, p.y, depth});
+
+  transitions->clear();
+  transitions->reserve(depths.size());
+  int64_t low = 0;
+  for (double crossing : depths) {
+    // Binary search for the first voxel center at or above the crossing, starting from the previous one.
+    int64_t high = z_dim;
+    while (low < high) {
+      int64_t mid = low + (high - low) / 2;
+      if (MakePoint(x, y, mid, step).z / depth >= crossing) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
+    }
+    transitions->push_back(low);
   }
+}
 
-  // At least 1 extra step is required for the algorithm to work, 2 to be safe.
-  extra_steps_x = std::max(static_cast<int64_t>(2), extra_steps_x);
-  extra_steps_y = std::max(static_cast<int64_t>(2), extra_steps_y);
-  extra_steps_z = std::max(static_cast<int64_t>(2), extra_steps_z);
+// Same as above, returning the transitions.
+inline std::vector<int64_t> ColumnTransitions(const RayCaster& caster, int64_t x, int64_t y, int64_t z_dim,
+                                              double step) {
+  std::vector<int64_t> transitions;
+  ColumnTransitions(caster, x, y, z_dim, step, &transitions);
+  return transitions;
+}
 
-  // Compute bounding box and resize grid.
-  double width = 0, height = 0, depth = 0;
-  internal::ComputeBoundingBox(triangles, width, height, depth);
-  width += 2 * extra_steps_x * step;
-  height += 2 * extra_steps_y * step;
-  depth += 2 * extra_steps_z * step;
+// Classifies the column by the parity of the crossings below each voxel center, and calls set_inside(z, inside) for
+// every voxel of the column in ascending order.
+template <typename SetInside>
+void ScanColumn(const RayCaster& caster, int64_t x, int64_t y, int64_t z_dim, double step, SetInside set_inside) {
+  std::vector<int64_t> transitions = ColumnTransitions(caster, x, y, z_dim, step);
+  size_t crossings = 0;
+  for (int64_t z = 0; z < z_dim; z++) {
+    while (crossings < transitions.size() && transitions[crossings] <= z) {
+      crossings++;
+    }
+    set_inside(z, crossings % 2 == 1);
+  }
+}
 
-  int64_t x_dim = internal::ComputeSteps(width, step);
-  int64_t y_dim = internal::ComputeSteps(height, step);
-  int64_t z_dim = internal::ComputeSteps(depth, step);
-  grid->Init(x_dim, y_dim, z_dim, step);
+// Classifies every voxel by casting one ray per column from the bottom to the top of the grid and sweeping up the
+// column, flipping between external and internal at every crossing.
+template <std::derived_from<Voxel> T, typename Layout>
+void ClassifyColumnScanline(const RayCaster& caster, VoxelGrid3d<T, Layout>* grid) {
+  double step = grid->Step();
+  int64_t z_dim = grid->ZDim();
+
+  grid->ForEachXY([&](int64_t x, int64_t y) {
+    ScanColumn(caster, x, y, z_dim, step, [&](int64_t z, bool inside) {
+      grid->At(x, y, z)->type = inside ? kVoxelTypeInternal : kVoxelTypeExternal;
+    });
+  });
+}
 
-  // Recompute triangles as planes and release triangle memory.
-  std::vector<libmath::Plane> planes = internal::ComputePlane(triangles, extra_steps_x * step, extra_steps_y * step, extra_steps_z * step);
-  triangles.clear();
+// Classifies a grid of the specified dims coarse to fine, see Classification::kCoarseToFine. For a closed mesh, no
+// path between two voxel centers of a cell that no triangle touches crosses the surface, so every ray from them sees
+// the same parity and one vote classifies the whole cell. Cells the surface touches are split into octants, each
+// keeping the triangles of its parent that touch it, down to single voxels. Calls
+// fill(x_begin, x_end, y_begin, y_end, z_begin, z_end, inside) for every classified box. Tasks own whole columns of
+// cells, so fill never writes a column another task writes.
+template <typename Fill>
+void ClassifyCoarseToFine(const RayCaster& caster, std::span<libmath::Plane> planes, int64_t x_dim, int64_t y_dim,
+                          int64_t z_dim, double step, int64_t cell_size, Scheduler& scheduler, Fill fill) {
+  CHECK_GT(cell_size, 0);
+  CHECK_EQ(cell_size & (cell_size - 1), 0) << "The coarse cell size must be a power of two";
+  double width = x_dim * step;
+  double height = y_dim * step;
+  double depth = z_dim * step;
+  CellBins bins;
+  bins.Init(planes, x_dim, y_dim, z_dim, step, cell_size);
+
+  scheduler.ParallelFor(bins.cells_x * bins.cells_y, 1, [&](int64_t begin, int64_t end) {
+    // Candidates of the octant being refined at every level below the cells.
+    std::vector<std::vector<uint32_t>> levels(std::bit_width(static_cast<uint64_t>(cell_size)));
+    auto refine = [&](auto& self, int64_t x, int64_t y, int64_t z, int64_t size, std::span<const uint32_t> candidates,
+                      size_t level) -> void {
+      if (x >= x_dim || y >= y_dim || z >= z_dim) {
+        return;
+      }
+      if (candidates.empty() || size == 1) {
+        bool inside = SixRayVote(caster, MakePoint(x, y, z, step), width, height, depth);
+        fill(x, std::min(x + size, x_dim), y, std::min(y + size, y_dim), z, std::min(z + size, z_dim), inside);
+        return;
+      }
+      int64_t half = size / 2;
+      for (int64_t dz = 0; dz < size; dz += half) {
+        for (int64_t dy = 0; dy < size; dy += half) {
+          for (int64_t dx = 0; dx < size; dx += half) {
+            std::vector<uint32_t>& inner = levels[level];
+            inner.clear();
+            for (uint32_t index : candidates) {
+              if (TriangleTouchesCell(bins.triangles[index], x + dx, y + dy, z + dz, half, step)) {
+                inner.push_back(index);
+              }
+            }
+            self(self, x + dx, y + dy, z + dz, half, inner, level + 1);
+          }
+        }
+      }
+    };
 
-  // Recalculate to adjust for the ceil used in the step calculation.
-  width = x_dim * step;
-  height = y_dim * step;
-  depth = z_dim * step;
+    for (int64_t column = begin; column < end; column++) {
+      int64_t cx = column % bins.cells_x;
+      int64_t cy = column / bins.cells_x;
+      for (int64_t cz = 0; cz < bins.cells_z; cz++) {
+        refine(refine, cx * cell_size, cy * cell_size, cz * cell_size, cell_size, bins.Cell(cx, cy, cz), 0);
+      }
+    }
+  });
+}
 
-  // For each point, determine whether the voxel is internal or external.
-  grid->AddForeachXYZCallback([&](void* data, int64_t x, int64_t y, int64_t z) {
-    VoxelGrid3d<T>* grid = reinterpret_cast<VoxelGrid3d<T>*>(data);
-    libmath::Point p = internal::MakePoint(x, y, z, step);
-    auto* cur_voxel = grid->At(x, y, z);
+// Calls mark(z) for every voxel of the column that a triangle touches, skipping the voxels for which marked(z) is
+// already true. Each column only looks at the triangles binned for the rays along z through it, and tests the overlap
+// against the voxels within each triangle's z extent.
+template <typename Marked, typename Mark>
+void MarkSurfaceColumn(std::span<libmath::Plane> planes, const TriangleBins& bins, int64_t x, int64_t y, int64_t z_dim,
+                       double step, Marked marked, Mark mark) {
+  libmath::Point p = MakePoint(x, y, 0, step);
+  std::span<const uint32_t> candidates;
+  bins.Candidates({p.x, p.y, 0}, {p.x, p.y, z_dim * step}, &candidates);
+  for (uint32_t index : candidates) {
+    libmath::Triangle triangle = planes[index].ToTriangle();
+    double min_z = std::min({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z});
+    double max_z = std::max({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z});
+    int64_t z_begin = std::max(static_cast<int64_t>(std::floor(min_z / step)) - 1, static_cast<int64_t>(0));
+    int64_t z_end = std::min(static_cast<int64_t>(std::floor(max_z / step)) + 1, z_dim - 1);
+    for (int64_t z = z_begin; z <= z_end; z++) {
+      if (!marked(z) && TriangleOverlapsBox(triangle, MakePoint(x, y, z, step), step / 2)) {
+        mark(z);
+      }
+    }
+  }
+}
 
-    bool odd_intersection_count = true;
-    odd_intersection_count &= internal::ComputeIntersections(planes, p, {p.x, height, p.z}) % 2; // Up [ +y ]
-    odd_intersection_count &= internal::ComputeIntersections(planes, p, {p.x, 0, p.z}) % 2;      // Down [ -y ]
-    odd_intersection_count &= internal::ComputeIntersections(planes, p, {width, p.y, p.z}) % 2;  // Right [ +x ]
-    odd_intersection_count &= internal::ComputeIntersections(planes, p, {0, p.y, p.z}) % 2;      // Left [ -x ]
-    odd_intersection_count &= internal::ComputeIntersections(planes, p, {p.x, p.y, depth}) % 2;  // Front [ +z ]
-    odd_intersection_count &= internal::ComputeIntersections(planes, p, {p.x, p.y, 0}) % 2;      // Back [ -z ]
+// Marks every voxel that a triangle touches as a boundary, then floods the external space inwards from the faces of
+// the grid. Voxels the flood cannot reach are internal, which includes any sealed cavities in the mesh.
+template <std::derived_from<Voxel> T, typename Layout>
+void ClassifySurfaceFloodFill(std::span<libmath::Plane> planes, const TriangleBins& bins,
+                              VoxelGrid3d<T, Layout>* grid) {
+  double step = grid->Step();
+  int64_t x_dim = grid->XDim();
+  int64_t y_dim = grid->YDim();
+  int64_t z_dim = grid->ZDim();
+
+  grid->ForEachXY([&](int64_t x, int64_t y) {
+    for (int64_t z = 0; z < z_dim; z++) {
+      grid->At(x, y, z)->type = kVoxelTypeUndefined;
+    }
 
-    cur_voxel->type = odd_intersection_count ? kVoxelTypeInternal : kVoxelTypeExternal;
+    MarkSurfaceColumn(planes, bins, x, y, z_dim, step,
+                      [&](int64_t z) { return grid->At(x, y, z)->type != kVoxelTypeUndefined; },
+                      [&](int64_t z) { grid->At(x, y, z)->type = kVoxelTypeInternal | kVoxelTypeBoundary; });
   });
-  grid->RunSync(true);
 
-  // Mark each internal voxel that has at least one non-internal neighbor, mark it as a boundary.
-  grid->AddForeachXYZCallback([&](void* data, int64_t x, int64_t y, int64_t z) {
-    VoxelGrid3d<T>* grid = reinterpret_cast<VoxelGrid3d<T>*>(data);
+  // Flood the external label from the faces of the grid through face neighbors. Every voxel of the frontier is
+  // claimed once, by the task that turns it from undefined to external, so each voxel is visited a constant number of
+  // times whatever the shape of the space. A task floods depth first from its share of the frontier, and hands what is
+  // left on its stack after kFloodBudget voxels to the next round, which keeps the tasks balanced without a round per
+  // voxel of distance from the faces.
+  constexpr int64_t kFloodBudget = 1 << 14;
+  auto claim = [&](int64_t x, int64_t y, int64_t z) {
+    int32_t expected = kVoxelTypeUndefined;
+    return std::atomic_ref<int32_t>(grid->At(x, y, z)->type)
+        .compare_exchange_strong(expected, kVoxelTypeExternal, std::memory_order_relaxed);
+  };
+  auto index = [&](int64_t x, int64_t y, int64_t z) { return (z * y_dim + y) * x_dim + x; };
+
+  std::vector<int64_t> frontier;
+  for (int64_t z = 0; z < z_dim; z++) {
+    for (int64_t y = 0; y < y_dim; y++) {
+      // Whole rows on the z and y faces, the two ends of the row otherwise.
+      bool face_row = z == 0 || z == z_dim - 1 || y == 0 || y == y_dim - 1;
+      for (int64_t x = 0; x < x_dim; x += face_row || x == x_dim - 1 ? 1 : x_dim - 1) {
+        if (claim(x, y, z)) {
+          frontier.push_back(index(x, y, z));
+        }
+      }
+    }
+  }
+
+  Scheduler& scheduler = *grid->GetScheduler();
+  std::mutex next_mutex;
+  std::vector<int64_t> next;
+  while (!frontier.empty()) {
+    int64_t grain = std::max<int64_t>(frontier.size() / (8 * scheduler.Threads()), 64);
+    scheduler.ParallelFor(frontier.size(), grain, [&](int64_t begin, int64_t end) {
+      std::vector<int64_t> stack(frontier.begin() + begin, frontier.begin() + end);
+      for (int64_t visited = 0; !stack.empty() && visited < kFloodBudget; visited++) {
+        int64_t i = stack.back();
+        stack.pop_back();
+        int64_t x = i % x_dim, y = i / x_dim % y_dim, z = i / x_dim / y_dim;
+        auto visit = [&](int64_t nx, int64_t ny, int64_t nz) {
+          if (nx >= 0 && ny >= 0 && nz >= 0 && nx < x_dim && ny < y_dim && nz < z_dim && claim(nx, ny, nz)) {
+            stack.push_back(index(nx, ny, nz));
+          }
+        };
+        visit(x - 1, y, z);
+        visit(x + 1, y, z);
+        visit(x, y - 1, z);
+        visit(x, y + 1, z);
+        visit(x, y, z - 1);
+        visit(x, y, z + 1);
+      }
+      if (!stack.empty()) {
+        std::lock_guard<std::mutex> lock(next_mutex);
+        next.insert(next.end(), stack.begin(), stack.end());
+      }
+    });
+    frontier.swap(next);
+    next.clear();
+  }
+
+  // Everything the flood could not reach is enclosed by the surface.
+  grid->ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+    auto* cur_voxel = grid->At(x, y, z);
+    if (cur_voxel->type == kVoxelTypeUndefined) {
+      cur_voxel->type = kVoxelTypeInternal;
+    }
+  });
+}
+
+// Marks every internal voxel of the layers [z_begin, z_end) that has at least one external neighbor as a boundary.
+template <std::derived_from<Voxel> T, typename Layout>
+void MarkBoundaries(VoxelGrid3d<T, Layout>* grid, int64_t z_begin, int64_t z_end) {
+  grid->ForEachXYZ(0, grid->XDim(), 0, grid->YDim(), z_begin, z_end, [&](int64_t x, int64_t y, int64_t z) {
     auto* cur_voxel = grid->At(x, y, z);
 
     // If it's an external voxel, leave it alone.
@@ -159,9 +557,368 @@ bool BuildFromStl(const std::filesystem::path& stl_path, VoxelGrid3d<T>* grid, d
       cur_voxel->type |= kVoxelTypeBoundary;
     }
   });
+}
+
+// Marks every internal voxel that has at least one external neighbor as a boundary.
+template <std::derived_from<Voxel> T, typename Layout>
+void MarkBoundaries(VoxelGrid3d<T, Layout>* grid) {
+  MarkBoundaries(grid, 0, grid->ZDim());
+}
+
+// Same as above, skipping the uniform bricks in bulk. An external brick never has boundaries, and neither does a
+// uniform internal brick without an external voxel in the one voxel thick shell around it. Every other brick is allocated
+// and marked voxel by voxel. Deciding, allocating and marking run as separate passes, so that no brick is allocated
+// while its neighbors read it.
+template <std::derived_from<Voxel> T>
+void MarkBoundaries(BrickGrid3d<T>* grid) {
+  const BrickGrid3d<T>& bricks = *grid;
+  auto index = [&](int64_t bx, int64_t by, int64_t bz) { return (bz * bricks.BricksY() + by) * bricks.BricksX() + bx; };
+  std::vector<uint8_t> needs_storage(bricks.BricksX() * bricks.BricksY() * bricks.BricksZ(), 0);
+
+  grid->AddForeachBrickColumnCallback([&](void* data, int64_t bx, int64_t by) {
+    for (int64_t bz = 0; bz < bricks.BricksZ(); bz++) {
+      const T* uniform = bricks.Uniform(bx, by, bz);
+      if (uniform == nullptr) {
+        needs_storage[index(bx, by, bz)] = 1;
+        continue;
+      }
+      if (uniform->type == kVoxelTypeExternal) {
+        continue;
+      }
+
+      // Look for an external voxel in the one voxel thick shell around the brick.
+      constexpr int64_t kBrickSize = BrickGrid3d<T>::kBrickSize;
+      int64_t x_begin = std::max(bx * kBrickSize - 1, int64_t{0});
+      int64_t x_end = std::min((bx + 1) * kBrickSize + 1, bricks.XDim());
+      int64_t y_begin = std::max(by * kBrickSize - 1, int64_t{0});
+      int64_t y_end = std::min((by + 1) * kBrickSize + 1, bricks.YDim());
+      int64_t z_begin = std::max(bz * kBrickSize - 1, int64_t{0});
+      int64_t z_end = std::min((bz + 1) * kBrickSize + 1, bricks.ZDim());
+      for (int64_t x = x_begin; x < x_end && !needs_storage[index(bx, by, bz)]; x++) {
+        for (int64_t y = y_begin; y < y_end; y++) {
+          bool in_brick_xy = x / kBrickSize == bx && y / kBrickSize == by;
+          for (int64_t z = z_begin; z < z_end; z++) {
+            // Skip over the brick itself.
+            if (in_brick_xy && z / kBrickSize == bz) {
+              z = z < (bz + 1) * kBrickSize - 1 ? (bz + 1) * kBrickSize - 1 : z;
+              continue;
+            }
+            if (bricks.At(x, y, z)->type == kVoxelTypeExternal) {
+              needs_storage[index(bx, by, bz)] = 1;
+            }
+          }
+        }
+      }
+    }
+  });
+  grid->RunSync(true);
+
+  grid->AddForeachBrickColumnCallback([&](void* data, int64_t bx, int64_t by) {
+    for (int64_t bz = 0; bz < bricks.BricksZ(); bz++) {
+      if (needs_storage[index(bx, by, bz)]) {
+        grid->At(bx * bricks.kBrickSize, by * bricks.kBrickSize, bz * bricks.kBrickSize);
+      }
+    }
+  });
+  grid->RunSync(true);
+
+  grid->AddForeachBrickColumnCallback([&](void* data, int64_t bx, int64_t by) {
+    for (int64_t bz = 0; bz < bricks.BricksZ(); bz++) {
+      if (!needs_storage[index(bx, by, bz)]) {
+        continue;
+      }
+      bricks.ForEachVoxelInBrick(bx, by, bz, [&](int64_t x, int64_t y, int64_t z) {
+        auto* cur_voxel = grid->At(x, y, z);
+        if (cur_voxel->type == kVoxelTypeExternal) {
+          return;
+        }
+        for (const auto* neighbor : bricks.D3Q27(x, y, z)) {
+          if (neighbor != nullptr && neighbor->type == kVoxelTypeExternal) {
+            cur_voxel->type |= kVoxelTypeBoundary;
+            return;
+          }
+        }
+      });
+    }
+  });
+  grid->RunSync(true);
+}
+
+}
+
+namespace internal {
+
+// Builds the grid of a mesh with the engine the options ask for.
+template <std::derived_from<Voxel> T, typename Layout>
+void Voxelize(StlMesh& mesh, double step, const StlBuildOptions& options, VoxelGrid3d<T, Layout>* grid) {
+  voxel::internal::StatsScope stats(options.stats);
+  {
+    voxel::internal::PhaseScope phase("classify");
+    grid->Init(mesh.x_dim, mesh.y_dim, mesh.z_dim, step);
+    phase.AddBytes(mesh.x_dim * mesh.y_dim * mesh.z_dim * sizeof(T));
+    RayCaster caster = mesh.Caster();
+
+    switch (options.classification) {
+      case Classification::kSixRayVote:
+        ClassifySixRayVote(caster, grid);
+        break;
+      case Classification::kColumnScanline:
+        ClassifyColumnScanline(caster, grid);
+        break;
+      case Classification::kCoarseToFine:
+        ClassifyCoarseToFine(caster, mesh.planes, mesh.x_dim, mesh.y_dim, mesh.z_dim, step, options.coarse_cell_size,
+                             *grid->GetScheduler(),
+                             [&](int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, int64_t z_begin,
+                                 int64_t z_end, bool inside) {
+                               for (int64_t z = z_begin; z < z_end; z++) {
+                                 for (int64_t y = y_begin; y < y_end; y++) {
+                                   for (int64_t x = x_begin; x < x_end; x++) {
+                                     grid->At(x, y, z)->type = inside ? kVoxelTypeInternal : kVoxelTypeExternal;
+                                   }
+                                 }
+                               }
+                             });
+        break;
+      case Classification::kSurfaceFloodFill:
+        // The surface voxels already form the boundary layer.
+        ClassifySurfaceFloodFill(mesh.planes, *mesh.bins, grid);
+        return;
+    }
+  }
+
+  voxel::internal::PhaseScope phase("boundaries");
+  MarkBoundaries(grid);
+}
+
+}
+
+template <std::derived_from<Voxel> T, typename Layout>
+bool BuildFromStl(const std::filesystem::path& stl_path, VoxelGrid3d<T, Layout>* grid, double step,
+                  const StlBuildOptions& options) {
+  internal::StlMesh mesh;
+  if (!internal::LoadStlMesh(stl_path, step, options, &mesh)) {
+    return false;
+  }
+  internal::Voxelize(mesh, step, options, grid);
+  return true;
+}
+
+// Builds the grid of a mesh generated in memory instead of read from a stl file. The mesh is moved to the origin
+// first, so its coordinates may be anywhere.
+template <std::derived_from<Voxel> T, typename Layout>
+void BuildFromTriangles(std::span<const libmath::Triangle> triangles, VoxelGrid3d<T, Layout>* grid, double step,
+                        const StlBuildOptions& options = {}) {
+  std::vector<libmath::Triangle> moved = internal::MoveToOrigin(triangles);
+  internal::StlMesh mesh;
+  internal::BuildStlMesh(moved, step, options, &mesh);
+  internal::Voxelize(mesh, step, options, grid);
+}
+
+// Builds a sparse grid, matching the VoxelGrid3d BuildFromStl produces with the column scanline engine. That is the
+// only engine that classifies whole bricks at once, so options.classification is ignored. A brick is stored as a single
+// value when no ray crosses the mesh within it, so only the bricks the surface passes through are ever allocated. The
+// grid starts out external, so external bricks leave their node untouched, and the nodes that end up uniform, like
+// those of a solid interior, release their brick tables once the boundaries are marked.
+template <std::derived_from<Voxel> T>
+bool BuildFromStl(const std::filesystem::path& stl_path, BrickGrid3d<T>* grid, double step,
+                  const StlBuildOptions& options) {
+  voxel::internal::StatsScope stats(options.stats);
+  internal::StlMesh mesh;
+  if (!internal::LoadStlMesh(stl_path, step, options, &mesh)) {
+    return false;
+  }
+  // Bricks are allocated as they are classified, so the phase records no bytes.
+  std::optional<voxel::internal::PhaseScope> phase;
+  phase.emplace("classify");
+  T external{};
+  external.type = kVoxelTypeExternal;
+  grid->Init(mesh.x_dim, mesh.y_dim, mesh.z_dim, step, external);
+  internal::RayCaster caster = mesh.Caster();
+  constexpr int64_t kBrickSize = BrickGrid3d<T>::kBrickSize;
+
+  grid->AddForeachBrickColumnCallback([&](void* data, int64_t bx, int64_t by) {
+    // Cast the rays of every column of the brick column up front, then walk up the bricks with a cursor per column.
+    std::vector<std::array<int64_t, 2>> columns;
+    std::vector<std::vector<int64_t>> transitions;
+    for (int64_t x = bx * kBrickSize; x < std::min((bx + 1) * kBrickSize, mesh.x_dim); x++) {
+      for (int64_t y = by * kBrickSize; y < std::min((by + 1) * kBrickSize, mesh.y_dim); y++) {
+        columns.push_back({x, y});
+        transitions.push_back(internal::ColumnTransitions(caster, x, y, mesh.z_dim, step));
+      }
+    }
+    std::vector<size_t> crossings(columns.size(), 0);
+
+    for (int64_t bz = 0; bz < grid->BricksZ(); bz++) {
+      int64_t z_begin = bz * kBrickSize;
+      int64_t z_end = std::min(z_begin + kBrickSize, mesh.z_dim);
+
+      // The brick is uniform if no column changes parity within it, and all of them agree.
+      bool uniform = true;
+      std::optional<bool> inside;
+      for (size_t i = 0; i < columns.size(); i++) {
+        while (crossings[i] < transitions[i].size() && transitions[i][crossings[i]] <= z_begin) {
+          crossings[i]++;
+        }
+        bool column_inside = crossings[i] % 2 == 1;
+        uniform &= crossings[i] == transitions[i].size() || transitions[i][crossings[i]] >= z_end;
+        uniform &= !inside.has_value() || *inside == column_inside;
+        inside = column_inside;
+      }
+
+      if (uniform) {
+        if (inside.value_or(false)) {
+          T value{};
+          value.type = kVoxelTypeInternal;
+          grid->SetUniform(bx, by, bz, value);
+        }
+        continue;
+      }
+
+      for (size_t i = 0; i < columns.size(); i++) {
+        size_t column_crossings = crossings[i];
+        for (int64_t z = z_begin; z < z_end; z++) {
+          while (column_crossings < transitions[i].size() && transitions[i][column_crossings] <= z) {
+            column_crossings++;
+          }
+          grid->At(columns[i][0], columns[i][1], z)->type =
+              column_crossings % 2 == 1 ? kVoxelTypeInternal : kVoxelTypeExternal;
+        }
+      }
+    }
+  });
   grid->RunSync(true);
 
+  phase.emplace("boundaries");
+  internal::MarkBoundaries(grid);
+  grid->CompactNodes([](const T& a, const T& b) { return a.type == b.type; });
   return true;
 }
 
+// Builds the same grid as the VoxelGrid3d BuildFromStl, but only keeps slab_depth layers along z in memory at a time,
+// and hands every finished slab to sink in ascending z order. The buffer is reused for the next slab once the sink
+// returns, and the sink can stop the build by returning false. One halo layer below and above the slab is classified
+// along with it so that boundaries are marked as in the whole grid, and the two top layers are carried over as the
+// halo and first layer of the next slab. Memory is the slab plus, with the column scanline engine, the crossings of
+// every column. The surface engine needs the whole grid to flood the external space, so it is rejected.
+template <std::derived_from<Voxel> T>
+bool BuildSlabsFromStl(const std::filesystem::path& stl_path, double step, int64_t slab_depth,
+                       const StlBuildOptions& options, std::function<bool(const VoxelSlab<T>& slab)> sink) {
+  CHECK_GT(slab_depth, 0);
+  if (options.classification == Classification::kSurfaceFloodFill) {
+    LOG(ERROR) << "The surface flood fill engine cannot build a grid in slabs";
+    return false;
+  }
+  voxel::internal::StatsScope stats(options.stats);
+  internal::StlMesh mesh;
+  if (!internal::LoadStlMesh(stl_path, step, options, &mesh)) {
+    return false;
+  }
+  // Classification, boundaries and the sink interleave slab by slab, so they are recorded as a single phase.
+  voxel::internal::PhaseScope phase("slabs");
+  internal::RayCaster caster = mesh.Caster();
+  double width = mesh.x_dim * step;
+  double height = mesh.y_dim * step;
+  double depth = mesh.z_dim * step;
+
+  // Cast the ray of every column once, and keep only its crossings, packed column after column: the crossings of
+  // column c = y * x_dim + x are transitions[offsets[c], offsets[c + 1]).
+  std::vector<int64_t> offsets;
+  std::vector<int64_t> transitions;
+  VoxelGrid3d<T> layers;
+  if (options.classification == Classification::kColumnScanline) {
+    Scheduler& scheduler = *layers.GetScheduler();
+    Tiling tiling = Tiling::Make(0, mesh.x_dim, 0, mesh.y_dim,
+                                 Tiling::Grain(layers.GrainSize(), mesh.x_dim * mesh.y_dim, scheduler));
+    // Every tile collects the crossings of its columns in its own buffer, which is copied into place once the counts
+    // of all columns, and with them the offsets, are known.
+    std::vector<std::vector<int64_t>> tile_transitions(tiling.Count());
+    offsets.assign(mesh.x_dim * mesh.y_dim + 1, 0);
+    scheduler.ParallelFor(tiling.Count(), 1, [&](int64_t begin, int64_t end) {
+      std::vector<int64_t> column;
+      for (int64_t tile = begin; tile < end; tile++) {
+        tiling.ForEachColumn(tile, [&](int64_t x, int64_t y) {
+          internal::ColumnTransitions(caster, x, y, mesh.z_dim, step, &column);
+          offsets[y * mesh.x_dim + x + 1] = column.size();
+          tile_transitions[tile].insert(tile_transitions[tile].end(), column.begin(), column.end());
+        });
+      }
+    });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    transitions.resize(offsets.back());
+    scheduler.ParallelFor(tiling.Count(), 1, [&](int64_t begin, int64_t end) {
+      for (int64_t tile = begin; tile < end; tile++) {
+        auto next = tile_transitions[tile].begin();
+        tiling.ForEachColumn(tile, [&](int64_t x, int64_t y) {
+          int64_t c = y * mesh.x_dim + x;
+          std::copy(next, next + (offsets[c + 1] - offsets[c]), transitions.begin() + offsets[c]);
+          next += offsets[c + 1] - offsets[c];
+        });
+        std::vector<int64_t>().swap(tile_transitions[tile]);
+      }
+    });
+  }
+
+  // Layer l of the buffer holds voxel z = z_begin - 1 + l. Layers outside the grid are left undefined, which boundary
+  // marking treats like a missing neighbor.
+  layers.Init(mesh.x_dim, mesh.y_dim, std::min(slab_depth, mesh.z_dim) + 2, step);
+  phase.AddBytes(mesh.x_dim * mesh.y_dim * layers.ZDim() * sizeof(T));
+  auto classify = [&](int64_t z_begin, int64_t layer_begin, int64_t layer_end) {
+    layers.ForEachXY([&](int64_t x, int64_t y) {
+      int64_t c = y * mesh.x_dim + x;
+      for (int64_t l = layer_begin; l < layer_end; l++) {
+        int64_t z = z_begin - 1 + l;
+        if (z < 0 || z >= mesh.z_dim) {
+          layers.At(x, y, l)->type = kVoxelTypeUndefined;
+          continue;
+        }
+        bool inside = !offsets.empty()
+            ? (std::upper_bound(transitions.begin() + offsets[c], transitions.begin() + offsets[c + 1], z) -
+               transitions.begin() - offsets[c]) % 2 == 1
+            : internal::SixRayVote(caster, internal::MakePoint(x, y, z, step), width, height, depth);
+        layers.At(x, y, l)->type = inside ? kVoxelTypeInternal : kVoxelTypeExternal;
+      }
+    });
+  };
+
+  int64_t classified = 0;
+  for (int64_t z_begin = 0; z_begin < mesh.z_dim; z_begin += slab_depth) {
+    int64_t z_end = std::min(z_begin + slab_depth, mesh.z_dim);
+    int64_t slab_layers = z_end - z_begin;
+    if (z_begin > 0) {
+      // Carry the last slab layer and the halo above it down to the bottom of the buffer.
+      int64_t carried = classified - 2;
+      layers.ForEachXY([&](int64_t x, int64_t y) {
+        *layers.At(x, y, 0) = *layers.At(x, y, carried);
+        *layers.At(x, y, 1) = *layers.At(x, y, carried + 1);
+      });
+      classified = 2;
+    }
+    classify(z_begin, classified, slab_layers + 2);
+    classified = slab_layers + 2;
+
+    internal::MarkBoundaries(&layers, 1, slab_layers + 1);
+
+    if (!sink(VoxelSlab<T>(&layers, 1, mesh.z_dim, z_begin, z_end))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Builds the packed equivalent of the VoxelGrid3d BuildFromStl produces with the same options. The surface engine
+// marks the surface voxels directly in the boundary plane and floods the external space word by word, see
+// BitGrid3d::FillInterior.
+bool BuildFromStl(const std::filesystem::path& stl_path, BitGrid3d* grid, double step,
+                  const StlBuildOptions& options = {});
+
+template <std::derived_from<Voxel> T, typename Layout>
+bool BuildFromStl(const std::filesystem::path& stl_path, VoxelGrid3d<T, Layout>* grid, double step,
+                  int64_t extra_steps_x = 2, int64_t extra_steps_y = 2, int64_t extra_steps_z = 2) {
+  StlBuildOptions options;
+  options.extra_steps_x = extra_steps_x;
+  options.extra_steps_y = extra_steps_y;
+  options.extra_steps_z = extra_steps_z;
+  return BuildFromStl(stl_path, grid, step, options);
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "voxel/components.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <unordered_map>
+
+#include "glog/logging.h"
+
+
+namespace voxel::internal {
+namespace {
+
+// Offsets of the neighbors that come before a voxel in index order, the only ones a scan has to join it with.
+struct Offset {
+  int64_t dx;
+  int64_t dy;
+  int64_t dz;
+};
+
+std::vector<Offset> BackwardOffsets(Connectivity connectivity) {
+  int max_nonzero = connectivity == Connectivity::k6 ? 1 : connectivity == Connectivity::k18 ? 2 : 3;
+  std::vector<Offset> offsets;
+  for (int64_t dz = -1; dz <= 0; dz++) {
+    for (int64_t dy = -1; dy <= 1; dy++) {
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        bool backward = dz < 0 || (dz == 0 && dy < 0) || (dz == 0 && dy == 0 && dx < 0);
+        if (backward && (dx != 0) + (dy != 0) + (dz != 0) <= max_nonzero) {
+          offsets.push_back({dx, dy, dz});
+        }
+      }
+    }
+  }
+  return offsets;
+}
+
+// Union-find over the voxel indices in which every node points to a smaller or equal index, so the root of a
+// component is its first voxel. Blocks are labeled with the plain operations, each on its own indices, and the seams
+// with the atomic ones, which only ever replace a parent by one of its ancestors.
+class DisjointSets {
+  public:
+    explicit DisjointSets(size_t size) : parents_(size) {}
+
+    void MakeSet(uint32_t i) { parents_[i] = i; }
+    uint32_t Parent(uint32_t i) const { return parents_[i]; }
+    void SetParent(uint32_t i, uint32_t parent) { parents_[i] = parent; }
+
+    uint32_t Find(uint32_t i) {
+      while (parents_[i] != i) {
+        // Path halving.
+        parents_[i] = parents_[parents_[i]];
+        i = parents_[i];
+      }
+      return i;
+    }
+
+    void Union(uint32_t a, uint32_t b) {
+      a = Find(a);
+      b = Find(b);
+      if (a != b) {
+        parents_[std::max(a, b)] = std::min(a, b);
+      }
+    }
+
+    void AtomicSetParent(uint32_t i, uint32_t parent) { Atomic(i).store(parent, std::memory_order_release); }
+
+    uint32_t AtomicFind(uint32_t i) {
+      while (true) {
+        uint32_t parent = Atomic(i).load(std::memory_order_acquire);
+        if (parent == i) {
+          return i;
+        }
+        i = parent;
+      }
+    }
+
+    void AtomicUnion(uint32_t a, uint32_t b) {
+      while (true) {
+        a = AtomicFind(a);
+        b = AtomicFind(b);
+        if (a == b) {
+          return;
+        }
+        if (a < b) {
+          std::swap(a, b);
+        }
+        // Fails if another thread linked the root a meanwhile, in which case both roots are looked up again.
+        uint32_t expected = a;
+        if (Atomic(a).compare_exchange_strong(expected, b, std::memory_order_acq_rel)) {
+          return;
+        }
+      }
+    }
+
+  private:
+    std::atomic_ref<uint32_t> Atomic(uint32_t i) { return std::atomic_ref<uint32_t>(parents_[i]); }
+
+    std::vector<uint32_t> parents_;
+};
+
+}
+
+void LabelComponents(std::span<const uint8_t> selected, int64_t x_dim, int64_t y_dim, int64_t z_dim,
+                     Connectivity connectivity, Scheduler& scheduler, ComponentLabels* result) {
+  int64_t size = x_dim * y_dim * z_dim;
+  CHECK_EQ(static_cast<int64_t>(selected.size()), size);
+  CHECK_LT(size, std::numeric_limits<int32_t>::max());
+  result->labels.assign(size, kNoComponent);
+  result->components.clear();
+  if (size == 0) {
+    return;
+  }
+
+  // Blocks are runs of whole rows of x, so a block only depends on the rows before it through its first y_dim + 1
+  // rows, the ones with neighbors in the previous z plane or the previous row.
+  int64_t rows = y_dim * z_dim;
+  int64_t blocks = std::clamp<int64_t>(size >> 16, 1, std::min<int64_t>(rows, scheduler.Threads() * 4));
+  auto block_row = [&](int64_t block) { return rows * block / blocks; };
+  std::vector<Offset> offsets = BackwardOffsets(connectivity);
+
+  // Calls f(i, j) for every selected voxel i and every selected neighbor j before it whose row is in
+  // [first_row, row of i).
+  auto for_each_backward_pair = [&](int64_t row, int64_t first_row, auto&& f) {
+    int64_t y = row % y_dim, z = row / y_dim;
+    for (int64_t x = 0; x < x_dim; x++) {
+      int64_t i = row * x_dim + x;
+      if (!selected[i]) {
+        continue;
+      }
+      for (const Offset& o : offsets) {
+        int64_t nx = x + o.dx, ny = y + o.dy, nz = z + o.dz;
+        if (nx < 0 || nx >= x_dim || ny < 0 || ny >= y_dim || nz < 0) {
+          continue;
+        }
+        int64_t neighbor_row = nz * y_dim + ny;
+        int64_t j = neighbor_row * x_dim + nx;
+        if (neighbor_row >= first_row && selected[j]) {
+          f(i, j);
+        }
+      }
+    }
+  };
+
+  DisjointSets sets(size);
+  scheduler.ParallelFor(blocks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t block = begin; block < end; block++) {
+      int64_t first_row = block_row(block);
+      for (int64_t row = first_row; row < block_row(block + 1); row++) {
+        for (int64_t i = row * x_dim; i < (row + 1) * x_dim; i++) {
+          sets.MakeSet(i);
+        }
+        for_each_backward_pair(row, first_row, [&](int64_t i, int64_t j) { sets.Union(i, j); });
+      }
+    }
+  });
+
+  // Join every block to the ones before it.
+  scheduler.ParallelFor(blocks - 1, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t block = begin + 1; block < end + 1; block++) {
+      int64_t first_row = block_row(block);
+      int64_t seam_end = std::min(block_row(block + 1), first_row + y_dim + 1);
+      for (int64_t row = first_row; row < seam_end; row++) {
+        for_each_backward_pair(row, 0, [&](int64_t i, int64_t j) {
+          if (j < first_row * x_dim) {
+            sets.AtomicUnion(i, j);
+          }
+        });
+      }
+    }
+  });
+
+  // Parents only point back, so a scan in index order flattens a block, leaving the nodes whose root is in an earlier
+  // block pointing into that block. The roots of every block are counted on the way.
+  std::vector<int64_t> block_roots(blocks + 1, 0);
+  scheduler.ParallelFor(blocks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t block = begin; block < end; block++) {
+      int64_t first = block_row(block) * x_dim;
+      for (int64_t i = first; i < block_row(block + 1) * x_dim; i++) {
+        if (!selected[i]) {
+          continue;
+        }
+        uint32_t parent = sets.Parent(i);
+        if (parent == i) {
+          block_roots[block + 1]++;
+        } else if (parent >= first) {
+          sets.SetParent(i, sets.Parent(parent));
+        }
+      }
+    }
+  });
+  for (int64_t block = 0; block < blocks; block++) {
+    block_roots[block + 1] += block_roots[block];
+  }
+  CHECK_LE(block_roots.back(), std::numeric_limits<int32_t>::max());
+
+  // The roots are numbered, then the nodes with a root in an earlier block follow their parents to it. Those parents
+  // may be replaced concurrently, but only by ancestors.
+  std::vector<int32_t>& labels = result->labels;
+  scheduler.ParallelFor(blocks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t block = begin; block < end; block++) {
+      int32_t next = block_roots[block];
+      int64_t first = block_row(block) * x_dim;
+      for (int64_t i = first; i < block_row(block + 1) * x_dim; i++) {
+        if (selected[i]) {
+          uint32_t parent = sets.Parent(i);
+          if (parent == i) {
+            labels[i] = next++;
+          } else if (parent < first) {
+            sets.AtomicSetParent(i, sets.AtomicFind(parent));
+          }
+        }
+      }
+    }
+  });
+
+  // Every node now points to its root. Gather the statistics of every block one run of equal labels at a time, then
+  // add them up.
+  std::vector<std::unordered_map<int32_t, Component>> block_components(blocks);
+  scheduler.ParallelFor(blocks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t block = begin; block < end; block++) {
+      auto& components = block_components[block];
+      for (int64_t row = block_row(block); row < block_row(block + 1); row++) {
+        int64_t y = row % y_dim, z = row / y_dim;
+        bool border_row = y == 0 || y == y_dim - 1 || (z_dim > 1 && (z == 0 || z == z_dim - 1));
+        int64_t x = 0;
+        while (x < x_dim) {
+          int64_t i = row * x_dim + x;
+          if (!selected[i]) {
+            x++;
+            continue;
+          }
+          int32_t label = labels[sets.Parent(i)];
+          int64_t run_begin = x;
+          for (; x < x_dim && selected[i] && labels[sets.Parent(i)] == label; x++, i++) {
+            // Roots already hold their label, and other blocks may be reading it.
+            if (sets.Parent(i) != i) {
+              labels[i] = label;
+            }
+          }
+          auto [it, inserted] = components.try_emplace(label);
+          Component& c = it->second;
+          if (inserted) {
+            c = {0, run_begin, y, z, x - 1, y, z, false};
+          }
+          c.voxels += x - run_begin;
+          c.min_x = std::min(c.min_x, run_begin);
+          c.min_y = std::min(c.min_y, y);
+          c.min_z = std::min(c.min_z, z);
+          c.max_x = std::max(c.max_x, x - 1);
+          c.max_y = std::max(c.max_y, y);
+          c.max_z = std::max(c.max_z, z);
+          c.touches_border |= border_row || run_begin == 0 || x == x_dim;
+        }
+      }
+    }
+  });
+
+  std::vector<Component>& components = result->components;
+  components.resize(block_roots.back());
+  std::vector<bool> seen(components.size());
+  for (const auto& block : block_components) {
+    for (const auto& [label, c] : block) {
+      Component& total = components[label];
+      if (!seen[label]) {
+        seen[label] = true;
+        total = c;
+        continue;
+      }
+      total.voxels += c.voxels;
+      total.min_x = std::min(total.min_x, c.min_x);
+      total.min_y = std::min(total.min_y, c.min_y);
+      total.min_z = std::min(total.min_z, c.min_z);
+      total.max_x = std::max(total.max_x, c.max_x);
+      total.max_y = std::max(total.max_y, c.max_y);
+      total.max_z = std::max(total.max_z, c.max_z);
+      total.touches_border |= c.touches_border;
+    }
+  }
+}
+
+}
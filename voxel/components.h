@@ -0,0 +1,88 @@
+#pragma once
+
+#include <concepts>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+namespace voxel {
+
+// Which neighbors of a voxel belong to the same component: the ones sharing a face, a face or an edge, or a face, an
+// edge or a corner, out of the 26 neighbors of D3Q27. In 2d, k6 connects the 4 neighbors sharing an edge, and k18 and
+// k26 all 8.
+enum class Connectivity {
+  k6,
+  k18,
+  k26,
+};
+
+constexpr int32_t kNoComponent = -1;
+
+struct Component {
+  int64_t voxels = 0;
+  // Bounding box in voxels, both ends inclusive.
+  int64_t min_x = 0;
+  int64_t min_y = 0;
+  int64_t min_z = 0;
+  int64_t max_x = 0;
+  int64_t max_y = 0;
+  int64_t max_z = 0;
+  // Whether the component reaches a face of the grid. An external component that does not is a sealed void.
+  bool touches_border = false;
+};
+
+struct ComponentLabels {
+  // The component of every voxel, indexed (z * y_dim + y) * x_dim + x, kNoComponent for the voxels not labeled.
+  std::vector<int32_t> labels;
+  // Numbered in the order of their first voxel in labels.
+  std::vector<Component> components;
+};
+
+namespace internal {
+
+// Labels the connected components of the voxels whose selected byte is not 0, in an x_dim * y_dim * z_dim buffer,
+// x fastest. The rows are split into blocks that are labeled with a union-find in parallel, then the blocks are joined
+// along their seams with a lock free union-find, and the labels and statistics are gathered in parallel again.
+void LabelComponents(std::span<const uint8_t> selected, int64_t x_dim, int64_t y_dim, int64_t z_dim,
+                     Connectivity connectivity, Scheduler& scheduler, ComponentLabels* result);
+
+}
+
+// Labels the connected components of the voxels whose type has any of the bits of types. The solid bodies of a mesh
+// are the components of kVoxelTypeInternal | kVoxelTypeBoundary, and its sealed voids the components of
+// kVoxelTypeExternal that do not touch the border.
+template <std::derived_from<Voxel> T>
+void LabelComponents(const VoxelGrid3d<T>& grid, int32_t types, Connectivity connectivity, ComponentLabels* result) {
+  int64_t x_dim = grid.XDim(), y_dim = grid.YDim(), z_dim = grid.ZDim();
+  Scheduler& scheduler = *grid.GetScheduler();
+  std::vector<uint8_t> selected(x_dim * y_dim * z_dim);
+  scheduler.ParallelFor(y_dim * z_dim, 16, [&](int64_t begin, int64_t end) {
+    for (int64_t row = begin; row < end; row++) {
+      for (int64_t x = 0; x < x_dim; x++) {
+        selected[row * x_dim + x] = (grid.At(x, row % y_dim, row / y_dim)->type & types) != 0;
+      }
+    }
+  });
+  internal::LabelComponents(selected, x_dim, y_dim, z_dim, connectivity, scheduler, result);
+}
+
+// The 2d equivalent, with labels indexed y * x_dim + x and min_z = max_z = 0.
+template <std::derived_from<Voxel> T>
+void LabelComponents(const VoxelGrid2d<T>& grid, int32_t types, Connectivity connectivity, ComponentLabels* result) {
+  int64_t x_dim = grid.XDim(), y_dim = grid.YDim();
+  Scheduler& scheduler = *grid.GetScheduler();
+  std::vector<uint8_t> selected(x_dim * y_dim);
+  scheduler.ParallelFor(y_dim, 16, [&](int64_t begin, int64_t end) {
+    for (int64_t y = begin; y < end; y++) {
+      for (int64_t x = 0; x < x_dim; x++) {
+        selected[y * x_dim + x] = (grid.At(x, y)->type & types) != 0;
+      }
+    }
+  });
+  internal::LabelComponents(selected, x_dim, y_dim, 1, connectivity, scheduler, result);
+}
+
+}
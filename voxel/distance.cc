@@ -0,0 +1,98 @@
+#include "voxel/distance.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+
+
+namespace voxel::internal {
+namespace {
+
+// Scratch space of one task, reused for all of its lines.
+struct LineScratch {
+  std::vector<double> f;
+  std::vector<double> d;
+  // Positions of the parabolas of the lower envelope, and the boundaries between them.
+  std::vector<int64_t> v;
+  std::vector<double> z;
+
+  void Resize(int64_t n) {
+    f.resize(n);
+    d.resize(n);
+    v.resize(n);
+    z.resize(n + 1);
+  }
+};
+
+// d[q] = min over the finite f[p] of (q - p)^2 + f[p], infinity if there are none.
+void SquaredDistance1d(int64_t n, LineScratch& s) {
+  constexpr double kInfinity = std::numeric_limits<double>::infinity();
+  int64_t k = -1;
+  for (int64_t q = 0; q < n; q++) {
+    if (s.f[q] == kInfinity) {
+      continue;
+    }
+    // Drop the parabolas that the new one hides, then append it.
+    double boundary = -kInfinity;
+    while (k >= 0) {
+      int64_t p = s.v[k];
+      boundary = ((s.f[q] + q * q) - (s.f[p] + p * p)) / (2.0 * (q - p));
+      if (boundary > s.z[k]) {
+        break;
+      }
+      k--;
+    }
+    k++;
+    s.v[k] = q;
+    s.z[k] = k == 0 ? -kInfinity : boundary;
+    s.z[k + 1] = kInfinity;
+  }
+
+  if (k < 0) {
+    std::fill(s.d.begin(), s.d.begin() + n, kInfinity);
+    return;
+  }
+  int64_t j = 0;
+  for (int64_t q = 0; q < n; q++) {
+    while (s.z[j + 1] < q) {
+      j++;
+    }
+    double offset = q - s.v[j];
+    s.d[q] = offset * offset + s.f[s.v[j]];
+  }
+}
+
+}
+
+void SquaredDistanceTransform(std::span<float> values, int64_t x_dim, int64_t y_dim, int64_t z_dim,
+                              Scheduler& scheduler) {
+  std::array<int64_t, 3> dims = {x_dim, y_dim, z_dim};
+  std::array<int64_t, 3> strides = {1, x_dim, x_dim * y_dim};
+  for (int axis = 0; axis < 3; axis++) {
+    int64_t n = dims[axis];
+    if (n <= 1) {
+      continue;
+    }
+    // The lines of an axis are numbered by the other two coordinates, the lower one fastest, so that consecutive lines
+    // of the y and z passes are neighbors in memory and share cache lines.
+    int u_axis = axis == 0 ? 1 : 0;
+    int w_axis = axis == 2 ? 1 : 2;
+    int64_t lines = dims[u_axis] * dims[w_axis];
+    scheduler.ParallelFor(lines, std::max<int64_t>(1, 4096 / n), [&](int64_t begin, int64_t end) {
+      LineScratch scratch;
+      scratch.Resize(n);
+      for (int64_t line = begin; line < end; line++) {
+        int64_t base = (line % dims[u_axis]) * strides[u_axis] + (line / dims[u_axis]) * strides[w_axis];
+        for (int64_t i = 0; i < n; i++) {
+          scratch.f[i] = values[base + i * strides[axis]];
+        }
+        SquaredDistance1d(n, scratch);
+        for (int64_t i = 0; i < n; i++) {
+          values[base + i * strides[axis]] = scratch.d[i];
+        }
+      }
+    });
+  }
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+#include "glog/logging.h"
+
+namespace voxel {
+namespace internal {
+
+// Replaces every value of an x_dim * y_dim * z_dim buffer, x fastest, which must be 0 or infinity, by the exact squared
+// Euclidean distance in voxels to the nearest 0. Runs one pass per axis with the lower envelope of parabolas of
+// Felzenszwalb and Huttenlocher, which is linear in the length of each line, and every pass runs in parallel over its
+// lines. Values stay infinite if there is no 0 at all.
+void SquaredDistanceTransform(std::span<float> values, int64_t x_dim, int64_t y_dim, int64_t z_dim,
+                              Scheduler& scheduler);
+
+// 0 for boundary voxels, the seeds of the transform, and infinity for all others.
+inline float DistanceSeed(int32_t type) {
+  return (type & kVoxelTypeBoundary) ? 0 : std::numeric_limits<float>::infinity();
+}
+
+// Turns a squared distance in voxels into the signed distance of a voxel of the specified type.
+inline float SignedDistance(float squared, int32_t type, double step) {
+  float distance = std::sqrt(squared) * static_cast<float>(step);
+  return (type & kVoxelTypeInternal) ? -distance : distance;
+}
+
+}
+
+// Computes the distance from the center of every voxel to the center of the nearest boundary voxel, in the units of
+// the step, negative for internal voxels and positive for external ones. Boundary voxels are 0. distances is indexed
+// like a grid file payload, (z * y_dim + y) * x_dim + x. Every voxel is infinitely far if there are no boundaries.
+template <std::derived_from<Voxel> T>
+void ComputeSignedDistance(const VoxelGrid3d<T>& grid, std::span<float> distances) {
+  int64_t x_dim = grid.XDim(), y_dim = grid.YDim(), z_dim = grid.ZDim();
+  CHECK_EQ(static_cast<int64_t>(distances.size()), x_dim * y_dim * z_dim);
+  Scheduler& scheduler = *grid.GetScheduler();
+  auto for_each_row = [&](auto&& f) {
+    scheduler.ParallelFor(y_dim * z_dim, 16, [&](int64_t begin, int64_t end) {
+      for (int64_t row = begin; row < end; row++) {
+        for (int64_t x = 0; x < x_dim; x++) {
+          f(x, row % y_dim, row / y_dim, row * x_dim + x);
+        }
+      }
+    });
+  };
+
+  for_each_row([&](int64_t x, int64_t y, int64_t z, int64_t i) {
+    distances[i] = internal::DistanceSeed(grid.At(x, y, z)->type);
+  });
+  internal::SquaredDistanceTransform(distances, x_dim, y_dim, z_dim, scheduler);
+  for_each_row([&](int64_t x, int64_t y, int64_t z, int64_t i) {
+    distances[i] = internal::SignedDistance(distances[i], grid.At(x, y, z)->type, grid.Step());
+  });
+}
+
+// Same as above, storing the distances in a float member of the voxels of field, which must have the dims of grid and
+// may be grid itself.
+template <std::derived_from<Voxel> T, std::derived_from<Voxel> U>
+void ComputeSignedDistance(const VoxelGrid3d<T>& grid, VoxelGrid3d<U>* field, float U::*distance) {
+  CHECK_EQ(field->XDim(), grid.XDim());
+  CHECK_EQ(field->YDim(), grid.YDim());
+  CHECK_EQ(field->ZDim(), grid.ZDim());
+  std::vector<float> distances(grid.XDim() * grid.YDim() * grid.ZDim());
+  ComputeSignedDistance(grid, distances);
+  field->ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+    field->At(x, y, z)->*distance = distances[(z * grid.YDim() + y) * grid.XDim() + x];
+  });
+}
+
+// The 2d equivalents, with distances indexed y * x_dim + x.
+template <std::derived_from<Voxel> T>
+void ComputeSignedDistance(const VoxelGrid2d<T>& grid, std::span<float> distances) {
+  int64_t x_dim = grid.XDim(), y_dim = grid.YDim();
+  CHECK_EQ(static_cast<int64_t>(distances.size()), x_dim * y_dim);
+  Scheduler& scheduler = *grid.GetScheduler();
+  auto for_each_row = [&](auto&& f) {
+    scheduler.ParallelFor(y_dim, 16, [&](int64_t begin, int64_t end) {
+      for (int64_t y = begin; y < end; y++) {
+        for (int64_t x = 0; x < x_dim; x++) {
+          f(x, y, y * x_dim + x);
+        }
+      }
+    });
+  };
+
+  for_each_row([&](int64_t x, int64_t y, int64_t i) { distances[i] = internal::DistanceSeed(grid.At(x, y)->type); });
+  internal::SquaredDistanceTransform(distances, x_dim, y_dim, 1, scheduler);
+  for_each_row([&](int64_t x, int64_t y, int64_t i) {
+    distances[i] = internal::SignedDistance(distances[i], grid.At(x, y)->type, grid.Step());
+  });
+}
+
+template <std::derived_from<Voxel> T, std::derived_from<Voxel> U>
+void ComputeSignedDistance(const VoxelGrid2d<T>& grid, VoxelGrid2d<U>* field, float U::*distance) {
+  CHECK_EQ(field->XDim(), grid.XDim());
+  CHECK_EQ(field->YDim(), grid.YDim());
+  std::vector<float> distances(grid.XDim() * grid.YDim());
+  ComputeSignedDistance(grid, distances);
+  field->ForEachXY([&](int64_t x, int64_t y) { field->At(x, y)->*distance = distances[y * grid.XDim() + x]; });
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "voxel/grid_file.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "glog/logging.h"
+
+
+namespace voxel {
+namespace internal {
+
+bool GridPayloadSize(int64_t x_dim, int64_t y_dim, int64_t z_dim, uint32_t voxel_size, uint64_t* size) {
+  if (x_dim < 0 || y_dim < 0 || z_dim < 0) {
+    return false;
+  }
+  uint64_t voxels;
+  return !__builtin_mul_overflow(static_cast<uint64_t>(x_dim), static_cast<uint64_t>(y_dim), &voxels) &&
+         !__builtin_mul_overflow(voxels, static_cast<uint64_t>(z_dim), &voxels) &&
+         !__builtin_mul_overflow(voxels, static_cast<uint64_t>(voxel_size), size);
+}
+
+bool MakeGridFileHeader(uint32_t rank, int64_t x_dim, int64_t y_dim, int64_t z_dim, double step, uint32_t voxel_size,
+                        GridFileHeader* header) {
+  *header = {};
+  std::memcpy(header->magic, kGridFileMagic, sizeof(header->magic));
+  header->version = kGridFileVersion;
+  header->rank = rank;
+  header->x_dim = x_dim;
+  header->y_dim = y_dim;
+  header->z_dim = z_dim;
+  header->step = step;
+  header->voxel_size = voxel_size;
+  header->layout = GridFileLayout::kLinear;
+  header->payload_offset = (sizeof(GridFileHeader) + kGridFileAlignment - 1) / kGridFileAlignment * kGridFileAlignment;
+  if (!GridPayloadSize(x_dim, y_dim, z_dim, voxel_size, &header->payload_size)) {
+    LOG(ERROR) << "Grid too large for a grid file: " << x_dim << "x" << y_dim << "x" << z_dim;
+    return false;
+  }
+  return true;
+}
+
+bool WriteGridFileHeader(std::ofstream& out, GridFileHeader header) {
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  std::vector<char> padding(header.payload_offset - sizeof(header), 0);
+  out.write(padding.data(), padding.size());
+  return out.good();
+}
+
+}
+
+MappedGridFile::~MappedGridFile() {
+  Close();
+}
+
+bool MappedGridFile::Open(const std::filesystem::path& path, uint32_t rank, uint32_t voxel_size) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(GridFileHeader)) {
+    close(fd);
+    return false;
+  }
+  size_ = st.st_size;
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps the file open.
+  close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    return false;
+  }
+
+  const GridFileHeader& header = Header();
+  uint64_t payload_size;
+  bool valid = std::memcmp(header.magic, kGridFileMagic, sizeof(header.magic)) == 0 &&
+               header.version == kGridFileVersion && header.rank == rank && header.voxel_size == voxel_size &&
+               header.layout == GridFileLayout::kLinear &&
+               internal::GridPayloadSize(header.x_dim, header.y_dim, header.z_dim, voxel_size, &payload_size) &&
+               header.payload_offset % kGridFileAlignment == 0 && header.payload_size == payload_size &&
+               header.payload_offset <= size_ &&
+               header.payload_size <= size_ - header.payload_offset;
+  if (!valid) {
+    LOG(ERROR) << "Not a valid grid file for this voxel type: " << path;
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void MappedGridFile::Close() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+#include <vector>
+
+#include "voxel/voxel.h"
+
+namespace voxel {
+
+// Binary file holding one VoxelGrid2d or VoxelGrid3d. The header is followed by the voxels as raw T, starting at the
+// first multiple of kGridFileAlignment after it, so a mapping of the file can be used in place as the voxel array.
+// Files are written and read in native byte order.
+constexpr char kGridFileMagic[8] = {'V', 'O', 'X', 'G', 'R', 'I', 'D', '\0'};
+constexpr uint32_t kGridFileVersion = 1;
+constexpr uint64_t kGridFileAlignment = 4096;
+
+// Order of the voxels in the payload.
+enum class GridFileLayout : uint32_t {
+  // x fastest, then y, then z.
+  kLinear = 0,
+};
+
+struct GridFileHeader {
+  char magic[8];
+  uint32_t version;
+  // 2 or 3. A 2d grid has a z_dim of 1.
+  uint32_t rank;
+  int64_t x_dim;
+  int64_t y_dim;
+  int64_t z_dim;
+  double step;
+  // sizeof(T), so that a file is not opened as the wrong voxel type.
+  uint32_t voxel_size;
+  GridFileLayout layout;
+  uint64_t payload_offset;
+  uint64_t payload_size;
+};
+
+namespace internal {
+
+// Writes the header with the payload offset and size filled in, followed by the padding up to the payload.
+bool WriteGridFileHeader(std::ofstream& out, GridFileHeader header);
+
+// Size in bytes of the voxels of a grid with the specified shape. Returns false if a dimension is negative or the size
+// does not fit in 64 bits.
+bool GridPayloadSize(int64_t x_dim, int64_t y_dim, int64_t z_dim, uint32_t voxel_size, uint64_t* size);
+
+// Header of a grid with the specified shape. Returns false if its payload size overflows.
+bool MakeGridFileHeader(uint32_t rank, int64_t x_dim, int64_t y_dim, int64_t z_dim, double step, uint32_t voxel_size,
+                        GridFileHeader* header);
+
+// Writes a grid of the specified shape, calling voxel_at(x, y, z) for every voxel in payload order.
+template <typename T, typename VoxelAt>
+bool WriteGridFile(const std::filesystem::path& path, const GridFileHeader& header, VoxelAt voxel_at) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!WriteGridFileHeader(out, header)) {
+    return false;
+  }
+  std::vector<T> row(header.x_dim);
+  for (int64_t z = 0; z < header.z_dim; z++) {
+    for (int64_t y = 0; y < header.y_dim; y++) {
+      for (int64_t x = 0; x < header.x_dim; x++) {
+        row[x] = *voxel_at(x, y, z);
+      }
+      out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(T));
+    }
+  }
+  out.close();
+  return !out.fail();
+}
+
+}
+
+template <std::derived_from<Voxel> T>
+bool WriteGridFile(const VoxelGrid3d<T>& grid, const std::filesystem::path& path) {
+  static_assert(std::is_trivially_copyable_v<T>, "Grid files hold voxels as raw bytes");
+  GridFileHeader header;
+  if (!internal::MakeGridFileHeader(3, grid.XDim(), grid.YDim(), grid.ZDim(), grid.Step(), sizeof(T), &header)) {
+    return false;
+  }
+  return internal::WriteGridFile<T>(path, header, [&](int64_t x, int64_t y, int64_t z) { return grid.At(x, y, z); });
+}
+
+template <std::derived_from<Voxel> T>
+bool WriteGridFile(const VoxelGrid2d<T>& grid, const std::filesystem::path& path) {
+  static_assert(std::is_trivially_copyable_v<T>, "Grid files hold voxels as raw bytes");
+  GridFileHeader header;
+  if (!internal::MakeGridFileHeader(2, grid.XDim(), grid.YDim(), 1, grid.Step(), sizeof(T), &header)) {
+    return false;
+  }
+  return internal::WriteGridFile<T>(path, header, [&](int64_t x, int64_t y, int64_t z) { return grid.At(x, y); });
+}
+
+// A read only mapping of a grid file. The pages are shared with every other process mapping the same file, and are
+// only read from disk when first touched.
+class MappedGridFile {
+  public:
+    MappedGridFile() = default;
+    ~MappedGridFile();
+
+    MappedGridFile(const MappedGridFile&) = delete;
+    MappedGridFile& operator=(const MappedGridFile&) = delete;
+
+    // Maps the file and checks that its header describes a grid of the specified rank and voxel size, with a payload
+    // that fits in the file. Returns false otherwise.
+    bool Open(const std::filesystem::path& path, uint32_t rank, uint32_t voxel_size);
+
+    const GridFileHeader& Header() const { return *static_cast<const GridFileHeader*>(data_); }
+    const void* Payload() const { return static_cast<const char*>(data_) + Header().payload_offset; }
+
+  private:
+    void Close();
+
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Read only view of a 3d grid file with the accessors of VoxelGrid3d, reading the voxels straight from the mapping.
+template <std::derived_from<Voxel> T>
+class MappedVoxelGrid3d {
+  public:
+    bool Open(const std::filesystem::path& path) {
+      if (!file_.Open(path, 3, sizeof(T))) {
+        return false;
+      }
+      const GridFileHeader& header = file_.Header();
+      x_dim_ = header.x_dim;
+      y_dim_ = header.y_dim;
+      z_dim_ = header.z_dim;
+      step_ = header.step;
+      voxels_ = static_cast<const T*>(file_.Payload());
+      return true;
+    }
+
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
+    int64_t ZDim() const { return z_dim_; }
+    double Step() const { return step_; }
+
+    const T* At(int64_t x, int64_t y, int64_t z) const { return &voxels_[(z * y_dim_ + y) * x_dim_ + x]; }
+
+    // The voxel followed by its 26 neighbors, null for the neighbors outside the grid.
+    std::array<const T*, 27> D3Q27(int64_t x, int64_t y, int64_t z) const {
+      std::array<const T*, 27> neighbors = {At(x, y, z)};
+      int i = 1;
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          for (int64_t dz = -1; dz <= 1; dz++) {
+            if (dx == 0 && dy == 0 && dz == 0) {
+              continue;
+            }
+            int64_t nx = x + dx, ny = y + dy, nz = z + dz;
+            if (nx >= 0 && ny >= 0 && nz >= 0 && nx < x_dim_ && ny < y_dim_ && nz < z_dim_) {
+              neighbors[i] = At(nx, ny, nz);
+            }
+            i++;
+          }
+        }
+      }
+      return neighbors;
+    }
+
+  private:
+    MappedGridFile file_;
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    int64_t z_dim_ = 0;
+    double step_ = 0;
+    const T* voxels_ = nullptr;
+};
+
+// Read only view of a 2d grid file with the accessors of VoxelGrid2d.
+template <std::derived_from<Voxel> T>
+class MappedVoxelGrid2d {
+  public:
+    bool Open(const std::filesystem::path& path) {
+      if (!file_.Open(path, 2, sizeof(T))) {
+        return false;
+      }
+      const GridFileHeader& header = file_.Header();
+      x_dim_ = header.x_dim;
+      y_dim_ = header.y_dim;
+      step_ = header.step;
+      voxels_ = static_cast<const T*>(file_.Payload());
+      return true;
+    }
+
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
+    double Step() const { return step_; }
+
+    const T* At(int64_t x, int64_t y) const { return &voxels_[y * x_dim_ + x]; }
+
+    // The voxel followed by its 8 neighbors, null for the neighbors outside the grid.
+    std::array<const T*, 9> D2Q9(int64_t x, int64_t y) const {
+      std::array<const T*, 9> neighbors = {At(x, y)};
+      int i = 1;
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          if (dx == 0 && dy == 0) {
+            continue;
+          }
+          int64_t nx = x + dx, ny = y + dy;
+          if (nx >= 0 && ny >= 0 && nx < x_dim_ && ny < y_dim_) {
+            neighbors[i] = At(nx, ny);
+          }
+          i++;
+        }
+      }
+      return neighbors;
+    }
+
+  private:
+    MappedGridFile file_;
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    double step_ = 0;
+    const T* voxels_ = nullptr;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include "voxel/grid_storage.h"
+
+#include <utility>
+
+#include <sys/mman.h>
+
+#include "glog/logging.h"
+
+
+namespace voxel::internal {
+namespace {
+
+constexpr size_t kHugePageSize = 2 << 20;
+
+}
+
+MappedBuffer::~MappedBuffer() {
+  Unmap();
+}
+
+MappedBuffer& MappedBuffer::operator=(MappedBuffer&& other) {
+  if (this != &other) {
+    Unmap();
+    data_ = std::exchange(other.data_, nullptr);
+    capacity_ = std::exchange(other.capacity_, 0);
+    huge_tlb_ = std::exchange(other.huge_tlb_, false);
+  }
+  return *this;
+}
+
+bool MappedBuffer::Map(size_t bytes, HugePages huge_pages) {
+  Unmap();
+  // Huge pages need the length to be a whole number of them.
+  size_t capacity = bytes;
+  if (huge_pages != HugePages::kNone) {
+    capacity = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  }
+  void* data = MAP_FAILED;
+  if (huge_pages == HugePages::kExplicit) {
+    data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge_tlb_ = data != MAP_FAILED;
+  }
+  if (data == MAP_FAILED) {
+    data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    if (huge_pages != HugePages::kNone) {
+      // Only advice: the mapping works without, with small pages.
+      madvise(data, capacity, MADV_HUGEPAGE);
+    }
+  }
+  data_ = data;
+  capacity_ = capacity;
+  return true;
+}
+
+void MappedBuffer::Unmap() {
+  if (data_ != nullptr) {
+    munmap(data_, capacity_);
+  }
+  data_ = nullptr;
+  capacity_ = 0;
+  huge_tlb_ = false;
+}
+
+}
\ No newline at end of file
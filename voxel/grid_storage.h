@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace voxel {
+
+// How a grid allocates its voxels, see VoxelGrid3d::SetAllocation.
+enum class Allocation {
+  // A std::vector, value initialized by the thread calling Init.
+  kDefault,
+  // An anonymous mapping that Init leaves untouched, and whose voxels are then constructed by the tasks of the grid's
+  // scheduler in the partitioning ForEachXYZ (ForEachXY in 2d) uses. The kernel backs a page on the NUMA node of the
+  // thread that first writes it, so every page lands next to the thread that works on it, and the zero filling runs
+  // on every thread instead of one.
+  kFirstTouch,
+};
+
+// Huge pages for the mapping of Allocation::kFirstTouch, which cut the TLB misses of the random neighbor accesses into
+// a large grid. Ignored with Allocation::kDefault.
+enum class HugePages {
+  kNone,
+  // madvise(MADV_HUGEPAGE), which lets khugepaged and the fault handler use transparent huge pages.
+  kTransparent,
+  // MAP_HUGETLB, from the pool reserved in /proc/sys/vm/nr_hugepages. Falls back to kTransparent if the pool is empty.
+  kExplicit,
+};
+
+namespace internal {
+
+// Anonymous read write mapping, untouched until written.
+class MappedBuffer {
+  public:
+    MappedBuffer() = default;
+    ~MappedBuffer();
+
+    MappedBuffer(const MappedBuffer&) = delete;
+    MappedBuffer& operator=(const MappedBuffer&) = delete;
+    MappedBuffer(MappedBuffer&& other) { *this = std::move(other); }
+    MappedBuffer& operator=(MappedBuffer&& other);
+
+    // Replaces the mapping by one of at least `bytes`. Returns false if it cannot be mapped, leaving no mapping.
+    bool Map(size_t bytes, HugePages huge_pages);
+    void Unmap();
+
+    void* Data() const { return data_; }
+    size_t Capacity() const { return capacity_; }
+    // Whether the mapping came from the MAP_HUGETLB pool.
+    bool HugeTlb() const { return huge_tlb_; }
+
+  private:
+    void* data_ = nullptr;
+    size_t capacity_ = 0;
+    bool huge_tlb_ = false;
+};
+
+// The voxels of a grid, in a std::vector or in a MappedBuffer depending on the allocation. Resizing keeps the storage
+// when it is large enough, so that building into the same grid again does not map and fault in the pages again.
+template <typename T>
+class GridStorage {
+  public:
+    void SetAllocation(Allocation allocation, HugePages huge_pages) {
+      // Mapped voxels of the padding of a tiled layout are never constructed, so they must not need destroying.
+      CHECK(allocation == Allocation::kDefault || std::is_trivially_destructible_v<T>);
+      allocation_ = allocation;
+      huge_pages_ = huge_pages;
+    }
+    Allocation GetAllocation() const { return allocation_; }
+    HugePages GetHugePages() const { return huge_pages_; }
+
+    // Makes room for `size` voxels. As with std::vector::resize, the voxels below the previous size keep their values
+    // and the others are value initialized, except that with a mapping the caller constructs them: Resize returns the
+    // index of the first voxel left to construct, `size` if there is none.
+    int64_t Resize(int64_t size) {
+      if (allocation_ == Allocation::kFirstTouch) {
+        size_t bytes = size * sizeof(T);
+        if (buffer_.Data() == nullptr || bytes > buffer_.Capacity()) {
+          size_ = 0;
+          if (!buffer_.Map(std::max<size_t>(bytes, 1), huge_pages_)) {
+            LOG(ERROR) << "Cannot map " << bytes << " bytes of voxels, falling back to the default allocation";
+            allocation_ = Allocation::kDefault;
+          }
+        }
+        if (allocation_ == Allocation::kFirstTouch) {
+          vector_ = std::vector<T>();
+          data_ = static_cast<T*>(buffer_.Data());
+          int64_t first = std::min(size_, size);
+          size_ = size;
+          return first;
+        }
+      }
+
+      if (buffer_.Data() != nullptr) {
+        buffer_.Unmap();
+        size_ = 0;
+      }
+      vector_.resize(size);
+      data_ = vector_.data();
+      size_ = size;
+      return size;
+    }
+
+    T* Data() { return data_; }
+    const T* Data() const { return data_; }
+    int64_t Size() const { return size_; }
+    bool HugeTlb() const { return buffer_.HugeTlb(); }
+
+  private:
+    Allocation allocation_ = Allocation::kDefault;
+    HugePages huge_pages_ = HugePages::kNone;
+    std::vector<T> vector_;
+    MappedBuffer buffer_;
+    T* data_ = nullptr;
+    int64_t size_ = 0;
+};
+
+}
+
+}
\ No newline at end of file
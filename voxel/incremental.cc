@@ -0,0 +1,119 @@
+#include "voxel/incremental.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace voxel::builder {
+namespace {
+
+std::array<double, 9> TriangleKey(const libmath::Triangle& triangle) {
+  std::array<double, 9> key;
+  for (int i = 0; i < 3; i++) {
+    key[i * 3] = triangle.vertices[i].x;
+    key[i * 3 + 1] = triangle.vertices[i].y;
+    key[i * 3 + 2] = triangle.vertices[i].z;
+  }
+  return key;
+}
+
+}
+
+MeshDelta MeshDelta::RigidTransform(std::span<const libmath::Triangle> triangles,
+                                    const std::array<double, 9>& rotation, const libmath::Point& translation) {
+  MeshDelta delta;
+  delta.removed.assign(triangles.begin(), triangles.end());
+  for (libmath::Triangle triangle : triangles) {
+    for (auto& v : triangle.vertices) {
+      v = libmath::Point(rotation[0] * v.x + rotation[1] * v.y + rotation[2] * v.z + translation.x,
+                         rotation[3] * v.x + rotation[4] * v.y + rotation[5] * v.z + translation.y,
+                         rotation[6] * v.x + rotation[7] * v.y + rotation[8] * v.z + translation.z);
+    }
+    delta.added.push_back(triangle);
+  }
+  return delta;
+}
+
+namespace internal {
+
+bool ApplyMeshDelta(const MeshDelta& delta, std::vector<libmath::Triangle>* triangles) {
+  std::map<std::array<double, 9>, int64_t> to_remove;
+  for (const auto& triangle : delta.removed) {
+    to_remove[TriangleKey(triangle)]++;
+  }
+  // Stl meshes live in the positive octant, see ComputeBoundingBox.
+  for (const auto& triangle : delta.added) {
+    for (const auto& vertex : triangle.vertices) {
+      if (vertex.x < 0 || vertex.y < 0 || vertex.z < 0) {
+        return false;
+      }
+    }
+  }
+
+  std::vector<libmath::Triangle> kept;
+  kept.reserve(triangles->size() - std::min(triangles->size(), delta.removed.size()) + delta.added.size());
+  for (const auto& triangle : *triangles) {
+    auto it = to_remove.find(TriangleKey(triangle));
+    if (it != to_remove.end() && it->second > 0) {
+      it->second--;
+      continue;
+    }
+    kept.push_back(triangle);
+  }
+  for (const auto& [key, count] : to_remove) {
+    if (count > 0) {
+      return false;
+    }
+  }
+
+  kept.insert(kept.end(), delta.added.begin(), delta.added.end());
+  triangles->swap(kept);
+  return true;
+}
+
+void TriangleFootprint::Init(const StlMesh& mesh, double step, std::span<const libmath::Triangle> triangles) {
+  x_dim = mesh.x_dim;
+  y_dim = mesh.y_dim;
+  z_dim = mesh.z_dim;
+  xy.assign(x_dim * y_dim, 0);
+  xz.assign(x_dim * z_dim, 0);
+  yz.assign(y_dim * z_dim, 0);
+  dilated_xy.assign(x_dim * y_dim, 0);
+  dilated_xz.assign(x_dim * z_dim, 0);
+  dilated_yz.assign(y_dim * z_dim, 0);
+
+  std::array<int64_t, 3> dims = {x_dim, y_dim, z_dim};
+  std::array<double, 3> translate = {mesh.translate_x, mesh.translate_y, mesh.translate_z};
+  for (const auto& triangle : triangles) {
+    // Voxel range around the triangle along each axis, with a voxel of slack on each side for rounding.
+    std::array<int64_t, 3> begin, end;
+    for (int axis = 0; axis < 3; axis++) {
+      auto coordinate = [&](int i) {
+        const libmath::Point& v = triangle.vertices[i];
+        return (axis == 0 ? v.x : axis == 1 ? v.y : v.z) + translate[axis];
+      };
+      double low = std::min({coordinate(0), coordinate(1), coordinate(2)});
+      double high = std::max({coordinate(0), coordinate(1), coordinate(2)});
+      begin[axis] = std::clamp(static_cast<int64_t>(std::floor(low / step)) - 1, int64_t{0}, dims[axis]);
+      end[axis] = std::clamp(static_cast<int64_t>(std::floor(high / step)) + 2, int64_t{0}, dims[axis]);
+    }
+
+    auto mark = [&](std::vector<uint8_t>& mask, std::vector<uint8_t>& dilated, int u, int v) {
+      for (int64_t j = std::max(begin[v] - 1, int64_t{0}); j < std::min(end[v] + 1, dims[v]); j++) {
+        for (int64_t i = std::max(begin[u] - 1, int64_t{0}); i < std::min(end[u] + 1, dims[u]); i++) {
+          dilated[j * dims[u] + i] = 1;
+          if (i >= begin[u] && i < end[u] && j >= begin[v] && j < end[v]) {
+            mask[j * dims[u] + i] = 1;
+          }
+        }
+      }
+    };
+    mark(xy, dilated_xy, 0, 1);
+    mark(xz, dilated_xz, 0, 2);
+    mark(yz, dilated_yz, 1, 2);
+  }
+}
+
+}
+
+}
\ No newline at end of file
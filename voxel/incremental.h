@@ -0,0 +1,193 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <concepts>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+#include "libmath/point.h"
+#include "libmath/triangle.h"
+#include "voxel/builder.h"
+#include "voxel/indexed_mesh.h"
+#include "voxel/voxel.h"
+
+namespace voxel::builder {
+
+// A change to the triangles of a mesh, in the coordinates of IncrementalStlBuilder::Triangles.
+struct MeshDelta {
+  std::vector<libmath::Triangle> added;
+  // Must match triangles of the mesh exactly. Each one removes a single copy.
+  std::vector<libmath::Triangle> removed;
+
+  // The delta that moves the triangles by the rotation, a row major 3x3 matrix, followed by the translation.
+  static MeshDelta RigidTransform(std::span<const libmath::Triangle> triangles,
+                                  const std::array<double, 9>& rotation, const libmath::Point& translation);
+};
+
+namespace internal {
+
+// Removes the delta's removed triangles from triangles and appends its added ones. Returns false, leaving triangles
+// unchanged, if a removed triangle is not in the mesh or an added one has a negative coordinate.
+bool ApplyMeshDelta(const MeshDelta& delta, std::vector<libmath::Triangle>* triangles);
+
+// Which voxels a set of triangles can affect. Each mask has one entry per line of voxels along an axis: xy per column
+// along z, xz per row along y and yz per row along x. A ray along an axis can only cross a triangle if its line is
+// marked in the mask perpendicular to that axis. The dilated masks are also marked one voxel around every entry.
+struct TriangleFootprint {
+  int64_t x_dim = 0;
+  int64_t y_dim = 0;
+  int64_t z_dim = 0;
+  std::vector<uint8_t> xy, xz, yz;
+  std::vector<uint8_t> dilated_xy, dilated_xz, dilated_yz;
+
+  // Marks the voxel box around each triangle, with the triangles in grid coordinates.
+  void Init(const StlMesh& mesh, double step, std::span<const libmath::Triangle> triangles);
+
+  bool Column(int64_t x, int64_t y) const { return xy[y * x_dim + x]; }
+  bool Row(int64_t x, int64_t y, int64_t z) const { return xz[z * x_dim + x] || yz[z * y_dim + y]; }
+  bool DilatedColumn(int64_t x, int64_t y) const { return dilated_xy[y * x_dim + x]; }
+  bool DilatedRow(int64_t x, int64_t y, int64_t z) const {
+    return dilated_xz[z * x_dim + x] || dilated_yz[z * y_dim + y];
+  }
+};
+
+}
+
+// Keeps the mesh a grid was built from, so that edits to it only reclassify the voxels they can affect. The grid after
+// Apply is identical to a full build of the edited mesh, which keeps the surviving triangles in their order followed
+// by the added ones, see Triangles.
+//
+// With the column scanline engine only the columns whose ray can cross a changed triangle are cast again. The six ray
+// engines also recast the voxels whose x or y rays can cross one, voxel by voxel. Boundaries are marked again one voxel
+// around the reclassified voxels. The surface engine floods the whole grid, so it always rebuilds in full, as does any
+// edit that changes the dims of the grid.
+//
+// Only the voxel work is proportional to the edit. Apply still rebuilds the planes and the acceleration structures of
+// the whole mesh, O(triangles), which dominates for edits to large meshes on small grids.
+template <std::derived_from<Voxel> T>
+class IncrementalStlBuilder {
+  public:
+    // Builds the same grid as BuildFromStl, reading the file the same way, and keeps the triangles for Apply.
+    bool Build(const std::filesystem::path& stl_path, double step, const StlBuildOptions& options,
+               VoxelGrid3d<T>* grid) {
+      IndexedMesh indexed;
+      if (!indexed.Read(stl_path)) {
+        return false;
+      }
+      std::vector<libmath::Triangle> triangles;
+      triangles.reserve(indexed.TriangleCount());
+      for (size_t triangle = 0; triangle < indexed.TriangleCount(); triangle++) {
+        triangles.emplace_back(indexed.Vertex(triangle, 0), indexed.Vertex(triangle, 1), indexed.Vertex(triangle, 2));
+      }
+      Build(std::move(triangles), step, options, grid);
+      return true;
+    }
+
+    void Build(std::vector<libmath::Triangle> triangles, double step, const StlBuildOptions& options,
+               VoxelGrid3d<T>* grid) {
+      triangles_ = std::move(triangles);
+      step_ = step;
+      options_ = options;
+      internal::StlMesh mesh;
+      internal::BuildStlMesh(triangles_, step_, options_, &mesh);
+      internal::Voxelize(mesh, step_, options_, grid);
+      last_reclassified_ = grid->XDim() * grid->YDim() * grid->ZDim();
+    }
+
+    // Applies the delta to the mesh and updates grid, which must be the grid of the last Build or Apply. Returns false,
+    // leaving the mesh and the grid unchanged, if the delta does not apply, see ApplyMeshDelta.
+    bool Apply(const MeshDelta& delta, VoxelGrid3d<T>* grid) {
+      if (!internal::ApplyMeshDelta(delta, &triangles_)) {
+        return false;
+      }
+      internal::StlMesh mesh;
+      internal::BuildStlMesh(triangles_, step_, options_, &mesh);
+      if (options_.classification == Classification::kSurfaceFloodFill || mesh.x_dim != grid->XDim() ||
+          mesh.y_dim != grid->YDim() || mesh.z_dim != grid->ZDim()) {
+        internal::Voxelize(mesh, step_, options_, grid);
+        last_reclassified_ = grid->XDim() * grid->YDim() * grid->ZDim();
+        return true;
+      }
+
+      std::vector<libmath::Triangle> changed = delta.removed;
+      changed.insert(changed.end(), delta.added.begin(), delta.added.end());
+      internal::TriangleFootprint footprint;
+      footprint.Init(mesh, step_, changed);
+
+      internal::RayCaster caster = mesh.Caster();
+      bool six_ray = options_.classification != Classification::kColumnScanline;
+      double width = mesh.x_dim * step_;
+      double height = mesh.y_dim * step_;
+      double depth = mesh.z_dim * step_;
+      std::atomic<int64_t> reclassified = 0;
+      grid->ForEachXY([&](int64_t x, int64_t y) {
+        auto set_inside = [&](int64_t z, bool inside) {
+          grid->At(x, y, z)->type = inside ? kVoxelTypeInternal : kVoxelTypeExternal;
+        };
+        if (footprint.Column(x, y)) {
+          if (six_ray) {
+            for (int64_t z = 0; z < mesh.z_dim; z++) {
+              set_inside(z, internal::SixRayVote(caster, internal::MakePoint(x, y, z, step_), width, height, depth));
+            }
+          } else {
+            internal::ScanColumn(caster, x, y, mesh.z_dim, step_, set_inside);
+          }
+          reclassified.fetch_add(mesh.z_dim, std::memory_order_relaxed);
+          return;
+        }
+        if (!six_ray) {
+          return;
+        }
+        for (int64_t z = 0; z < mesh.z_dim; z++) {
+          if (footprint.Row(x, y, z)) {
+            set_inside(z, internal::SixRayVote(caster, internal::MakePoint(x, y, z, step_), width, height, depth));
+            reclassified.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+      });
+      last_reclassified_ = reclassified;
+
+      // Boundaries only depend on which neighbors are external, so they can be marked again in place.
+      grid->ForEachXY([&](int64_t x, int64_t y) {
+        bool column = footprint.DilatedColumn(x, y);
+        if (!column && !six_ray) {
+          return;
+        }
+        for (int64_t z = 0; z < mesh.z_dim; z++) {
+          if (!column && !footprint.DilatedRow(x, y, z)) {
+            continue;
+          }
+          auto* cur_voxel = grid->At(x, y, z);
+          if (cur_voxel->type == kVoxelTypeExternal) {
+            continue;
+          }
+          cur_voxel->type = kVoxelTypeInternal;
+          for (const auto* neighbor : grid->D3Q27(x, y, z)) {
+            if (neighbor != nullptr && neighbor->type == kVoxelTypeExternal) {
+              cur_voxel->type |= kVoxelTypeBoundary;
+              break;
+            }
+          }
+        }
+      });
+      return true;
+    }
+
+    // The current mesh. After a Build from a file, its coordinates are relative to the minimum corner of the file's
+    // bounding box, see IndexedMesh::Vertex.
+    const std::vector<libmath::Triangle>& Triangles() const { return triangles_; }
+
+    // Number of voxels the last Build or Apply classified.
+    int64_t LastReclassified() const { return last_reclassified_; }
+
+  private:
+    std::vector<libmath::Triangle> triangles_;
+    double step_ = 0;
+    StlBuildOptions options_;
+    int64_t last_reclassified_ = 0;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,306 @@
+#include "voxel/indexed_mesh.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "glog/logging.h"
+
+
+namespace voxel::builder {
+namespace {
+
+constexpr size_t kBinaryHeaderSize = 84;
+constexpr size_t kBinaryTriangleSize = 50;
+
+// Read only mapping of a whole file.
+class MappedFile {
+  public:
+    ~MappedFile() {
+      if (data_ != nullptr) {
+        munmap(data_, size_);
+      }
+    }
+
+    bool Open(const std::filesystem::path& path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+      }
+      size_ = st.st_size;
+      data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      // The mapping keeps the file open.
+      close(fd);
+      if (data_ == MAP_FAILED) {
+        data_ = nullptr;
+        return false;
+      }
+      // The file is read front to back.
+      madvise(data_, size_, MADV_SEQUENTIAL);
+      return true;
+    }
+
+    std::span<const char> Data() const { return {static_cast<const char*>(data_), size_}; }
+
+  private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Coordinates as integers, with -0 folded into 0, so that equal positions compare and hash equal.
+std::array<uint32_t, 3> PositionKey(const IndexedMesh::Position& p) {
+  return {std::bit_cast<uint32_t>(p.x + 0.0f), std::bit_cast<uint32_t>(p.y + 0.0f),
+          std::bit_cast<uint32_t>(p.z + 0.0f)};
+}
+
+uint64_t PositionHash(const std::array<uint32_t, 3>& key) {
+  uint64_t hash = key[0] * 0x9E3779B97F4A7C15ull ^ key[1] * 0xC2B2AE3D27D4EB4Full ^ key[2] * 0x165667B19E3779F9ull;
+  return hash ^ (hash >> 29);
+}
+
+// Parses the next number after optional whitespace and sign, and advances pos past it.
+bool ParseFloat(std::string_view text, size_t& pos, float* value) {
+  while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n')) {
+    pos++;
+  }
+  if (pos < text.size() && text[pos] == '+') {
+    pos++;
+  }
+  auto [end, error] = std::from_chars(text.data() + pos, text.data() + text.size(), *value);
+  if (error != std::errc()) {
+    return false;
+  }
+  pos = end - text.data();
+  return true;
+}
+
+}
+
+bool IndexedMesh::Read(const std::filesystem::path& path) {
+  MappedFile file;
+  if (!file.Open(path)) {
+    return false;
+  }
+  std::span<const char> data = file.Data();
+
+  // Binary files may also start with "solid", so the size decides when it matches the triangle count.
+  bool binary_size = false;
+  if (data.size() >= kBinaryHeaderSize) {
+    uint32_t count;
+    std::memcpy(&count, data.data() + 80, sizeof(count));
+    binary_size = data.size() == kBinaryHeaderSize + static_cast<uint64_t>(count) * kBinaryTriangleSize;
+  }
+  std::string_view text(data.data(), data.size());
+  bool ok = !binary_size && text.starts_with("solid") ? ReadAscii(text) : ReadBinary(data);
+  if (!ok) {
+    LOG(ERROR) << "Not a valid stl file: " << path;
+  }
+  return ok;
+}
+
+bool IndexedMesh::ReadBinary(std::span<const char> data) {
+  if (data.size() < kBinaryHeaderSize) {
+    return false;
+  }
+  uint32_t count;
+  std::memcpy(&count, data.data() + 80, sizeof(count));
+  if (data.size() < kBinaryHeaderSize + static_cast<uint64_t>(count) * kBinaryTriangleSize) {
+    return false;
+  }
+
+  // Each record is the normal, the three vertices and a 2 byte attribute, packed without alignment.
+  std::vector<Position> vertices(static_cast<size_t>(count) * 3);
+  scheduler_->ParallelFor(count, 1 << 14, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      const char* record = data.data() + kBinaryHeaderSize + i * kBinaryTriangleSize;
+      std::memcpy(&vertices[i * 3], record + 3 * sizeof(float), 9 * sizeof(float));
+    }
+  });
+  Weld(std::move(vertices));
+  return true;
+}
+
+bool IndexedMesh::ReadAscii(std::string_view text) {
+  // Skip the "solid name" line, whose name could contain anything, and stop at "endsolid", without which the file was
+  // cut short.
+  size_t body = std::min(text.find('\n'), text.size());
+  size_t end_solid = text.rfind("endsolid");
+  if (end_solid == std::string_view::npos || end_solid < body) {
+    return false;
+  }
+  text = text.substr(0, end_solid);
+
+  // Chunks end right after an "endfacet", so every chunk holds whole facets.
+  constexpr size_t kChunkBytes = 1 << 20;
+  size_t chunks = std::clamp((text.size() - body) / kChunkBytes, size_t{1}, size_t(scheduler_->Threads()) * 4);
+  std::vector<size_t> bounds(chunks + 1, text.size());
+  bounds[0] = body;
+  for (size_t i = 1; i < chunks; i++) {
+    size_t end = text.find("endfacet", std::max(bounds[i - 1], body + (text.size() - body) * i / chunks));
+    bounds[i] = end == std::string_view::npos ? text.size() : end + std::strlen("endfacet");
+  }
+
+  std::vector<std::vector<Position>> parsed(chunks);
+  std::vector<uint8_t> valid(chunks, 1);
+  scheduler_->ParallelFor(chunks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+      std::string_view slice = text.substr(bounds[chunk], bounds[chunk + 1] - bounds[chunk]);
+      size_t pos = 0;
+      while ((pos = slice.find("vertex", pos)) != std::string_view::npos) {
+        pos += std::strlen("vertex");
+        Position p;
+        if (!ParseFloat(slice, pos, &p.x) || !ParseFloat(slice, pos, &p.y) || !ParseFloat(slice, pos, &p.z)) {
+          valid[chunk] = 0;
+          break;
+        }
+        parsed[chunk].push_back(p);
+      }
+      if (parsed[chunk].size() % 3 != 0) {
+        valid[chunk] = 0;
+      }
+    }
+  });
+  if (std::find(valid.begin(), valid.end(), 0) != valid.end()) {
+    return false;
+  }
+
+  std::vector<Position> vertices;
+  size_t total = 0;
+  for (const auto& chunk : parsed) {
+    total += chunk.size();
+  }
+  vertices.reserve(total);
+  for (auto& chunk : parsed) {
+    vertices.insert(vertices.end(), chunk.begin(), chunk.end());
+    std::vector<Position>().swap(chunk);
+  }
+  Weld(std::move(vertices));
+  return true;
+}
+
+void IndexedMesh::Weld(std::vector<Position> vertices) {
+  CHECK_LE(vertices.size(), std::numeric_limits<uint32_t>::max());
+  // Spread the vertices over buckets by a hash of their coordinates, so that every bucket can be deduplicated on its
+  // own. Small meshes are welded as a single bucket.
+  size_t buckets = std::clamp(vertices.size() >> 16, size_t{1}, static_cast<size_t>(scheduler_->Threads()) * 8);
+  std::vector<uint64_t> hashes(vertices.size());
+  scheduler_->ParallelFor(vertices.size(), 1 << 16, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      hashes[i] = PositionHash(PositionKey(vertices[i]));
+    }
+  });
+
+  // Counting sort of the vertices by bucket, keeping the order of the file within each bucket.
+  std::vector<size_t> bucket_offsets(buckets + 1, 0);
+  for (uint64_t hash : hashes) {
+    bucket_offsets[hash % buckets + 1]++;
+  }
+  for (size_t b = 0; b < buckets; b++) {
+    bucket_offsets[b + 1] += bucket_offsets[b];
+  }
+  std::vector<uint32_t> order(vertices.size());
+  std::vector<size_t> cursors(bucket_offsets.begin(), bucket_offsets.end() - 1);
+  for (uint32_t i = 0; i < vertices.size(); i++) {
+    order[cursors[hashes[i] % buckets]++] = i;
+  }
+
+  // Number the distinct positions of every bucket in order of first use with an open addressing table, then offset
+  // the numbers by the positions of the buckets before.
+  indices_.resize(vertices.size());
+  std::vector<std::vector<uint32_t>> firsts(buckets);
+  scheduler_->ParallelFor(buckets, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t b = begin; b < end; b++) {
+      size_t count = bucket_offsets[b + 1] - bucket_offsets[b];
+      // Holds the first vertex of every position plus one, 0 for empty slots.
+      std::vector<uint32_t> table(std::bit_ceil(count * 2 + 1), 0);
+      size_t mask = table.size() - 1;
+      std::vector<uint32_t>& first = firsts[b];
+      for (size_t k = bucket_offsets[b]; k < bucket_offsets[b + 1]; k++) {
+        uint32_t i = order[k];
+        std::array<uint32_t, 3> key = PositionKey(vertices[i]);
+        // The low bits picked the bucket, so probe with the high ones.
+        size_t slot = (hashes[i] >> 32) & mask;
+        while (table[slot] != 0 && PositionKey(vertices[table[slot] - 1]) != key) {
+          slot = (slot + 1) & mask;
+        }
+        if (table[slot] == 0) {
+          table[slot] = i + 1;
+          first.push_back(i);
+        }
+        indices_[i] = table[slot] - 1;
+      }
+    }
+  });
+
+  std::vector<size_t> position_offsets(buckets + 1, 0);
+  for (size_t b = 0; b < buckets; b++) {
+    position_offsets[b + 1] = position_offsets[b] + firsts[b].size();
+  }
+  positions_.resize(position_offsets.back());
+  // Map every first vertex to its position, then every vertex to the position of its first vertex.
+  std::vector<uint32_t> position_of(vertices.size());
+  scheduler_->ParallelFor(buckets, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t b = begin; b < end; b++) {
+      for (size_t n = 0; n < firsts[b].size(); n++) {
+        uint32_t id = position_offsets[b] + n;
+        position_of[firsts[b][n]] = id;
+        positions_[id] = vertices[firsts[b][n]];
+      }
+    }
+  });
+  scheduler_->ParallelFor(vertices.size(), 1 << 16, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      indices_[i] = position_of[indices_[i]];
+    }
+  });
+
+  min_ = max_ = {0, 0, 0};
+  if (!positions_.empty()) {
+    min_ = max_ = positions_.front();
+  }
+  for (const auto& p : positions_) {
+    min_ = {std::min(min_.x, p.x), std::min(min_.y, p.y), std::min(min_.z, p.z)};
+    max_ = {std::max(max_.x, p.x), std::max(max_.y, p.y), std::max(max_.z, p.z)};
+  }
+}
+
+std::vector<uint32_t> NumberEdges(std::span<const uint32_t> indices) {
+  CHECK_EQ(indices.size() % 3, 0);
+  CHECK_LT(indices.size(), static_cast<size_t>(std::numeric_limits<uint32_t>::max()));
+  // Sort the edges by their two vertices, smallest index first, and number the distinct ones.
+  std::vector<std::pair<uint64_t, uint32_t>> edges(indices.size());
+  for (size_t triangle = 0; triangle < indices.size() / 3; triangle++) {
+    for (int edge = 0; edge < 3; edge++) {
+      uint64_t a = indices[triangle * 3 + edge];
+      uint64_t b = indices[triangle * 3 + (edge + 1) % 3];
+      edges[triangle * 3 + edge] = {std::min(a, b) << 32 | std::max(a, b), triangle * 3 + edge};
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+
+  std::vector<uint32_t> ids(edges.size());
+  uint32_t id = 0;
+  for (size_t i = 0; i < edges.size(); i++) {
+    if (i > 0 && edges[i].first != edges[i - 1].first) {
+      id++;
+    }
+    ids[edges[i].second] = id;
+  }
+  return ids;
+}
+
+}
\ No newline at end of file
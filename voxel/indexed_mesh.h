@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "libmath/point.h"
+#include "voxel/scheduler.h"
+
+
+namespace voxel::builder {
+
+// Ids of the edges of triangles given as three vertex indices each, three per triangle in the order (0, 1), (1, 2),
+// (2, 0). The edges two triangles share get the same id, so shared edges are found by comparing integers instead of
+// coordinates.
+std::vector<uint32_t> NumberEdges(std::span<const uint32_t> indices);
+
+// A triangle mesh read from a stl file, with every vertex position stored once and the triangles as indices into the
+// positions. The file is mapped rather than read, binary stl is decoded straight from the mapping, and ascii stl is
+// parsed in parallel chunks of facets, so the only full copy of the mesh ever held is the welded one.
+class IndexedMesh {
+  public:
+    struct Position {
+      float x;
+      float y;
+      float z;
+    };
+
+    // Work runs on the shared Scheduler::Default() unless another scheduler is set.
+    void SetScheduler(Scheduler* scheduler) { scheduler_ = scheduler; }
+
+    // Reads a binary or ascii stl file and merges the vertices with identical coordinates. Returns false if the file
+    // cannot be read or is malformed.
+    bool Read(const std::filesystem::path& path);
+
+    size_t TriangleCount() const { return indices_.size() / 3; }
+    std::span<const Position> Positions() const { return positions_; }
+    // Three indices into Positions per triangle, in the order of the file.
+    std::span<const uint32_t> Indices() const { return indices_; }
+
+    // Corners of the bounding box.
+    const Position& Min() const { return min_; }
+    const Position& Max() const { return max_; }
+
+    // Vertex `vertex` of a triangle relative to Min(), in single precision like simplestl::StlReader, so that the
+    // mesh lies in the positive octant. Adding a translation here is what builds the planes of a grid without a
+    // translated copy of the mesh.
+    libmath::Point Vertex(size_t triangle, int vertex) const {
+      const Position& p = positions_[indices_[triangle * 3 + vertex]];
+      return libmath::Point(p.x - min_.x, p.y - min_.y, p.z - min_.z);
+    }
+
+    // Ids of the edges of every triangle, see NumberEdges.
+    std::vector<uint32_t> EdgeIds() const { return NumberEdges(indices_); }
+
+  private:
+    bool ReadBinary(std::span<const char> data);
+    bool ReadAscii(std::string_view text);
+    // Replaces the raw vertices, three per triangle, by the welded positions and indices.
+    void Weld(std::vector<Position> vertices);
+
+    Scheduler* scheduler_ = &Scheduler::Default();
+    std::vector<Position> positions_;
+    std::vector<uint32_t> indices_;
+    Position min_ = {0, 0, 0};
+    Position max_ = {0, 0, 0};
+};
+
+}
\ No newline at end of file
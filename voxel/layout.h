@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+
+namespace voxel {
+
+// Layouts map the coordinates of a voxel of a VoxelGrid3d to its index in the storage of the grid.
+//
+// x fastest, then y, then z, the order the grids have always stored their voxels in. The neighbors of a voxel along z
+// are a whole plane apart.
+class LinearLayout {
+  public:
+    // Voxels per side of the tiles the storage is split into, 0 if it is not.
+    static constexpr int64_t kTileSize = 0;
+
+    void Init(int64_t x_dim, int64_t y_dim, int64_t z_dim) {
+      x_dim_ = x_dim;
+      y_dim_ = y_dim;
+      z_dim_ = z_dim;
+    }
+
+    // Number of voxels to store.
+    int64_t Size() const { return x_dim_ * y_dim_ * z_dim_; }
+
+    int64_t Index(int64_t x, int64_t y, int64_t z) const { return (z * y_dim_ + y) * x_dim_ + x; }
+
+  private:
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    int64_t z_dim_ = 0;
+};
+
+// Cubes of kTile voxels per side stored one after the other, x fastest, so that the 27 voxels of a D3Q27 neighborhood
+// are within one tile, or a few neighboring ones at the faces of a tile. Inside a tile the voxels are stored x fastest,
+// or in Morton (Z) order if kMorton, which interleaves the bits of the three coordinates so that every aligned cube of
+// 2, 4, ... voxels per side is contiguous too. The dims are padded up to whole tiles.
+template <int64_t kTile, bool kMorton = false>
+class TiledLayout {
+  public:
+    static_assert(kTile >= 2 && kTile <= 32 && std::has_single_bit(static_cast<uint64_t>(kTile)),
+                  "tiles must be a power of two voxels per side");
+
+    static constexpr int64_t kTileSize = kTile;
+    static constexpr int64_t kTileVoxels = kTile * kTile * kTile;
+
+    void Init(int64_t x_dim, int64_t y_dim, int64_t z_dim) {
+      tiles_x_ = (x_dim + kTile - 1) / kTile;
+      tiles_y_ = (y_dim + kTile - 1) / kTile;
+      tiles_z_ = (z_dim + kTile - 1) / kTile;
+    }
+
+    int64_t Size() const { return tiles_x_ * tiles_y_ * tiles_z_ * kTileVoxels; }
+
+    int64_t Index(int64_t x, int64_t y, int64_t z) const {
+      int64_t tile = ((z >> kShift) * tiles_y_ + (y >> kShift)) * tiles_x_ + (x >> kShift);
+      return tile * kTileVoxels + Offset(x & kMask, y & kMask, z & kMask);
+    }
+
+    int64_t TilesX() const { return tiles_x_; }
+    int64_t TilesY() const { return tiles_y_; }
+    int64_t TilesZ() const { return tiles_z_; }
+
+    // Calls f(dx, dy, dz) for every voxel of a tile, in storage order.
+    template <typename F>
+    static void ForEachInTile(F&& f) {
+      if constexpr (kMorton) {
+        for (int64_t code = 0; code < kTileVoxels; code++) {
+          f(Compact(code), Compact(code >> 1), Compact(code >> 2));
+        }
+      } else {
+        for (int64_t dz = 0; dz < kTile; dz++) {
+          for (int64_t dy = 0; dy < kTile; dy++) {
+            for (int64_t dx = 0; dx < kTile; dx++) {
+              f(dx, dy, dz);
+            }
+          }
+        }
+      }
+    }
+
+  private:
+    static constexpr int kShift = std::countr_zero(static_cast<uint64_t>(kTile));
+    static constexpr int64_t kMask = kTile - 1;
+
+    // The bits of a coordinate within a tile moved 3 apart, the Morton code of (v, 0, 0).
+    static constexpr std::array<int64_t, kTile> kSpread = [] {
+      std::array<int64_t, kTile> spread = {};
+      for (int64_t v = 0; v < kTile; v++) {
+        for (int bit = 0; bit < kShift; bit++) {
+          spread[v] |= ((v >> bit) & 1) << (3 * bit);
+        }
+      }
+      return spread;
+    }();
+
+    static int64_t Offset(int64_t dx, int64_t dy, int64_t dz) {
+      if constexpr (kMorton) {
+        return kSpread[dx] | (kSpread[dy] << 1) | (kSpread[dz] << 2);
+      } else {
+        return (((dz << kShift) | dy) << kShift) | dx;
+      }
+    }
+
+    // Inverse of kSpread on the low bits of a Morton code.
+    static int64_t Compact(int64_t code) {
+      int64_t v = 0;
+      for (int bit = 0; bit < kShift; bit++) {
+        v |= ((code >> (3 * bit)) & 1) << bit;
+      }
+      return v;
+    }
+
+    int64_t tiles_x_ = 0;
+    int64_t tiles_y_ = 0;
+    int64_t tiles_z_ = 0;
+};
+
+using Tiled4Layout = TiledLayout<4>;
+using Tiled8Layout = TiledLayout<8>;
+// Morton order inside tiles of 8 voxels per side, which bounds the padding to less than a tile per axis where a single
+// Z-order curve over the grid would pad every axis up to the same power of two.
+using MortonLayout = TiledLayout<8, true>;
+
+}
\ No newline at end of file
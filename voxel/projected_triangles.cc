@@ -0,0 +1,97 @@
+#include "voxel/projected_triangles.h"
+
+#include <utility>
+
+#include "libmath/triangle.h"
+
+
+namespace voxel::builder::internal {
+
+bool AxisAlignedRay::FromPoints(const libmath::Point& p1, const libmath::Point& p2, AxisAlignedRay* ray) {
+  const std::array<double, 3> a = {p1.x, p1.y, p1.z};
+  const std::array<double, 3> b = {p2.x, p2.y, p2.z};
+
+  int axis = -1;
+  for (int i = 0; i < 3; i++) {
+    if (a[i] != b[i]) {
+      if (axis != -1) {
+        return false;
+      }
+      axis = i;
+    }
+  }
+
+  // A degenerate ray can be treated as running along any axis.
+  if (axis == -1) {
+    axis = 2;
+  }
+
+  ray->axis = axis;
+  ray->u = a[axis == 0 ? 1 : 0];
+  ray->v = a[axis == 2 ? 1 : 2];
+  ray->w1 = a[axis];
+  ray->w2 = b[axis];
+  return true;
+}
+
+ProjectedTriangles::ProjectedTriangles(std::span<const libmath::Plane> planes) : size_(planes.size()) {
+  for (int axis = 0; axis < 3; axis++) {
+    const int u_axis = axis == 0 ? 1 : 0;
+    const int v_axis = axis == 2 ? 1 : 2;
+    projections_[axis].resize(size_);
+
+    for (size_t i = 0; i < size_; i++) {
+      libmath::Triangle triangle = planes[i].ToTriangle();
+      std::array<std::array<double, 3>, 3> vertices;
+      for (int j = 0; j < 3; j++) {
+        vertices[j] = {triangle.vertices[j].x, triangle.vertices[j].y, triangle.vertices[j].z};
+      }
+
+      Projection& p = projections_[axis][i];
+      for (int edge = 0; edge < 3; edge++) {
+        // Compute the coefficients from the lexicographically smaller endpoint, so that the triangle on the other side
+        // of the edge, which visits it in the opposite direction, gets exactly the negated values.
+        const auto* from = &vertices[edge];
+        const auto* to = &vertices[(edge + 1) % 3];
+        bool reversed = std::make_pair((*to)[u_axis], (*to)[v_axis]) < std::make_pair((*from)[u_axis], (*from)[v_axis]);
+        if (reversed) {
+          std::swap(from, to);
+        }
+        p.a[edge] = (*to)[v_axis] - (*from)[v_axis];
+        p.b[edge] = (*from)[u_axis] - (*to)[u_axis];
+        p.u0[edge] = (*from)[u_axis];
+        p.v0[edge] = (*from)[v_axis];
+        if (reversed) {
+          p.a[edge] = -p.a[edge];
+          p.b[edge] = -p.b[edge];
+        }
+        p.w[edge] = vertices[edge][axis];
+      }
+
+      // Twice the signed area of the projection is any edge function evaluated at the opposite vertex.
+      double area = p.a[0] * (vertices[2][u_axis] - p.u0[0]) + p.b[0] * (vertices[2][v_axis] - p.v0[0]);
+      if (area == 0) {
+        p.a = p.b = {0, 0, 0};
+        p.top_left = {false, false, false};
+        p.inv_area = 0;
+        continue;
+      }
+      if (area < 0) {
+        for (int edge = 0; edge < 3; edge++) {
+          p.a[edge] = -p.a[edge];
+          p.b[edge] = -p.b[edge];
+        }
+        area = -area;
+      }
+
+      // Of two consistently oriented triangles sharing an edge, the gradient (a, b) of the edge function points into
+      // both, but is top-left for exactly one of them, which then owns the points on the edge.
+      for (int edge = 0; edge < 3; edge++) {
+        p.top_left[edge] = p.a[edge] > 0 || (p.a[edge] == 0 && p.b[edge] > 0);
+      }
+      p.inv_area = 1 / area;
+    }
+  }
+}
+
+}
\ No newline at end of file
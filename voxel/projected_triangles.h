@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "libmath/plane.h"
+#include "libmath/point.h"
+
+
+namespace voxel::builder::internal {
+
+// An axis aligned segment, decomposed into the axis it runs along, its position (u, v) on the two perpendicular axes
+// (in ascending axis order) and its extent [w1, w2] along the axis.
+struct AxisAlignedRay {
+  int axis;
+  double u;
+  double v;
+  double w1;
+  double w2;
+
+  // Decomposes the segment between two points. Returns false if it is not parallel to an axis.
+  static bool FromPoints(const libmath::Point& p1, const libmath::Point& p2, AxisAlignedRay* ray);
+};
+
+// The triangles projected onto the three axis planes, with everything that does not depend on the ray precomputed.
+//
+// A ray along an axis hits a triangle iff its (u, v) position lies inside the projected triangle, which takes three
+// edge function evaluations, and its extent covers the depth of the triangle at that position, which is a single
+// interpolation of the vertex depths with the same edge function values. Triangles parallel to an axis project to a
+// line and are never hit along that axis.
+//
+// The test is watertight on shared edges and vertices. Every edge function is evaluated relative to the first of its
+// endpoints in a canonical order, as (u - u0) * dv - (v - v0) * du, and negated as needed. Two triangles sharing an
+// edge therefore evaluate exactly opposite values for it, and every edge function is exactly zero at both of its
+// endpoints, so a ray through a vertex sees zero on all the edges meeting there. The top-left rule then assigns a ray
+// on an edge to exactly one of its two triangles, and a ray through a vertex to exactly one triangle of the fan.
+// Along a silhouette, where neighboring triangles project with opposite orientations, the ray is assigned to both or
+// neither, which preserves the parity. Callers therefore do no duplicate rejection.
+class ProjectedTriangles {
+  public:
+    explicit ProjectedTriangles(std::span<const libmath::Plane> planes);
+
+    size_t Size() const { return size_; }
+
+    // Tests triangle `index` against the ray, and sets *depth to the position of the crossing along the ray's axis.
+    bool Intersect(const AxisAlignedRay& ray, uint32_t index, double* depth) const {
+      const Projection& p = projections_[ray.axis][index];
+      double e0 = p.a[0] * (ray.u - p.u0[0]) + p.b[0] * (ray.v - p.v0[0]);
+      double e1 = p.a[1] * (ray.u - p.u0[1]) + p.b[1] * (ray.v - p.v0[1]);
+      double e2 = p.a[2] * (ray.u - p.u0[2]) + p.b[2] * (ray.v - p.v0[2]);
+      bool inside = (e0 > 0 || (e0 == 0 && p.top_left[0])) && (e1 > 0 || (e1 == 0 && p.top_left[1])) &&
+                    (e2 > 0 || (e2 == 0 && p.top_left[2]));
+      if (!inside) {
+        return false;
+      }
+
+      // Each edge function is zero on its edge and twice the area on the opposite vertex, and edge i runs from vertex
+      // i to vertex i + 1.
+      *depth = (e0 * p.w[2] + e1 * p.w[0] + e2 * p.w[1]) * p.inv_area;
+      return *depth >= std::min(ray.w1, ray.w2) && *depth <= std::max(ray.w1, ray.w2);
+    }
+
+  private:
+    // Edge function i is a[i] * (u - u0[i]) + b[i] * (v - v0[i]), with (u0, v0) its canonical first endpoint, oriented
+    // to be positive inside the triangle. top_left[i] tells whether points on the edge itself belong to the triangle,
+    // and w holds the vertex depths. Degenerate projections have all coefficients zero and no top-left edges, so every
+    // ray misses them.
+    struct Projection {
+      std::array<double, 3> a;
+      std::array<double, 3> b;
+      std::array<double, 3> u0;
+      std::array<double, 3> v0;
+      std::array<double, 3> w;
+      std::array<bool, 3> top_left;
+      double inv_area;
+    };
+
+    size_t size_;
+    // Indexed by the axis the rays run along: 0 = x, 1 = y, 2 = z.
+    std::array<std::vector<Projection>, 3> projections_;
+};
+
+}
\ No newline at end of file
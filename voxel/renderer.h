@@ -1,8 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <concepts>
 #include <functional>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <vector>
 
 #include "voxel/voxel.h"
+#include "voxel/brick_grid.h"
+#include "voxel/scheduler.h"
 #include "simplebmp/canvas.h"
 
 #include "glog/logging.h"
@@ -22,8 +31,8 @@ void Render(const VoxelGrid2d<T>& grid, simplebmp::Canvas* canvas,
   }
 }
 
-template <std::derived_from<Voxel> T>
-void RenderSliceXY(const VoxelGrid3d<T>& grid, int64_t z_offset, simplebmp::Canvas* canvas,
+template <std::derived_from<Voxel> T, typename Layout>
+void RenderSliceXY(const VoxelGrid3d<T, Layout>& grid, int64_t z_offset, simplebmp::Canvas* canvas,
             std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step, const void* voxel)> per_voxel_callback) {
   CHECK_EQ(canvas->Width(), grid.XDim());
   CHECK_EQ(canvas->Height(), grid.YDim());
@@ -35,8 +44,8 @@ void RenderSliceXY(const VoxelGrid3d<T>& grid, int64_t z_offset, simplebmp::Canv
   }
 }
 
-template <std::derived_from<Voxel> T>
-void RenderSliceXZ(const VoxelGrid3d<T>& grid, int64_t y_offset, simplebmp::Canvas* canvas,
+template <std::derived_from<Voxel> T, typename Layout>
+void RenderSliceXZ(const VoxelGrid3d<T, Layout>& grid, int64_t y_offset, simplebmp::Canvas* canvas,
             std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step, const void* voxel)> per_voxel_callback) {
   CHECK_EQ(canvas->Width(), grid.XDim());
   CHECK_EQ(canvas->Height(), grid.ZDim());
@@ -48,8 +57,8 @@ void RenderSliceXZ(const VoxelGrid3d<T>& grid, int64_t y_offset, simplebmp::Canv
   }
 }
 
-template <std::derived_from<Voxel> T>
-void RenderSliceYZ(const VoxelGrid3d<T>& grid, int64_t x_offset, simplebmp::Canvas* canvas,
+template <std::derived_from<Voxel> T, typename Layout>
+void RenderSliceYZ(const VoxelGrid3d<T, Layout>& grid, int64_t x_offset, simplebmp::Canvas* canvas,
             std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step, const void* voxel)> per_voxel_callback) {
   CHECK_EQ(canvas->Height(), grid.YDim());
   CHECK_EQ(canvas->Width(), grid.ZDim());
@@ -62,4 +71,376 @@ void RenderSliceYZ(const VoxelGrid3d<T>& grid, int64_t x_offset, simplebmp::Canv
   }
 }
 
+namespace internal {
+
+// Renders the slice of a brick grid at `offset` along the axis `axis`, one brick face at a time. The callback is invoked
+// once for a uniform brick, at the first voxel of its face, and that color fills the face without reading any voxel.
+// set_pixel(x, y, z, color) writes the pixel of a voxel.
+template <std::derived_from<Voxel> T, typename SetPixel>
+void RenderBrickSlice(const BrickGrid3d<T>& grid, int axis, int64_t offset,
+                      const std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step,
+                                                             const void* voxel)>& per_voxel_callback,
+                      SetPixel set_pixel) {
+  constexpr int64_t kBrickSize = BrickGrid3d<T>::kBrickSize;
+  std::array<int64_t, 3> begin = {0, 0, 0};
+  std::array<int64_t, 3> end = {grid.BricksX(), grid.BricksY(), grid.BricksZ()};
+  begin[axis] = offset / kBrickSize;
+  end[axis] = begin[axis] + 1;
+
+  for (int64_t bx = begin[0]; bx < end[0]; bx++) {
+    for (int64_t by = begin[1]; by < end[1]; by++) {
+      for (int64_t bz = begin[2]; bz < end[2]; bz++) {
+        // The face of the brick in the slice.
+        std::array<int64_t, 3> lo = {bx * kBrickSize, by * kBrickSize, bz * kBrickSize};
+        std::array<int64_t, 3> hi = {std::min(lo[0] + kBrickSize, grid.XDim()),
+                                     std::min(lo[1] + kBrickSize, grid.YDim()),
+                                     std::min(lo[2] + kBrickSize, grid.ZDim())};
+        lo[axis] = offset;
+        hi[axis] = offset + 1;
+        const T* uniform = grid.Uniform(bx, by, bz);
+        simplebmp::Color4f color;
+        if (uniform != nullptr) {
+          color = per_voxel_callback(lo[0], lo[1], lo[2], grid.Step(), uniform);
+        }
+        for (int64_t z = lo[2]; z < hi[2]; z++) {
+          for (int64_t y = lo[1]; y < hi[1]; y++) {
+            for (int64_t x = lo[0]; x < hi[0]; x++) {
+              if (uniform == nullptr) {
+                color = per_voxel_callback(x, y, z, grid.Step(), grid.At(x, y, z));
+              }
+              set_pixel(x, y, z, color);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+}
+
+template <std::derived_from<Voxel> T>
+void RenderSliceXY(const BrickGrid3d<T>& grid, int64_t z_offset, simplebmp::Canvas* canvas,
+            std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step, const void* voxel)> per_voxel_callback) {
+  CHECK_EQ(canvas->Width(), grid.XDim());
+  CHECK_EQ(canvas->Height(), grid.YDim());
+  internal::RenderBrickSlice(grid, 2, z_offset, per_voxel_callback, [&](int64_t x, int64_t y, int64_t z,
+                                                                        const simplebmp::Color4f& color) {
+    canvas->Set(x, y, color);
+  });
+}
+
+template <std::derived_from<Voxel> T>
+void RenderSliceXZ(const BrickGrid3d<T>& grid, int64_t y_offset, simplebmp::Canvas* canvas,
+            std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step, const void* voxel)> per_voxel_callback) {
+  CHECK_EQ(canvas->Width(), grid.XDim());
+  CHECK_EQ(canvas->Height(), grid.ZDim());
+  internal::RenderBrickSlice(grid, 1, y_offset, per_voxel_callback, [&](int64_t x, int64_t y, int64_t z,
+                                                                        const simplebmp::Color4f& color) {
+    canvas->Set(x, z, color);
+  });
+}
+
+template <std::derived_from<Voxel> T>
+void RenderSliceYZ(const BrickGrid3d<T>& grid, int64_t x_offset, simplebmp::Canvas* canvas,
+            std::function<simplebmp::Color4f(int64_t x, int64_t y, int64_t z, double step, const void* voxel)> per_voxel_callback) {
+  CHECK_EQ(canvas->Height(), grid.YDim());
+  CHECK_EQ(canvas->Width(), grid.ZDim());
+  internal::RenderBrickSlice(grid, 0, x_offset, per_voxel_callback, [&](int64_t x, int64_t y, int64_t z,
+                                                                        const simplebmp::Color4f& color) {
+    canvas->Set(z, y, color);
+  });
+}
+
+// The renderers below take the color of a voxel from a function object of the voxel itself, which is inlined into the
+// loops instead of called through a std::function, and split the canvas into tiles that run on the scheduler of the
+// grid. They write every pixel, so canvases can be reused from one call to the next.
+
+// The axis a slice is perpendicular to, or a projection looks along. Canvases are laid out like the ones of
+// RenderSliceXY, RenderSliceXZ and RenderSliceYZ: kZ gives XDim x YDim canvases, kY XDim x ZDim canvases, and kX
+// ZDim x YDim canvases.
+enum class Axis {
+  kX,
+  kY,
+  kZ,
+};
+
+template <typename F, typename T>
+concept VoxelColorMap = std::invocable<const F&, const T&> &&
+                        std::convertible_to<std::invoke_result_t<const F&, const T&>, simplebmp::Color4f>;
+
+// Colors voxels by their type through a table, and the types that were not set with the fallback color.
+class TypeColors {
+  public:
+    explicit TypeColors(simplebmp::Color4f fallback = {}) : fallback_(fallback) {}
+
+    TypeColors& Set(int32_t type, simplebmp::Color4f color) {
+      CHECK_GE(type, 0);
+      CHECK_LT(type, kMaxTypes);
+      if (type >= static_cast<int32_t>(colors_.size())) {
+        colors_.resize(type + 1, fallback_);
+      }
+      colors_[type] = color;
+      return *this;
+    }
+
+    simplebmp::Color4f operator()(const Voxel& voxel) const {
+      return static_cast<uint32_t>(voxel.type) < colors_.size() ? colors_[voxel.type] : fallback_;
+    }
+
+  private:
+    static constexpr int32_t kMaxTypes = 1 << 16;
+    std::vector<simplebmp::Color4f> colors_;
+    simplebmp::Color4f fallback_;
+};
+
+namespace internal {
+
+// Calls f with the axis as a compile time constant, so that the loops of every axis are compiled on their own.
+template <typename F>
+void WithAxis(Axis axis, F&& f) {
+  switch (axis) {
+    case Axis::kX:
+      f(std::integral_constant<Axis, Axis::kX>());
+      break;
+    case Axis::kY:
+      f(std::integral_constant<Axis, Axis::kY>());
+      break;
+    case Axis::kZ:
+      f(std::integral_constant<Axis, Axis::kZ>());
+      break;
+  }
+}
+
+// A slice is the plane of the two other axes, u the lower one and v the higher one, at a depth along the axis.
+struct SlicePlane {
+  int64_t u_dim;
+  int64_t v_dim;
+  int64_t depth;
+};
+
+template <std::derived_from<Voxel> T, typename Layout>
+SlicePlane MakeSlicePlane(const VoxelGrid3d<T, Layout>& grid, Axis axis) {
+  switch (axis) {
+    case Axis::kX:
+      return {grid.YDim(), grid.ZDim(), grid.XDim()};
+    case Axis::kY:
+      return {grid.XDim(), grid.ZDim(), grid.YDim()};
+    default:
+      return {grid.XDim(), grid.YDim(), grid.ZDim()};
+  }
+}
+
+template <Axis kAxis, std::derived_from<Voxel> T, typename Layout>
+const T& PlaneVoxel(const VoxelGrid3d<T, Layout>& grid, int64_t u, int64_t v, int64_t d) {
+  if constexpr (kAxis == Axis::kX) {
+    return *grid.At(d, u, v);
+  } else if constexpr (kAxis == Axis::kY) {
+    return *grid.At(u, d, v);
+  } else {
+    return *grid.At(u, v, d);
+  }
+}
+
+template <Axis kAxis>
+void SetPlanePixel(simplebmp::Canvas* canvas, int64_t u, int64_t v, const simplebmp::Color4f& color) {
+  if constexpr (kAxis == Axis::kX) {
+    canvas->Set(v, u, color);
+  } else {
+    canvas->Set(u, v, color);
+  }
+}
+
+template <std::derived_from<Voxel> T, typename Layout>
+void CheckCanvas(const VoxelGrid3d<T, Layout>& grid, Axis axis, const simplebmp::Canvas& canvas) {
+  SlicePlane plane = MakeSlicePlane(grid, axis);
+  CHECK_EQ(canvas.Width(), axis == Axis::kX ? plane.v_dim : plane.u_dim);
+  CHECK_EQ(canvas.Height(), axis == Axis::kX ? plane.u_dim : plane.v_dim);
+}
+
+// Calls f(u0, u1, v0, v1) for every tile of the plane, in parallel.
+template <std::derived_from<Voxel> T, typename Layout, typename F>
+void ForEachPlaneTile(const VoxelGrid3d<T, Layout>& grid, const SlicePlane& plane, F&& f) {
+  Scheduler& scheduler = *grid.GetScheduler();
+  Tiling tiling = Tiling::Make(0, plane.u_dim, 0, plane.v_dim,
+                               Tiling::Grain(0, plane.u_dim * plane.v_dim, scheduler));
+  scheduler.ParallelFor(tiling.Count(), 1, [&](int64_t begin, int64_t end) {
+    for (int64_t tile = begin; tile < end; tile++) {
+      int64_t u0, u1, v0, v1;
+      tiling.Bounds(tile, &u0, &u1, &v0, &v1);
+      f(u0, u1, v0, v1);
+    }
+  });
+}
+
+// Renders the slices [begin, end) along axis into canvases[0, end - begin). The slices along x are rendered together,
+// so that the voxels of a tile are still read in rows of x.
+template <std::derived_from<Voxel> T, typename Layout, VoxelColorMap<T> F>
+void RenderSlices(const VoxelGrid3d<T, Layout>& grid, Axis axis, int64_t begin, int64_t end,
+                  std::span<simplebmp::Canvas> canvases, const F& color) {
+  CHECK_LE(0, begin);
+  CHECK_LE(end, MakeSlicePlane(grid, axis).depth);
+  CHECK_EQ(static_cast<int64_t>(canvases.size()), end - begin);
+  WithAxis(axis, [&](auto axis_constant) {
+    constexpr Axis kAxis = decltype(axis_constant)::value;
+    ForEachPlaneTile(grid, MakeSlicePlane(grid, axis), [&](int64_t u0, int64_t u1, int64_t v0, int64_t v1) {
+      if constexpr (kAxis == Axis::kX) {
+        for (int64_t v = v0; v < v1; v++) {
+          for (int64_t u = u0; u < u1; u++) {
+            for (int64_t d = begin; d < end; d++) {
+              SetPlanePixel<kAxis>(&canvases[d - begin], u, v, color(PlaneVoxel<kAxis>(grid, u, v, d)));
+            }
+          }
+        }
+      } else {
+        for (int64_t d = begin; d < end; d++) {
+          for (int64_t v = v0; v < v1; v++) {
+            for (int64_t u = u0; u < u1; u++) {
+              SetPlanePixel<kAxis>(&canvases[d - begin], u, v, color(PlaneVoxel<kAxis>(grid, u, v, d)));
+            }
+          }
+        }
+      }
+    });
+  });
+}
+
+// Marches every ray of the plane through the whole depth, calling visit(u, v, d) in order of d along each ray, and
+// done(u, v) once a ray is finished. visit returns false to end its ray early. Rays along x are marched one at a time,
+// the others a tile at a time, so that the voxels are always read in rows of x.
+template <Axis kAxis, std::derived_from<Voxel> T, typename Layout, typename Visit, typename Done>
+void MarchRays(const VoxelGrid3d<T, Layout>& grid, Visit&& visit, Done&& done) {
+  SlicePlane plane = MakeSlicePlane(grid, kAxis);
+  ForEachPlaneTile(grid, plane, [&](int64_t u0, int64_t u1, int64_t v0, int64_t v1) {
+    if constexpr (kAxis == Axis::kX) {
+      for (int64_t v = v0; v < v1; v++) {
+        for (int64_t u = u0; u < u1; u++) {
+          for (int64_t d = 0; d < plane.depth; d++) {
+            if (!visit(u, v, d)) {
+              break;
+            }
+          }
+          done(u, v);
+        }
+      }
+    } else {
+      int64_t width = u1 - u0;
+      std::vector<uint8_t> active(width * (v1 - v0), 1);
+      int64_t remaining = active.size();
+      for (int64_t d = 0; d < plane.depth && remaining > 0; d++) {
+        for (int64_t v = v0; v < v1; v++) {
+          for (int64_t u = u0; u < u1; u++) {
+            uint8_t& ray = active[(v - v0) * width + u - u0];
+            if (ray && !visit(u, v, d)) {
+              ray = 0;
+              remaining--;
+            }
+          }
+        }
+      }
+      for (int64_t v = v0; v < v1; v++) {
+        for (int64_t u = u0; u < u1; u++) {
+          done(u, v);
+        }
+      }
+    }
+  });
+}
+
+}
+
+// Tile parallel equivalent of Render above.
+template <std::derived_from<Voxel> T, VoxelColorMap<T> F>
+void Render(const VoxelGrid2d<T>& grid, simplebmp::Canvas* canvas, const F& color) {
+  CHECK_EQ(canvas->Width(), grid.XDim());
+  CHECK_EQ(canvas->Height(), grid.YDim());
+  Scheduler& scheduler = *grid.GetScheduler();
+  Tiling tiling = Tiling::Make(0, grid.XDim(), 0, grid.YDim(), Tiling::Grain(0, grid.XDim() * grid.YDim(), scheduler));
+  scheduler.ParallelFor(tiling.Count(), 1, [&](int64_t begin, int64_t end) {
+    for (int64_t tile = begin; tile < end; tile++) {
+      tiling.ForEachColumn(tile, [&](int64_t x, int64_t y) { canvas->Set(x, y, color(*grid.At(x, y))); });
+    }
+  });
+}
+
+// Renders the slice at `offset` along axis.
+template <std::derived_from<Voxel> T, typename Layout, VoxelColorMap<T> F>
+void RenderSlice(const VoxelGrid3d<T, Layout>& grid, Axis axis, int64_t offset, simplebmp::Canvas* canvas,
+                 const F& color) {
+  internal::CheckCanvas(grid, axis, *canvas);
+  internal::RenderSlices(grid, axis, offset, offset + 1, std::span(canvas, 1), color);
+}
+
+// Renders every slice along axis, at `scale` pixels per voxel, and calls sink(offset, canvas) for each of them in order
+// of offset on the calling thread. Slices are rendered batch_size at a time, 0 for a batch per thread of the scheduler
+// but at least 8, into the same canvases for every batch, so a canvas is only valid until sink returns.
+template <std::derived_from<Voxel> T, typename Layout, VoxelColorMap<T> F,
+          std::invocable<int64_t, const simplebmp::Canvas&> Sink>
+void RenderAllSlices(const VoxelGrid3d<T, Layout>& grid, Axis axis, int scale, const F& color, Sink&& sink,
+                     int64_t batch_size = 0) {
+  internal::SlicePlane plane = internal::MakeSlicePlane(grid, axis);
+  if (batch_size <= 0) {
+    batch_size = std::max<int64_t>(8, grid.GetScheduler()->Threads());
+  }
+  batch_size = std::max<int64_t>(1, std::min(batch_size, plane.depth));
+  int64_t width = axis == Axis::kX ? plane.v_dim : plane.u_dim;
+  int64_t height = axis == Axis::kX ? plane.u_dim : plane.v_dim;
+  std::vector<simplebmp::Canvas> canvases(batch_size, simplebmp::Canvas(width, height, scale));
+  for (int64_t begin = 0; begin < plane.depth; begin += batch_size) {
+    int64_t end = std::min(begin + batch_size, plane.depth);
+    std::span<simplebmp::Canvas> batch(canvases.data(), end - begin);
+    internal::RenderSlices(grid, axis, begin, end, batch, color);
+    for (int64_t offset = begin; offset < end; offset++) {
+      sink(offset, batch[offset - begin]);
+    }
+  }
+}
+
+// Maximum intensity projection along axis: every pixel is color(m), with m the largest intensity(voxel) along its ray.
+template <std::derived_from<Voxel> T, typename Layout, std::invocable<const T&> Intensity, std::invocable<float> Color>
+void RenderMaxIntensity(const VoxelGrid3d<T, Layout>& grid, Axis axis, simplebmp::Canvas* canvas,
+                        const Intensity& intensity, const Color& color) {
+  internal::CheckCanvas(grid, axis, *canvas);
+  internal::SlicePlane plane = internal::MakeSlicePlane(grid, axis);
+  std::vector<float> maxima(plane.u_dim * plane.v_dim, -std::numeric_limits<float>::infinity());
+  internal::WithAxis(axis, [&](auto axis_constant) {
+    constexpr Axis kAxis = decltype(axis_constant)::value;
+    internal::MarchRays<kAxis>(
+        grid,
+        [&](int64_t u, int64_t v, int64_t d) {
+          float& m = maxima[v * plane.u_dim + u];
+          m = std::max(m, static_cast<float>(intensity(internal::PlaneVoxel<kAxis>(grid, u, v, d))));
+          return true;
+        },
+        [&](int64_t u, int64_t v) {
+          internal::SetPlanePixel<kAxis>(canvas, u, v, color(maxima[v * plane.u_dim + u]));
+        });
+  });
+}
+
+// Depth projection along axis, looking from offset 0: every pixel is color(d), with d the offset of the first voxel
+// along its ray for which hit(voxel) holds, or -1 if there is none. Rays stop at their first hit.
+template <std::derived_from<Voxel> T, typename Layout, std::predicate<const T&> Hit, std::invocable<int64_t> Color>
+void RenderDepth(const VoxelGrid3d<T, Layout>& grid, Axis axis, simplebmp::Canvas* canvas, const Hit& hit,
+                 const Color& color) {
+  internal::CheckCanvas(grid, axis, *canvas);
+  internal::SlicePlane plane = internal::MakeSlicePlane(grid, axis);
+  std::vector<int64_t> depths(plane.u_dim * plane.v_dim, -1);
+  internal::WithAxis(axis, [&](auto axis_constant) {
+    constexpr Axis kAxis = decltype(axis_constant)::value;
+    internal::MarchRays<kAxis>(
+        grid,
+        [&](int64_t u, int64_t v, int64_t d) {
+          if (!hit(internal::PlaneVoxel<kAxis>(grid, u, v, d))) {
+            return true;
+          }
+          depths[v * plane.u_dim + u] = d;
+          return false;
+        },
+        [&](int64_t u, int64_t v) {
+          internal::SetPlanePixel<kAxis>(canvas, u, v, color(depths[v * plane.u_dim + u]));
+        });
+  });
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "voxel/scheduler.h"
+#include "voxel/voxel.h"
+
+#include "glog/logging.h"
+
+namespace voxel {
+
+// A read only 3d grid stored as runs of equal voxels along every (x, y) column. Classified grids are mostly long
+// external runs with a few internal runs in between, so a column usually takes a handful of runs instead of z_dim
+// voxels. Columns are indexed by the offset of their first run, so random access is a binary search within a single
+// column, and whole columns decode straight into a caller's buffer.
+//
+// The same arrays are the file format, see Write and Read.
+template <std::derived_from<Voxel> T>
+class RleGrid3d {
+  public:
+    static_assert(std::is_trivially_copyable_v<T>, "Runs are stored and written as raw bytes");
+
+    static constexpr char kMagic[8] = {'V', 'O', 'X', 'R', 'L', 'E', '\0', '\0'};
+    static constexpr uint32_t kVersion = 1;
+
+    // Work runs on the shared Scheduler::Default() unless another scheduler is set.
+    void SetScheduler(Scheduler* scheduler) { scheduler_ = scheduler; }
+
+    // Compresses a grid, merging every voxel of a column into the current run for which equal(first voxel of the run,
+    // voxel) returns true, so a tolerance does not drift along the run. Columns are encoded in parallel.
+    void Encode(const VoxelGrid3d<T>& grid, std::function<bool(const T& a, const T& b)> equal) {
+      CHECK_LE(grid.ZDim(), std::numeric_limits<uint32_t>::max());
+      x_dim_ = grid.XDim();
+      y_dim_ = grid.YDim();
+      z_dim_ = grid.ZDim();
+      step_ = grid.Step();
+
+      // Count the runs of every column, then fill them in at their offsets.
+      column_offsets_.assign(x_dim_ * y_dim_ + 1, 0);
+      ForEachColumn([&](int64_t x, int64_t y) {
+        uint64_t runs = 0;
+        const T* first = nullptr;
+        for (int64_t z = 0; z < z_dim_; z++) {
+          if (first == nullptr || !equal(*first, *grid.At(x, y, z))) {
+            first = grid.At(x, y, z);
+            runs++;
+          }
+        }
+        column_offsets_[ColumnIndex(x, y) + 1] = runs;
+      });
+      for (size_t i = 1; i < column_offsets_.size(); i++) {
+        column_offsets_[i] += column_offsets_[i - 1];
+      }
+
+      run_ends_.resize(column_offsets_.back());
+      values_.resize(column_offsets_.back());
+      ForEachColumn([&](int64_t x, int64_t y) {
+        uint64_t run = column_offsets_[ColumnIndex(x, y)];
+        for (int64_t z = 0; z < z_dim_; z++) {
+          if (z > 0 && equal(values_[run - 1], *grid.At(x, y, z))) {
+            run_ends_[run - 1] = z + 1;
+            continue;
+          }
+          values_[run] = *grid.At(x, y, z);
+          run_ends_[run] = z + 1;
+          run++;
+        }
+      });
+    }
+
+    // Same as above, merging voxels with identical bytes.
+    void Encode(const VoxelGrid3d<T>& grid) {
+      Encode(grid, [](const T& a, const T& b) { return std::memcmp(&a, &b, sizeof(T)) == 0; });
+    }
+
+    // Expands into a dense grid, decoding columns in parallel.
+    void Decode(VoxelGrid3d<T>* grid) const {
+      grid->Init(x_dim_, y_dim_, z_dim_, step_);
+      ForEachColumn([&](int64_t x, int64_t y) {
+        ForEachRun(x, y, [&](int64_t z_begin, int64_t z_end, const T& value) {
+          for (int64_t z = z_begin; z < z_end; z++) {
+            *grid->At(x, y, z) = value;
+          }
+        });
+      });
+    }
+
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
+    int64_t ZDim() const { return z_dim_; }
+    double Step() const { return step_; }
+
+    int64_t Runs() const { return values_.size(); }
+    int64_t Runs(int64_t x, int64_t y) const {
+      return column_offsets_[ColumnIndex(x, y) + 1] - column_offsets_[ColumnIndex(x, y)];
+    }
+
+    // Bytes used by the index and the runs.
+    int64_t CompressedBytes() const {
+      return column_offsets_.size() * sizeof(uint64_t) + run_ends_.size() * sizeof(uint32_t) +
+             values_.size() * sizeof(T);
+    }
+
+    const T* At(int64_t x, int64_t y, int64_t z) const {
+      auto begin = run_ends_.begin() + column_offsets_[ColumnIndex(x, y)];
+      auto end = run_ends_.begin() + column_offsets_[ColumnIndex(x, y) + 1];
+      // The first run ending after z.
+      return &values_[std::upper_bound(begin, end, static_cast<uint32_t>(z)) - run_ends_.begin()];
+    }
+
+    // The voxel followed by its 26 neighbors, null for the neighbors outside the grid.
+    std::array<const T*, 27> D3Q27(int64_t x, int64_t y, int64_t z) const {
+      std::array<const T*, 27> neighbors = {At(x, y, z)};
+      int i = 1;
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          for (int64_t dz = -1; dz <= 1; dz++) {
+            if (dx == 0 && dy == 0 && dz == 0) {
+              continue;
+            }
+            int64_t nx = x + dx, ny = y + dy, nz = z + dz;
+            if (nx >= 0 && ny >= 0 && nz >= 0 && nx < x_dim_ && ny < y_dim_ && nz < z_dim_) {
+              neighbors[i] = At(nx, ny, nz);
+            }
+            i++;
+          }
+        }
+      }
+      return neighbors;
+    }
+
+    // Calls visit(z_begin, z_end, value) for every run of the column, in ascending z.
+    template <typename Visitor>
+    void ForEachRun(int64_t x, int64_t y, Visitor visit) const {
+      int64_t z_begin = 0;
+      for (uint64_t run = column_offsets_[ColumnIndex(x, y)]; run < column_offsets_[ColumnIndex(x, y) + 1]; run++) {
+        visit(z_begin, static_cast<int64_t>(run_ends_[run]), values_[run]);
+        z_begin = run_ends_[run];
+      }
+    }
+
+    // Decodes the column into out, which must hold ZDim() voxels.
+    void DecodeColumn(int64_t x, int64_t y, std::span<T> out) const {
+      CHECK_GE(static_cast<int64_t>(out.size()), z_dim_);
+      ForEachRun(x, y, [&](int64_t z_begin, int64_t z_end, const T& value) {
+        std::fill(out.begin() + z_begin, out.begin() + z_end, value);
+      });
+    }
+
+    // Writes the header, with the dims, step, voxel size and counts, followed by the column offsets, the run ends and
+    // the run values. Returns false on write errors.
+    bool Write(const std::filesystem::path& path) const {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      Header header = {};
+      std::memcpy(header.magic, kMagic, sizeof(header.magic));
+      header.version = kVersion;
+      header.voxel_size = sizeof(T);
+      header.x_dim = x_dim_;
+      header.y_dim = y_dim_;
+      header.z_dim = z_dim_;
+      header.step = step_;
+      header.runs = values_.size();
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(column_offsets_.data()), column_offsets_.size() * sizeof(uint64_t));
+      out.write(reinterpret_cast<const char*>(run_ends_.data()), run_ends_.size() * sizeof(uint32_t));
+      out.write(reinterpret_cast<const char*>(values_.data()), values_.size() * sizeof(T));
+      out.close();
+      return !out.fail();
+    }
+
+    // Reads a file written by Write. Returns false if it cannot be read, is for another voxel type, or is inconsistent,
+    // in which case the grid is left unchanged. The header is checked against the file size before anything is
+    // allocated, so a corrupt header cannot request more memory than the file holds.
+    bool Read(const std::filesystem::path& path) {
+      std::ifstream in(path, std::ios::binary);
+      Header header;
+      if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+          std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 || header.version != kVersion ||
+          header.voxel_size != sizeof(T) || header.x_dim < 0 || header.y_dim < 0 || header.z_dim < 0 ||
+          header.z_dim > std::numeric_limits<uint32_t>::max()) {
+        return false;
+      }
+
+      // A column has at most one run per voxel, and the arrays must fill the rest of the file exactly.
+      uint64_t columns, voxels, offsets_bytes, runs_bytes, file_bytes;
+      std::error_code error;
+      uint64_t actual_bytes = std::filesystem::file_size(path, error);
+      if (error || __builtin_mul_overflow(static_cast<uint64_t>(header.x_dim), static_cast<uint64_t>(header.y_dim),
+                                          &columns) ||
+          __builtin_mul_overflow(columns, static_cast<uint64_t>(header.z_dim), &voxels) || header.runs > voxels ||
+          __builtin_mul_overflow(columns + 1, sizeof(uint64_t), &offsets_bytes) ||
+          __builtin_mul_overflow(header.runs, sizeof(uint32_t) + sizeof(T), &runs_bytes) ||
+          __builtin_add_overflow(offsets_bytes, runs_bytes, &file_bytes) ||
+          __builtin_add_overflow(file_bytes, sizeof(header), &file_bytes) || file_bytes != actual_bytes) {
+        return false;
+      }
+
+      std::vector<uint64_t> column_offsets(columns + 1);
+      std::vector<uint32_t> run_ends(header.runs);
+      std::vector<T> values(header.runs);
+      in.read(reinterpret_cast<char*>(column_offsets.data()), column_offsets.size() * sizeof(uint64_t));
+      in.read(reinterpret_cast<char*>(run_ends.data()), run_ends.size() * sizeof(uint32_t));
+      in.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(T));
+      if (!in || column_offsets.front() != 0 || column_offsets.back() != header.runs ||
+          !std::is_sorted(column_offsets.begin(), column_offsets.end())) {
+        return false;
+      }
+      // Every column must cover [0, z_dim) with runs in ascending order.
+      for (size_t column = 0; column + 1 < column_offsets.size(); column++) {
+        uint32_t z = 0;
+        for (uint64_t run = column_offsets[column]; run < column_offsets[column + 1]; run++) {
+          if (run_ends[run] <= z) {
+            return false;
+          }
+          z = run_ends[run];
+        }
+        if (z != header.z_dim) {
+          return false;
+        }
+      }
+
+      x_dim_ = header.x_dim;
+      y_dim_ = header.y_dim;
+      z_dim_ = header.z_dim;
+      step_ = header.step;
+      column_offsets_.swap(column_offsets);
+      run_ends_.swap(run_ends);
+      values_.swap(values);
+      return true;
+    }
+
+  private:
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t voxel_size;
+      int64_t x_dim;
+      int64_t y_dim;
+      int64_t z_dim;
+      double step;
+      uint64_t runs;
+    };
+
+    int64_t ColumnIndex(int64_t x, int64_t y) const { return y * x_dim_ + x; }
+
+    // Calls f(x, y) for every column, in parallel tiles.
+    template <typename F>
+    void ForEachColumn(F&& f) const {
+      Tiling tiling = Tiling::Make(0, x_dim_, 0, y_dim_, Tiling::Grain(0, x_dim_ * y_dim_, *scheduler_));
+      scheduler_->ParallelFor(tiling.Count(), 1, [&](int64_t begin, int64_t end) {
+        for (int64_t tile = begin; tile < end; tile++) {
+          tiling.ForEachColumn(tile, f);
+        }
+      });
+    }
+
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    int64_t z_dim_ = 0;
+    double step_ = 0;
+    Scheduler* scheduler_ = &Scheduler::Default();
+    // Offset of the first run of every column, followed by the total number of runs.
+    std::vector<uint64_t> column_offsets_;
+    // One past the last z of every run.
+    std::vector<uint32_t> run_ends_;
+    std::vector<T> values_;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,175 @@
+#include "voxel/scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "glog/logging.h"
+#include "voxel/build_stats.h"
+
+
+namespace voxel {
+namespace {
+
+// The scheduler and queue index of the worker running on this thread, if any.
+thread_local const Scheduler* current_scheduler = nullptr;
+thread_local int current_worker = -1;
+
+}
+
+Scheduler::Scheduler(int threads) {
+  CHECK_GT(threads, 0);
+  for (int i = 0; i < threads; i++) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (int i = 0; i < threads; i++) {
+    workers_.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+Scheduler& Scheduler::Default() {
+  static Scheduler scheduler(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+  return scheduler;
+}
+
+void Scheduler::Submit(ChunkFunction function, void* context, int64_t count, int64_t grain, std::latch* done) {
+  CHECK_GT(grain, 0);
+  int64_t chunks = ChunkCount(count, grain);
+  if (chunks == 0) {
+    return;
+  }
+
+  // A worker keeps its own batches in its own queue, where they are the first thing it runs when it waits for them,
+  // and leaves them to be stolen by the others. Batches from other threads are dealt out over all the queues.
+  bool from_worker = current_scheduler == this;
+  // queued_ is raised before the chunks are published so that it never undercounts them, otherwise a waiter could
+  // read zero while its own chunks sit in a queue and block on them forever.
+  queued_.fetch_add(chunks);
+  for (int64_t i = 0; i < chunks; i++) {
+    size_t queue = from_worker ? current_worker : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    int64_t begin = i * grain;
+    std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+    queues_[queue]->chunks.push_back(
+        {function, context, begin, std::min(begin + grain, count), done, internal::current_stats});
+  }
+
+  // Taking the lock orders the update of queued_ before any worker that is about to sleep checks it.
+  { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+  wake_.notify_all();
+}
+
+void Scheduler::Wait(std::latch* done) {
+  int index = current_scheduler == this ? current_worker : -1;
+  Chunk chunk;
+  while (!done->try_wait()) {
+    if (!Take(index, &chunk)) {
+      // Every chunk of the batch has been taken, so it completes without help.
+      done->wait();
+      return;
+    }
+    Execute(chunk);
+  }
+}
+
+void Scheduler::WorkerLoop(int index) {
+  current_scheduler = this;
+  current_worker = index;
+  Chunk chunk;
+  while (true) {
+    if (Take(index, &chunk)) {
+      Execute(chunk);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [this]() { return stop_ || queued_.load() > 0; });
+    if (stop_ && queued_.load() == 0) {
+      return;
+    }
+  }
+}
+
+bool Scheduler::Take(int index, Chunk* chunk) {
+  if (queued_.load() == 0) {
+    return false;
+  }
+
+  if (index >= 0) {
+    Queue& own = *queues_[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.chunks.empty()) {
+      *chunk = own.chunks.front();
+      own.chunks.pop_front();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+
+  size_t start = index >= 0 ? index + 1 : next_queue_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < queues_.size(); i++) {
+    Queue& victim = *queues_[(start + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.chunks.empty()) {
+      *chunk = victim.chunks.back();
+      victim.chunks.pop_back();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Scheduler::Execute(const Chunk& chunk) {
+  // A thread waiting for its own batch may run the chunks of another build, so the stats are always swapped.
+  BuildStats* previous = internal::current_stats;
+  internal::current_stats = chunk.stats;
+  if (chunk.stats == nullptr) {
+    chunk.function(chunk.context, chunk.begin, chunk.end);
+  } else {
+    int64_t begin = chunk.stats->Now();
+    chunk.function(chunk.context, chunk.begin, chunk.end);
+    chunk.stats->RecordTask(begin, chunk.stats->Now());
+  }
+  internal::current_stats = previous;
+  chunk.done->count_down();
+}
+
+Tiling Tiling::Make(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, int64_t columns) {
+  Tiling tiling;
+  tiling.x_begin = x_begin;
+  tiling.x_end = x_end;
+  tiling.y_begin = y_begin;
+  tiling.y_end = y_end;
+  int64_t x_len = std::max(x_end - x_begin, int64_t{0});
+  int64_t y_len = std::max(y_end - y_begin, int64_t{0});
+  if (x_len == 0 || y_len == 0) {
+    return tiling;
+  }
+
+  columns = std::max(columns, int64_t{1});
+  int64_t side = std::max(static_cast<int64_t>(std::sqrt(static_cast<double>(columns))), int64_t{1});
+  tiling.tile_x = std::min(x_len, side);
+  tiling.tile_y = std::min(y_len, std::max(columns / tiling.tile_x, int64_t{1}));
+  tiling.tiles_x = (x_len + tiling.tile_x - 1) / tiling.tile_x;
+  tiling.tiles_y = (y_len + tiling.tile_y - 1) / tiling.tile_y;
+  return tiling;
+}
+
+int64_t Tiling::Grain(int64_t grain, int64_t columns, const Scheduler& scheduler) {
+  if (grain > 0) {
+    return grain;
+  }
+  return std::max(columns / (8 * static_cast<int64_t>(scheduler.Threads())), int64_t{1});
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace voxel {
+
+class BuildStats;
+
+// Process wide work stealing thread pool that the grids borrow instead of each owning a workqueue.
+//
+// Work is submitted as a range [0, count) split into chunks, with a single latch counting the chunks down, so a batch
+// costs no allocation per chunk. Each worker has its own queue: it takes chunks from the front of its queue, and steals
+// from the back of the others' when it runs dry, which keeps every core busy when some chunks take much longer than
+// others. Threads waiting for a batch run queued chunks in the meantime, so batches may be submitted from within
+// chunks. Chunks run with the BuildStats of the thread that submitted them, see internal::current_stats.
+class Scheduler {
+  public:
+    // Runs chunk [begin, end) of a batch. `context` is the pointer passed to Submit.
+    using ChunkFunction = void (*)(void* context, int64_t begin, int64_t end);
+
+    explicit Scheduler(int threads);
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // The pool shared by all grids, with one thread per hardware thread, started on first use.
+    static Scheduler& Default();
+
+    int Threads() const { return static_cast<int>(workers_.size()); }
+
+    // Number of chunks Submit splits [0, count) into.
+    static int64_t ChunkCount(int64_t count, int64_t grain) { return (count + grain - 1) / grain; }
+
+    // Queues [0, count) in chunks of `grain` and returns immediately. `done` must be constructed with
+    // ChunkCount(count, grain), and is counted down once per chunk.
+    void Submit(ChunkFunction function, void* context, int64_t count, int64_t grain, std::latch* done);
+
+    // Waits for the batch to complete, running queued chunks while there are any.
+    void Wait(std::latch* done);
+
+    // Calls body(begin, end) on every chunk of [0, count) and waits for all of them.
+    template <typename F>
+    void ParallelFor(int64_t count, int64_t grain, F&& body) {
+      using Body = std::remove_reference_t<F>;
+      std::latch done(ChunkCount(count, grain));
+      Submit([](void* context, int64_t begin, int64_t end) { (*static_cast<Body*>(context))(begin, end); },
+             const_cast<void*>(static_cast<const void*>(&body)), count, grain, &done);
+      Wait(&done);
+    }
+
+  private:
+    struct Chunk {
+      ChunkFunction function;
+      void* context;
+      int64_t begin;
+      int64_t end;
+      std::latch* done;
+      BuildStats* stats;
+    };
+
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Chunk> chunks;
+    };
+
+    void WorkerLoop(int index);
+    // Takes a chunk from the queue of worker `index` or steals one from another queue. index is -1 for threads that
+    // are not workers of this scheduler.
+    bool Take(int index, Chunk* chunk);
+    static void Execute(const Chunk& chunk);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<int64_t> queued_ = 0;
+    std::atomic<uint64_t> next_queue_ = 0;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+};
+
+// Splits the columns [x_begin, x_end) x [y_begin, y_end) into rectangular tiles, numbered x fastest.
+struct Tiling {
+  int64_t x_begin = 0;
+  int64_t x_end = 0;
+  int64_t y_begin = 0;
+  int64_t y_end = 0;
+  int64_t tile_x = 1;
+  int64_t tile_y = 1;
+  int64_t tiles_x = 0;
+  int64_t tiles_y = 0;
+
+  // Tiles of about `columns` columns each. Tiles are as square as the extent allows.
+  static Tiling Make(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, int64_t columns);
+
+  // Picks the number of columns per tile. A positive grain is used as is, otherwise the columns are split into about
+  // eight tiles per thread of the scheduler, so that stealing can even out uneven columns.
+  static int64_t Grain(int64_t grain, int64_t columns, const Scheduler& scheduler);
+
+  int64_t Count() const { return tiles_x * tiles_y; }
+
+  // Columns [x0, x1) x [y0, y1) of tile `index`.
+  void Bounds(int64_t index, int64_t* x0, int64_t* x1, int64_t* y0, int64_t* y1) const {
+    *x0 = x_begin + (index % tiles_x) * tile_x;
+    *y0 = y_begin + (index / tiles_x) * tile_y;
+    *x1 = *x0 + tile_x < x_end ? *x0 + tile_x : x_end;
+    *y1 = *y0 + tile_y < y_end ? *y0 + tile_y : y_end;
+  }
+
+  // Calls f(x, y) for every column of tile `index`.
+  template <typename F>
+  void ForEachColumn(int64_t index, F&& f) const {
+    int64_t x0, x1, y0, y1;
+    Bounds(index, &x0, &x1, &y0, &y1);
+    for (int64_t y = y0; y < y1; y++) {
+      for (int64_t x = x0; x < x1; x++) {
+        f(x, y);
+      }
+    }
+  }
+};
+
+}
\ No newline at end of file
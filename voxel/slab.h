@@ -0,0 +1,109 @@
+#pragma once
+
+#include <concepts>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "voxel/voxel.h"
+
+namespace voxel {
+
+// The layers [z_begin, z_end) of a grid that is built one slab at a time, see builder::BuildSlabsFromStl. The voxels
+// live in a buffer that is reused for the next slab, so they are only valid while the sink is running.
+template <std::derived_from<Voxel> T>
+class VoxelSlab {
+  public:
+    // `layers` holds the slab, starting at its layer `first_layer`.
+    VoxelSlab(const VoxelGrid3d<T>* layers, int64_t first_layer, int64_t z_dim, int64_t z_begin, int64_t z_end)
+        : layers_(layers), first_layer_(first_layer), z_dim_(z_dim), z_begin_(z_begin), z_end_(z_end) {}
+
+    // Dims of the whole grid.
+    int64_t XDim() const { return layers_->XDim(); }
+    int64_t YDim() const { return layers_->YDim(); }
+    int64_t ZDim() const { return z_dim_; }
+    double Step() const { return layers_->Step(); }
+
+    int64_t ZBegin() const { return z_begin_; }
+    int64_t ZEnd() const { return z_end_; }
+
+    // z is in the coordinates of the whole grid, within [ZBegin(), ZEnd()).
+    const T* At(int64_t x, int64_t y, int64_t z) const { return layers_->At(x, y, z - z_begin_ + first_layer_); }
+
+  private:
+    const VoxelGrid3d<T>* layers_;
+    int64_t first_layer_;
+    int64_t z_dim_;
+    int64_t z_begin_;
+    int64_t z_end_;
+};
+
+// Sink for builder::BuildSlabsFromStl that appends every slab to a file, so that grids larger than memory can be
+// written out. The file starts with the x, y and z dims as int64_t and the step as a double, followed by the type of
+// every voxel as an int32_t, x fastest then y then z.
+class SlabFileWriter {
+  public:
+    explicit SlabFileWriter(const std::filesystem::path& path) : out_(path, std::ios::binary | std::ios::trunc) {}
+
+    // Writes the header before the first slab. Slabs must arrive in ascending z order. Returns false on write errors.
+    template <std::derived_from<Voxel> T>
+    bool Write(const VoxelSlab<T>& slab) {
+      if (slab.ZBegin() == 0) {
+        int64_t dims[3] = {slab.XDim(), slab.YDim(), slab.ZDim()};
+        double step = slab.Step();
+        out_.write(reinterpret_cast<const char*>(dims), sizeof(dims));
+        out_.write(reinterpret_cast<const char*>(&step), sizeof(step));
+      }
+
+      layer_.resize(slab.XDim() * slab.YDim());
+      for (int64_t z = slab.ZBegin(); z < slab.ZEnd(); z++) {
+        for (int64_t y = 0; y < slab.YDim(); y++) {
+          for (int64_t x = 0; x < slab.XDim(); x++) {
+            layer_[y * slab.XDim() + x] = slab.At(x, y, z)->type;
+          }
+        }
+        out_.write(reinterpret_cast<const char*>(layer_.data()), layer_.size() * sizeof(int32_t));
+      }
+      return out_.good();
+    }
+
+    // Flushes the file. Returns false if any write failed.
+    bool Close() {
+      out_.close();
+      return !out_.fail();
+    }
+
+  private:
+    std::ofstream out_;
+    std::vector<int32_t> layer_;
+};
+
+// Reads a file written by SlabFileWriter into a grid. Returns false if the file cannot be read or is truncated.
+template <std::derived_from<Voxel> T>
+bool ReadSlabFile(const std::filesystem::path& path, VoxelGrid3d<T>* grid) {
+  std::ifstream in(path, std::ios::binary);
+  int64_t dims[3];
+  double step;
+  in.read(reinterpret_cast<char*>(dims), sizeof(dims));
+  in.read(reinterpret_cast<char*>(&step), sizeof(step));
+  if (!in || dims[0] < 0 || dims[1] < 0 || dims[2] < 0) {
+    return false;
+  }
+
+  grid->Init(dims[0], dims[1], dims[2], step);
+  std::vector<int32_t> layer(dims[0] * dims[1]);
+  for (int64_t z = 0; z < dims[2]; z++) {
+    if (!in.read(reinterpret_cast<char*>(layer.data()), layer.size() * sizeof(int32_t))) {
+      return false;
+    }
+    for (int64_t y = 0; y < dims[1]; y++) {
+      for (int64_t x = 0; x < dims[0]; x++) {
+        grid->At(x, y, z)->type = layer[y * dims[0] + x];
+      }
+    }
+  }
+  return true;
+}
+
+}
\ No newline at end of file
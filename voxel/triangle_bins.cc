@@ -0,0 +1,117 @@
+#include "voxel/triangle_bins.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "glog/logging.h"
+#include "libmath/triangle.h"
+
+
+namespace voxel::builder::internal {
+
+TriangleBins::TriangleBins(std::span<const libmath::Plane> planes, double step, int64_t x_dim, int64_t y_dim, int64_t z_dim)
+    : step_(step) {
+  // The indices feed the gathers of the AVX2 kernel, which are signed.
+  CHECK_LT(planes.size(), static_cast<size_t>(std::numeric_limits<int32_t>::max()));
+  const std::array<int64_t, 3> dims = {x_dim, y_dim, z_dim};
+
+  // Cache the bounding box of every triangle, the planes only hand out their vertices by value.
+  std::vector<std::array<double, 6>> boxes;
+  boxes.reserve(planes.size());
+  for (const auto& plane : planes) {
+    libmath::Triangle triangle = plane.ToTriangle();
+    std::array<double, 6> box = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+                                 std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest(),
+                                 std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+    for (const auto& vertex : triangle.vertices) {
+      box[0] = std::min(box[0], vertex.x);
+      box[1] = std::min(box[1], vertex.y);
+      box[2] = std::min(box[2], vertex.z);
+      box[3] = std::max(box[3], vertex.x);
+      box[4] = std::max(box[4], vertex.y);
+      box[5] = std::max(box[5], vertex.z);
+    }
+    boxes.push_back(box);
+  }
+
+  for (int axis = 0; axis < 3; axis++) {
+    // The two axes perpendicular to the rays, in ascending order.
+    const int u_axis = axis == 0 ? 1 : 0;
+    const int v_axis = axis == 2 ? 1 : 2;
+    Bins& bins = bins_[axis];
+    bins.u_dim = dims[u_axis];
+    bins.v_dim = dims[v_axis];
+    bins.offsets.assign(bins.u_dim * bins.v_dim + 1, 0);
+
+    // First pass counts the triangles per column, the second pass scatters them. Triangles are visited in index order
+    // so each column ends up sorted, which keeps the intersection order identical to a linear scan.
+    for (int pass = 0; pass < 2; pass++) {
+      std::vector<size_t> cursor;
+      if (pass == 1) {
+        for (size_t i = 1; i < bins.offsets.size(); i++) {
+          bins.offsets[i] += bins.offsets[i - 1];
+        }
+        bins.indices.resize(bins.offsets.back());
+        cursor.assign(bins.offsets.begin(), bins.offsets.end() - 1);
+      }
+
+      for (size_t index = 0; index < boxes.size(); index++) {
+        const auto& box = boxes[index];
+        int64_t u_begin = Cell(box[u_axis], bins.u_dim);
+        int64_t u_end = Cell(box[u_axis + 3], bins.u_dim);
+        int64_t v_begin = Cell(box[v_axis], bins.v_dim);
+        int64_t v_end = Cell(box[v_axis + 3], bins.v_dim);
+        for (int64_t u = u_begin; u <= u_end; u++) {
+          for (int64_t v = v_begin; v <= v_end; v++) {
+            int64_t cell = u * bins.v_dim + v;
+            if (pass == 0) {
+              bins.offsets[cell + 1]++;
+            } else {
+              bins.indices[cursor[cell]++] = static_cast<uint32_t>(index);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+int64_t TriangleBins::Cell(double coordinate, int64_t dim) const {
+  int64_t cell = static_cast<int64_t>(std::floor(coordinate / step_));
+  return std::clamp(cell, static_cast<int64_t>(0), dim - 1);
+}
+
+bool TriangleBins::Candidates(const libmath::Point& p1, const libmath::Point& p2, std::span<const uint32_t>* candidates) const {
+  const std::array<double, 3> a = {p1.x, p1.y, p1.z};
+  const std::array<double, 3> b = {p2.x, p2.y, p2.z};
+
+  int axis = -1;
+  for (int i = 0; i < 3; i++) {
+    if (a[i] != b[i]) {
+      if (axis != -1) {
+        return false;
+      }
+      axis = i;
+    }
+  }
+
+  // A degenerate ray has no length and cannot cross anything, any column will do.
+  if (axis == -1) {
+    axis = 2;
+  }
+
+  const int u_axis = axis == 0 ? 1 : 0;
+  const int v_axis = axis == 2 ? 1 : 2;
+  const Bins& bins = bins_[axis];
+  int64_t cell = Cell(a[u_axis], bins.u_dim) * bins.v_dim + Cell(a[v_axis], bins.v_dim);
+  *candidates = std::span<const uint32_t>(bins.indices.data() + bins.offsets[cell],
+                                          bins.offsets[cell + 1] - bins.offsets[cell]);
+  return true;
+}
+
+size_t TriangleBins::Size() const {
+  return bins_[0].indices.size() + bins_[1].indices.size() + bins_[2].indices.size();
+}
+
+}
\ No newline at end of file
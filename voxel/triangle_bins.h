@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "libmath/plane.h"
+#include "libmath/point.h"
+
+
+namespace voxel::builder::internal {
+
+// Buckets triangles by the grid columns they cover, once for each axis.
+//
+// Every ray cast by the builder runs parallel to one of the axes through the center of a voxel, so the only triangles
+// it can hit are the ones whose projection onto the perpendicular plane covers that voxel's column. The bins are
+// stored in a compressed row layout (an offsets array and a flat index array) so that a lookup is two loads.
+class TriangleBins {
+  public:
+    TriangleBins(std::span<const libmath::Plane> planes, double step, int64_t x_dim, int64_t y_dim, int64_t z_dim);
+
+    // Looks up the triangles that may be hit by the ray between two points, in ascending index order. Returns false
+    // if the ray is not parallel to an axis, in which case every triangle must be considered.
+    bool Candidates(const libmath::Point& p1, const libmath::Point& p2, std::span<const uint32_t>* candidates) const;
+
+    // Total number of (column, triangle) entries across all three axes.
+    size_t Size() const;
+
+  private:
+    struct Bins {
+      int64_t u_dim = 0;
+      int64_t v_dim = 0;
+      std::vector<size_t> offsets;
+      std::vector<uint32_t> indices;
+    };
+
+    int64_t Cell(double coordinate, int64_t dim) const;
+
+    double step_;
+    // Indexed by the axis the rays run along: 0 = x, 1 = y, 2 = z.
+    std::array<Bins, 3> bins_;
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include "voxel/triangle_store.h"
+
+#include <cmath>
+#include <limits>
+
+#include "glog/logging.h"
+#include "libmath/triangle.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VOXEL_HAVE_AVX2_KERNEL 1
+#endif
+
+// The kernels must round every operation separately to stay bit identical, so never fuse multiplies and adds.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+namespace voxel::builder::internal {
+namespace {
+
+// Barycentric slack allowed on the edges of a triangle, so that a ray through a shared edge never slips between both
+// triangles due to rounding. Double counting is rejected by the callers.
+constexpr double kEdgeTolerance = 1e-9;
+
+}
+
+TriangleStore::TriangleStore(std::span<const libmath::Plane> planes) : size_(planes.size()) {
+  CHECK_LT(size_, static_cast<size_t>(std::numeric_limits<int32_t>::max()));
+  size_t padded_size = (size_ + kLanes - 1) / kLanes * kLanes;
+  for (auto& coordinates : coordinates_) {
+    coordinates.assign(padded_size, 0);
+  }
+
+  for (size_t i = 0; i < size_; i++) {
+    libmath::Triangle triangle = planes[i].ToTriangle();
+    for (int vertex = 0; vertex < 3; vertex++) {
+      coordinates_[vertex * 3 + 0][i] = triangle.vertices[vertex].x;
+      coordinates_[vertex * 3 + 1][i] = triangle.vertices[vertex].y;
+      coordinates_[vertex * 3 + 2][i] = triangle.vertices[vertex].z;
+    }
+  }
+}
+
+// Moller-Trumbore, restricted to the segment. The AVX2 kernel below performs exactly the same operations in the same
+// order, which is what makes the two bit identical. Neither may be compiled with FMA contraction.
+void IntersectScalar(const TriangleStore& store, const Ray& ray, const uint32_t* indices, size_t count, uint8_t* hits,
+                     double* t) {
+  const double* c[9];
+  for (int i = 0; i < 9; i++) {
+    c[i] = store.Coordinates(i / 3, i % 3);
+  }
+  const auto& o = ray.origin;
+  const auto& d = ray.direction;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t k = indices != nullptr ? indices[i] : i;
+    double e1x = c[3][k] - c[0][k], e1y = c[4][k] - c[1][k], e1z = c[5][k] - c[2][k];
+    double e2x = c[6][k] - c[0][k], e2y = c[7][k] - c[1][k], e2z = c[8][k] - c[2][k];
+
+    double px = d[1] * e2z - d[2] * e2y;
+    double py = d[2] * e2x - d[0] * e2z;
+    double pz = d[0] * e2y - d[1] * e2x;
+    double det = e1x * px + e1y * py + e1z * pz;
+    double inv_det = 1.0 / det;
+
+    double sx = o[0] - c[0][k], sy = o[1] - c[1][k], sz = o[2] - c[2][k];
+    double u = (sx * px + sy * py + sz * pz) * inv_det;
+
+    double qx = sy * e1z - sz * e1y;
+    double qy = sz * e1x - sx * e1z;
+    double qz = sx * e1y - sy * e1x;
+    double v = (d[0] * qx + d[1] * qy + d[2] * qz) * inv_det;
+    double s = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+    bool hit = det != 0 && u >= -kEdgeTolerance && v >= -kEdgeTolerance && u + v <= 1 + kEdgeTolerance && s >= 0 &&
+               s <= 1;
+    hits[i] = hit ? 1 : 0;
+    t[i] = s;
+  }
+}
+
+#ifdef VOXEL_HAVE_AVX2_KERNEL
+
+__attribute__((target("avx2"))) void IntersectAvx2(const TriangleStore& store, const Ray& ray,
+                                                   const uint32_t* indices, size_t count, uint8_t* hits, double* t) {
+  const double* c[9];
+  for (int i = 0; i < 9; i++) {
+    c[i] = store.Coordinates(i / 3, i % 3);
+  }
+
+  const __m256d ox = _mm256_set1_pd(ray.origin[0]);
+  const __m256d oy = _mm256_set1_pd(ray.origin[1]);
+  const __m256d oz = _mm256_set1_pd(ray.origin[2]);
+  const __m256d dx = _mm256_set1_pd(ray.direction[0]);
+  const __m256d dy = _mm256_set1_pd(ray.direction[1]);
+  const __m256d dz = _mm256_set1_pd(ray.direction[2]);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d low = _mm256_set1_pd(-kEdgeTolerance);
+  const __m256d high = _mm256_set1_pd(1 + kEdgeTolerance);
+  const __m256d all_lanes = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+  size_t i = 0;
+  for (; i + TriangleStore::kLanes <= count || (indices == nullptr && i < count); i += TriangleStore::kLanes) {
+    // Without indices the store's padding makes the tail safe to load, with indices the tail is handled below. The
+    // gather takes signed 32 bit indices, which the store bounds, and a defined source for the lanes it masks out.
+    __m256d v[9];
+    if (indices != nullptr) {
+      __m128i lanes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i));
+      for (int j = 0; j < 9; j++) {
+        v[j] = _mm256_mask_i32gather_pd(zero, c[j], lanes, all_lanes, 8);
+      }
+    } else {
+      for (int j = 0; j < 9; j++) {
+        v[j] = _mm256_loadu_pd(c[j] + i);
+      }
+    }
+
+    __m256d e1x = _mm256_sub_pd(v[3], v[0]), e1y = _mm256_sub_pd(v[4], v[1]), e1z = _mm256_sub_pd(v[5], v[2]);
+    __m256d e2x = _mm256_sub_pd(v[6], v[0]), e2y = _mm256_sub_pd(v[7], v[1]), e2z = _mm256_sub_pd(v[8], v[2]);
+
+    __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+    __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+    __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+    __m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)), _mm256_mul_pd(e1z, pz));
+    __m256d inv_det = _mm256_div_pd(one, det);
+
+    __m256d sx = _mm256_sub_pd(ox, v[0]), sy = _mm256_sub_pd(oy, v[1]), sz = _mm256_sub_pd(oz, v[2]);
+    __m256d u = _mm256_mul_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, px), _mm256_mul_pd(sy, py)), _mm256_mul_pd(sz, pz)), inv_det);
+
+    __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+    __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+    __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+    __m256d w = _mm256_mul_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)), inv_det);
+    __m256d s = _mm256_mul_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)), inv_det);
+
+    __m256d hit = _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ);
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(u, low, _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(w, low, _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(_mm256_add_pd(u, w), high, _CMP_LE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(s, zero, _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(s, one, _CMP_LE_OQ));
+
+    int mask = _mm256_movemask_pd(hit);
+    double lanes_t[TriangleStore::kLanes];
+    _mm256_storeu_pd(lanes_t, s);
+    for (size_t lane = 0; lane < TriangleStore::kLanes && i + lane < count; lane++) {
+      hits[i + lane] = (mask >> lane) & 1;
+      t[i + lane] = lanes_t[lane];
+    }
+  }
+
+  if (i < count) {
+    IntersectScalar(store, ray, indices + i, count - i, hits + i, t + i);
+  }
+}
+
+bool Avx2Supported() {
+  return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+void IntersectAvx2(const TriangleStore& store, const Ray& ray, const uint32_t* indices, size_t count, uint8_t* hits,
+                   double* t) {
+  LOG(FATAL) << "AVX2 kernel is not available on this architecture";
+}
+
+bool Avx2Supported() {
+  return false;
+}
+
+#endif
+
+IntersectKernel DefaultIntersectKernel() {
+  static const IntersectKernel kernel = Avx2Supported() ? IntersectAvx2 : IntersectScalar;
+  return kernel;
+}
+
+}
\ No newline at end of file
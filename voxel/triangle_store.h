@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "libmath/plane.h"
+#include "libmath/point.h"
+
+
+namespace voxel::builder::internal {
+
+// The segment origin + t * direction for t in [0, 1].
+struct Ray {
+  std::array<double, 3> origin;
+  std::array<double, 3> direction;
+
+  static Ray Between(const libmath::Point& p1, const libmath::Point& p2) {
+    return {{p1.x, p1.y, p1.z}, {p2.x - p1.x, p2.y - p1.y, p2.z - p1.z}};
+  }
+};
+
+// Structure of arrays copy of a list of triangles, so that SIMD kernels can load the same coordinate of consecutive
+// triangles with a single instruction. The arrays are padded with degenerate triangles to a multiple of kLanes.
+class TriangleStore {
+  public:
+    static constexpr size_t kLanes = 4;
+
+    explicit TriangleStore(std::span<const libmath::Plane> planes);
+
+    // Number of triangles, excluding the padding.
+    size_t Size() const { return size_; }
+
+    // Coordinate `axis` of vertex `vertex` of every triangle.
+    const double* Coordinates(int vertex, int axis) const { return coordinates_[vertex * 3 + axis].data(); }
+
+  private:
+    size_t size_;
+    std::array<std::vector<double>, 9> coordinates_;
+};
+
+// Tests a ray against a batch of triangles. If indices is null the batch is the first `count` triangles of the store,
+// otherwise it is the triangles at indices[0, count), which the store keeps below INT32_MAX. For every triangle i of
+// the batch, hits[i] is set to 1 if the ray crosses it and 0 otherwise, and t[i] to the ray parameter of the crossing.
+// Kernels must produce bit identical results to IntersectScalar.
+using IntersectKernel = void (*)(const TriangleStore& store, const Ray& ray, const uint32_t* indices, size_t count,
+                                 uint8_t* hits, double* t);
+
+// Portable reference kernel.
+void IntersectScalar(const TriangleStore& store, const Ray& ray, const uint32_t* indices, size_t count, uint8_t* hits,
+                     double* t);
+
+// Tests four triangles per instruction. Must only be called if Avx2Supported() returns true.
+void IntersectAvx2(const TriangleStore& store, const Ray& ray, const uint32_t* indices, size_t count, uint8_t* hits,
+                   double* t);
+
+// Tests whether the CPU this is running on supports the AVX2 kernel.
+bool Avx2Supported();
+
+// The fastest kernel supported by the CPU, selected once on first use.
+IntersectKernel DefaultIntersectKernel();
+
+}
\ No newline at end of file
@@ -1,11 +1,15 @@
 #include "voxel/voxel.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <cmath>
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <span>
+#include <utility>
 #include <vector>
 
 #include "glog/logging.h"
@@ -14,11 +18,14 @@
 #include "libmath/point.h"
 #include "simplebmp/simplebmp.h"
 #include "simplestl/simplestl.h"
-#include "workqueue/workqueue.h"
+#include "voxel/build_stats.h"
+#include "voxel/builder.h"
 
 
 namespace voxel::builder::internal {
 
+using voxel::internal::CountRay;
+
 bool IsBlack(const simplebmp::Color& color) {
   return color.r == 0 && color.g == 0 && color.b == 0;
 }
@@ -67,32 +74,719 @@ int64_t ComputeSteps(double dim, double step) {
 }
 
 
-int64_t ComputeIntersections(std::span<libmath::Plane> triangles, const libmath::Point& p1, const libmath::Point& p2) {
+namespace {
+
+// Tests whether the line cuts the triangle.
+bool Crosses(const libmath::Line& line, const libmath::Plane& triangle) {
+  return !line.LiesOnPlane(triangle) && line.IntersectsWithinBounds(triangle);
+}
+
+// Computes where the line crosses the plane of the triangle, as a fraction of the distance from p1 to p2.
+double IntersectionFraction(const libmath::Plane& plane, const libmath::Point& p1, const libmath::Point& p2) {
+  libmath::Triangle triangle = plane.ToTriangle();
+  const auto& a = triangle.vertices[0];
+  const auto& b = triangle.vertices[1];
+  const auto& c = triangle.vertices[2];
+  double ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+  double vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+  double nx = uy * vz - uz * vy;
+  double ny = uz * vx - ux * vz;
+  double nz = ux * vy - uy * vx;
+  double numerator = nx * (a.x - p1.x) + ny * (a.y - p1.y) + nz * (a.z - p1.z);
+  double denominator = nx * (p2.x - p1.x) + ny * (p2.y - p1.y) + nz * (p2.z - p1.z);
+  return numerator / denominator;
+}
+
+// Open addressing table from the edge ids of the crossings kept along a ray to the depth of the last of them, so that a
+// crossing through a shared edge is rejected in constant time. Every thread reuses one for all of its rays.
+class EdgeTable {
+  public:
+    // Empties the table and makes room for the edges of `triangles` triangles, at most half full.
+    void Reset(size_t triangles) {
+      size_t size = std::bit_ceil(triangles * 6 + 1);
+      if (ids_.size() < size) {
+        ids_.resize(size);
+        depths_.resize(size);
+      }
+      mask_ = size - 1;
+      std::fill_n(ids_.begin(), size, kEmpty);
+    }
+
+    // The depth stored for the edge, null if there is none.
+    const double* Find(uint32_t id) const {
+      size_t slot = Slot(id);
+      return ids_[slot] == id ? &depths_[slot] : nullptr;
+    }
+
+    void Insert(uint32_t id, double depth) {
+      size_t slot = Slot(id);
+      ids_[slot] = id;
+      depths_[slot] = depth;
+    }
+
+  private:
+    static constexpr uint32_t kEmpty = std::numeric_limits<uint32_t>::max();
+
+    size_t Slot(uint32_t id) const {
+      size_t slot = (id * uint64_t{0x9e3779b97f4a7c15}) >> 32 & mask_;
+      while (ids_[slot] != kEmpty && ids_[slot] != id) {
+        slot = (slot + 1) & mask_;
+      }
+      return slot;
+    }
+
+    std::vector<uint32_t> ids_;
+    std::vector<double> depths_;
+    size_t mask_ = 0;
+};
+
+// Sorts crossings given as (depth, triangle index) and returns their depths, dropping every crossing at (almost) the
+// same depth as a kept crossing of a triangle that shares an edge with it.
+std::vector<double> DistinctDepths(std::vector<std::pair<double, uint32_t>>& crossings,
+                                   std::span<const uint32_t> edge_ids) {
+  std::stable_sort(crossings.begin(), crossings.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  constexpr double kSameDepth = 1e-9;
+  thread_local EdgeTable kept;
+  kept.Reset(crossings.size());
+  std::vector<double> depths;
+  for (const auto& [depth, index] : crossings) {
+    bool duplicate_intersection = false;
+    for (int edge = 0; edge < 3; edge++) {
+      const double* previous = kept.Find(edge_ids[index * 3 + edge]);
+      duplicate_intersection |= previous != nullptr && depth - *previous <= kSameDepth;
+    }
+
+    if (!duplicate_intersection) {
+      depths.push_back(depth);
+      for (int edge = 0; edge < 3; edge++) {
+        kept.Insert(edge_ids[index * 3 + edge], depth);
+      }
+    }
+  }
+
+  return depths;
+}
+
+// Counts the crossed triangles, given in ascending index order, skipping every triangle that shares an edge with one
+// that was already counted.
+int64_t CountDistinct(std::span<const uint32_t> crossed, std::span<const uint32_t> edge_ids) {
+  thread_local EdgeTable kept;
+  kept.Reset(crossed.size());
+  int64_t distinct = 0;
+  for (uint32_t index : crossed) {
+    const uint32_t* edges = &edge_ids[index * 3];
+    if (kept.Find(edges[0]) != nullptr || kept.Find(edges[1]) != nullptr || kept.Find(edges[2]) != nullptr) {
+      continue;
+    }
+    for (int edge = 0; edge < 3; edge++) {
+      kept.Insert(edges[edge], 0);
+    }
+    distinct++;
+  }
+  return distinct;
+}
+
+}
+
+std::vector<uint32_t> ComputeEdgeIds(std::span<const libmath::Plane> triangles) {
+  // Number the distinct vertices in sorted order, then the edges between them.
+  std::vector<std::pair<std::array<double, 3>, uint32_t>> vertices(triangles.size() * 3);
+  for (size_t i = 0; i < triangles.size(); i++) {
+    libmath::Triangle triangle = triangles[i].ToTriangle();
+    for (int vertex = 0; vertex < 3; vertex++) {
+      const libmath::Point& p = triangle.vertices[vertex];
+      vertices[i * 3 + vertex] = {{p.x, p.y, p.z}, static_cast<uint32_t>(i * 3 + vertex)};
+    }
+  }
+  std::sort(vertices.begin(), vertices.end());
+
+  std::vector<uint32_t> indices(vertices.size());
+  uint32_t id = 0;
+  for (size_t i = 0; i < vertices.size(); i++) {
+    if (i > 0 && vertices[i].first != vertices[i - 1].first) {
+      id++;
+    }
+    indices[vertices[i].second] = id;
+  }
+  return NumberEdges(indices);
+}
+
+int64_t ComputeIntersections(std::span<libmath::Plane> triangles, std::span<const uint32_t> edge_ids,
+                             const libmath::Point& p1, const libmath::Point& p2) {
   libmath::Line line(p1, p2);
-  std::vector<const libmath::Plane*> intersected_triangles;
+  thread_local std::vector<uint32_t> crossed;
+  crossed.clear();
+  for (uint32_t index = 0; index < triangles.size(); index++) {
+    if (Crosses(line, triangles[index])) {
+      crossed.push_back(index);
+    }
+  }
 
-  for (const auto& triangle : triangles) {
-    // The line must cut the triangle for it to be considered intersecting.
-    if (!line.LiesOnPlane(triangle) && line.IntersectsWithinBounds(triangle)) {
-      // Skip a triangle that has a shared edge with one that has already been intersected to prevent double counting.
-      // This happens at the boundary of adjacent triangles.
-      bool duplicate_intersection = false;
-      for (const auto* prev_intersection : intersected_triangles) {
-        if (prev_intersection->ToTriangle().SharesEdge(triangle.ToTriangle())) {
-          duplicate_intersection = true;
-          break;
+  int64_t distinct = CountDistinct(crossed, edge_ids);
+  CountRay(triangles.size(), distinct, crossed.size() - distinct);
+  return distinct;
+}
+
+int64_t ComputeIntersections(std::span<libmath::Plane> triangles, std::span<const uint32_t> edge_ids,
+                             const TriangleBins& bins, const libmath::Point& p1, const libmath::Point& p2) {
+  std::span<const uint32_t> candidates;
+  if (!bins.Candidates(p1, p2, &candidates)) {
+    return ComputeIntersections(triangles, edge_ids, p1, p2);
+  }
+
+  // Candidates are in ascending order, so the duplicate rejection sees triangles in the same order as a full scan.
+  libmath::Line line(p1, p2);
+  thread_local std::vector<uint32_t> crossed;
+  crossed.clear();
+  for (uint32_t index : candidates) {
+    if (Crosses(line, triangles[index])) {
+      crossed.push_back(index);
+    }
+  }
+
+  int64_t distinct = CountDistinct(crossed, edge_ids);
+  CountRay(candidates.size(), distinct, crossed.size() - distinct);
+  return distinct;
+}
+
+bool TriangleOverlapsBox(const libmath::Triangle& triangle, const libmath::Point& center, double half_size) {
+  // Separating axis test with the box centered at the origin: the box normals, the triangle normal and the nine cross
+  // products of the box normals with the triangle edges.
+  std::array<std::array<double, 3>, 3> v;
+  for (int i = 0; i < 3; i++) {
+    v[i] = {triangle.vertices[i].x - center.x, triangle.vertices[i].y - center.y, triangle.vertices[i].z - center.z};
+  }
+
+  for (int axis = 0; axis < 3; axis++) {
+    double min = std::min({v[0][axis], v[1][axis], v[2][axis]});
+    double max = std::max({v[0][axis], v[1][axis], v[2][axis]});
+    if (min > half_size || max < -half_size) {
+      return false;
+    }
+  }
+
+  std::array<std::array<double, 3>, 3> edges;
+  for (int i = 0; i < 3; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      edges[i][axis] = v[(i + 1) % 3][axis] - v[i][axis];
+    }
+  }
+
+  auto cross = [](const std::array<double, 3>& a, const std::array<double, 3>& b) -> std::array<double, 3> {
+    return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
+  };
+  auto dot = [](const std::array<double, 3>& a, const std::array<double, 3>& b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  };
+  auto separates = [&](const std::array<double, 3>& axis) {
+    double p0 = dot(v[0], axis);
+    double p1 = dot(v[1], axis);
+    double p2 = dot(v[2], axis);
+    double radius = half_size * (std::fabs(axis[0]) + std::fabs(axis[1]) + std::fabs(axis[2]));
+    return std::min({p0, p1, p2}) > radius || std::max({p0, p1, p2}) < -radius;
+  };
+
+  if (separates(cross(edges[0], edges[1]))) {
+    return false;
+  }
+
+  for (int axis = 0; axis < 3; axis++) {
+    std::array<double, 3> box_normal = {0, 0, 0};
+    box_normal[axis] = 1;
+    for (const auto& edge : edges) {
+      if (separates(cross(box_normal, edge))) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool TriangleTouchesCell(const libmath::Triangle& triangle, int64_t x, int64_t y, int64_t z, int64_t size,
+                         double step) {
+  double half_size = size * step / 2;
+  libmath::Point center((x + size / 2.0) * step, (y + size / 2.0) * step, (z + size / 2.0) * step);
+  return TriangleOverlapsBox(triangle, center, half_size + step * 1e-6);
+}
+
+void CellBins::Init(std::span<libmath::Plane> planes, int64_t x_dim, int64_t y_dim, int64_t z_dim, double step,
+                    int64_t cell_size) {
+  this->cell_size = cell_size;
+  cells_x = (x_dim + cell_size - 1) / cell_size;
+  cells_y = (y_dim + cell_size - 1) / cell_size;
+  cells_z = (z_dim + cell_size - 1) / cell_size;
+  cells.assign(cells_x * cells_y * cells_z, {});
+  triangles.clear();
+  triangles.reserve(planes.size());
+
+  std::array<int64_t, 3> cell_counts = {cells_x, cells_y, cells_z};
+  for (const auto& plane : planes) {
+    triangles.push_back(plane.ToTriangle());
+    const libmath::Triangle& triangle = triangles.back();
+    // Range of cells the bounding box touches, with a cell of slack for triangles on a face.
+    std::array<int64_t, 3> begin, end;
+    for (int axis = 0; axis < 3; axis++) {
+      auto coordinate = [&](int i) {
+        const libmath::Point& v = triangle.vertices[i];
+        return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+      };
+      double low = std::min({coordinate(0), coordinate(1), coordinate(2)});
+      double high = std::max({coordinate(0), coordinate(1), coordinate(2)});
+      begin[axis] = std::clamp(static_cast<int64_t>(std::floor(low / (cell_size * step))) - 1, int64_t{0},
+                               cell_counts[axis]);
+      end[axis] = std::clamp(static_cast<int64_t>(std::floor(high / (cell_size * step))) + 2, int64_t{0},
+                             cell_counts[axis]);
+    }
+    uint32_t index = triangles.size() - 1;
+    for (int64_t cz = begin[2]; cz < end[2]; cz++) {
+      for (int64_t cy = begin[1]; cy < end[1]; cy++) {
+        for (int64_t cx = begin[0]; cx < end[0]; cx++) {
+          if (TriangleTouchesCell(triangle, cx * cell_size, cy * cell_size, cz * cell_size, cell_size, step)) {
+            cells[(cz * cells_y + cy) * cells_x + cx].push_back(index);
+          }
         }
       }
+    }
+  }
+}
+
+std::vector<double> ComputeIntersectionDepths(std::span<libmath::Plane> triangles, std::span<const uint32_t> edge_ids,
+                                              const TriangleBins* bins, const libmath::Point& p1,
+                                              const libmath::Point& p2) {
+  libmath::Line line(p1, p2);
+  thread_local std::vector<std::pair<double, uint32_t>> crossings;
+  crossings.clear();
+  auto test = [&](uint32_t index) {
+    const libmath::Plane& triangle = triangles[index];
+    if (Crosses(line, triangle)) {
+      crossings.emplace_back(IntersectionFraction(triangle, p1, p2), index);
+    }
+  };
+
+  std::span<const uint32_t> candidates;
+  int64_t tested = triangles.size();
+  if (bins != nullptr && bins->Candidates(p1, p2, &candidates)) {
+    tested = candidates.size();
+    for (uint32_t index : candidates) {
+      test(index);
+    }
+  } else {
+    for (uint32_t index = 0; index < triangles.size(); index++) {
+      test(index);
+    }
+  }
+
+  std::vector<double> depths = DistinctDepths(crossings, edge_ids);
+  CountRay(tested, depths.size(), crossings.size() - depths.size());
+  return depths;
+}
+
+namespace {
+
+// Runs the kernel over the candidates the bins pick for the ray, or over every triangle without bins. Returns the
+// batch that was tested, so that hits[i] and t[i] can be mapped back to triangle indices.
+std::span<const uint32_t> RunKernel(const TriangleStore& store, const TriangleBins* bins, const Ray& ray,
+                                    const libmath::Point& p1, const libmath::Point& p2, size_t* count,
+                                    std::vector<uint8_t>& hits, std::vector<double>& t) {
+  std::span<const uint32_t> candidates;
+  bool binned = bins != nullptr && bins->Candidates(p1, p2, &candidates);
+  *count = binned ? candidates.size() : store.Size();
+  if (hits.size() < *count) {
+    hits.resize(*count);
+    t.resize(*count);
+  }
+  DefaultIntersectKernel()(store, ray, binned ? candidates.data() : nullptr, *count, hits.data(), t.data());
+  return candidates;
+}
+
+}
 
-      if (duplicate_intersection) {
-        continue;
+int64_t ComputeIntersections(const TriangleStore& store, std::span<const uint32_t> edge_ids, const TriangleBins* bins,
+                             const libmath::Point& p1, const libmath::Point& p2) {
+  thread_local std::vector<uint8_t> hits;
+  thread_local std::vector<double> t;
+  thread_local std::vector<uint32_t> crossed;
+  crossed.clear();
+
+  size_t count = 0;
+  std::span<const uint32_t> candidates = RunKernel(store, bins, Ray::Between(p1, p2), p1, p2, &count, hits, t);
+  for (size_t i = 0; i < count; i++) {
+    if (hits[i]) {
+      crossed.push_back(candidates.empty() ? i : candidates[i]);
+    }
+  }
+
+  // Same shared edge rejection as the libmath path.
+  int64_t distinct = CountDistinct(crossed, edge_ids);
+  CountRay(count, distinct, crossed.size() - distinct);
+  return distinct;
+}
+
+std::vector<double> ComputeIntersectionDepths(const TriangleStore& store, std::span<const uint32_t> edge_ids,
+                                              const TriangleBins* bins, const libmath::Point& p1,
+                                              const libmath::Point& p2) {
+  thread_local std::vector<uint8_t> hits;
+  thread_local std::vector<double> t;
+  size_t count = 0;
+  std::span<const uint32_t> candidates = RunKernel(store, bins, Ray::Between(p1, p2), p1, p2, &count, hits, t);
+
+  thread_local std::vector<std::pair<double, uint32_t>> crossings;
+  crossings.clear();
+  for (size_t i = 0; i < count; i++) {
+    if (hits[i]) {
+      crossings.emplace_back(t[i], candidates.empty() ? i : candidates[i]);
+    }
+  }
+
+  std::vector<double> depths = DistinctDepths(crossings, edge_ids);
+  CountRay(count, depths.size(), crossings.size() - depths.size());
+  return depths;
+}
+
+namespace {
+
+// Calls visit(index, depth) for every triangle the axis aligned ray crosses, in ascending index order. Returns the
+// number of triangles tested.
+template <typename Visitor>
+int64_t VisitProjectedCrossings(const ProjectedTriangles& projected, const TriangleBins* bins,
+                                const libmath::Point& p1, const libmath::Point& p2, const AxisAlignedRay& ray,
+                                Visitor visit) {
+  double depth = 0;
+  std::span<const uint32_t> candidates;
+  if (bins != nullptr && bins->Candidates(p1, p2, &candidates)) {
+    for (uint32_t index : candidates) {
+      if (projected.Intersect(ray, index, &depth)) {
+        visit(index, depth);
+      }
+    }
+    return candidates.size();
+  }
+  for (uint32_t index = 0; index < projected.Size(); index++) {
+    if (projected.Intersect(ray, index, &depth)) {
+      visit(index, depth);
+    }
+  }
+  return projected.Size();
+}
+
+}
+
+int64_t ComputeIntersections(const ProjectedTriangles& projected, std::span<libmath::Plane> triangles,
+                             std::span<const uint32_t> edge_ids, const TriangleBins* bins, const libmath::Point& p1,
+                             const libmath::Point& p2) {
+  AxisAlignedRay ray;
+  if (!AxisAlignedRay::FromPoints(p1, p2, &ray)) {
+    return bins != nullptr ? ComputeIntersections(triangles, edge_ids, *bins, p1, p2)
+                           : ComputeIntersections(triangles, edge_ids, p1, p2);
+  }
+
+  // The top-left rule assigns crossings through shared edges to one triangle, so there is no duplicate rejection.
+  int64_t intersections = 0;
+  int64_t tested =
+      VisitProjectedCrossings(projected, bins, p1, p2, ray, [&](uint32_t index, double depth) { intersections++; });
+  CountRay(tested, intersections, 0);
+  return intersections;
+}
+
+std::vector<double> ComputeIntersectionDepths(const ProjectedTriangles& projected, std::span<libmath::Plane> triangles,
+                                              std::span<const uint32_t> edge_ids, const TriangleBins* bins,
+                                              const libmath::Point& p1, const libmath::Point& p2) {
+  AxisAlignedRay ray;
+  if (!AxisAlignedRay::FromPoints(p1, p2, &ray)) {
+    return ComputeIntersectionDepths(triangles, edge_ids, bins, p1, p2);
+  }
+
+  std::vector<double> depths;
+  int64_t tested = VisitProjectedCrossings(projected, bins, p1, p2, ray, [&](uint32_t index, double depth) {
+    depths.push_back((depth - ray.w1) / (ray.w2 - ray.w1));
+  });
+  std::sort(depths.begin(), depths.end());
+  CountRay(tested, depths.size(), 0);
+  return depths;
+}
+
+namespace {
+
+// Sizes the grid around a mesh whose bounding box, in the coordinates of the stl file, extends from the origin to
+// (width, height, depth), and sets the translation into the padding.
+void SizeStlMesh(double width, double height, double depth, double step, const StlBuildOptions& options,
+                 StlMesh* mesh) {
+  // At least 1 extra step is required for the algorithm to work, 2 to be safe.
+  int64_t extra_steps_x = std::max(static_cast<int64_t>(2), options.extra_steps_x);
+  int64_t extra_steps_y = std::max(static_cast<int64_t>(2), options.extra_steps_y);
+  int64_t extra_steps_z = std::max(static_cast<int64_t>(2), options.extra_steps_z);
+
+  width += 2 * extra_steps_x * step;
+  height += 2 * extra_steps_y * step;
+  depth += 2 * extra_steps_z * step;
+
+  mesh->x_dim = ComputeSteps(width, step);
+  mesh->y_dim = ComputeSteps(height, step);
+  mesh->z_dim = ComputeSteps(depth, step);
+
+  mesh->translate_x = extra_steps_x * step;
+  mesh->translate_y = extra_steps_y * step;
+  mesh->translate_z = extra_steps_z * step;
+}
+
+// Builds the acceleration structures the options ask for over the planes of the mesh.
+void IndexStlMesh(double step, const StlBuildOptions& options, StlMesh* mesh) {
+  voxel::internal::PhaseScope phase("index");
+  // The surface engine walks the bins to find the triangles touching each column, so it always needs them.
+  if (options.acceleration == Acceleration::kTriangleBins ||
+      options.classification == Classification::kSurfaceFloodFill) {
+    mesh->bins.emplace(mesh->planes, step, mesh->x_dim, mesh->y_dim, mesh->z_dim);
+  }
+  if (options.ray_triangle_test == RayTriangleTest::kBatched) {
+    mesh->store.emplace(mesh->planes);
+  }
+  if (options.ray_triangle_test == RayTriangleTest::kProjected) {
+    mesh->projected.emplace(mesh->planes);
+  }
+}
+
+}
+
+bool LoadStlMesh(const std::filesystem::path& stl_path, double step, const StlBuildOptions& options, StlMesh* mesh) {
+  voxel::internal::StatsScope stats(options.stats);
+  IndexedMesh indexed;
+  {
+    voxel::internal::PhaseScope phase("read");
+    if (!indexed.Read(stl_path)) {
+      return false;
+    }
+    phase.AddBytes(indexed.Positions().size_bytes() + indexed.Indices().size_bytes());
+  }
+  BuildStlMesh(indexed, step, options, mesh);
+  return true;
+}
+
+void BuildStlMesh(std::span<libmath::Triangle> triangles, double step, const StlBuildOptions& options, StlMesh* mesh) {
+  voxel::internal::StatsScope stats(options.stats);
+  {
+    voxel::internal::PhaseScope phase("planes");
+    double width = 0, height = 0, depth = 0;
+    ComputeBoundingBox(triangles, width, height, depth);
+    SizeStlMesh(width, height, depth, step, options, mesh);
+
+    // Recompute triangles as planes.
+    mesh->planes = ComputePlane(triangles, mesh->translate_x, mesh->translate_y, mesh->translate_z);
+    mesh->edge_ids = ComputeEdgeIds(mesh->planes);
+    phase.AddBytes(mesh->planes.size() * sizeof(libmath::Plane) + mesh->edge_ids.size() * sizeof(uint32_t));
+  }
+  IndexStlMesh(step, options, mesh);
+}
+
+bool LoadAssemblyMeshes(std::span<const std::filesystem::path> stl_paths, double step, const StlBuildOptions& options,
+                        std::vector<std::unique_ptr<StlMesh>>* meshes) {
+  voxel::internal::StatsScope stats(options.stats);
+  std::vector<IndexedMesh> parts(stl_paths.size());
+  {
+    voxel::internal::PhaseScope phase("read");
+    for (size_t i = 0; i < parts.size(); i++) {
+      if (!parts[i].Read(stl_paths[i])) {
+        LOG(ERROR) << "Cannot read " << stl_paths[i];
+        return false;
+      }
+      phase.AddBytes(parts[i].Positions().size_bytes() + parts[i].Indices().size_bytes());
+    }
+  }
+
+  meshes->clear();
+  {
+    voxel::internal::PhaseScope phase("planes");
+    // The corners of the box around every part, in single precision like IndexedMesh::Vertex, so that a single part
+    // gets the same planes as from BuildStlMesh.
+    IndexedMesh::Position min = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                                 std::numeric_limits<float>::max()};
+    IndexedMesh::Position max = {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(),
+                                 std::numeric_limits<float>::lowest()};
+    for (const IndexedMesh& part : parts) {
+      if (part.TriangleCount() > 0) {
+        min = {std::min(min.x, part.Min().x), std::min(min.y, part.Min().y), std::min(min.z, part.Min().z)};
+        max = {std::max(max.x, part.Max().x), std::max(max.y, part.Max().y), std::max(max.z, part.Max().z)};
       }
+    }
+    double width = 0, height = 0, depth = 0;
+    if (min.x <= max.x) {
+      width = max.x - min.x;
+      height = max.y - min.y;
+      depth = max.z - min.z;
+    }
+    StlMesh frame;
+    SizeStlMesh(width, height, depth, step, options, &frame);
+
+    for (const IndexedMesh& part : parts) {
+      auto mesh = std::make_unique<StlMesh>();
+      mesh->x_dim = frame.x_dim;
+      mesh->y_dim = frame.y_dim;
+      mesh->z_dim = frame.z_dim;
+      mesh->translate_x = frame.translate_x;
+      mesh->translate_y = frame.translate_y;
+      mesh->translate_z = frame.translate_z;
+      mesh->planes.reserve(part.TriangleCount());
+      auto vertex = [&](size_t triangle, int v) {
+        const IndexedMesh::Position& p = part.Positions()[part.Indices()[triangle * 3 + v]];
+        return libmath::Point(p.x - min.x, p.y - min.y, p.z - min.z)
+            .Translate(frame.translate_x, frame.translate_y, frame.translate_z);
+      };
+      for (size_t triangle = 0; triangle < part.TriangleCount(); triangle++) {
+        mesh->planes.emplace_back(vertex(triangle, 0), vertex(triangle, 1), vertex(triangle, 2));
+      }
+      mesh->edge_ids = part.EdgeIds();
+      phase.AddBytes(mesh->planes.size() * sizeof(libmath::Plane) + mesh->edge_ids.size() * sizeof(uint32_t));
+      meshes->push_back(std::move(mesh));
+    }
+  }
+
+  for (auto& mesh : *meshes) {
+    IndexStlMesh(step, options, mesh.get());
+  }
+  return true;
+}
+
+std::vector<libmath::Triangle> MoveToOrigin(std::span<const libmath::Triangle> triangles) {
+  double min_x = std::numeric_limits<double>::max();
+  double min_y = std::numeric_limits<double>::max();
+  double min_z = std::numeric_limits<double>::max();
+  for (const auto& triangle : triangles) {
+    for (const auto& vertex : triangle.vertices) {
+      min_x = std::min(min_x, vertex.x);
+      min_y = std::min(min_y, vertex.y);
+      min_z = std::min(min_z, vertex.z);
+    }
+  }
 
-      intersected_triangles.push_back(&triangle);
+  std::vector<libmath::Triangle> moved;
+  moved.reserve(triangles.size());
+  for (const auto& triangle : triangles) {
+    moved.emplace_back(triangle.vertices[0].Translate(-min_x, -min_y, -min_z),
+                       triangle.vertices[1].Translate(-min_x, -min_y, -min_z),
+                       triangle.vertices[2].Translate(-min_x, -min_y, -min_z));
+  }
+  return moved;
+}
+
+void BuildStlMesh(const IndexedMesh& indexed, double step, const StlBuildOptions& options, StlMesh* mesh) {
+  voxel::internal::StatsScope stats(options.stats);
+  {
+    voxel::internal::PhaseScope phase("planes");
+    // Same extents as ComputeBoundingBox on the triangles relative to the minimum.
+    double width = 0, height = 0, depth = 0;
+    if (indexed.TriangleCount() > 0) {
+      width = indexed.Max().x - indexed.Min().x;
+      height = indexed.Max().y - indexed.Min().y;
+      depth = indexed.Max().z - indexed.Min().z;
+    }
+    SizeStlMesh(width, height, depth, step, options, mesh);
+
+    // The translation into the padding is applied while building the planes, without a translated copy of the mesh.
+    mesh->planes.clear();
+    mesh->planes.reserve(indexed.TriangleCount());
+    for (size_t triangle = 0; triangle < indexed.TriangleCount(); triangle++) {
+      mesh->planes.emplace_back(
+          indexed.Vertex(triangle, 0).Translate(mesh->translate_x, mesh->translate_y, mesh->translate_z),
+          indexed.Vertex(triangle, 1).Translate(mesh->translate_x, mesh->translate_y, mesh->translate_z),
+          indexed.Vertex(triangle, 2).Translate(mesh->translate_x, mesh->translate_y, mesh->translate_z));
     }
+    // The vertices are already welded, so shared edges are numbered without comparing coordinates.
+    mesh->edge_ids = indexed.EdgeIds();
+    phase.AddBytes(mesh->planes.size() * sizeof(libmath::Plane) + mesh->edge_ids.size() * sizeof(uint32_t));
+  }
+  IndexStlMesh(step, options, mesh);
+}
+
+int64_t RayCaster::CountIntersections(const libmath::Point& p1, const libmath::Point& p2) const {
+  if (projected != nullptr) {
+    return ComputeIntersections(*projected, planes, edge_ids, bins, p1, p2);
+  }
+  if (store != nullptr) {
+    return ComputeIntersections(*store, edge_ids, bins, p1, p2);
+  }
+  return bins != nullptr ? ComputeIntersections(planes, edge_ids, *bins, p1, p2)
+                         : ComputeIntersections(planes, edge_ids, p1, p2);
+}
+
+std::vector<double> RayCaster::IntersectionDepths(const libmath::Point& p1, const libmath::Point& p2) const {
+  if (projected != nullptr) {
+    return ComputeIntersectionDepths(*projected, planes, edge_ids, bins, p1, p2);
+  }
+  if (store != nullptr) {
+    return ComputeIntersectionDepths(*store, edge_ids, bins, p1, p2);
+  }
+  return ComputeIntersectionDepths(planes, edge_ids, bins, p1, p2);
+}
+
+}
+
+namespace voxel::builder {
+
+bool BuildFromStl(const std::filesystem::path& stl_path, BitGrid3d* grid, double step, const StlBuildOptions& options) {
+  voxel::internal::StatsScope stats(options.stats);
+  internal::StlMesh mesh;
+  if (!internal::LoadStlMesh(stl_path, step, options, &mesh)) {
+    return false;
+  }
+  // Classification and boundaries share the passes of most engines, so the bit grid records them as one phase.
+  voxel::internal::PhaseScope phase("classify");
+  grid->Init(mesh.x_dim, mesh.y_dim, mesh.z_dim, step);
+  phase.AddBytes(2 * mesh.x_dim * mesh.y_dim * grid->WordsPerColumn() * sizeof(uint64_t));
+  internal::RayCaster caster = mesh.Caster();
+  double width = mesh.x_dim * step;
+  double height = mesh.y_dim * step;
+  double depth = mesh.z_dim * step;
+
+  // Every callback only writes the words of its own column.
+  switch (options.classification) {
+    case Classification::kSixRayVote:
+      grid->AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+        for (int64_t z = 0; z < mesh.z_dim; z++) {
+          libmath::Point p = internal::MakePoint(x, y, z, step);
+          grid->SetInside(x, y, z, internal::SixRayVote(caster, p, width, height, depth));
+        }
+      });
+      grid->RunSync(true);
+      grid->MarkBoundaries();
+      break;
+    case Classification::kColumnScanline:
+      grid->AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+        internal::ScanColumn(caster, x, y, mesh.z_dim, step, [&](int64_t z, bool inside) {
+          grid->SetInside(x, y, z, inside);
+        });
+      });
+      grid->RunSync(true);
+      grid->MarkBoundaries();
+      break;
+    case Classification::kCoarseToFine:
+      internal::ClassifyCoarseToFine(caster, mesh.planes, mesh.x_dim, mesh.y_dim, mesh.z_dim, step,
+                                     options.coarse_cell_size, *grid->GetScheduler(),
+                                     [&](int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end,
+                                         int64_t z_begin, int64_t z_end, bool inside) {
+                                       for (int64_t y = y_begin; y < y_end; y++) {
+                                         for (int64_t x = x_begin; x < x_end; x++) {
+                                           for (int64_t z = z_begin; z < z_end; z++) {
+                                             grid->SetInside(x, y, z, inside);
+                                           }
+                                         }
+                                       }
+                                     });
+      grid->MarkBoundaries();
+      break;
+    case Classification::kSurfaceFloodFill:
+      // The surface voxels already form the boundary layer.
+      grid->AddForeachXYCallback([&](void* data, int64_t x, int64_t y) {
+        internal::MarkSurfaceColumn(mesh.planes, *mesh.bins, x, y, mesh.z_dim, step,
+                                    [&](int64_t z) { return grid->Boundary(x, y, z); },
+                                    [&](int64_t z) { grid->SetBoundary(x, y, z, true); });
+      });
+      grid->RunSync(true);
+      grid->FillInterior();
+      break;
   }
 
-  return intersected_triangles.size();
+  return true;
 }
 
 }
\ No newline at end of file
@@ -1,15 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdint>
 #include <concepts>
 #include <filesystem>
 #include <functional>
+#include <latch>
 #include <memory>
+#include <utility>
 #include <vector>
 
-#include "workqueue/grid.h"
-#include "workqueue/workqueue.h"
+#include "voxel/grid_storage.h"
+#include "voxel/layout.h"
+#include "voxel/scheduler.h"
 
 namespace voxel {
 
@@ -17,6 +22,8 @@ constexpr int32_t kVoxelTypeUndefined = 0;
 constexpr int32_t kVoxelTypeExternal = 1 << 1;
 constexpr int32_t kVoxelTypeInternal = 1 << 2;
 constexpr int32_t kVoxelTypeBoundary = 1 << 3;
+// Internal voxel next to an internal voxel of another material, see builder::BuildFromStlAssembly.
+constexpr int32_t kVoxelTypeInterface = 1 << 4;
 
 class Voxel {
   public:
@@ -24,17 +31,53 @@ class Voxel {
 };
 
 template <std::derived_from<Voxel> T>
-class VoxelGrid2d : public workqueue::Grid2d<T> {
+class VoxelGrid2d {
   public:
     void Init(int64_t x_dim, int64_t y_dim, double step) {
-      this->x_dim_ = x_dim;
-      this->y_dim_ = y_dim;
+      x_dim_ = x_dim;
+      y_dim_ = y_dim;
       step_ = step;
-      this->elements_.resize(this->x_dim_ * this->y_dim_);
+      int64_t first = storage_.Resize(x_dim * y_dim);
+      if (first < x_dim * y_dim) {
+        ForEachXY([&](int64_t x, int64_t y) {
+          if (y * x_dim + x >= first) {
+            std::construct_at(At(x, y));
+          }
+        });
+      }
+    }
+
+    // How Init allocates the voxels. Takes effect on the next Init, which keeps the storage of the previous one when it
+    // is large enough.
+    void SetAllocation(Allocation allocation, HugePages huge_pages = HugePages::kNone) {
+      storage_.SetAllocation(allocation, huge_pages);
+    }
+    Allocation GetAllocation() const { return storage_.GetAllocation(); }
+
+    T* At(int64_t x, int64_t y) { return &storage_.Data()[y * x_dim_ + x]; }
+    const T* At(int64_t x, int64_t y) const { return &storage_.Data()[y * x_dim_ + x]; }
+
+    // The voxel followed by its 8 neighbors, null for the neighbors outside the grid.
+    std::array<T*, 9> D2Q9(int64_t x, int64_t y) {
+      std::array<T*, 9> neighbors = {At(x, y)};
+      int i = 1;
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          if (dx == 0 && dy == 0) {
+            continue;
+          }
+          int64_t nx = x + dx, ny = y + dy;
+          if (nx >= 0 && ny >= 0 && nx < x_dim_ && ny < y_dim_) {
+            neighbors[i] = At(nx, ny);
+          }
+          i++;
+        }
+      }
+      return neighbors;
     }
 
-    int64_t XDim() const { return this->x_dim_; }
-    int64_t YDim() const { return this->y_dim_; }
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
     double Step() const { return step_; }
 
     void AddForeachXYCallback(std::function<void(void*, int64_t, int64_t)> callback) {
@@ -45,20 +88,28 @@ class VoxelGrid2d : public workqueue::Grid2d<T> {
       foreach_xy_callbacks_.clear();
     }
 
+    // Work runs on the shared Scheduler::Default() unless another scheduler is set.
+    void SetScheduler(Scheduler* scheduler) { scheduler_ = scheduler; }
+    Scheduler* GetScheduler() const { return scheduler_; }
+
+    // Number of voxels per task, 0 to pick it from the grid size and the number of threads.
+    void SetGrainSize(int64_t voxels) { grain_ = voxels; }
+    int64_t GrainSize() const { return grain_; }
+
+    // Starts the callbacks on every voxel, split into tiles, and returns without waiting for them.
     void Run() {
-      for (int64_t x = 0; x < this->x_dim_; x++) {
-        tasks_.push_back(std::make_shared<Task>(this, x));
-      }
-      for (auto& task : this->tasks_) {
-        workqueue_.Enqueue(task);
-      }
+      WaitForCompletion();
+      tiling_ = Tiling::Make(0, x_dim_, 0, y_dim_,
+                             Tiling::Grain(grain_, x_dim_ * y_dim_, *scheduler_));
+      done_ = std::make_unique<std::latch>(tiling_.Count());
+      scheduler_->Submit(&VoxelGrid2d::RunTiles, this, tiling_.Count(), 1, done_.get());
     }
 
     void WaitForCompletion() {
-      for (auto& task : this->tasks_) {
-        task->WaitForFinish();
+      if (done_ != nullptr) {
+        scheduler_->Wait(done_.get());
+        done_.reset();
       }
-      tasks_.clear();
     }
 
     void RunSync(bool clear_on_completion) {
@@ -69,45 +120,106 @@ class VoxelGrid2d : public workqueue::Grid2d<T> {
       }
     }
 
-  private:
-    class Task : public workqueue::WorkItem {
-      public:
-        Task(VoxelGrid2d* grid, int64_t x) : grid_(grid), cur_x_(x) {}
-
-        void Run() {
-          for (int64_t y = 0; y < grid_->YDim(); y++) {
-            for (auto& callback : grid_->foreach_xy_callbacks_) {
-              callback(grid_, cur_x_, y);
-            }
-          }
+    // Calls f(x, y) for every voxel in [x_begin, x_end) x [y_begin, y_end), split into tiles, and waits for all of
+    // them. Unlike the callbacks, f is inlined into the loop.
+    template <typename F>
+    void ForEachXY(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, F&& f) {
+      Tiling tiling = Tiling::Make(x_begin, x_end, y_begin, y_end,
+                                   Tiling::Grain(grain_, (x_end - x_begin) * (y_end - y_begin), *scheduler_));
+      scheduler_->ParallelFor(tiling.Count(), 1, [&tiling, &f](int64_t begin, int64_t end) {
+        for (int64_t tile = begin; tile < end; tile++) {
+          tiling.ForEachColumn(tile, f);
         }
+      });
+    }
 
-      private:
-        VoxelGrid2d* grid_;
-        int64_t cur_x_;
-    };
+    template <typename F>
+    void ForEachXY(F&& f) {
+      ForEachXY(0, x_dim_, 0, y_dim_, f);
+    }
+
+  private:
+    static void RunTiles(void* context, int64_t begin, int64_t end) {
+      auto* grid = static_cast<VoxelGrid2d*>(context);
+      for (int64_t tile = begin; tile < end; tile++) {
+        grid->tiling_.ForEachColumn(tile, [grid](int64_t x, int64_t y) {
+          for (auto& callback : grid->foreach_xy_callbacks_) {
+            callback(grid, x, y);
+          }
+        });
+      }
+    }
 
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
     double step_ = 1.0;
-    std::vector<std::shared_ptr<workqueue::WorkItem>> tasks_;
-    workqueue::WorkQueue workqueue_;
+    internal::GridStorage<T> storage_;
+    Scheduler* scheduler_ = &Scheduler::Default();
+    int64_t grain_ = 0;
+    Tiling tiling_;
+    std::unique_ptr<std::latch> done_;
     std::vector<std::function<void(void* data, int64_t x, int64_t y)>> foreach_xy_callbacks_;
 };
 
 
-template <std::derived_from<Voxel> T>
-class VoxelGrid3d : public workqueue::Grid3d<T> {
+// Voxels are stored in the order of Layout, see layout.h. At and D3Q27 follow it, and ForEachXYZ walks a tiled layout
+// tile by tile in storage order. The column callbacks and ForEachXY still run by columns of (x, y).
+template <std::derived_from<Voxel> T, typename Layout = LinearLayout>
+class VoxelGrid3d {
   public:
-    void Init(int64_t x_dim, int64_t y_dim, int64_t z_dim, size_t step) {
-      this->x_dim_ = x_dim;
-      this->y_dim_ = y_dim;
-      this->z_dim_ = z_dim;
+    void Init(int64_t x_dim, int64_t y_dim, int64_t z_dim, double step) {
+      x_dim_ = x_dim;
+      y_dim_ = y_dim;
+      z_dim_ = z_dim;
       step_ = step;
-      this->elements_.resize(this->x_dim_ * this->y_dim_ * this->z_dim_);
+      layout_.Init(x_dim, y_dim, z_dim);
+      int64_t first = storage_.Resize(layout_.Size());
+      if (first < layout_.Size()) {
+        // Voxels are first touched by the tasks that will work on them.
+        ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+          if (layout_.Index(x, y, z) >= first) {
+            std::construct_at(At(x, y, z));
+          }
+        });
+      }
+    }
+
+    // How Init allocates the voxels. Takes effect on the next Init, which keeps the storage of the previous one when it
+    // is large enough, so that repeated builds into the same grid skip the allocation and the page faults.
+    void SetAllocation(Allocation allocation, HugePages huge_pages = HugePages::kNone) {
+      storage_.SetAllocation(allocation, huge_pages);
+    }
+    Allocation GetAllocation() const { return storage_.GetAllocation(); }
+
+    T* At(int64_t x, int64_t y, int64_t z) { return &storage_.Data()[layout_.Index(x, y, z)]; }
+    const T* At(int64_t x, int64_t y, int64_t z) const { return &storage_.Data()[layout_.Index(x, y, z)]; }
+
+    // The voxel followed by its 26 neighbors, null for the neighbors outside the grid.
+    std::array<T*, 27> D3Q27(int64_t x, int64_t y, int64_t z) {
+      std::array<T*, 27> neighbors = {At(x, y, z)};
+      int i = 1;
+      for (int64_t dx = -1; dx <= 1; dx++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          for (int64_t dz = -1; dz <= 1; dz++) {
+            if (dx == 0 && dy == 0 && dz == 0) {
+              continue;
+            }
+            int64_t nx = x + dx, ny = y + dy, nz = z + dz;
+            if (nx >= 0 && ny >= 0 && nz >= 0 && nx < x_dim_ && ny < y_dim_ && nz < z_dim_) {
+              neighbors[i] = At(nx, ny, nz);
+            }
+            i++;
+          }
+        }
+      }
+      return neighbors;
     }
 
-    int64_t XDim() const { return this->x_dim_; }
-    int64_t YDim() const { return this->y_dim_; }
-    int64_t ZDim() const { return this->z_dim_; }
+    const Layout& GetLayout() const { return layout_; }
+
+    int64_t XDim() const { return x_dim_; }
+    int64_t YDim() const { return y_dim_; }
+    int64_t ZDim() const { return z_dim_; }
     double Step() const { return step_; }
 
     void AddForeachXYZCallback(std::function<void(void*, int64_t, int64_t, int64_t)> callback) {
@@ -118,54 +230,163 @@ class VoxelGrid3d : public workqueue::Grid3d<T> {
       foreach_xyz_callbacks_.clear();
     }
 
+    // Column callbacks run once per (x, y) column, before the per voxel callbacks of that column.
+    void AddForeachXYCallback(std::function<void(void*, int64_t, int64_t)> callback) {
+      foreach_xy_callbacks_.push_back(callback);
+    }
+
+    void ClearForeachXYCallbacks() {
+      foreach_xy_callbacks_.clear();
+    }
+
+    // Work runs on the shared Scheduler::Default() unless another scheduler is set.
+    void SetScheduler(Scheduler* scheduler) { scheduler_ = scheduler; }
+    Scheduler* GetScheduler() const { return scheduler_; }
+
+    // Number of (x, y) columns per task, 0 to pick it from the grid size and the number of threads.
+    void SetGrainSize(int64_t columns) { grain_ = columns; }
+    int64_t GrainSize() const { return grain_; }
+
+    // Starts the callbacks on every column, split into tiles of columns, and returns without waiting for them.
     void Run() {
-      for (int64_t x = 0; x < this->x_dim_; x++) {
-        for (int64_t y = 0; y < this->y_dim_; y++) {
-          tasks_.push_back(std::make_shared<Task>(this, x, y));
-        }
-      }
-      for (auto& task : this->tasks_) {
-        workqueue_.Enqueue(task);
-      }
+      WaitForCompletion();
+      tiling_ = Tiling::Make(0, x_dim_, 0, y_dim_,
+                             Tiling::Grain(grain_, x_dim_ * y_dim_, *scheduler_));
+      done_ = std::make_unique<std::latch>(tiling_.Count());
+      scheduler_->Submit(&VoxelGrid3d::RunTiles, this, tiling_.Count(), 1, done_.get());
     }
 
     void WaitForCompletion() {
-      for (auto& task : this->tasks_) {
-        task->WaitForFinish();
+      if (done_ != nullptr) {
+        scheduler_->Wait(done_.get());
+        done_.reset();
       }
-      tasks_.clear();
     }
 
     void RunSync(bool clear_on_completion) {
       Run();
       WaitForCompletion();
       if (clear_on_completion) {
+        ClearForeachXYCallbacks();
         ClearForeachXYZCallbacks();
       }
     }
 
+    // Calls f(x, y) for every column in [x_begin, x_end) x [y_begin, y_end), split into tiles of columns, and waits
+    // for all of them. Unlike the callbacks, f is inlined into the loop.
+    template <typename F>
+    void ForEachXY(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, F&& f) {
+      Tiling tiling = Tiling::Make(x_begin, x_end, y_begin, y_end,
+                                   Tiling::Grain(grain_, (x_end - x_begin) * (y_end - y_begin), *scheduler_));
+      scheduler_->ParallelFor(tiling.Count(), 1, [&tiling, &f](int64_t begin, int64_t end) {
+        for (int64_t tile = begin; tile < end; tile++) {
+          tiling.ForEachColumn(tile, f);
+        }
+      });
+    }
+
+    template <typename F>
+    void ForEachXY(F&& f) {
+      ForEachXY(0, x_dim_, 0, y_dim_, f);
+    }
+
+    // Calls f(x, y, z) for every voxel in the box [x_begin, x_end) x [y_begin, y_end) x [z_begin, z_end), split into
+    // tiles of columns, and waits for all of them. Unlike the callbacks, f is inlined into the loop. With an automatic
+    // grain size and too few columns to keep every thread busy, the columns are also split along z. With a tiled
+    // layout, tasks are runs of tiles instead, the grain size counting tiles, and the voxels are visited in storage
+    // order.
+    template <typename F>
+    void ForEachXYZ(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, int64_t z_begin, int64_t z_end,
+                    F&& f) {
+      if constexpr (Layout::kTileSize > 0) {
+        ForEachTiledXYZ(x_begin, x_end, y_begin, y_end, z_begin, z_end, f);
+        return;
+      }
+      Tiling tiling = Tiling::Make(x_begin, x_end, y_begin, y_end,
+                                   Tiling::Grain(grain_, (x_end - x_begin) * (y_end - y_begin), *scheduler_));
+      int64_t slabs = 1;
+      if (grain_ <= 0 && tiling.Count() > 0 && z_end > z_begin) {
+        slabs = std::clamp<int64_t>(8 * scheduler_->Threads() / tiling.Count(), 1, z_end - z_begin);
+      }
+      int64_t slab_depth = (z_end - z_begin + slabs - 1) / slabs;
+      scheduler_->ParallelFor(tiling.Count() * slabs, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t task = begin; task < end; task++) {
+          int64_t z0 = z_begin + (task / tiling.Count()) * slab_depth;
+          int64_t z1 = std::min(z0 + slab_depth, z_end);
+          tiling.ForEachColumn(task % tiling.Count(), [&f, z0, z1](int64_t x, int64_t y) {
+            for (int64_t z = z0; z < z1; z++) {
+              f(x, y, z);
+            }
+          });
+        }
+      });
+    }
+
+    template <typename F>
+    void ForEachXYZ(F&& f) {
+      ForEachXYZ(0, x_dim_, 0, y_dim_, 0, z_dim_, f);
+    }
+
   private:
-    class Task : public workqueue::WorkItem {
-      public:
-        Task(VoxelGrid3d* grid, int64_t x, int64_t y) : grid_(grid), cur_x_(x), cur_y_(y) {}
-
-        void Run() {
-          for (int64_t z = 0; z < grid_->ZDim(); z++) {
-            for (auto& callback : grid_->foreach_xyz_callbacks_) {
-              callback(grid_, cur_x_, cur_y_, z);
+    template <typename F>
+    void ForEachTiledXYZ(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, int64_t z_begin,
+                         int64_t z_end, F&& f) {
+      if (x_begin >= x_end || y_begin >= y_end || z_begin >= z_end) {
+        return;
+      }
+      constexpr int64_t kTile = Layout::kTileSize;
+      int64_t tx_begin = x_begin / kTile, tx_count = (x_end - 1) / kTile - tx_begin + 1;
+      int64_t ty_begin = y_begin / kTile, ty_count = (y_end - 1) / kTile - ty_begin + 1;
+      int64_t tz_begin = z_begin / kTile, tz_count = (z_end - 1) / kTile - tz_begin + 1;
+      int64_t tiles = tx_count * ty_count * tz_count;
+      int64_t grain = grain_ > 0 ? grain_ : std::max<int64_t>(1, tiles / (8 * scheduler_->Threads()));
+      scheduler_->ParallelFor(tiles, grain, [&](int64_t begin, int64_t end) {
+        for (int64_t tile = begin; tile < end; tile++) {
+          int64_t x0 = (tx_begin + tile % tx_count) * kTile;
+          int64_t y0 = (ty_begin + tile / tx_count % ty_count) * kTile;
+          int64_t z0 = (tz_begin + tile / (tx_count * ty_count)) * kTile;
+          bool whole = x0 >= x_begin && x0 + kTile <= x_end && y0 >= y_begin && y0 + kTile <= y_end &&
+                       z0 >= z_begin && z0 + kTile <= z_end;
+          Layout::ForEachInTile([&](int64_t dx, int64_t dy, int64_t dz) {
+            int64_t x = x0 + dx, y = y0 + dy, z = z0 + dz;
+            if (whole || (x >= x_begin && x < x_end && y >= y_begin && y < y_end && z >= z_begin && z < z_end)) {
+              f(x, y, z);
             }
-          }
+          });
         }
+      });
+    }
 
-      private:
-        VoxelGrid3d* grid_;
-        int64_t cur_x_;
-        int64_t cur_y_;
-    };
+    static void RunTiles(void* context, int64_t begin, int64_t end) {
+      auto* grid = static_cast<VoxelGrid3d*>(context);
+      for (int64_t tile = begin; tile < end; tile++) {
+        grid->tiling_.ForEachColumn(tile, [grid](int64_t x, int64_t y) {
+          for (auto& callback : grid->foreach_xy_callbacks_) {
+            callback(grid, x, y);
+          }
+          if (grid->foreach_xyz_callbacks_.empty()) {
+            return;
+          }
+          for (int64_t z = 0; z < grid->ZDim(); z++) {
+            for (auto& callback : grid->foreach_xyz_callbacks_) {
+              callback(grid, x, y, z);
+            }
+          }
+        });
+      }
+    }
 
+    int64_t x_dim_ = 0;
+    int64_t y_dim_ = 0;
+    int64_t z_dim_ = 0;
     double step_ = 0;
-    std::vector<std::shared_ptr<workqueue::WorkItem>> tasks_;
-    workqueue::WorkQueue workqueue_;
+    Layout layout_;
+    internal::GridStorage<T> storage_;
+    Scheduler* scheduler_ = &Scheduler::Default();
+    int64_t grain_ = 0;
+    Tiling tiling_;
+    std::unique_ptr<std::latch> done_;
+    std::vector<std::function<void(void* data, int64_t x, int64_t y)>> foreach_xy_callbacks_;
     std::vector<std::function<void(void* data, int64_t x, int64_t y, int64_t z)>> foreach_xyz_callbacks_;
 };
 
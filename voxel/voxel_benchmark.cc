@@ -0,0 +1,658 @@
+#include "voxel/voxel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "voxel/assembly.h"
+#include "voxel/batch.h"
+#include "voxel/bit_grid.h"
+#include "voxel/builder.h"
+#include "voxel/components.h"
+#include "voxel/distance.h"
+#include "voxel/indexed_mesh.h"
+#include "voxel/renderer.h"
+
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
+#include "tools/cpp/runfiles/runfiles.h"
+
+
+namespace voxel {
+namespace {
+
+using bazel::tools::cpp::runfiles::Runfiles;
+
+std::unique_ptr<Runfiles> runfiles;
+
+std::string ResolvePath(const std::string& path) {
+  return runfiles->Rlocation(path);
+}
+
+builder::StlBuildOptions MakeOptions(builder::Classification classification, builder::Acceleration acceleration,
+                                     builder::RayTriangleTest ray_triangle_test = builder::RayTriangleTest::kLibmath) {
+  builder::StlBuildOptions options;
+  options.classification = classification;
+  options.acceleration = acceleration;
+  options.ray_triangle_test = ray_triangle_test;
+  return options;
+}
+
+void BM_BuildFromStl(benchmark::State& state, const std::string& mesh, builder::StlBuildOptions options) {
+  std::string path = ResolvePath("__main__/voxel/testdata/" + mesh + ".stl");
+  int64_t voxels = 0;
+  for (auto _ : state) {
+    VoxelGrid3d<Voxel> grid;
+    CHECK(builder::BuildFromStl(path, &grid, 1.0, options));
+    voxels += grid.XDim() * grid.YDim() * grid.ZDim();
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(voxels, benchmark::Counter::kIsRate);
+}
+
+#define VOXEL_STL_BENCHMARKS(mesh)                                                                                     \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_six_ray, #mesh,                                                            \
+                    MakeOptions(builder::Classification::kSixRayVote, builder::Acceleration::kNone))                   \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_six_ray_bins, #mesh,                                                       \
+                    MakeOptions(builder::Classification::kSixRayVote, builder::Acceleration::kTriangleBins))           \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_six_ray_bins_batched, #mesh,                                               \
+                    MakeOptions(builder::Classification::kSixRayVote, builder::Acceleration::kTriangleBins,            \
+                                builder::RayTriangleTest::kBatched))                                                   \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_six_ray_bins_projected, #mesh,                                             \
+                    MakeOptions(builder::Classification::kSixRayVote, builder::Acceleration::kTriangleBins,            \
+                                builder::RayTriangleTest::kProjected))                                                 \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_scanline, #mesh,                                                           \
+                    MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kNone))               \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_scanline_bins, #mesh,                                                      \
+                    MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins))       \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_surface_flood_fill, #mesh,                                                 \
+                    MakeOptions(builder::Classification::kSurfaceFloodFill, builder::Acceleration::kTriangleBins))     \
+      ->Unit(benchmark::kMillisecond)->UseRealTime();                                                                  \
+  BENCHMARK_CAPTURE(BM_BuildFromStl, mesh##_coarse_to_fine, #mesh,                                                     \
+                    MakeOptions(builder::Classification::kCoarseToFine, builder::Acceleration::kTriangleBins,          \
+                                builder::RayTriangleTest::kProjected))                                                 \
+      ->Unit(benchmark::kMillisecond)->UseRealTime()
+
+// Signed distance field of the sphere at 4 voxels per unit.
+void BM_SignedDistance(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  VoxelGrid3d<Voxel> grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 0.25, options));
+  std::vector<float> distances(grid.XDim() * grid.YDim() * grid.ZDim());
+  for (auto _ : state) {
+    ComputeSignedDistance(grid, distances);
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(state.iterations() * distances.size(),
+                                                           benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BM_SignedDistance)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Every slice of the sphere at 4 voxels per unit along x, through the per voxel callback and as batches of tiles.
+simplebmp::Color4f TypeColor(int64_t x, int64_t y, int64_t z, double step, const void* voxel) {
+  int32_t type = static_cast<const Voxel*>(voxel)->type;
+  return type & kVoxelTypeBoundary ? simplebmp::Color4f(1, 0, 0, 1)
+                                   : simplebmp::Color4f(type == kVoxelTypeInternal ? 0 : 1, 1, 1, 1);
+}
+
+void BM_RenderSlicesCallback(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  VoxelGrid3d<Voxel> grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 0.25, options));
+  simplebmp::Canvas canvas(grid.ZDim(), grid.YDim(), 1);
+  for (auto _ : state) {
+    for (int64_t x = 0; x < grid.XDim(); x++) {
+      renderer::RenderSliceYZ(grid, x, &canvas, TypeColor);
+    }
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(state.iterations() * grid.XDim() * grid.YDim() * grid.ZDim(),
+                                                           benchmark::Counter::kIsRate);
+}
+
+void BM_RenderSlicesTiled(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  VoxelGrid3d<Voxel> grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 0.25, options));
+  renderer::TypeColors colors(simplebmp::Color4f(1, 1, 1, 1));
+  colors.Set(kVoxelTypeInternal, simplebmp::Color4f(0, 1, 1, 1));
+  for (int32_t type = kVoxelTypeBoundary; type < 2 * kVoxelTypeBoundary; type++) {
+    colors.Set(type, simplebmp::Color4f(1, 0, 0, 1));
+  }
+  for (auto _ : state) {
+    renderer::RenderAllSlices(grid, renderer::Axis::kX, 1, colors, [](int64_t offset, const simplebmp::Canvas& canvas) {
+      benchmark::DoNotOptimize(&canvas);
+    });
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(state.iterations() * grid.XDim() * grid.YDim() * grid.ZDim(),
+                                                           benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BM_RenderSlicesCallback)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_RenderSlicesTiled)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Components of the air around the sphere at 4 voxels per unit, with the connectivity as the argument.
+void BM_LabelComponents(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  VoxelGrid3d<Voxel> grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 0.25, options));
+  auto connectivity = static_cast<Connectivity>(state.range(0));
+  ComponentLabels result;
+  for (auto _ : state) {
+    LabelComponents(grid, kVoxelTypeExternal, connectivity, &result);
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(state.iterations() * result.labels.size(),
+                                                           benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BM_LabelComponents)->Arg(static_cast<int>(Connectivity::k6))->Arg(static_cast<int>(Connectivity::k26))
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Reads the sphere into the triangle list of simplestl::StlReader and into a welded IndexedMesh.
+void BM_ReadStlTriangles(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  for (auto _ : state) {
+    std::vector<libmath::Triangle> triangles;
+    CHECK(simplestl::StlReader(path).Read(&triangles));
+    benchmark::DoNotOptimize(triangles.data());
+  }
+}
+
+void BM_ReadStlIndexed(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  for (auto _ : state) {
+    builder::IndexedMesh mesh;
+    CHECK(mesh.Read(path));
+    benchmark::DoNotOptimize(mesh.Indices().data());
+  }
+}
+
+BENCHMARK(BM_ReadStlTriangles)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ReadStlIndexed)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Builds every test mesh at two steps, one BuildFromStl call after the other and as a single pipelined batch.
+std::vector<builder::BatchJob> MakeBatchJobs() {
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  std::vector<builder::BatchJob> jobs;
+  for (const std::string mesh : {"sphere", "cone", "hollow_cube", "pyramid"}) {
+    for (double step : {1.0, 0.5}) {
+      jobs.push_back({ResolvePath("__main__/voxel/testdata/" + mesh + ".stl"), step, options});
+    }
+  }
+  return jobs;
+}
+
+void BM_SerialBuilds(benchmark::State& state) {
+  std::vector<builder::BatchJob> jobs = MakeBatchJobs();
+  for (auto _ : state) {
+    for (const auto& job : jobs) {
+      VoxelGrid3d<Voxel> grid;
+      CHECK(builder::BuildFromStl(job.stl_path, &grid, job.step, job.options));
+    }
+  }
+  state.counters["jobs_per_second"] = benchmark::Counter(state.iterations() * jobs.size(), benchmark::Counter::kIsRate);
+}
+
+void BM_BatchBuilds(benchmark::State& state) {
+  std::vector<builder::BatchJob> jobs = MakeBatchJobs();
+  for (auto _ : state) {
+    builder::BatchBuilder<Voxel> batch;
+    batch.Start(jobs);
+    builder::BatchResult<Voxel> result;
+    while (batch.Next(&result)) {
+      CHECK(result.ok);
+    }
+  }
+  state.counters["jobs_per_second"] = benchmark::Counter(state.iterations() * jobs.size(), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BM_SerialBuilds)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_BatchBuilds)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// The parts of an assembly, state.range(0) copies of the sphere, built part by part into separate grids that are then
+// merged, or all at once. The step is fine enough for the grid traversals, rather than reading the parts, to dominate,
+// as they do for real assemblies.
+constexpr double kAssemblyStep = 0.25;
+
+void BM_AssemblyPerPart(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  for (auto _ : state) {
+    VoxelGrid3d<MaterialVoxel> merged;
+    for (int64_t part = 0; part < state.range(0); part++) {
+      VoxelGrid3d<Voxel> grid;
+      CHECK(builder::BuildFromStl(path, &grid, kAssemblyStep, options));
+      if (part == 0) {
+        merged.Init(grid.XDim(), grid.YDim(), grid.ZDim(), grid.Step());
+      }
+      merged.ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+        MaterialVoxel* voxel = merged.At(x, y, z);
+        if (grid.At(x, y, z)->type != kVoxelTypeExternal && voxel->material == kNoMaterial) {
+          voxel->type = grid.At(x, y, z)->type;
+          voxel->material = part;
+        }
+      });
+    }
+  }
+  state.counters["parts_per_second"] =
+      benchmark::Counter(state.iterations() * state.range(0), benchmark::Counter::kIsRate);
+}
+
+void BM_AssemblySinglePass(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  std::vector<builder::AssemblyPart> parts;
+  for (int64_t part = 0; part < state.range(0); part++) {
+    parts.push_back({path, static_cast<int32_t>(part)});
+  }
+  for (auto _ : state) {
+    VoxelGrid3d<MaterialVoxel> grid;
+    CHECK(builder::BuildFromStlAssembly(parts, &grid, kAssemblyStep, options));
+  }
+  state.counters["parts_per_second"] =
+      benchmark::Counter(state.iterations() * state.range(0), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BM_AssemblyPerPart)->RangeMultiplier(4)->Range(1, 16)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_AssemblySinglePass)->RangeMultiplier(4)->Range(1, 16)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Builds the sphere with state.range(0) voxels per unit along each axis. The per voxel engines grow with the volume,
+// while the coarse to fine engine mostly grows with the surface.
+void BM_BuildFromStlResolution(benchmark::State& state, builder::StlBuildOptions options) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  double step = 1.0 / state.range(0);
+  int64_t voxels = 0;
+  for (auto _ : state) {
+    VoxelGrid3d<Voxel> grid;
+    CHECK(builder::BuildFromStl(path, &grid, step, options));
+    voxels += grid.XDim() * grid.YDim() * grid.ZDim();
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(voxels, benchmark::Counter::kIsRate);
+}
+
+BENCHMARK_CAPTURE(BM_BuildFromStlResolution, six_ray,
+                  MakeOptions(builder::Classification::kSixRayVote, builder::Acceleration::kTriangleBins,
+                              builder::RayTriangleTest::kProjected))
+    ->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_BuildFromStlResolution, scanline,
+                  MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins,
+                              builder::RayTriangleTest::kProjected))
+    ->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_BuildFromStlResolution, coarse_to_fine,
+                  MakeOptions(builder::Classification::kCoarseToFine, builder::Acceleration::kTriangleBins,
+                              builder::RayTriangleTest::kProjected))
+    ->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Marks the boundary of the sphere, classified once up front, in the unpacked grid with every layout and in the packed
+// grid.
+template <typename Layout>
+void BM_MarkBoundaries(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  VoxelGrid3d<Voxel, Layout> grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 1.0, options));
+  for (auto _ : state) {
+    builder::internal::MarkBoundaries(&grid);
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(
+      state.iterations() * grid.XDim() * grid.YDim() * grid.ZDim(), benchmark::Counter::kIsRate);
+}
+
+// The boundary pass as it was written against the std::function callbacks, for comparison with the inlined ForEachXYZ
+// version in builder::internal::MarkBoundaries.
+void BM_MarkBoundariesCallbacks(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  VoxelGrid3d<Voxel> grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 1.0, options));
+  for (auto _ : state) {
+    grid.AddForeachXYZCallback([&](void* data, int64_t x, int64_t y, int64_t z) {
+      VoxelGrid3d<Voxel>* grid = reinterpret_cast<VoxelGrid3d<Voxel>*>(data);
+      auto* cur_voxel = grid->At(x, y, z);
+      if (cur_voxel->type == kVoxelTypeExternal) {
+        return;
+      }
+      for (const auto* neighbor : grid->D3Q27(x, y, z)) {
+        if (neighbor != nullptr && neighbor->type == kVoxelTypeExternal) {
+          cur_voxel->type |= kVoxelTypeBoundary;
+          return;
+        }
+      }
+    });
+    grid.RunSync(true);
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(
+      state.iterations() * grid.XDim() * grid.YDim() * grid.ZDim(), benchmark::Counter::kIsRate);
+}
+
+void BM_MarkBoundariesPacked(benchmark::State& state) {
+  std::string path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  BitGrid3d grid;
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  CHECK(builder::BuildFromStl(path, &grid, 1.0, options));
+  for (auto _ : state) {
+    grid.MarkBoundaries();
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(
+      state.iterations() * grid.XDim() * grid.YDim() * grid.ZDim(), benchmark::Counter::kIsRate);
+}
+
+// Initializes a 256^3 grid, either a new one every iteration or the same one again, with every allocation.
+void BM_InitGrid(benchmark::State& state, Allocation allocation, HugePages huge_pages, bool reuse) {
+  constexpr int64_t kDim = 256;
+  auto grid = std::make_unique<VoxelGrid3d<Voxel>>();
+  for (auto _ : state) {
+    if (!reuse) {
+      grid = std::make_unique<VoxelGrid3d<Voxel>>();
+    }
+    grid->SetAllocation(allocation, huge_pages);
+    grid->Init(kDim, kDim, kDim, 1.0);
+    benchmark::DoNotOptimize(grid->At(kDim - 1, kDim - 1, kDim - 1));
+  }
+  state.counters["voxels_per_second"] =
+      benchmark::Counter(state.iterations() * kDim * kDim * kDim, benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_InitGrid, default, Allocation::kDefault, HugePages::kNone, false)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitGrid, first_touch, Allocation::kFirstTouch, HugePages::kNone, false)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitGrid, first_touch_thp, Allocation::kFirstTouch, HugePages::kTransparent, false)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitGrid, first_touch_hugetlb, Allocation::kFirstTouch, HugePages::kExplicit, false)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitGrid, first_touch_reused, Allocation::kFirstTouch, HugePages::kNone, true)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_MarkBoundaries, LinearLayout)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MarkBoundaries, Tiled4Layout)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MarkBoundaries, Tiled8Layout)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MarkBoundaries, MortonLayout)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_MarkBoundariesCallbacks)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_MarkBoundariesPacked)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Tests rays along z through the sphere's bounding box against all of its triangles with one kernel.
+void BM_IntersectKernel(benchmark::State& state, builder::internal::IntersectKernel kernel) {
+  if (kernel == builder::internal::IntersectAvx2 && !builder::internal::Avx2Supported()) {
+    state.SkipWithError("AVX2 is not supported on this CPU");
+    return;
+  }
+
+  simplestl::StlReader reader(ResolvePath("__main__/voxel/testdata/sphere.stl"));
+  std::vector<libmath::Triangle> triangles;
+  CHECK(reader.Read(&triangles));
+  std::vector<libmath::Plane> planes = builder::internal::ComputePlane(triangles, 0, 0, 0);
+  builder::internal::TriangleStore store(planes);
+  std::vector<uint8_t> hits(store.Size());
+  std::vector<double> t(store.Size());
+
+  double x = 0;
+  for (auto _ : state) {
+    x = x > 20 ? 0 : x + 0.37;
+    auto ray = builder::internal::Ray::Between({x, 10, 0}, {x, 10, 20});
+    kernel(store, ray, nullptr, store.Size(), hits.data(), t.data());
+    benchmark::DoNotOptimize(hits.data());
+  }
+  state.counters["triangles_per_second"] =
+      benchmark::Counter(state.iterations() * store.Size(), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK_CAPTURE(BM_IntersectKernel, scalar, builder::internal::IntersectScalar);
+BENCHMARK_CAPTURE(BM_IntersectKernel, avx2, builder::internal::IntersectAvx2);
+
+// Meshes generated in memory with any number of triangles, so builds are measured at production sizes without large
+// test files. All of them are closed and about 20 units across.
+enum class SyntheticShape {
+  // Latitude and longitude sphere.
+  kSphere,
+  kTorus,
+  // Every triangle shares the apex or the center of the base, so the mesh is all fans of long thin triangles.
+  kCone,
+};
+
+const char* SyntheticShapeName(SyntheticShape shape) {
+  switch (shape) {
+    case SyntheticShape::kSphere:
+      return "sphere";
+    case SyntheticShape::kTorus:
+      return "torus";
+    default:
+      return "cone";
+  }
+}
+
+// Generates about `triangles` triangles of the shape.
+std::vector<libmath::Triangle> MakeSyntheticMesh(SyntheticShape shape, int64_t triangles) {
+  constexpr double kPi = 3.14159265358979323846;
+  std::vector<libmath::Triangle> mesh;
+  switch (shape) {
+    case SyntheticShape::kSphere: {
+      // 2 * segments * (rings - 1) triangles, with twice as many segments as rings.
+      int64_t rings = std::max<int64_t>(3, std::lround(std::sqrt(triangles / 4.0)));
+      int64_t segments = rings * 2;
+      auto point = [&](int64_t ring, int64_t segment) {
+        double theta = kPi * ring / rings, phi = 2 * kPi * segment / segments;
+        return libmath::Point(10 * std::sin(theta) * std::cos(phi), 10 * std::sin(theta) * std::sin(phi),
+                              10 * std::cos(theta));
+      };
+      for (int64_t ring = 0; ring < rings; ring++) {
+        for (int64_t segment = 0; segment < segments; segment++) {
+          // The first and last rings are fans around the poles.
+          if (ring > 0) {
+            mesh.emplace_back(point(ring, segment), point(ring + 1, segment), point(ring, segment + 1));
+          }
+          if (ring < rings - 1) {
+            mesh.emplace_back(point(ring, segment + 1), point(ring + 1, segment), point(ring + 1, segment + 1));
+          }
+        }
+      }
+      break;
+    }
+    case SyntheticShape::kTorus: {
+      // 2 * major * minor triangles, with twice as many segments around the ring as around the tube.
+      int64_t minor = std::max<int64_t>(3, std::lround(std::sqrt(triangles / 4.0)));
+      int64_t major = minor * 2;
+      auto point = [&](int64_t i, int64_t j) {
+        double u = 2 * kPi * i / major, v = 2 * kPi * j / minor;
+        double r = 7 + 3 * std::cos(v);
+        return libmath::Point(r * std::cos(u), r * std::sin(u), 3 * std::sin(v));
+      };
+      for (int64_t i = 0; i < major; i++) {
+        for (int64_t j = 0; j < minor; j++) {
+          mesh.emplace_back(point(i, j), point(i + 1, j), point(i, j + 1));
+          mesh.emplace_back(point(i, j + 1), point(i + 1, j), point(i + 1, j + 1));
+        }
+      }
+      break;
+    }
+    case SyntheticShape::kCone: {
+      int64_t segments = std::max<int64_t>(3, triangles / 2);
+      libmath::Point apex(0, 0, 20), center(0, 0, 0);
+      auto point = [&](int64_t segment) {
+        double phi = 2 * kPi * segment / segments;
+        return libmath::Point(10 * std::cos(phi), 10 * std::sin(phi), 0);
+      };
+      for (int64_t segment = 0; segment < segments; segment++) {
+        mesh.emplace_back(apex, point(segment), point(segment + 1));
+        mesh.emplace_back(center, point(segment + 1), point(segment));
+      }
+      break;
+    }
+  }
+  return mesh;
+}
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+// Builds a synthetic mesh with the column scanline engine and the triangle bins, timing every phase. The arguments are
+// the number of triangles, the voxels per unit and the number of threads.
+void BM_BuildSynthetic(benchmark::State& state, SyntheticShape shape) {
+  std::vector<libmath::Triangle> triangles =
+      builder::internal::MoveToOrigin(MakeSyntheticMesh(shape, state.range(0)));
+  double step = 1.0 / state.range(1);
+  Scheduler scheduler(state.range(2));
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+
+  double prepare_seconds = 0, classify_seconds = 0, boundary_seconds = 0;
+  int64_t voxels = 0, rays = 0;
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    builder::internal::StlMesh mesh;
+    builder::internal::BuildStlMesh(triangles, step, options, &mesh);
+    Clock::time_point prepared = Clock::now();
+    VoxelGrid3d<Voxel> grid;
+    grid.SetScheduler(&scheduler);
+    grid.Init(mesh.x_dim, mesh.y_dim, mesh.z_dim, step);
+    builder::internal::ClassifyColumnScanline(mesh.Caster(), &grid);
+    Clock::time_point classified = Clock::now();
+    builder::internal::MarkBoundaries(&grid);
+    Clock::time_point done = Clock::now();
+
+    prepare_seconds += Seconds(start, prepared);
+    classify_seconds += Seconds(prepared, classified);
+    boundary_seconds += Seconds(classified, done);
+    voxels += grid.XDim() * grid.YDim() * grid.ZDim();
+    // One ray per column.
+    rays += grid.XDim() * grid.YDim();
+  }
+  state.counters["triangles"] = triangles.size();
+  state.counters["grid_voxels"] = voxels / std::max<int64_t>(1, state.iterations());
+  state.counters["voxels_per_second"] = benchmark::Counter(voxels, benchmark::Counter::kIsRate);
+  state.counters["prepare_triangles_per_second"] = state.iterations() * triangles.size() / prepare_seconds;
+  state.counters["classify_rays_per_second"] = rays / classify_seconds;
+  state.counters["classify_voxels_per_second"] = voxels / classify_seconds;
+  state.counters["boundary_voxels_per_second"] = voxels / boundary_seconds;
+}
+
+// Builds a 2d grid from a generated bitmap of a disc with a hole, with the side in pixels and the number of threads as
+// the arguments.
+void BM_BuildFromBmpSynthetic(benchmark::State& state) {
+  int64_t side = state.range(0);
+  simplebmp::Canvas canvas(side, side, 1);
+  for (int64_t y = 0; y < side; y++) {
+    for (int64_t x = 0; x < side; x++) {
+      double dx = x - side / 2.0, dy = y - side / 2.0;
+      double r = std::sqrt(dx * dx + dy * dy) / side;
+      canvas.Set(x, y, r < 0.45 && r > 0.2 ? simplebmp::Color4f(0, 0, 0, 1) : simplebmp::Color4f(1, 1, 1, 1));
+    }
+  }
+  std::filesystem::path path =
+      std::filesystem::temp_directory_path().append("voxel_benchmark_" + std::to_string(side) + ".bmp");
+  CHECK(simplebmp::Image(canvas).Write(path.c_str()));
+
+  Scheduler scheduler(state.range(1));
+  for (auto _ : state) {
+    VoxelGrid2d<Voxel> grid;
+    grid.SetScheduler(&scheduler);
+    CHECK(builder::BuildFromBmp(path, 1.0, &grid));
+  }
+  state.counters["voxels_per_second"] = benchmark::Counter(state.iterations() * side * side,
+                                                           benchmark::Counter::kIsRate);
+  std::filesystem::remove(path);
+}
+
+// Renders every XY slice and the maximum intensity projection along z of the synthetic sphere, with the voxels per
+// unit and the number of threads as the arguments.
+void BM_RenderSynthetic(benchmark::State& state) {
+  Scheduler scheduler(state.range(1));
+  VoxelGrid3d<Voxel> grid;
+  grid.SetScheduler(&scheduler);
+  std::vector<libmath::Triangle> triangles = MakeSyntheticMesh(SyntheticShape::kSphere, 1 << 14);
+  auto options = MakeOptions(builder::Classification::kColumnScanline, builder::Acceleration::kTriangleBins);
+  builder::BuildFromTriangles(triangles, &grid, 1.0 / state.range(0), options);
+  renderer::TypeColors colors(simplebmp::Color4f(1, 1, 1, 1));
+  colors.Set(kVoxelTypeInternal, simplebmp::Color4f(0, 0, 0, 1));
+  simplebmp::Canvas projection(grid.XDim(), grid.YDim(), 1);
+
+  double slice_seconds = 0, projection_seconds = 0;
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    renderer::RenderAllSlices(grid, renderer::Axis::kZ, 1, colors, [](int64_t offset, const simplebmp::Canvas& canvas) {
+      benchmark::DoNotOptimize(&canvas);
+    });
+    Clock::time_point sliced = Clock::now();
+    renderer::RenderMaxIntensity(grid, renderer::Axis::kZ, &projection,
+                                 [](const Voxel& voxel) { return voxel.type == kVoxelTypeExternal ? 0.0f : 1.0f; },
+                                 [](float value) { return simplebmp::Color4f(value, value, value, 1); });
+    Clock::time_point done = Clock::now();
+    slice_seconds += Seconds(start, sliced);
+    projection_seconds += Seconds(sliced, done);
+  }
+  double voxels = static_cast<double>(state.iterations()) * grid.XDim() * grid.YDim() * grid.ZDim();
+  state.counters["grid_voxels"] = grid.XDim() * grid.YDim() * grid.ZDim();
+  state.counters["slice_voxels_per_second"] = voxels / slice_seconds;
+  state.counters["projection_voxels_per_second"] = voxels / projection_seconds;
+}
+
+// Thread counts of the sweeps: powers of two up to the number of hardware threads, and that number itself.
+std::vector<int64_t> SweepThreads() {
+  int64_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int64_t> threads;
+  for (int64_t n = 1; n < hardware; n *= 2) {
+    threads.push_back(n);
+  }
+  threads.push_back(hardware);
+  return threads;
+}
+
+// The sweeps cover 1k to 1M triangles, 1 to 4 voxels per unit, so grids of about 24^3 to 84^3 voxels, and every
+// thread count. Their names and counters are fixed, so runs written with --benchmark_format=json or
+// --benchmark_out=<file> --benchmark_out_format=json can be compared from one commit to the next.
+void RegisterSyntheticBenchmarks() {
+  std::vector<int64_t> threads = SweepThreads();
+  benchmark::AddCustomContext("hardware_threads", std::to_string(threads.back()));
+  for (auto shape : {SyntheticShape::kSphere, SyntheticShape::kTorus, SyntheticShape::kCone}) {
+    std::vector<int64_t> triangles = {1 << 10, 1 << 14, 1 << 17, 1 << 20};
+    benchmark::RegisterBenchmark((std::string("BM_BuildSynthetic/") + SyntheticShapeName(shape)).c_str(),
+                                 BM_BuildSynthetic, shape)
+        ->ArgsProduct({triangles, {1, 2, 4}, threads})
+        ->ArgNames({"triangles", "voxels_per_unit", "threads"})
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+  }
+  benchmark::RegisterBenchmark("BM_BuildFromBmpSynthetic", BM_BuildFromBmpSynthetic)
+      ->ArgsProduct({{256, 1024, 4096}, threads})
+      ->ArgNames({"side", "threads"})
+      ->Unit(benchmark::kMillisecond)
+      ->UseRealTime();
+  benchmark::RegisterBenchmark("BM_RenderSynthetic", BM_RenderSynthetic)
+      ->ArgsProduct({{2, 4, 8}, threads})
+      ->ArgNames({"voxels_per_unit", "threads"})
+      ->Unit(benchmark::kMillisecond)
+      ->UseRealTime();
+}
+
+VOXEL_STL_BENCHMARKS(sphere);
+VOXEL_STL_BENCHMARKS(cone);
+VOXEL_STL_BENCHMARKS(hollow_cube);
+
+}
+}
+
+int main(int argc, char** argv) {
+  std::string error;
+  voxel::runfiles.reset(bazel::tools::cpp::runfiles::Runfiles::Create(argv[0], &error));
+  CHECK(voxel::runfiles != nullptr) << error;
+
+  voxel::RegisterSyntheticBenchmarks();
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
\ No newline at end of file
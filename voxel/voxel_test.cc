@@ -1,10 +1,37 @@
 #include "voxel/voxel.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
 #include <string>
+#include <vector>
 
+#include "voxel/assembly.h"
+#include "voxel/batch.h"
+#include "voxel/bit_grid.h"
+#include "voxel/brick_grid.h"
+#include "voxel/build_stats.h"
 #include "voxel/builder.h"
+#include "voxel/components.h"
+#include "voxel/distance.h"
+#include "voxel/grid_file.h"
+#include "voxel/incremental.h"
+#include "voxel/indexed_mesh.h"
 #include "voxel/renderer.h"
+#include "voxel/rle_grid.h"
+#include "voxel/scheduler.h"
+#include "voxel/slab.h"
 
 #include "gtest/gtest.h"
 #include "tools/cpp/runfiles/runfiles.h"
@@ -102,6 +129,16 @@ TEST(VoxelGrid2dTests, RenderTest) {
 
   simplebmp::Image actual(canvas);
   EXPECT_EQ(actual, reference);
+
+  // The same colors through a table, rendered in tiles.
+  renderer::TypeColors colors(white);
+  colors.Set(kVoxelTypeInternal, black);
+  for (int32_t type = kVoxelTypeBoundary; type < 2 * kVoxelTypeBoundary; type++) {
+    colors.Set(type, red);
+  }
+  simplebmp::Canvas tiled(grid.XDim(), grid.YDim(), 2);
+  renderer::Render(grid, &tiled, colors);
+  EXPECT_EQ(simplebmp::Image(tiled), reference);
 }
 
 simplebmp::Color4f RenderCallback(int64_t x, int64_t y, int64_t z, double step, const void* voxel) {
@@ -122,9 +159,9 @@ simplebmp::Color4f RenderCallback(int64_t x, int64_t y, int64_t z, double step,
   return blue;
 }
 
-void StlTestHelper(const std::string& prefix) {
+void StlTestHelper(const std::string& prefix, const builder::StlBuildOptions& options = {}) {
   VoxelGrid3d<TestVoxel> grid;
-  EXPECT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/" + prefix + ".stl"), &grid, 1.0));
+  EXPECT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/" + prefix + ".stl"), &grid, 1.0, options));
 
   {
     simplebmp::Canvas canvas_xy(grid.XDim(), grid.YDim(), 2);
@@ -160,6 +197,144 @@ void StlTestHelper(const std::string& prefix) {
   }
 }
 
+TEST(RendererTests, SlicesMatchCallbackRenderer) {
+  Scheduler scheduler(3);
+  VoxelGrid3d<TestVoxel> grid;
+  grid.SetScheduler(&scheduler);
+  ASSERT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/hollow_cube.stl"), &grid, 1.0));
+  // The colors of RenderCallback.
+  renderer::TypeColors colors(simplebmp::Color4f(0.0f, 0.0f, 1.0f, 1.0f));
+  colors.Set(kVoxelTypeInternal, simplebmp::Color4f());
+  colors.Set(kVoxelTypeExternal, simplebmp::Color4f(1.0f, 1.0f, 1.0f, 1.0f));
+  for (int32_t type = kVoxelTypeBoundary; type < 2 * kVoxelTypeBoundary; type++) {
+    colors.Set(type, simplebmp::Color4f(1.0f, 0.0f, 0.0f, 1.0f));
+  }
+
+  for (auto axis : {renderer::Axis::kX, renderer::Axis::kY, renderer::Axis::kZ}) {
+    SCOPED_TRACE(static_cast<int>(axis));
+    int64_t slices = 0;
+    renderer::RenderAllSlices(grid, axis, 2, colors, [&](int64_t offset, const simplebmp::Canvas& actual) {
+      EXPECT_EQ(offset, slices++);
+      std::unique_ptr<simplebmp::Canvas> expected;
+      if (axis == renderer::Axis::kX) {
+        expected = std::make_unique<simplebmp::Canvas>(grid.ZDim(), grid.YDim(), 2);
+        renderer::RenderSliceYZ(grid, offset, expected.get(), RenderCallback);
+      } else if (axis == renderer::Axis::kY) {
+        expected = std::make_unique<simplebmp::Canvas>(grid.XDim(), grid.ZDim(), 2);
+        renderer::RenderSliceXZ(grid, offset, expected.get(), RenderCallback);
+      } else {
+        expected = std::make_unique<simplebmp::Canvas>(grid.XDim(), grid.YDim(), 2);
+        renderer::RenderSliceXY(grid, offset, expected.get(), RenderCallback);
+      }
+      EXPECT_EQ(simplebmp::Image(*expected), simplebmp::Image(actual));
+    }, 5);
+    int64_t depth = axis == renderer::Axis::kX ? grid.XDim() : axis == renderer::Axis::kY ? grid.YDim() : grid.ZDim();
+    EXPECT_EQ(slices, depth);
+  }
+
+  simplebmp::Canvas expected(grid.XDim(), grid.ZDim(), 1);
+  renderer::RenderSliceXZ(grid, 7, &expected, RenderCallback);
+  simplebmp::Canvas actual(grid.XDim(), grid.ZDim(), 1);
+  renderer::RenderSlice(grid, renderer::Axis::kY, 7, &actual,
+                        [](const TestVoxel& voxel) { return RenderCallback(0, 0, 0, 1.0, &voxel); });
+  EXPECT_EQ(simplebmp::Image(expected), simplebmp::Image(actual));
+}
+
+TEST(RendererTests, Projections) {
+  Scheduler scheduler(3);
+  VoxelGrid3d<TestVoxel> grid;
+  grid.SetScheduler(&scheduler);
+  ASSERT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/cube_with_cutout.stl"), &grid, 1.0));
+  auto gray = [](float value) { return simplebmp::Color4f(value, value, value, 1.0f); };
+  // Intensity is the number of bits of the type, so that boundary voxels inside the solid stand out.
+  auto intensity = [](const TestVoxel& voxel) { return static_cast<float>(std::popcount(uint32_t(voxel.type))) / 4; };
+  auto solid = [](const TestVoxel& voxel) { return voxel.type != kVoxelTypeExternal; };
+  auto depth_color = [](int64_t depth) {
+    return simplebmp::Color4f(depth < 0 ? 1.0f : depth / 64.0f, 0.0f, 0.0f, 1.0f);
+  };
+
+  for (auto axis : {renderer::Axis::kX, renderer::Axis::kY, renderer::Axis::kZ}) {
+    SCOPED_TRACE(static_cast<int>(axis));
+    // Maps the pixel (u, v) and the offset d along the axis to the voxel, and the pixel to the canvas.
+    int64_t u_dim = axis == renderer::Axis::kX ? grid.YDim() : grid.XDim();
+    int64_t v_dim = axis == renderer::Axis::kZ ? grid.YDim() : grid.ZDim();
+    int64_t depth = axis == renderer::Axis::kX ? grid.XDim() : axis == renderer::Axis::kY ? grid.YDim() : grid.ZDim();
+    auto voxel = [&](int64_t u, int64_t v, int64_t d) -> const TestVoxel& {
+      return axis == renderer::Axis::kX ? *grid.At(d, u, v) : axis == renderer::Axis::kY ? *grid.At(u, d, v)
+                                                                                         : *grid.At(u, v, d);
+    };
+    auto make_canvas = [&] {
+      return axis == renderer::Axis::kX ? simplebmp::Canvas(v_dim, u_dim, 1) : simplebmp::Canvas(u_dim, v_dim, 1);
+    };
+    auto set = [&](simplebmp::Canvas* canvas, int64_t u, int64_t v, const simplebmp::Color4f& color) {
+      axis == renderer::Axis::kX ? canvas->Set(v, u, color) : canvas->Set(u, v, color);
+    };
+
+    simplebmp::Canvas expected_mip = make_canvas();
+    simplebmp::Canvas expected_depth = make_canvas();
+    for (int64_t v = 0; v < v_dim; v++) {
+      for (int64_t u = 0; u < u_dim; u++) {
+        float maximum = 0;
+        int64_t first = -1;
+        for (int64_t d = 0; d < depth; d++) {
+          maximum = std::max(maximum, intensity(voxel(u, v, d)));
+          if (first < 0 && solid(voxel(u, v, d))) {
+            first = d;
+          }
+        }
+        set(&expected_mip, u, v, gray(maximum));
+        set(&expected_depth, u, v, depth_color(first));
+      }
+    }
+
+    simplebmp::Canvas mip = make_canvas();
+    renderer::RenderMaxIntensity(grid, axis, &mip, intensity, gray);
+    EXPECT_EQ(simplebmp::Image(expected_mip), simplebmp::Image(mip));
+    simplebmp::Canvas depths = make_canvas();
+    renderer::RenderDepth(grid, axis, &depths, solid, depth_color);
+    EXPECT_EQ(simplebmp::Image(expected_depth), simplebmp::Image(depths));
+  }
+}
+
+const std::vector<std::string> kStlTestMeshes = {
+  "cube", "sphere", "cone", "cylinder", "cube_with_cutout", "hollow_cube", "pyramid",
+};
+
+template <typename Layout>
+void ExpectSameClassification(const VoxelGrid3d<TestVoxel>& expected, const VoxelGrid3d<TestVoxel, Layout>& actual) {
+  ASSERT_EQ(expected.XDim(), actual.XDim());
+  ASSERT_EQ(expected.YDim(), actual.YDim());
+  ASSERT_EQ(expected.ZDim(), actual.ZDim());
+  int64_t mismatches = 0;
+  for (int64_t x = 0; x < expected.XDim(); x++) {
+    for (int64_t y = 0; y < expected.YDim(); y++) {
+      for (int64_t z = 0; z < expected.ZDim(); z++) {
+        mismatches += expected.At(x, y, z)->type != actual.At(x, y, z)->type;
+      }
+    }
+  }
+  EXPECT_EQ(mismatches, 0);
+}
+
+// Builds a mesh with the default options once per test binary, as a reference for the other build modes.
+const VoxelGrid3d<TestVoxel>& ReferenceGrid(const std::string& prefix) {
+  static std::map<std::string, std::unique_ptr<VoxelGrid3d<TestVoxel>>> grids;
+  auto& grid = grids[prefix];
+  if (grid == nullptr) {
+    grid = std::make_unique<VoxelGrid3d<TestVoxel>>();
+    EXPECT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/" + prefix + ".stl"), grid.get(), 1.0));
+  }
+  return *grid;
+}
+
+// Builds a mesh with the specified options and checks that it agrees with the default options on every voxel.
+void StlParityHelper(const std::string& prefix, const builder::StlBuildOptions& options) {
+  SCOPED_TRACE(prefix);
+  VoxelGrid3d<TestVoxel> actual;
+  ASSERT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/" + prefix + ".stl"), &actual, 1.0, options));
+  ExpectSameClassification(ReferenceGrid(prefix), actual);
+}
+
 TEST(VoxelGrid3dTests, StlCube) {
   StlTestHelper("cube");
 }
@@ -188,5 +363,1641 @@ TEST(VoxelGrid3dTests, StlPyramid) {
   StlTestHelper("pyramid");
 }
 
+TEST(VoxelGrid3dTests, StlTriangleBins) {
+  builder::StlBuildOptions options;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  StlTestHelper("hollow_cube", options);
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+}
+
+TEST(VoxelGrid3dTests, StlColumnScanline) {
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  StlTestHelper("sphere", options);
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+}
+
+TEST(VoxelGrid3dTests, StlCoarseToFine) {
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kCoarseToFine;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  StlTestHelper("sphere", options);
+  for (int64_t cell_size : {1, 4, 16, 64}) {
+    SCOPED_TRACE(cell_size);
+    options.coarse_cell_size = cell_size;
+    for (const auto& prefix : kStlTestMeshes) {
+      StlParityHelper(prefix, options);
+    }
+  }
+}
+
+TEST(VoxelGrid3dTests, StlSurfaceFloodFill) {
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kSurfaceFloodFill;
+  for (const auto& prefix : kStlTestMeshes) {
+    SCOPED_TRACE(prefix);
+    const VoxelGrid3d<TestVoxel>& reference = ReferenceGrid(prefix);
+    VoxelGrid3d<TestVoxel> grid;
+    ASSERT_TRUE(voxel::builder::BuildFromStl(ResolvePath("__main__/voxel/testdata/" + prefix + ".stl"), &grid, 1.0, options));
+    ASSERT_EQ(grid.XDim(), reference.XDim());
+    ASSERT_EQ(grid.YDim(), reference.YDim());
+    ASSERT_EQ(grid.ZDim(), reference.ZDim());
+
+    // The conservative surface may only grow the solid, and the only voxels it can add are boundary voxels. The
+    // cavity of the hollow cube is sealed, so it is filled in.
+    int64_t mismatches = 0;
+    for (int64_t x = 0; x < grid.XDim(); x++) {
+      for (int64_t y = 0; y < grid.YDim(); y++) {
+        for (int64_t z = 0; z < grid.ZDim(); z++) {
+          int32_t expected = reference.At(x, y, z)->type;
+          int32_t actual = grid.At(x, y, z)->type;
+          EXPECT_NE(actual, kVoxelTypeUndefined);
+          if (expected == kVoxelTypeExternal && actual != kVoxelTypeExternal) {
+            mismatches += actual != (kVoxelTypeInternal | kVoxelTypeBoundary) && prefix != "hollow_cube";
+          } else if (expected != kVoxelTypeExternal) {
+            mismatches += (actual & kVoxelTypeInternal) == 0;
+          }
+        }
+      }
+    }
+    EXPECT_EQ(mismatches, 0);
+
+    // The padding is always external.
+    EXPECT_EQ(grid.At(0, 0, 0)->type, kVoxelTypeExternal);
+    EXPECT_EQ(grid.At(grid.XDim() - 1, grid.YDim() - 1, grid.ZDim() - 1)->type, kVoxelTypeExternal);
+  }
+}
+
+TEST(VoxelGrid3dTests, TriangleOverlapsBox) {
+  libmath::Triangle triangle(libmath::Point(0, 0, 0), libmath::Point(4, 0, 0), libmath::Point(0, 4, 0));
+  EXPECT_TRUE(builder::internal::TriangleOverlapsBox(triangle, {0.5, 0.5, 0.5}, 0.5));
+  EXPECT_TRUE(builder::internal::TriangleOverlapsBox(triangle, {1.5, 1.5, -0.4}, 0.5));
+  EXPECT_FALSE(builder::internal::TriangleOverlapsBox(triangle, {1.5, 1.5, 0.6}, 0.5));
+  // Within the bounding box of the triangle, but on the far side of the hypotenuse.
+  EXPECT_FALSE(builder::internal::TriangleOverlapsBox(triangle, {3.5, 3.5, 0}, 0.5));
+  EXPECT_TRUE(builder::internal::TriangleOverlapsBox(triangle, {2.4, 2.4, 0}, 0.5));
+}
+
+TEST(VoxelGrid3dTests, StlBatchedRayTriangleTest) {
+  builder::StlBuildOptions options;
+  options.ray_triangle_test = builder::RayTriangleTest::kBatched;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  StlTestHelper("cone", options);
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+
+  options.classification = builder::Classification::kColumnScanline;
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+}
+
+TEST(VoxelGrid3dTests, StlProjectedRayTriangleTest) {
+  builder::StlBuildOptions options;
+  options.ray_triangle_test = builder::RayTriangleTest::kProjected;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  StlTestHelper("pyramid", options);
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+
+  options.classification = builder::Classification::kColumnScanline;
+  for (const auto& prefix : kStlTestMeshes) {
+    StlParityHelper(prefix, options);
+  }
+}
+
+template <typename Layout>
+void ExpectLayoutMatchesLinear() {
+  Scheduler scheduler(3);
+  std::filesystem::path stl = ResolvePath("__main__/voxel/testdata/cube_with_cutout.stl");
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  VoxelGrid3d<TestVoxel> expected;
+  expected.SetScheduler(&scheduler);
+  ASSERT_TRUE(builder::BuildFromStl(stl, &expected, 1.0, options));
+  VoxelGrid3d<TestVoxel, Layout> grid;
+  grid.SetScheduler(&scheduler);
+  ASSERT_TRUE(builder::BuildFromStl(stl, &grid, 1.0, options));
+  ExpectSameClassification(expected, grid);
+
+  // Every voxel has its own storage, and its neighbors are the same voxels as in the linear grid.
+  std::vector<int64_t> indices;
+  int64_t neighbor_mismatches = 0;
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        int64_t index = grid.GetLayout().Index(x, y, z);
+        ASSERT_LT(index, grid.GetLayout().Size());
+        indices.push_back(index);
+        auto actual = grid.D3Q27(x, y, z);
+        auto linear = expected.D3Q27(x, y, z);
+        for (int i = 0; i < 27; i++) {
+          neighbor_mismatches += (actual[i] == nullptr) != (linear[i] == nullptr) ||
+                                 (actual[i] != nullptr && actual[i]->type != linear[i]->type);
+        }
+      }
+    }
+  }
+  std::sort(indices.begin(), indices.end());
+  EXPECT_EQ(std::adjacent_find(indices.begin(), indices.end()), indices.end());
+  EXPECT_EQ(neighbor_mismatches, 0);
+
+  // Tiled iteration covers a box that does not start or end on tile boundaries exactly once.
+  std::vector<std::atomic<int>> visits(grid.XDim() * grid.YDim() * grid.ZDim());
+  grid.ForEachXYZ(1, grid.XDim() - 2, 3, grid.YDim(), 2, grid.ZDim() - 5, [&](int64_t x, int64_t y, int64_t z) {
+    visits[(z * grid.YDim() + y) * grid.XDim() + x]++;
+  });
+  int64_t wrong = 0;
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        bool inside = x >= 1 && x < grid.XDim() - 2 && y >= 3 && z >= 2 && z < grid.ZDim() - 5;
+        wrong += visits[(z * grid.YDim() + y) * grid.XDim() + x] != (inside ? 1 : 0);
+      }
+    }
+  }
+  EXPECT_EQ(wrong, 0);
+
+  auto color = [](const TestVoxel& voxel) { return RenderCallback(0, 0, 0, 1.0, &voxel); };
+  simplebmp::Canvas linear_slice(expected.ZDim(), expected.YDim(), 1);
+  renderer::RenderSlice(expected, renderer::Axis::kX, 6, &linear_slice, color);
+  simplebmp::Canvas slice(grid.ZDim(), grid.YDim(), 1);
+  renderer::RenderSlice(grid, renderer::Axis::kX, 6, &slice, color);
+  EXPECT_EQ(simplebmp::Image(linear_slice), simplebmp::Image(slice));
+}
+
+TEST(VoxelGrid3dTests, Tiled4Layout) {
+  ExpectLayoutMatchesLinear<Tiled4Layout>();
+}
+
+TEST(VoxelGrid3dTests, Tiled8Layout) {
+  ExpectLayoutMatchesLinear<Tiled8Layout>();
+}
+
+TEST(VoxelGrid3dTests, MortonLayout) {
+  ExpectLayoutMatchesLinear<MortonLayout>();
+}
+
+TEST(VoxelGrid3dTests, FirstTouchAllocation) {
+  Scheduler scheduler(3);
+  std::filesystem::path stl = ResolvePath("__main__/voxel/testdata/cube_with_cutout.stl");
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  VoxelGrid3d<TestVoxel> expected;
+  ASSERT_TRUE(builder::BuildFromStl(stl, &expected, 1.0, options));
+
+  for (HugePages huge_pages : {HugePages::kNone, HugePages::kTransparent, HugePages::kExplicit}) {
+    SCOPED_TRACE(static_cast<int>(huge_pages));
+    VoxelGrid3d<TestVoxel> grid;
+    grid.SetScheduler(&scheduler);
+    grid.SetAllocation(Allocation::kFirstTouch, huge_pages);
+    grid.Init(17, 9, 23, 1.0);
+    std::atomic<int64_t> undefined = 0;
+    grid.ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+      undefined += grid.At(x, y, z)->type == kVoxelTypeUndefined;
+    });
+    EXPECT_EQ(undefined, 17 * 9 * 23);
+
+    ASSERT_TRUE(builder::BuildFromStl(stl, &grid, 1.0, options));
+    EXPECT_EQ(grid.GetAllocation(), Allocation::kFirstTouch);
+    ExpectSameClassification(expected, grid);
+
+    // Building again reuses the storage.
+    const TestVoxel* first = grid.At(0, 0, 0);
+    ASSERT_TRUE(builder::BuildFromStl(stl, &grid, 1.0, options));
+    EXPECT_EQ(grid.At(0, 0, 0), first);
+    ExpectSameClassification(expected, grid);
+  }
+
+  VoxelGrid3d<TestVoxel, Tiled8Layout> tiled;
+  tiled.SetScheduler(&scheduler);
+  tiled.SetAllocation(Allocation::kFirstTouch);
+  ASSERT_TRUE(builder::BuildFromStl(stl, &tiled, 1.0, options));
+  ExpectSameClassification(expected, tiled);
+
+  VoxelGrid2d<TestVoxel> expected_2d;
+  ASSERT_TRUE(builder::BuildFromBmp(ResolvePath("__main__/voxel/testdata/test.bmp"), 1.0, &expected_2d));
+  VoxelGrid2d<TestVoxel> grid_2d;
+  grid_2d.SetScheduler(&scheduler);
+  grid_2d.SetAllocation(Allocation::kFirstTouch, HugePages::kTransparent);
+  ASSERT_TRUE(builder::BuildFromBmp(ResolvePath("__main__/voxel/testdata/test.bmp"), 1.0, &grid_2d));
+  int64_t mismatches = 0;
+  for (int64_t y = 0; y < grid_2d.YDim(); y++) {
+    for (int64_t x = 0; x < grid_2d.XDim(); x++) {
+      mismatches += grid_2d.At(x, y)->type != expected_2d.At(x, y)->type;
+    }
+  }
+  EXPECT_EQ(mismatches, 0);
+}
+
+TEST(VoxelGrid3dTests, ForEach) {
+  VoxelGrid3d<TestVoxel> grid;
+  grid.Init(6, 5, 4, 1.0);
+  grid.ForEachXYZ([&](int64_t x, int64_t y, int64_t z) { grid.At(x, y, z)->type = kVoxelTypeExternal; });
+  grid.ForEachXYZ(1, 3, 2, 5, 0, 2, [&](int64_t x, int64_t y, int64_t z) {
+    grid.At(x, y, z)->type |= kVoxelTypeBoundary;
+  });
+  std::atomic<int64_t> columns = 0;
+  grid.ForEachXY(0, 6, 1, 2, [&](int64_t x, int64_t y) { columns++; });
+  EXPECT_EQ(columns, 6);
+
+  int64_t marked = 0;
+  for (int64_t x = 0; x < 6; x++) {
+    for (int64_t y = 0; y < 5; y++) {
+      for (int64_t z = 0; z < 4; z++) {
+        bool in_range = x >= 1 && x < 3 && y >= 2 && z < 2;
+        EXPECT_EQ(grid.At(x, y, z)->type, in_range ? kVoxelTypeExternal | kVoxelTypeBoundary : kVoxelTypeExternal);
+        marked += in_range;
+      }
+    }
+  }
+  EXPECT_EQ(marked, 2 * 3 * 2);
+}
+
+TEST(VoxelGrid3dTests, GrainSizes) {
+  for (int64_t grain : {0, 1, 7, 1000}) {
+    VoxelGrid3d<TestVoxel> grid;
+    grid.Init(9, 5, 3, 1.0);
+    grid.SetGrainSize(grain);
+    // Each column's callback runs before the per voxel callbacks of the same column.
+    grid.AddForeachXYCallback([&](void* data, int64_t x, int64_t y) { grid.At(x, y, 0)->type = kVoxelTypeExternal; });
+    grid.AddForeachXYZCallback([&](void* data, int64_t x, int64_t y, int64_t z) {
+      grid.At(x, y, z)->type |= grid.At(x, y, 0)->type << 1;
+    });
+    grid.RunSync(true);
+    for (int64_t x = 0; x < 9; x++) {
+      for (int64_t y = 0; y < 5; y++) {
+        for (int64_t z = 0; z < 3; z++) {
+          EXPECT_EQ(grid.At(x, y, z)->type & kVoxelTypeInternal, kVoxelTypeInternal) << "grain " << grain;
+        }
+      }
+    }
+
+    std::atomic<int64_t> visits = 0;
+    grid.ForEachXYZ(1, 8, 0, 5, 1, 3, [&](int64_t x, int64_t y, int64_t z) { visits++; });
+    EXPECT_EQ(visits, 7 * 5 * 2) << "grain " << grain;
+  }
+}
+
+TEST(SchedulerTests, ParallelForCoversRange) {
+  Scheduler scheduler(3);
+  for (int64_t grain : {1, 5, 64, 1000}) {
+    std::vector<std::atomic<int>> hits(333);
+    scheduler.ParallelFor(hits.size(), grain, [&](int64_t begin, int64_t end) {
+      EXPECT_LE(end - begin, grain);
+      for (int64_t i = begin; i < end; i++) {
+        hits[i]++;
+      }
+    });
+    for (const auto& hit : hits) {
+      EXPECT_EQ(hit, 1) << "grain " << grain;
+    }
+  }
+  scheduler.ParallelFor(0, 1, [](int64_t begin, int64_t end) { FAIL(); });
+}
+
+TEST(SchedulerTests, NestedBatches) {
+  // Batches submitted from inside a chunk complete even when every worker is waiting on one.
+  Scheduler scheduler(2);
+  std::atomic<int64_t> sum = 0;
+  scheduler.ParallelFor(16, 1, [&](int64_t begin, int64_t end) {
+    scheduler.ParallelFor(100, 10, [&](int64_t inner_begin, int64_t inner_end) {
+      for (int64_t i = inner_begin; i < inner_end; i++) {
+        sum += i;
+      }
+    });
+  });
+  EXPECT_EQ(sum, 16 * 4950);
+}
+
+TEST(SchedulerTests, TilingCoversColumns) {
+  for (int64_t columns : {1, 2, 6, 50, 1000}) {
+    Tiling tiling = Tiling::Make(2, 13, 1, 8, columns);
+    std::vector<int> hits(13 * 8);
+    for (int64_t tile = 0; tile < tiling.Count(); tile++) {
+      tiling.ForEachColumn(tile, [&](int64_t x, int64_t y) { hits[y * 13 + x]++; });
+    }
+    for (int64_t x = 0; x < 13; x++) {
+      for (int64_t y = 0; y < 8; y++) {
+        EXPECT_EQ(hits[y * 13 + x], x >= 2 && y >= 1 ? 1 : 0) << "columns " << columns;
+      }
+    }
+  }
+  EXPECT_EQ(Tiling::Make(0, 0, 0, 5, 4).Count(), 0);
+}
+
+TEST(VoxelGrid3dTests, StlSlabs) {
+  builder::StlBuildOptions options;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  for (auto classification : {builder::Classification::kSixRayVote, builder::Classification::kColumnScanline}) {
+    options.classification = classification;
+    for (const auto& prefix : {"sphere", "hollow_cube", "cube_with_cutout"}) {
+      SCOPED_TRACE(prefix);
+      std::filesystem::path path = ResolvePath("__main__/voxel/testdata/" + std::string(prefix) + ".stl");
+      VoxelGrid3d<TestVoxel> expected;
+      ASSERT_TRUE(voxel::builder::BuildFromStl(path, &expected, 1.0, options));
+
+      for (int64_t slab_depth : {1, 2, 7, 1000}) {
+        SCOPED_TRACE(slab_depth);
+        VoxelGrid3d<TestVoxel> actual;
+        actual.Init(expected.XDim(), expected.YDim(), expected.ZDim(), 1.0);
+        int64_t next_z = 0;
+        ASSERT_TRUE(voxel::builder::BuildSlabsFromStl<TestVoxel>(path, 1.0, slab_depth, options,
+                                                                 [&](const VoxelSlab<TestVoxel>& slab) {
+          EXPECT_EQ(slab.ZBegin(), next_z);
+          EXPECT_LE(slab.ZEnd() - slab.ZBegin(), slab_depth);
+          next_z = slab.ZEnd();
+          for (int64_t x = 0; x < slab.XDim(); x++) {
+            for (int64_t y = 0; y < slab.YDim(); y++) {
+              for (int64_t z = slab.ZBegin(); z < slab.ZEnd(); z++) {
+                *actual.At(x, y, z) = *slab.At(x, y, z);
+              }
+            }
+          }
+          return true;
+        }));
+        EXPECT_EQ(next_z, expected.ZDim());
+        ExpectSameClassification(expected, actual);
+      }
+    }
+  }
+
+  options.classification = builder::Classification::kSurfaceFloodFill;
+  EXPECT_FALSE(voxel::builder::BuildSlabsFromStl<TestVoxel>(ResolvePath("__main__/voxel/testdata/cube.stl"), 1.0, 4,
+                                                            options, [](const VoxelSlab<TestVoxel>& slab) {
+    return true;
+  }));
+}
+
+TEST(VoxelGrid3dTests, StlSlabFile) {
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  std::filesystem::path path = ResolvePath("__main__/voxel/testdata/cone.stl");
+  std::filesystem::path file = std::filesystem::temp_directory_path().append("cone_slabs.bin");
+  SlabFileWriter writer(file);
+  int64_t slabs = 0;
+  ASSERT_TRUE(voxel::builder::BuildSlabsFromStl<TestVoxel>(path, 1.0, 5, options,
+                                                           [&](const VoxelSlab<TestVoxel>& slab) {
+    slabs++;
+    return writer.Write(slab);
+  }));
+  ASSERT_TRUE(writer.Close());
+
+  VoxelGrid3d<TestVoxel> expected;
+  ASSERT_TRUE(voxel::builder::BuildFromStl(path, &expected, 1.0, options));
+  EXPECT_EQ(slabs, (expected.ZDim() + 4) / 5);
+  VoxelGrid3d<TestVoxel> actual;
+  ASSERT_TRUE(ReadSlabFile(file, &actual));
+  ExpectSameClassification(expected, actual);
+
+  // A sink returning false stops the build.
+  slabs = 0;
+  EXPECT_FALSE(voxel::builder::BuildSlabsFromStl<TestVoxel>(path, 1.0, 5, options,
+                                                            [&](const VoxelSlab<TestVoxel>& slab) {
+    return ++slabs < 2;
+  }));
+  EXPECT_EQ(slabs, 2);
+}
+
+TEST(GridFileTests, MappedVoxelGrid3d) {
+  const VoxelGrid3d<TestVoxel>& grid = ReferenceGrid("cube_with_cutout");
+  std::filesystem::path file = std::filesystem::temp_directory_path().append("cube_with_cutout.grid");
+  ASSERT_TRUE(WriteGridFile(grid, file));
+  EXPECT_EQ(std::filesystem::file_size(file),
+            kGridFileAlignment + grid.XDim() * grid.YDim() * grid.ZDim() * sizeof(TestVoxel));
+
+  MappedVoxelGrid3d<TestVoxel> mapped;
+  ASSERT_TRUE(mapped.Open(file));
+  ASSERT_EQ(mapped.XDim(), grid.XDim());
+  ASSERT_EQ(mapped.YDim(), grid.YDim());
+  ASSERT_EQ(mapped.ZDim(), grid.ZDim());
+  EXPECT_EQ(mapped.Step(), grid.Step());
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(mapped.At(0, 0, 0)) % kGridFileAlignment, 0);
+
+  VoxelGrid3d<TestVoxel> copy;
+  copy.Init(grid.XDim(), grid.YDim(), grid.ZDim(), grid.Step());
+  int64_t mismatches = 0;
+  for (int64_t x = 0; x < grid.XDim(); x++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t z = 0; z < grid.ZDim(); z++) {
+        copy.At(x, y, z)->type = mapped.At(x, y, z)->type;
+        mismatches += mapped.At(x, y, z)->type != grid.At(x, y, z)->type;
+      }
+    }
+  }
+  EXPECT_EQ(mismatches, 0);
+
+  // The neighbors are in the same order as the ones of VoxelGrid3d.
+  for (auto [x, y, z] : {std::array<int64_t, 3>{0, 0, 0}, {3, 4, 5}, {grid.XDim() - 1, 2, grid.ZDim() - 1}}) {
+    auto expected = copy.D3Q27(x, y, z);
+    auto actual = mapped.D3Q27(x, y, z);
+    for (int i = 0; i < 27; i++) {
+      ASSERT_EQ(expected[i] == nullptr, actual[i] == nullptr) << i;
+      if (expected[i] != nullptr) {
+        EXPECT_EQ(expected[i]->type, actual[i]->type) << i;
+      }
+    }
+  }
+
+  // Files of another rank, voxel size or version are rejected.
+  EXPECT_FALSE(MappedVoxelGrid2d<TestVoxel>().Open(file));
+  struct WideVoxel : Voxel {
+    int64_t extra;
+  };
+  EXPECT_FALSE(MappedVoxelGrid3d<WideVoxel>().Open(file));
+  std::filesystem::path truncated = std::filesystem::temp_directory_path().append("truncated.grid");
+  std::filesystem::copy_file(file, truncated, std::filesystem::copy_options::overwrite_existing);
+  std::filesystem::resize_file(truncated, std::filesystem::file_size(file) - 1);
+  EXPECT_FALSE(MappedVoxelGrid3d<TestVoxel>().Open(truncated));
+  EXPECT_FALSE(MappedVoxelGrid3d<TestVoxel>().Open("/foo/bar.grid"));
+
+  // So are dimensions whose voxel count wraps around to the payload size, and such grids are never written.
+  GridFileHeader header;
+  EXPECT_FALSE(internal::MakeGridFileHeader(3, int64_t{1} << 32, int64_t{1} << 32, 1, 1.0, sizeof(TestVoxel), &header));
+  ASSERT_TRUE(internal::MakeGridFileHeader(3, 1, 1, 1, 1.0, sizeof(TestVoxel), &header));
+  header.x_dim = int64_t{1} << 32;
+  header.y_dim = int64_t{1} << 32;
+  header.payload_size = 0;
+  std::filesystem::path wrapped = std::filesystem::temp_directory_path().append("wrapped.grid");
+  {
+    std::ofstream out(wrapped, std::ios::binary | std::ios::trunc);
+    ASSERT_TRUE(internal::WriteGridFileHeader(out, header));
+  }
+  EXPECT_FALSE(MappedVoxelGrid3d<TestVoxel>().Open(wrapped));
+}
+
+TEST(GridFileTests, MappedVoxelGrid2d) {
+  VoxelGrid2d<TestVoxel> grid;
+  ASSERT_TRUE(voxel::builder::BuildFromBmp(ResolvePath("__main__/voxel/testdata/test.bmp"), 1.0, &grid));
+  std::filesystem::path file = std::filesystem::temp_directory_path().append("test_bmp.grid");
+  ASSERT_TRUE(WriteGridFile(grid, file));
+
+  MappedVoxelGrid2d<TestVoxel> mapped;
+  ASSERT_TRUE(mapped.Open(file));
+  ASSERT_EQ(mapped.XDim(), grid.XDim());
+  ASSERT_EQ(mapped.YDim(), grid.YDim());
+  for (int64_t x = 0; x < grid.XDim(); x++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      EXPECT_EQ(mapped.At(x, y)->type, grid.At(x, y)->type);
+      auto expected = grid.D2Q9(x, y);
+      auto actual = mapped.D2Q9(x, y);
+      for (int i = 0; i < 9; i++) {
+        ASSERT_EQ(expected[i] == nullptr, actual[i] == nullptr);
+        if (expected[i] != nullptr) {
+          EXPECT_EQ(expected[i]->type, actual[i]->type);
+        }
+      }
+    }
+  }
+  EXPECT_FALSE(MappedVoxelGrid3d<TestVoxel>().Open(file));
+}
+
+TEST(RleGrid3dTests, MatchesVoxelGrid) {
+  for (const auto& prefix : kStlTestMeshes) {
+    SCOPED_TRACE(prefix);
+    const VoxelGrid3d<TestVoxel>& grid = ReferenceGrid(prefix);
+    RleGrid3d<TestVoxel> rle;
+    rle.Encode(grid);
+    ASSERT_EQ(rle.XDim(), grid.XDim());
+    ASSERT_EQ(rle.YDim(), grid.YDim());
+    ASSERT_EQ(rle.ZDim(), grid.ZDim());
+    EXPECT_LT(rle.CompressedBytes() * 2, grid.XDim() * grid.YDim() * grid.ZDim() * sizeof(TestVoxel));
+
+    int64_t mismatches = 0;
+    std::vector<TestVoxel> column(grid.ZDim());
+    for (int64_t x = 0; x < grid.XDim(); x++) {
+      for (int64_t y = 0; y < grid.YDim(); y++) {
+        rle.DecodeColumn(x, y, column);
+        for (int64_t z = 0; z < grid.ZDim(); z++) {
+          mismatches += rle.At(x, y, z)->type != grid.At(x, y, z)->type;
+          mismatches += column[z].type != grid.At(x, y, z)->type;
+        }
+      }
+    }
+    EXPECT_EQ(mismatches, 0);
+
+    VoxelGrid3d<TestVoxel> decoded;
+    rle.Decode(&decoded);
+    ExpectSameClassification(grid, decoded);
+
+    auto neighbors = rle.D3Q27(0, 1, 2);
+    EXPECT_EQ(std::count(neighbors.begin(), neighbors.end(), nullptr), 9);
+  }
+}
+
+TEST(RleGrid3dTests, File) {
+  const VoxelGrid3d<TestVoxel>& grid = ReferenceGrid("hollow_cube");
+  RleGrid3d<TestVoxel> rle;
+  rle.Encode(grid, [](const TestVoxel& a, const TestVoxel& b) { return a.type == b.type; });
+  // The padding columns are a single external run.
+  EXPECT_EQ(rle.Runs(0, 0), 1);
+
+  std::filesystem::path file = std::filesystem::temp_directory_path().append("hollow_cube.rle");
+  ASSERT_TRUE(rle.Write(file));
+  RleGrid3d<TestVoxel> read;
+  ASSERT_TRUE(read.Read(file));
+  EXPECT_EQ(read.Runs(), rle.Runs());
+  EXPECT_EQ(read.Step(), rle.Step());
+  VoxelGrid3d<TestVoxel> decoded;
+  read.Decode(&decoded);
+  ExpectSameClassification(grid, decoded);
+
+  // Failed reads leave the grid as it was, and a header asking for more runs than voxels is rejected before anything
+  // is allocated.
+  {
+    std::fstream patch(file, std::ios::binary | std::ios::in | std::ios::out);
+    uint64_t runs = std::numeric_limits<uint64_t>::max() / 4;
+    patch.seekp(48);
+    patch.write(reinterpret_cast<const char*>(&runs), sizeof(runs));
+  }
+  EXPECT_FALSE(read.Read(file));
+  ASSERT_TRUE(rle.Write(file));
+  std::filesystem::resize_file(file, std::filesystem::file_size(file) - 1);
+  EXPECT_FALSE(read.Read(file));
+  EXPECT_FALSE(read.Read("/foo/bar.rle"));
+  EXPECT_EQ(read.Runs(), rle.Runs());
+  read.Decode(&decoded);
+  ExpectSameClassification(grid, decoded);
+}
+
+TEST(RleGrid3dTests, ToleranceAgainstFirstVoxelOfRun) {
+  VoxelGrid3d<TestVoxel> grid;
+  grid.Init(2, 3, 10, 1.0);
+  for (int64_t x = 0; x < 2; x++) {
+    for (int64_t y = 0; y < 3; y++) {
+      for (int64_t z = 0; z < 10; z++) {
+        grid.At(x, y, z)->val_ = z;
+      }
+    }
+  }
+
+  // Every step is within the tolerance, so comparing neighbors would merge each column into a single run.
+  RleGrid3d<TestVoxel> rle;
+  rle.Encode(grid, [](const TestVoxel& a, const TestVoxel& b) { return std::abs(a.val_ - b.val_) <= 2; });
+  EXPECT_EQ(rle.Runs(), 2 * 3 * 4);
+  std::vector<TestVoxel> column(10);
+  rle.DecodeColumn(1, 2, column);
+  for (int64_t z = 0; z < 10; z++) {
+    EXPECT_EQ(column[z].val_, z / 3 * 3) << z;
+    EXPECT_EQ(rle.At(1, 2, z)->val_, z / 3 * 3) << z;
+  }
+}
+
+TEST(IncrementalStlBuilderTests, MatchesFullBuild) {
+  std::filesystem::path sphere_path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  std::vector<libmath::Triangle> cube;
+  ASSERT_TRUE(simplestl::StlReader(ResolvePath("__main__/voxel/testdata/cube.stl")).Read(&cube));
+
+  // Edits are rounded to single precision, so that the edited mesh survives a round trip through a stl file.
+  auto to_float = [](builder::MeshDelta delta) {
+    for (auto& triangle : delta.added) {
+      for (auto& v : triangle.vertices) {
+        v = libmath::Point(static_cast<float>(v.x), static_cast<float>(v.y), static_cast<float>(v.z));
+      }
+    }
+    return delta;
+  };
+
+  // A small cube in a corner of the sphere's bounding box.
+  builder::MeshDelta add_cube;
+  for (auto triangle : cube) {
+    for (auto& v : triangle.vertices) {
+      v = libmath::Point(v.x * 0.2 + 0.3, v.y * 0.2 + 0.3, v.z * 0.2 + 0.3);
+    }
+    add_cube.added.push_back(triangle);
+  }
+  add_cube = to_float(add_cube);
+
+  builder::StlBuildOptions options;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  for (auto classification : {builder::Classification::kSixRayVote, builder::Classification::kColumnScanline}) {
+    options.classification = classification;
+    builder::IncrementalStlBuilder<TestVoxel> incremental;
+    VoxelGrid3d<TestVoxel> grid;
+    ASSERT_TRUE(incremental.Build(sphere_path, 1.0, options, &grid));
+    std::vector<libmath::Triangle> sphere = incremental.Triangles();
+    int64_t voxels = grid.XDim() * grid.YDim() * grid.ZDim();
+    EXPECT_EQ(incremental.LastReclassified(), voxels);
+
+    auto expect_full_build = [&]() {
+      builder::internal::StlMesh mesh;
+      std::vector<libmath::Triangle> triangles = incremental.Triangles();
+      builder::internal::BuildStlMesh(triangles, 1.0, options, &mesh);
+      VoxelGrid3d<TestVoxel> expected;
+      builder::internal::Voxelize(mesh, 1.0, options, &expected);
+      ExpectSameClassification(expected, grid);
+    };
+    // As long as the sphere keeps the mesh at the origin, the grid also matches BuildFromStl of the edited file.
+    auto expect_file_build = [&]() {
+      std::filesystem::path edited = std::filesystem::temp_directory_path().append("edited_sphere.stl");
+      {
+        std::ofstream out(edited);
+        out << "solid edited\n";
+        for (const auto& triangle : incremental.Triangles()) {
+          out << "  facet normal 0 0 +1\n    outer loop\n";
+          for (const auto& v : triangle.vertices) {
+            out << "      vertex " << std::setprecision(9) << v.x << " " << v.y << " " << v.z << "\n";
+          }
+          out << "    endloop\n  endfacet\n";
+        }
+        out << "endsolid edited\n";
+      }
+      VoxelGrid3d<TestVoxel> expected;
+      ASSERT_TRUE(builder::BuildFromStl(edited, &expected, 1.0, options));
+      ExpectSameClassification(expected, grid);
+    };
+
+    ASSERT_TRUE(incremental.Apply(add_cube, &grid));
+    EXPECT_GT(incremental.LastReclassified(), 0);
+    EXPECT_LT(incremental.LastReclassified(), voxels);
+    EXPECT_EQ(incremental.Triangles().size(), sphere.size() + cube.size());
+    expect_full_build();
+    expect_file_build();
+
+    // Move the small cube along the diagonal.
+    std::span<const libmath::Triangle> moved(incremental.Triangles().end() - cube.size(),
+                                             incremental.Triangles().end());
+    ASSERT_TRUE(incremental.Apply(to_float(builder::MeshDelta::RigidTransform(
+                                      moved, {1, 0, 0, 0, 1, 0, 0, 0, 1}, libmath::Point(0.1, 0.1, 0.1))),
+                                  &grid));
+    EXPECT_LT(incremental.LastReclassified(), voxels);
+    expect_full_build();
+    expect_file_build();
+
+    // A triangle that is not in the mesh leaves everything as it was.
+    builder::MeshDelta missing;
+    missing.removed.push_back(add_cube.added.front());
+    EXPECT_FALSE(incremental.Apply(missing, &grid));
+    EXPECT_EQ(incremental.Triangles().size(), sphere.size() + cube.size());
+    expect_full_build();
+
+    // Removing the whole sphere shrinks the grid, so it is rebuilt in full.
+    builder::MeshDelta remove_sphere;
+    remove_sphere.removed = sphere;
+    ASSERT_TRUE(incremental.Apply(remove_sphere, &grid));
+    EXPECT_EQ(incremental.LastReclassified(), grid.XDim() * grid.YDim() * grid.ZDim());
+    EXPECT_LT(grid.XDim() * grid.YDim() * grid.ZDim(), voxels);
+    expect_full_build();
+  }
+}
+
+TEST(DistanceTests, SignedDistance3d) {
+  const VoxelGrid3d<TestVoxel>& grid = ReferenceGrid("cube_with_cutout");
+  std::vector<std::array<int64_t, 3>> seeds;
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        if (grid.At(x, y, z)->type & kVoxelTypeBoundary) {
+          seeds.push_back({x, y, z});
+        }
+      }
+    }
+  }
+  ASSERT_FALSE(seeds.empty());
+
+  std::vector<float> distances(grid.XDim() * grid.YDim() * grid.ZDim());
+  ComputeSignedDistance(grid, distances);
+  int64_t mismatches = 0;
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        int64_t nearest = std::numeric_limits<int64_t>::max();
+        for (const auto& seed : seeds) {
+          int64_t dx = x - seed[0], dy = y - seed[1], dz = z - seed[2];
+          nearest = std::min(nearest, dx * dx + dy * dy + dz * dz);
+        }
+        float expected = std::sqrt(static_cast<float>(nearest)) * static_cast<float>(grid.Step());
+        if (grid.At(x, y, z)->type & kVoxelTypeInternal) {
+          expected = -expected;
+        }
+        mismatches += std::fabs(distances[(z * grid.YDim() + y) * grid.XDim() + x] - expected) > 1e-5;
+      }
+    }
+  }
+  EXPECT_EQ(mismatches, 0);
+
+  // The same distances, stored in the voxels of a copy of the grid.
+  struct DistanceVoxel : Voxel {
+    float distance = 0;
+  };
+  VoxelGrid3d<DistanceVoxel> field;
+  field.Init(grid.XDim(), grid.YDim(), grid.ZDim(), grid.Step());
+  ComputeSignedDistance(grid, &field, &DistanceVoxel::distance);
+  EXPECT_EQ(field.At(3, 4, 5)->distance, distances[(5 * grid.YDim() + 4) * grid.XDim() + 3]);
+}
+
+TEST(DistanceTests, SignedDistance2d) {
+  VoxelGrid2d<TestVoxel> grid;
+  ASSERT_TRUE(voxel::builder::BuildFromBmp(ResolvePath("__main__/voxel/testdata/test.bmp"), 0.5, &grid));
+  std::vector<float> distances(grid.XDim() * grid.YDim());
+  ComputeSignedDistance(grid, distances);
+
+  int64_t mismatches = 0;
+  for (int64_t y = 0; y < grid.YDim(); y++) {
+    for (int64_t x = 0; x < grid.XDim(); x++) {
+      int64_t nearest = std::numeric_limits<int64_t>::max();
+      for (int64_t sy = 0; sy < grid.YDim(); sy++) {
+        for (int64_t sx = 0; sx < grid.XDim(); sx++) {
+          if (grid.At(sx, sy)->type & kVoxelTypeBoundary) {
+            nearest = std::min(nearest, (x - sx) * (x - sx) + (y - sy) * (y - sy));
+          }
+        }
+      }
+      float expected = std::sqrt(static_cast<float>(nearest)) * 0.5f;
+      if (grid.At(x, y)->type & kVoxelTypeInternal) {
+        expected = -expected;
+      }
+      mismatches += std::fabs(distances[y * grid.XDim() + x] - expected) > 1e-5;
+    }
+  }
+  EXPECT_EQ(mismatches, 0);
+  EXPECT_LT(*std::min_element(distances.begin(), distances.end()), 0);
+  EXPECT_GT(*std::max_element(distances.begin(), distances.end()), 0);
+}
+
+// Labels the selected voxels by breadth first search, numbering the components in order of their first voxel.
+std::vector<int32_t> FloodFillComponents(const std::vector<uint8_t>& selected, int64_t x_dim, int64_t y_dim,
+                                         int64_t z_dim, int max_nonzero) {
+  std::vector<int32_t> labels(selected.size(), kNoComponent);
+  int32_t next = 0;
+  for (int64_t start = 0; start < static_cast<int64_t>(selected.size()); start++) {
+    if (!selected[start] || labels[start] != kNoComponent) {
+      continue;
+    }
+    std::vector<int64_t> queue = {start};
+    labels[start] = next;
+    for (size_t head = 0; head < queue.size(); head++) {
+      int64_t x = queue[head] % x_dim, y = queue[head] / x_dim % y_dim, z = queue[head] / x_dim / y_dim;
+      for (int64_t dz = -1; dz <= 1; dz++) {
+        for (int64_t dy = -1; dy <= 1; dy++) {
+          for (int64_t dx = -1; dx <= 1; dx++) {
+            int64_t nx = x + dx, ny = y + dy, nz = z + dz;
+            if ((dx != 0) + (dy != 0) + (dz != 0) > max_nonzero || nx < 0 || nx >= x_dim || ny < 0 || ny >= y_dim ||
+                nz < 0 || nz >= z_dim) {
+              continue;
+            }
+            int64_t i = (nz * y_dim + ny) * x_dim + nx;
+            if (selected[i] && labels[i] == kNoComponent) {
+              labels[i] = next;
+              queue.push_back(i);
+            }
+          }
+        }
+      }
+    }
+    next++;
+  }
+  return labels;
+}
+
+TEST(ComponentsTests, HollowCube) {
+  const VoxelGrid3d<TestVoxel>& grid = ReferenceGrid("hollow_cube");
+  ComponentLabels air;
+  LabelComponents(grid, kVoxelTypeExternal, Connectivity::k6, &air);
+  // The air around the cube, which starts at the first voxel, and the sealed void inside it.
+  ASSERT_EQ(air.components.size(), 2);
+  EXPECT_TRUE(air.components[0].touches_border);
+  const Component& cavity = air.components[1];
+  EXPECT_FALSE(cavity.touches_border);
+  EXPECT_GT(cavity.min_x, 0);
+  EXPECT_LT(cavity.max_x, grid.XDim() - 1);
+  EXPECT_LT(cavity.max_z, grid.ZDim() - 1);
+
+  ComponentLabels solid;
+  LabelComponents(grid, kVoxelTypeInternal | kVoxelTypeBoundary, Connectivity::k26, &solid);
+  ASSERT_EQ(solid.components.size(), 1);
+  int64_t voxels = 0;
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        voxels += grid.At(x, y, z)->type != kVoxelTypeExternal;
+      }
+    }
+  }
+  EXPECT_EQ(solid.components[0].voxels, voxels);
+  EXPECT_EQ(air.components[0].voxels + cavity.voxels + voxels, grid.XDim() * grid.YDim() * grid.ZDim());
+}
+
+TEST(ComponentsTests, MatchesFloodFill) {
+  // Large enough to be split into several blocks, with random voxels close to the percolation threshold so that
+  // components cross the seams in many places.
+  Scheduler scheduler(4);
+  VoxelGrid3d<TestVoxel> grid;
+  grid.SetScheduler(&scheduler);
+  grid.Init(96, 64, 64, 1.0);
+  std::mt19937 random(19);
+  std::vector<uint8_t> selected(grid.XDim() * grid.YDim() * grid.ZDim());
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        bool solid = random() % 100 < 30;
+        grid.At(x, y, z)->type = solid ? kVoxelTypeInternal : kVoxelTypeExternal;
+        selected[(z * grid.YDim() + y) * grid.XDim() + x] = solid;
+      }
+    }
+  }
+
+  for (auto [connectivity, max_nonzero] : {std::pair{Connectivity::k6, 1}, {Connectivity::k18, 2},
+                                           {Connectivity::k26, 3}}) {
+    SCOPED_TRACE(max_nonzero);
+    ComponentLabels result;
+    LabelComponents(grid, kVoxelTypeInternal, connectivity, &result);
+    std::vector<int32_t> expected = FloodFillComponents(selected, grid.XDim(), grid.YDim(), grid.ZDim(), max_nonzero);
+    EXPECT_EQ(result.labels, expected);
+    ASSERT_EQ(result.components.size(), *std::max_element(expected.begin(), expected.end()) + 1);
+
+    std::vector<Component> components(result.components.size());
+    std::vector<int64_t> border(result.components.size(), 0);
+    for (int64_t i = 0; i < static_cast<int64_t>(expected.size()); i++) {
+      if (expected[i] == kNoComponent) {
+        continue;
+      }
+      int64_t x = i % grid.XDim(), y = i / grid.XDim() % grid.YDim(), z = i / grid.XDim() / grid.YDim();
+      Component& c = components[expected[i]];
+      if (c.voxels++ == 0) {
+        c = {1, x, y, z, x, y, z, false};
+      }
+      c.min_x = std::min(c.min_x, x);
+      c.min_y = std::min(c.min_y, y);
+      c.min_z = std::min(c.min_z, z);
+      c.max_x = std::max(c.max_x, x);
+      c.max_y = std::max(c.max_y, y);
+      c.max_z = std::max(c.max_z, z);
+      c.touches_border |= x == 0 || y == 0 || z == 0 || x == grid.XDim() - 1 || y == grid.YDim() - 1 ||
+                          z == grid.ZDim() - 1;
+    }
+    int64_t mismatches = 0;
+    for (size_t n = 0; n < components.size(); n++) {
+      const Component& a = components[n];
+      const Component& b = result.components[n];
+      mismatches += a.voxels != b.voxels || a.min_x != b.min_x || a.min_y != b.min_y || a.min_z != b.min_z ||
+                    a.max_x != b.max_x || a.max_y != b.max_y || a.max_z != b.max_z ||
+                    a.touches_border != b.touches_border;
+    }
+    EXPECT_EQ(mismatches, 0);
+  }
+}
+
+TEST(ComponentsTests, Grid2d) {
+  Scheduler scheduler(3);
+  VoxelGrid2d<TestVoxel> grid;
+  grid.SetScheduler(&scheduler);
+  grid.Init(400, 500, 1.0);
+  std::mt19937 random(2);
+  std::vector<uint8_t> selected(grid.XDim() * grid.YDim());
+  for (int64_t y = 0; y < grid.YDim(); y++) {
+    for (int64_t x = 0; x < grid.XDim(); x++) {
+      bool solid = random() % 100 < 50;
+      grid.At(x, y)->type = solid ? kVoxelTypeBoundary : kVoxelTypeExternal;
+      selected[y * grid.XDim() + x] = solid;
+    }
+  }
+  for (auto [connectivity, max_nonzero] : {std::pair{Connectivity::k6, 1}, {Connectivity::k26, 2}}) {
+    ComponentLabels result;
+    LabelComponents(grid, kVoxelTypeBoundary, connectivity, &result);
+    EXPECT_EQ(result.labels, FloodFillComponents(selected, grid.XDim(), grid.YDim(), 1, max_nonzero));
+    // Only the edges of the image are borders.
+    bool enclosed = false;
+    for (const Component& c : result.components) {
+      enclosed |= !c.touches_border;
+      EXPECT_EQ(c.min_z, 0);
+    }
+    EXPECT_TRUE(enclosed);
+  }
+}
+
+TEST(IndexedMeshTests, MatchesStlReader) {
+  std::filesystem::path path = ResolvePath("__main__/voxel/testdata/sphere.stl");
+  std::vector<libmath::Triangle> triangles;
+  ASSERT_TRUE(simplestl::StlReader(path).Read(&triangles));
+  builder::IndexedMesh binary;
+  ASSERT_TRUE(binary.Read(path));
+  ASSERT_EQ(binary.TriangleCount(), triangles.size());
+  // A closed mesh shares every vertex between several triangles.
+  EXPECT_LT(binary.Positions().size(), triangles.size());
+
+  // The same mesh as ascii, with more facets than fit in one parsing chunk.
+  std::filesystem::path ascii_path = std::filesystem::temp_directory_path().append("sphere_ascii.stl");
+  {
+    std::ofstream out(ascii_path);
+    out << "solid sphere vertex\n";
+    for (int copy = 0; copy < 30; copy++) {
+      for (size_t i = 0; i < binary.TriangleCount(); i++) {
+        out << "  facet normal 0 0 +1\n    outer loop\n";
+        for (int v = 0; v < 3; v++) {
+          const auto& p = binary.Positions()[binary.Indices()[i * 3 + v]];
+          out << "      vertex " << std::setprecision(9) << p.x << " " << p.y << " " << p.z << "\n";
+        }
+        out << "    endloop\n  endfacet\n";
+      }
+    }
+    out << "endsolid sphere\n";
+  }
+  builder::IndexedMesh ascii;
+  ASSERT_TRUE(ascii.Read(ascii_path));
+  ASSERT_EQ(ascii.TriangleCount(), triangles.size() * 30);
+  EXPECT_EQ(ascii.Positions().size(), binary.Positions().size());
+
+  int64_t mismatches = 0;
+  for (size_t i = 0; i < ascii.TriangleCount(); i++) {
+    for (int v = 0; v < 3; v++) {
+      const libmath::Point& expected = triangles[i % triangles.size()].vertices[v];
+      mismatches += !(binary.Vertex(i % triangles.size(), v) == expected);
+      mismatches += !(ascii.Vertex(i, v) == expected);
+    }
+  }
+  EXPECT_EQ(mismatches, 0);
+
+  // Every edge of a closed mesh is shared by exactly two triangles.
+  std::vector<uint32_t> edge_ids = binary.EdgeIds();
+  std::map<uint32_t, int> uses;
+  for (uint32_t id : edge_ids) {
+    uses[id]++;
+  }
+  EXPECT_EQ(uses.size() * 2, edge_ids.size());
+  EXPECT_TRUE(std::all_of(uses.begin(), uses.end(), [](const auto& use) { return use.second == 2; }));
+
+  std::filesystem::resize_file(ascii_path, std::filesystem::file_size(ascii_path) / 2);
+  EXPECT_FALSE(ascii.Read(ascii_path));
+  EXPECT_FALSE(ascii.Read("/foo/bar.stl"));
+}
+
+TEST(BatchBuilderTests, StopsWithResultsNotTaken) {
+  // With a single voxelizer, at most one finished grid waits in the queue, so the voxelizer blocks on the next one
+  // until the builder is destroyed.
+  std::vector<builder::BatchJob> jobs;
+  for (int i = 0; i < 6; i++) {
+    jobs.push_back({ResolvePath("__main__/voxel/testdata/sphere.stl"), 1.0, {}});
+  }
+  builder::BatchBuilder<TestVoxel> batch(&Scheduler::Default(), 1, 1);
+  batch.Start(jobs);
+  builder::BatchResult<TestVoxel> result;
+  ASSERT_TRUE(batch.Next(&result));
+  EXPECT_TRUE(result.ok);
+}
+
+TEST(BatchBuilderTests, MatchesBuildFromStl) {
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  std::vector<builder::BatchJob> jobs;
+  for (const std::string prefix : {"sphere", "cone", "sphere"}) {
+    for (double step : {1.0, 0.5}) {
+      jobs.push_back({ResolvePath("__main__/voxel/testdata/" + prefix + ".stl"), step, options});
+    }
+  }
+  jobs[1].options.extra_steps_z = 5;
+  jobs.push_back({"/foo/bar.stl", 1.0, options});
+
+  builder::BatchBuilder<TestVoxel> batch;
+  batch.Start(jobs);
+  std::vector<bool> seen(jobs.size());
+  builder::BatchResult<TestVoxel> result;
+  while (batch.Next(&result)) {
+    SCOPED_TRACE(result.job);
+    ASSERT_LT(result.job, jobs.size());
+    EXPECT_FALSE(seen[result.job]);
+    seen[result.job] = true;
+    if (result.job == jobs.size() - 1) {
+      EXPECT_FALSE(result.ok);
+      continue;
+    }
+    ASSERT_TRUE(result.ok);
+    VoxelGrid3d<TestVoxel> expected;
+    ASSERT_TRUE(builder::BuildFromStl(jobs[result.job].stl_path, &expected, jobs[result.job].step,
+                                      jobs[result.job].options));
+    ExpectSameClassification(expected, *result.grid);
+  }
+  EXPECT_EQ(std::count(seen.begin(), seen.end(), true), jobs.size());
+}
+
+TEST(AssemblyTests, SinglePartMatchesBuildFromStl) {
+  std::filesystem::path stl = ResolvePath("__main__/voxel/testdata/cube_with_cutout.stl");
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  VoxelGrid3d<MaterialVoxel> expected;
+  ASSERT_TRUE(builder::BuildFromStl(stl, &expected, 1.0, options));
+
+  std::vector<builder::AssemblyPart> parts = {{stl, 7}};
+  VoxelGrid3d<MaterialVoxel> grid;
+  ASSERT_TRUE(builder::BuildFromStlAssembly(parts, &grid, 1.0, options));
+  ASSERT_EQ(grid.XDim(), expected.XDim());
+  ASSERT_EQ(grid.YDim(), expected.YDim());
+  ASSERT_EQ(grid.ZDim(), expected.ZDim());
+  int64_t mismatches = 0;
+  grid.ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+    const MaterialVoxel& voxel = *grid.At(x, y, z);
+    bool same = voxel.type == expected.At(x, y, z)->type &&
+                voxel.material == (voxel.type == kVoxelTypeExternal ? kNoMaterial : 7);
+    std::atomic_ref<int64_t>(mismatches).fetch_add(!same);
+  });
+  EXPECT_EQ(mismatches, 0);
+
+  parts.push_back({"/foo/bar.stl", 1});
+  EXPECT_FALSE(builder::BuildFromStlAssembly(parts, &grid, 1.0, options));
+}
+
+TEST(AssemblyTests, SixteenParts) {
+  // Sixteen copies of the same part, the last two with a higher priority, so the first of those wins every voxel.
+  std::filesystem::path stl = ResolvePath("__main__/voxel/testdata/cube_with_cutout.stl");
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  VoxelGrid3d<MaterialVoxel> expected;
+  ASSERT_TRUE(builder::BuildFromStl(stl, &expected, 1.0, options));
+
+  std::vector<builder::AssemblyPart> parts;
+  for (int32_t part = 0; part < 16; part++) {
+    parts.push_back({stl, part, part >= 14 ? 1 : 0});
+  }
+  VoxelGrid3d<MaterialVoxel> grid;
+  ASSERT_TRUE(builder::BuildFromStlAssembly(parts, &grid, 1.0, options));
+  ASSERT_EQ(grid.XDim(), expected.XDim());
+  ASSERT_EQ(grid.YDim(), expected.YDim());
+  ASSERT_EQ(grid.ZDim(), expected.ZDim());
+  int64_t mismatches = 0;
+  grid.ForEachXYZ([&](int64_t x, int64_t y, int64_t z) {
+    const MaterialVoxel& voxel = *grid.At(x, y, z);
+    bool same = voxel.type == expected.At(x, y, z)->type &&
+                voxel.material == (voxel.type == kVoxelTypeExternal ? kNoMaterial : 14);
+    std::atomic_ref<int64_t>(mismatches).fetch_add(!same);
+  });
+  EXPECT_EQ(mismatches, 0);
+}
+
+TEST(AssemblyTests, OverlappingParts) {
+  // The cube, and a copy of it moved half its size along x.
+  builder::IndexedMesh cube;
+  std::filesystem::path cube_path = ResolvePath("__main__/voxel/testdata/cube.stl");
+  ASSERT_TRUE(cube.Read(cube_path));
+  float shift = (cube.Max().x - cube.Min().x) / 2;
+  std::filesystem::path moved_path = std::filesystem::temp_directory_path().append("moved_cube.stl");
+  {
+    std::ofstream out(moved_path);
+    out << "solid moved\n";
+    for (size_t i = 0; i < cube.TriangleCount(); i++) {
+      out << "  facet normal 0 0 +1\n    outer loop\n";
+      for (int v = 0; v < 3; v++) {
+        const auto& p = cube.Positions()[cube.Indices()[i * 3 + v]];
+        out << "      vertex " << std::setprecision(9) << p.x + shift << " " << p.y << " " << p.z << "\n";
+      }
+      out << "    endloop\n  endfacet\n";
+    }
+    out << "endsolid moved\n";
+  }
+
+  // The moved cube wins the overlap.
+  std::vector<builder::AssemblyPart> parts = {{cube_path, 1}, {moved_path, 2, 1}};
+  VoxelGrid3d<MaterialVoxel> grid;
+  ASSERT_TRUE(builder::BuildFromStlAssembly(parts, &grid, 1.0));
+  VoxelGrid3d<MaterialVoxel> single;
+  ASSERT_TRUE(builder::BuildFromStl(cube_path, &single, 1.0));
+  EXPECT_GT(grid.XDim(), single.XDim());
+  EXPECT_EQ(grid.YDim(), single.YDim());
+
+  int64_t y = grid.YDim() / 2, z = grid.ZDim() / 2;
+  std::vector<int32_t> row;
+  for (int64_t x = 0; x < grid.XDim(); x++) {
+    int32_t material = grid.At(x, y, z)->material;
+    if (row.empty() || row.back() != material) {
+      row.push_back(material);
+    }
+  }
+  EXPECT_EQ(row, std::vector<int32_t>({kNoMaterial, 1, 2, kNoMaterial}));
+
+  // Interfaces sit exactly on the internal voxels next to the other material.
+  int64_t interfaces = 0, wrong = 0;
+  for (int64_t z = 0; z < grid.ZDim(); z++) {
+    for (int64_t y = 0; y < grid.YDim(); y++) {
+      for (int64_t x = 0; x < grid.XDim(); x++) {
+        const MaterialVoxel* voxel = grid.At(x, y, z);
+        bool other = false;
+        for (const MaterialVoxel* neighbor : grid.D3Q27(x, y, z)) {
+          other |= neighbor != nullptr && neighbor->material != kNoMaterial && voxel->material != kNoMaterial &&
+                   neighbor->material != voxel->material;
+        }
+        interfaces += (voxel->type & kVoxelTypeInterface) != 0;
+        wrong += ((voxel->type & kVoxelTypeInterface) != 0) != other;
+      }
+    }
+  }
+  EXPECT_GT(interfaces, 0);
+  EXPECT_EQ(wrong, 0);
+  std::filesystem::remove(moved_path);
+}
+
+TEST(BitGrid3dTests, StlMatchesVoxelGrid) {
+  builder::StlBuildOptions options;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  options.ray_triangle_test = builder::RayTriangleTest::kProjected;
+  for (auto classification : {builder::Classification::kSixRayVote, builder::Classification::kColumnScanline,
+                              builder::Classification::kSurfaceFloodFill, builder::Classification::kCoarseToFine}) {
+    options.classification = classification;
+    for (const auto& prefix : kStlTestMeshes) {
+      SCOPED_TRACE(prefix);
+      std::filesystem::path path = ResolvePath("__main__/voxel/testdata/" + prefix + ".stl");
+      VoxelGrid3d<TestVoxel> expected;
+      ASSERT_TRUE(voxel::builder::BuildFromStl(path, &expected, 1.0, options));
+      BitGrid3d packed;
+      ASSERT_TRUE(voxel::builder::BuildFromStl(path, &packed, 1.0, options));
+      VoxelGrid3d<TestVoxel> actual;
+      packed.ToVoxelGrid(&actual);
+      ExpectSameClassification(expected, actual);
+    }
+  }
+}
+
+TEST(BitGrid3dTests, Morphology) {
+  // A column longer than one word, with a voxel on each side of the word boundary.
+  BitGrid3d grid;
+  grid.Init(5, 5, 100, 1.0);
+  grid.SetInside(2, 2, 63, true);
+  grid.SetInside(2, 2, 64, true);
+
+  grid.Dilate();
+  EXPECT_EQ(grid.CountInside(), 3 * 3 * 4);
+  EXPECT_TRUE(grid.Inside(1, 3, 62));
+  EXPECT_TRUE(grid.Inside(3, 1, 65));
+  EXPECT_FALSE(grid.Inside(2, 2, 61));
+  EXPECT_FALSE(grid.Inside(2, 2, 66));
+
+  // Only the two original voxels have no external neighbor.
+  grid.MarkBoundaries();
+  EXPECT_EQ(grid.CountBoundary(), 3 * 3 * 4 - 2);
+  EXPECT_FALSE(grid.Boundary(2, 2, 63));
+  EXPECT_TRUE(grid.Boundary(2, 2, 62));
+
+  grid.Erode();
+  EXPECT_EQ(grid.CountInside(), 2);
+  EXPECT_TRUE(grid.Inside(2, 2, 63));
+  EXPECT_TRUE(grid.Inside(2, 2, 64));
+  EXPECT_EQ(grid.CountBoundary(), 0);
+
+  // Nothing this thin survives opening, while closing leaves it as it is.
+  grid.Open();
+  EXPECT_EQ(grid.CountInside(), 0);
+  for (int64_t z = 10; z < 90; z++) {
+    grid.SetInside(2, 2, z, true);
+  }
+  grid.Close();
+  EXPECT_EQ(grid.CountInside(), 80);
+  EXPECT_TRUE(grid.Inside(2, 2, 10));
+
+  // Everything outside the grid counts as external, so closing erodes the voxels on its faces.
+  grid.SetInside(2, 2, 0, true);
+  grid.Close();
+  EXPECT_FALSE(grid.Inside(2, 2, 0));
+}
+
+TEST(BitGrid3dTests, FillInterior) {
+  // A closed box of walls spanning two words along z, with a one voxel hole in a second, open box next to it.
+  BitGrid3d grid;
+  grid.Init(12, 6, 80, 1.0);
+  for (int64_t x = 0; x < 12; x++) {
+    for (int64_t y = 0; y < 6; y++) {
+      for (int64_t z = 0; z < 80; z++) {
+        bool in_closed = x >= 1 && x <= 4 && y >= 1 && y <= 4 && z >= 10 && z <= 70;
+        bool in_open = x >= 6 && x <= 9 && y >= 1 && y <= 4 && z >= 10 && z <= 20;
+        bool on_closed = in_closed && (x == 1 || x == 4 || y == 1 || y == 4 || z == 10 || z == 70);
+        bool on_open = in_open && (x == 6 || x == 9 || y == 1 || y == 4 || z == 10 || z == 20);
+        if (on_closed || (on_open && !(x == 9 && y == 2 && z == 15))) {
+          grid.SetBoundary(x, y, z, true);
+        }
+      }
+    }
+  }
+
+  grid.FillInterior();
+  EXPECT_EQ(grid.CountInside(), grid.CountBoundary() + 2 * 2 * 59);
+  EXPECT_TRUE(grid.Inside(2, 2, 40));
+  EXPECT_EQ(grid.Type(2, 2, 40), kVoxelTypeInternal);
+  EXPECT_EQ(grid.Type(1, 2, 40), kVoxelTypeInternal | kVoxelTypeBoundary);
+  EXPECT_EQ(grid.Type(7, 2, 15), kVoxelTypeExternal);
+  EXPECT_EQ(grid.Type(0, 0, 0), kVoxelTypeExternal);
+}
+
+TEST(BitGrid3dTests, FillInteriorSerpentine) {
+  // Walls everywhere but a corridor at z = 2 that enters at (0, 1) and winds back and forth along x up to y = 15, and a
+  // sealed voxel next to its end.
+  BitGrid3d grid;
+  grid.Init(20, 20, 5, 1.0);
+  auto in_corridor = [](int64_t x, int64_t y) {
+    if (y % 2 == 1 && y <= 15) {
+      return (x >= 1 && x <= 18) || (x == 0 && y == 1);
+    }
+    return y % 2 == 0 && y >= 2 && y <= 14 && x == (y % 4 == 2 ? 18 : 1);
+  };
+  for (int64_t x = 0; x < 20; x++) {
+    for (int64_t y = 0; y < 20; y++) {
+      for (int64_t z = 0; z < 5; z++) {
+        grid.SetBoundary(x, y, z, !(z == 2 && (in_corridor(x, y) || (x == 10 && y == 17))));
+      }
+    }
+  }
+
+  grid.FillInterior();
+  EXPECT_EQ(grid.CountInside(), 20 * 20 * 5 - (8 * 18 + 7 + 1));
+  EXPECT_EQ(grid.Type(1, 15, 2), kVoxelTypeExternal);
+  EXPECT_EQ(grid.Type(10, 17, 2), kVoxelTypeInternal);
+}
+
+TEST(BrickGrid3dTests, StlMatchesVoxelGrid) {
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  options.acceleration = builder::Acceleration::kTriangleBins;
+  options.ray_triangle_test = builder::RayTriangleTest::kProjected;
+  for (const auto& prefix : kStlTestMeshes) {
+    SCOPED_TRACE(prefix);
+    std::filesystem::path path = ResolvePath("__main__/voxel/testdata/" + prefix + ".stl");
+    VoxelGrid3d<TestVoxel> expected;
+    ASSERT_TRUE(voxel::builder::BuildFromStl(path, &expected, 1.0, options));
+    BrickGrid3d<TestVoxel> actual;
+    ASSERT_TRUE(voxel::builder::BuildFromStl(path, &actual, 1.0, options));
+    ASSERT_EQ(expected.XDim(), actual.XDim());
+    ASSERT_EQ(expected.YDim(), actual.YDim());
+    ASSERT_EQ(expected.ZDim(), actual.ZDim());
+
+    const BrickGrid3d<TestVoxel>& bricks = actual;
+    int64_t mismatches = 0;
+    for (int64_t x = 0; x < expected.XDim(); x++) {
+      for (int64_t y = 0; y < expected.YDim(); y++) {
+        for (int64_t z = 0; z < expected.ZDim(); z++) {
+          mismatches += expected.At(x, y, z)->type != bricks.At(x, y, z)->type;
+        }
+      }
+    }
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_LT(bricks.AllocatedBricks(), bricks.BricksX() * bricks.BricksY() * bricks.BricksZ());
+    EXPECT_LE(bricks.AllocatedBricks(), bricks.AllocatedNodes() * 64);
+
+    simplebmp::Canvas expected_canvas(expected.XDim(), expected.ZDim(), 2);
+    renderer::RenderSliceXZ(expected, expected.YDim() / 2, &expected_canvas, RenderCallback);
+    simplebmp::Canvas actual_canvas(bricks.XDim(), bricks.ZDim(), 2);
+    renderer::RenderSliceXZ(bricks, bricks.YDim() / 2, &actual_canvas, RenderCallback);
+    EXPECT_EQ(simplebmp::Image(expected_canvas), simplebmp::Image(actual_canvas));
+  }
+}
+
+TEST(BrickGrid3dTests, UniformBricks) {
+  BrickGrid3d<TestVoxel> grid;
+  grid.Init(20, 9, 17, 1.0);
+  EXPECT_EQ(grid.BricksX(), 3);
+  EXPECT_EQ(grid.BricksY(), 2);
+  EXPECT_EQ(grid.BricksZ(), 3);
+  EXPECT_EQ(grid.AllocatedBricks(), 0);
+
+  TestVoxel internal;
+  internal.type = kVoxelTypeInternal;
+  grid.SetUniform(1, 0, 1, internal);
+  const BrickGrid3d<TestVoxel>& const_grid = grid;
+  EXPECT_EQ(const_grid.At(12, 3, 9)->type, kVoxelTypeInternal);
+  EXPECT_EQ(const_grid.At(7, 3, 9)->type, kVoxelTypeUndefined);
+
+  // Reading neighbors leaves the bricks alone, writing allocates them.
+  auto neighbors = const_grid.D3Q27(8, 0, 8);
+  EXPECT_EQ(neighbors[0]->type, kVoxelTypeInternal);
+  EXPECT_EQ(std::count(neighbors.begin(), neighbors.end(), nullptr), 27 - 3 * 2 * 3);
+  EXPECT_EQ(grid.AllocatedBricks(), 0);
+  grid.At(8, 0, 8)->type = kVoxelTypeExternal;
+  EXPECT_EQ(grid.AllocatedBricks(), 1);
+  EXPECT_EQ(const_grid.At(9, 0, 8)->type, kVoxelTypeInternal);
+  EXPECT_EQ(grid.Uniform(1, 0, 1), nullptr);
+
+  // Compacting releases the bricks that turned out uniform again.
+  auto same_type = [](const TestVoxel& a, const TestVoxel& b) { return a.type == b.type; };
+  grid.Compact(same_type);
+  EXPECT_EQ(grid.AllocatedBricks(), 1);
+  grid.At(8, 0, 8)->type = kVoxelTypeInternal;
+  grid.Compact(same_type);
+  EXPECT_EQ(grid.AllocatedBricks(), 0);
+  ASSERT_NE(grid.Uniform(1, 0, 1), nullptr);
+  EXPECT_EQ(grid.Uniform(1, 0, 1)->type, kVoxelTypeInternal);
+}
+
+TEST(BrickGrid3dTests, UniformNodes) {
+  TestVoxel external;
+  external.type = kVoxelTypeExternal;
+  BrickGrid3d<TestVoxel> grid;
+  grid.Init(200, 100, 70, 1.0, external);
+  const BrickGrid3d<TestVoxel>& const_grid = grid;
+  EXPECT_EQ(grid.AllocatedNodes(), 0);
+  EXPECT_EQ(const_grid.At(199, 99, 69)->type, kVoxelTypeExternal);
+
+  // Only the node written to gets a brick table, and its other bricks keep the node's value.
+  TestVoxel internal;
+  internal.type = kVoxelTypeInternal;
+  for (int64_t bz = 4; bz < 8; bz++) {
+    for (int64_t by = 4; by < 8; by++) {
+      for (int64_t bx = 4; bx < 8; bx++) {
+        grid.SetUniform(bx, by, bz, internal);
+      }
+    }
+  }
+  grid.At(40, 40, 40)->type = kVoxelTypeBoundary;
+  EXPECT_EQ(grid.AllocatedNodes(), 1);
+  EXPECT_EQ(grid.AllocatedBricks(), 1);
+  EXPECT_EQ(const_grid.At(63, 63, 63)->type, kVoxelTypeInternal);
+  EXPECT_EQ(const_grid.At(64, 63, 63)->type, kVoxelTypeExternal);
+
+  // The node only collapses to a single value once all of its bricks are uniform and equal.
+  auto same_type = [](const TestVoxel& a, const TestVoxel& b) { return a.type == b.type; };
+  grid.CompactNodes(same_type);
+  EXPECT_EQ(grid.AllocatedNodes(), 1);
+  grid.At(40, 40, 40)->type = kVoxelTypeInternal;
+  grid.Compact(same_type);
+  EXPECT_EQ(grid.AllocatedNodes(), 0);
+  ASSERT_NE(grid.Uniform(5, 5, 5), nullptr);
+  EXPECT_EQ(grid.Uniform(5, 5, 5)->type, kVoxelTypeInternal);
+  EXPECT_EQ(const_grid.At(31, 31, 31)->type, kVoxelTypeExternal);
+}
+
+TEST(ProjectedTrianglesTests, AxisAlignedRays) {
+  // A triangle that is not parallel to any axis, and one parallel to z.
+  std::vector<libmath::Plane> planes;
+  planes.emplace_back(libmath::Point(0, 0, 0), libmath::Point(4, 0, 4), libmath::Point(0, 4, 2));
+  planes.emplace_back(libmath::Point(0, 1, 0), libmath::Point(4, 1, 0), libmath::Point(0, 1, 4));
+  builder::internal::ProjectedTriangles projected(planes);
+
+  builder::internal::AxisAlignedRay ray;
+  ASSERT_TRUE(builder::internal::AxisAlignedRay::FromPoints({1, 1, 10}, {1, 1, -10}, &ray));
+  EXPECT_EQ(ray.axis, 2);
+  double depth = 0;
+  ASSERT_TRUE(projected.Intersect(ray, 0, &depth));
+  EXPECT_DOUBLE_EQ(depth, 1.5);
+  EXPECT_FALSE(projected.Intersect(ray, 1, &depth));
+
+  // The first triangle lies in the plane z = x + y / 2, so along x it is crossed at x = z - y / 2.
+  ASSERT_TRUE(builder::internal::AxisAlignedRay::FromPoints({0, 1, 1}, {8, 1, 1}, &ray));
+  ASSERT_TRUE(projected.Intersect(ray, 0, &depth));
+  EXPECT_DOUBLE_EQ(depth, 0.5);
+
+  // The ray stops short of the triangle.
+  ASSERT_TRUE(builder::internal::AxisAlignedRay::FromPoints({1, 1, 10}, {1, 1, 2}, &ray));
+  EXPECT_FALSE(projected.Intersect(ray, 0, &depth));
+
+  // Outside the projection.
+  ASSERT_TRUE(builder::internal::AxisAlignedRay::FromPoints({3, 3, 10}, {3, 3, -10}, &ray));
+  EXPECT_FALSE(projected.Intersect(ray, 0, &depth));
+
+  EXPECT_FALSE(builder::internal::AxisAlignedRay::FromPoints({0, 0, 0}, {1, 1, 0}, &ray));
+}
+
+TEST(ProjectedTrianglesTests, WatertightOnSharedEdges) {
+  // An octahedron centered at (2.5, 2.5, 2.5), so that rays through voxel centers pass exactly through its vertices,
+  // where four triangles meet, and along its edges.
+  std::vector<libmath::Plane> planes;
+  for (int sx : {-1, 1}) {
+    for (int sy : {-1, 1}) {
+      for (int sz : {-1, 1}) {
+        libmath::Point x(2.5 + 2 * sx, 2.5, 2.5), y(2.5, 2.5 + 2 * sy, 2.5), z(2.5, 2.5, 2.5 + 2 * sz);
+        if (sx * sy * sz > 0) {
+          planes.emplace_back(x, y, z);
+        } else {
+          planes.emplace_back(x, z, y);
+        }
+      }
+    }
+  }
+  builder::internal::ProjectedTriangles projected(planes);
+
+  for (int axis = 0; axis < 3; axis++) {
+    for (double u = 0; u <= 5; u += 0.5) {
+      for (double v = 0; v <= 5; v += 0.5) {
+        std::array<double, 3> from = {u, u, u}, to = {u, u, u};
+        from[axis == 2 ? 1 : 2] = to[axis == 2 ? 1 : 2] = v;
+        from[axis] = -1;
+        to[axis] = 6;
+        builder::internal::AxisAlignedRay ray;
+        ASSERT_TRUE(builder::internal::AxisAlignedRay::FromPoints({from[0], from[1], from[2]}, {to[0], to[1], to[2]},
+                                                                  &ray));
+
+        int hits = 0;
+        double depth = 0;
+        for (uint32_t i = 0; i < projected.Size(); i++) {
+          hits += projected.Intersect(ray, i, &depth) ? 1 : 0;
+        }
+
+        // Every ray enters and leaves the solid exactly once, except along the silhouette where it may graze it.
+        double distance = std::abs(u - 2.5) + std::abs(v - 2.5);
+        if (distance < 2) {
+          EXPECT_EQ(hits, 2) << "axis " << axis << " at (" << u << ", " << v << ")";
+        } else if (distance > 2) {
+          EXPECT_EQ(hits, 0) << "axis " << axis << " at (" << u << ", " << v << ")";
+        } else {
+          EXPECT_EQ(hits % 2, 0) << "axis " << axis << " at (" << u << ", " << v << ")";
+        }
+      }
+    }
+  }
+}
+
+TEST(ProjectedTrianglesTests, FanVerticesCountedOnce) {
+  // Closed cones with their apex and the center of their base fan on the ray, and base points from cos and sin, so
+  // that the edge functions near the fan vertices round. Every ray through the apex crosses the surface exactly once
+  // there, and once more at the center of the base.
+  for (double center_u : {1.1, 2.3, 3.7}) {
+    for (int segments : {7, 16, 37}) {
+      for (double phase : {0.0, 0.3, 1.1}) {
+        double center_v = center_u * 0.7 + 0.45, top = 4.9, bottom = 0.3, radius = 1.3;
+        libmath::Point apex(center_u, center_v, top), base_center(center_u, center_v, bottom);
+        std::vector<libmath::Plane> planes;
+        for (int i = 0; i < segments; i++) {
+          double a0 = phase + 2 * M_PI * i / segments, a1 = phase + 2 * M_PI * (i + 1) / segments;
+          libmath::Point p0(center_u + radius * std::cos(a0), center_v + radius * std::sin(a0), bottom);
+          libmath::Point p1(center_u + radius * std::cos(a1), center_v + radius * std::sin(a1), bottom);
+          planes.emplace_back(p0, p1, apex);
+          planes.emplace_back(p1, p0, base_center);
+        }
+        builder::internal::ProjectedTriangles projected(planes);
+
+        builder::internal::AxisAlignedRay ray;
+        ASSERT_TRUE(builder::internal::AxisAlignedRay::FromPoints({center_u, center_v, -1},
+                                                                  {center_u, center_v, 6}, &ray));
+        int at_apex = 0, at_base = 0;
+        double depth = 0;
+        for (uint32_t i = 0; i < projected.Size(); i++) {
+          if (projected.Intersect(ray, i, &depth)) {
+            (depth > (top + bottom) / 2 ? at_apex : at_base)++;
+          }
+        }
+        EXPECT_EQ(at_apex, 1) << center_u << " " << segments << " " << phase;
+        EXPECT_EQ(at_base, 1) << center_u << " " << segments << " " << phase;
+      }
+    }
+  }
+}
+
+TEST(TriangleStoreTests, Avx2MatchesScalarBitForBit) {
+  if (!builder::internal::Avx2Supported()) {
+    GTEST_SKIP() << "AVX2 is not supported on this CPU";
+  }
+
+  // Random triangles in a small box, so that many rays hit, graze edges or run parallel to triangles.
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> coordinate(0.0, 8.0);
+  std::uniform_int_distribution<int> snapped(0, 8);
+  std::vector<libmath::Plane> planes;
+  for (int i = 0; i < 1001; i++) {
+    std::array<libmath::Point, 3> v;
+    for (auto& p : v) {
+      // Mix in points on the integer lattice so that rays through voxel centers hit edges and vertices exactly.
+      p = i % 2 ? libmath::Point(coordinate(rng), coordinate(rng), coordinate(rng))
+                : libmath::Point(snapped(rng), snapped(rng), snapped(rng));
+    }
+    planes.emplace_back(v[0], v[1], v[2]);
+  }
+  builder::internal::TriangleStore store(planes);
+
+  std::vector<uint32_t> indices;
+  for (uint32_t i = 0; i < planes.size(); i += 3) {
+    indices.push_back(i);
+  }
+
+  for (int r = 0; r < 200; r++) {
+    libmath::Point p1(coordinate(rng), coordinate(rng), coordinate(rng));
+    libmath::Point p2 = p1;
+    if (r % 2) {
+      p2 = libmath::Point(coordinate(rng), coordinate(rng), coordinate(rng));
+    } else {
+      p2.z = 8.0;
+    }
+    auto ray = builder::internal::Ray::Between(p1, p2);
+
+    for (const uint32_t* batch : std::array<const uint32_t*, 2>{nullptr, indices.data()}) {
+      size_t count = batch == nullptr ? store.Size() : indices.size();
+      std::vector<uint8_t> scalar_hits(count), avx2_hits(count);
+      std::vector<double> scalar_t(count), avx2_t(count);
+      builder::internal::IntersectScalar(store, ray, batch, count, scalar_hits.data(), scalar_t.data());
+      builder::internal::IntersectAvx2(store, ray, batch, count, avx2_hits.data(), avx2_t.data());
+      ASSERT_EQ(scalar_hits, avx2_hits);
+      for (size_t i = 0; i < count; i++) {
+        if (scalar_hits[i]) {
+          ASSERT_EQ(std::memcmp(&scalar_t[i], &avx2_t[i], sizeof(double)), 0);
+        }
+      }
+    }
+  }
+}
+
+TEST(TriangleBinsTests, CandidatesCoverColumn) {
+  // A single triangle spanning columns [1, 2] along x and [1, 3] along y, lying at z = 2.5.
+  std::vector<libmath::Plane> planes;
+  planes.emplace_back(libmath::Point(1.2, 1.2, 2.5), libmath::Point(2.8, 1.2, 2.5), libmath::Point(1.2, 3.8, 2.5));
+  builder::internal::TriangleBins bins(planes, 1.0, 5, 5, 5);
+  std::vector<uint32_t> edge_ids = builder::internal::ComputeEdgeIds(planes);
+
+  std::span<const uint32_t> candidates;
+  ASSERT_TRUE(bins.Candidates({1.5, 1.5, 0.5}, {1.5, 1.5, 5.0}, &candidates));
+  EXPECT_EQ(candidates.size(), 1);
+  ASSERT_TRUE(bins.Candidates({3.5, 1.5, 0.5}, {3.5, 1.5, 5.0}, &candidates));
+  EXPECT_TRUE(candidates.empty());
+  ASSERT_TRUE(bins.Candidates({0.5, 1.5, 2.5}, {5.0, 1.5, 2.5}, &candidates));
+  EXPECT_EQ(candidates.size(), 1);
+  EXPECT_FALSE(bins.Candidates({0.5, 0.5, 0.5}, {1.5, 1.5, 1.5}, &candidates));
+
+  EXPECT_EQ(builder::internal::ComputeIntersections(planes, edge_ids, bins, {1.5, 1.5, 0.5}, {1.5, 1.5, 5.0}), 1);
+  EXPECT_EQ(builder::internal::ComputeIntersections(planes, edge_ids, bins, {3.5, 1.5, 0.5}, {3.5, 1.5, 5.0}), 0);
+}
+
+TEST(VoxelGrid3dTests, BuildFromTriangles) {
+  std::vector<libmath::Triangle> triangles;
+  ASSERT_TRUE(simplestl::StlReader(ResolvePath("__main__/voxel/testdata/cube_with_cutout.stl")).Read(&triangles));
+  // Anywhere in space, the mesh builds the grid of the stl file.
+  for (auto& triangle : triangles) {
+    for (auto& vertex : triangle.vertices) {
+      vertex = vertex.Translate(5, -3, 2);
+    }
+  }
+  VoxelGrid3d<TestVoxel> grid;
+  builder::BuildFromTriangles(triangles, &grid, 1.0);
+  ExpectSameClassification(ReferenceGrid("cube_with_cutout"), grid);
+}
+
+TEST(BuildStatsTests, PhasesCountersAndTrace) {
+  Scheduler scheduler(3);
+  std::filesystem::path stl = ResolvePath("__main__/voxel/testdata/cone.stl");
+  builder::StlBuildOptions options;
+  options.classification = builder::Classification::kColumnScanline;
+  VoxelGrid3d<TestVoxel> expected;
+  expected.SetScheduler(&scheduler);
+  ASSERT_TRUE(builder::BuildFromStl(stl, &expected, 1.0, options));
+
+  BuildStats stats;
+  options.stats = &stats;
+  VoxelGrid3d<TestVoxel> grid;
+  grid.SetScheduler(&scheduler);
+  ASSERT_TRUE(builder::BuildFromStl(stl, &grid, 1.0, options));
+  ExpectSameClassification(expected, grid);
+
+  std::vector<std::string> names;
+  for (const auto& phase : stats.Phases()) {
+    names.push_back(phase.name);
+    EXPECT_GE(phase.end_ns, phase.begin_ns);
+  }
+  EXPECT_EQ(names, std::vector<std::string>({"read", "planes", "index", "classify", "boundaries"}));
+  EXPECT_EQ(stats.Phases()[3].bytes, grid.XDim() * grid.YDim() * grid.ZDim() * sizeof(TestVoxel));
+  EXPECT_GT(stats.Phases()[3].tasks, 0);
+
+  // One ray per column, each crossing the closed surface an even number of times.
+  BuildCounters counters = stats.Counters();
+  EXPECT_EQ(counters.rays, grid.XDim() * grid.YDim());
+  EXPECT_GE(counters.triangles_tested, counters.crossings);
+  EXPECT_GT(counters.crossings, 0);
+  EXPECT_GT(counters.tasks, 0);
+  int64_t thread_tasks = 0;
+  for (const auto& time : stats.ThreadTimes()) {
+    thread_tasks += time.tasks;
+    EXPECT_GE(time.busy_seconds, 0);
+  }
+  EXPECT_EQ(thread_tasks, counters.tasks);
+
+  std::filesystem::path trace = std::filesystem::temp_directory_path().append("build_stats_trace.json");
+  ASSERT_TRUE(stats.WriteChromeTrace(trace));
+  std::ifstream in(trace);
+  std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  EXPECT_NE(json.find("\"traceEvents\""), std::string::npos);
+  EXPECT_NE(json.find("\"classify\""), std::string::npos);
+  std::filesystem::remove(trace);
+
+  // Builds without stats leave the ones of the previous build alone.
+  ASSERT_TRUE(builder::BuildFromStl(stl, &grid, 1.0, builder::StlBuildOptions()));
+  EXPECT_EQ(stats.Counters().rays, counters.rays);
+}
+
+TEST(VoxelGrid3dTests, IntersectionDepths) {
+  // Two triangles forming a unit square at z = 2, sharing the diagonal from (1, 1) to (3, 3), and one more at z = 4.
+  std::vector<libmath::Plane> planes;
+  planes.emplace_back(libmath::Point(1, 1, 2), libmath::Point(3, 1, 2), libmath::Point(3, 3, 2));
+  planes.emplace_back(libmath::Point(1, 1, 2), libmath::Point(3, 3, 2), libmath::Point(1, 3, 2));
+  planes.emplace_back(libmath::Point(0, 0, 4), libmath::Point(5, 0, 4), libmath::Point(0, 5, 4));
+
+  // The diagonal is the only edge the two halves of the square share.
+  std::vector<uint32_t> edge_ids = builder::internal::ComputeEdgeIds(planes);
+  ASSERT_EQ(edge_ids.size(), 9);
+  EXPECT_EQ(edge_ids[2], edge_ids[3]);
+  EXPECT_EQ(std::set<uint32_t>(edge_ids.begin(), edge_ids.end()).size(), 8);
+
+  // The ray through the shared diagonal must only count the square once.
+  std::vector<double> depths =
+      builder::internal::ComputeIntersectionDepths(planes, edge_ids, nullptr, {2, 2, 0}, {2, 2, 5});
+  ASSERT_EQ(depths.size(), 2);
+  EXPECT_DOUBLE_EQ(depths[0], 0.4);
+  EXPECT_DOUBLE_EQ(depths[1], 0.8);
+
+  depths = builder::internal::ComputeIntersectionDepths(planes, edge_ids, nullptr, {4, 0.5, 5}, {4, 0.5, 0});
+  ASSERT_EQ(depths.size(), 1);
+  EXPECT_DOUBLE_EQ(depths[0], 0.2);
+}
+
 }
 }
\ No newline at end of file